@@ -0,0 +1,446 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+#include "../common/bgzf.h"
+
+#define BGZF_HEADER_SIZE	18
+#define BGZF_FOOTER_SIZE	8
+
+
+/* the empty block that marks the end of a BGZF file */
+unsigned char const bgzf_eof[BGZF_EOF_SIZE] = {
+  0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43,
+  0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+
+static inline void
+put_le16(unsigned char * p, uint16_t x)
+{
+  p[0] = x & 0xff;
+  p[1] = x >> 8;
+}
+
+static inline uint16_t
+get_le16(unsigned char const * p)
+{
+  return p[0] | p[1] << 8;
+}
+
+static inline uint32_t
+get_le32(unsigned char const * p)
+{
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void
+put_le32(unsigned char * p, uint32_t x)
+{
+  p[0] = x & 0xff;
+  p[1] = (x >> 8) & 0xff;
+  p[2] = (x >> 16) & 0xff;
+  p[3] = x >> 24;
+}
+
+
+/*
+ * Compress len bytes from src into BGZF blocks at dst, which must have room for
+ * bgzf_bound(len) bytes. Returns the size of the compressed data, or -1 on a
+ * zlib error.
+ */
+ssize_t
+bgzf_compress(void * dst, void const * src, size_t len, int level)
+{
+  static unsigned char const header[BGZF_HEADER_SIZE - 2] = {
+    0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43, 0x02, 0x00
+  };
+  unsigned char * out = (unsigned char *)dst;
+  unsigned char const * in = (unsigned char const *)src;
+  z_stream zs;
+  size_t block_len, block_size;
+
+  memset(&zs, 0, sizeof(zs));
+  if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    return -1;
+
+  while (len > 0) {
+    block_len = (len < BGZF_BLOCK_DATA ? len : BGZF_BLOCK_DATA);
+
+    zs.next_in = (Bytef *)in;
+    zs.avail_in = block_len;
+    zs.next_out = out + BGZF_HEADER_SIZE;
+    zs.avail_out = BGZF_MAX_BLOCK_SIZE - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+      deflateEnd(&zs);
+      return -1;
+    }
+
+    block_size = BGZF_HEADER_SIZE + zs.total_out + BGZF_FOOTER_SIZE;
+    assert(block_size <= BGZF_MAX_BLOCK_SIZE);
+    memcpy(out, header, sizeof(header));
+    put_le16(out + BGZF_HEADER_SIZE - 2, block_size - 1);
+    put_le32(out + block_size - 8, crc32(crc32(0, NULL, 0), in, block_len));
+    put_le32(out + block_size - 4, block_len);
+
+    deflateReset(&zs);
+    in += block_len;
+    len -= block_len;
+    out += block_size;
+  }
+  deflateEnd(&zs);
+
+  return out - (unsigned char *)dst;
+}
+
+
+/*
+ * Reader.
+ *
+ * The calling thread reads whole compressed blocks off the file into a ring of
+ * slots; the pool inflates them in the order they were queued, and the caller
+ * copies them out as they complete. Up to BGZF_READ_AHEAD blocks per thread are
+ * in flight at once.
+ */
+#define BGZF_READ_AHEAD		8
+
+enum {
+  SLOT_PENDING,
+  SLOT_DONE,
+  SLOT_BAD
+};
+
+struct bgzf_slot {
+  unsigned char	in[BGZF_MAX_BLOCK_SIZE];
+  unsigned char	out[BGZF_MAX_BLOCK_SIZE];
+  int		in_len;
+  int		hdr_len;
+  int		out_len;
+  int		state;
+};
+
+struct bgzf_reader {
+  char *		file;
+  int			fd;
+  bool			file_eof;
+  bool			closing;
+  struct bgzf_slot *	slot;
+  int			n_slots;
+  uint64_t		head;		/* next block to hand out */
+  uint64_t		next_job;	/* next block to inflate */
+  uint64_t		tail;		/* next block to read off the file */
+  int			pos;		/* bytes of the head block already handed out */
+  pthread_mutex_t	lock;
+  pthread_cond_t	work;
+  pthread_cond_t	done;
+  pthread_t *		thread;
+  int			n_threads;
+};
+
+
+/*
+ * Total size of a block from its extra field, or -1 if there is no BC subfield.
+ */
+static int
+bgzf_block_size(unsigned char const * extra, int xlen)
+{
+  int i, slen;
+
+  for (i = 0; i + 4 <= xlen; i += 4 + slen) {
+    slen = get_le16(extra + i + 2);
+    if (extra[i] == 'B' && extra[i + 1] == 'C' && slen == 2 && i + 6 <= xlen)
+      return get_le16(extra + i + 4) + 1;
+  }
+  return -1;
+}
+
+static ssize_t
+full_read(int fd, void * buf, size_t len)
+{
+  size_t n = 0;
+  ssize_t ret;
+
+  while (n < len) {
+    ret = read(fd, (char *)buf + n, len - n);
+    if (ret < 0) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    if (ret == 0)
+      break;
+    n += ret;
+  }
+  return n;
+}
+
+/*
+ * Does the file start with a BGZF block?
+ */
+bool
+bgzf_is_bgzf(char const * file)
+{
+  unsigned char h[BGZF_HEADER_SIZE];
+  int fd;
+  ssize_t n;
+
+  fd = open(file, O_RDONLY);
+  if (fd < 0)
+    return false;
+  n = full_read(fd, h, sizeof(h));
+  close(fd);
+
+  return n == (ssize_t)sizeof(h) && h[0] == 0x1f && h[1] == 0x8b && h[2] == 0x08 && h[3] == 0x04
+    && bgzf_block_size(h + 12, get_le16(h + 10) < 6 ? get_le16(h + 10) : 6) > 0;
+}
+
+/*
+ * Read the next compressed block into s. Returns 1, 0 at the end of the file,
+ * or -1 if what follows is not a BGZF block.
+ */
+static int
+bgzf_read_block(bgzf_reader_t r, struct bgzf_slot * s)
+{
+  ssize_t n;
+  int xlen, size;
+
+  n = full_read(r->fd, s->in, 12);
+  if (n == 0)
+    return 0;
+  if (n != 12 || s->in[0] != 0x1f || s->in[1] != 0x8b || s->in[2] != 0x08 || s->in[3] != 0x04)
+    goto bad;
+  xlen = get_le16(s->in + 10);
+  if (full_read(r->fd, s->in + 12, xlen) != xlen)
+    goto bad;
+  size = bgzf_block_size(s->in + 12, xlen);
+  if (size < 12 + xlen + BGZF_FOOTER_SIZE)
+    goto bad;
+  if (full_read(r->fd, s->in + 12 + xlen, size - 12 - xlen) != size - 12 - xlen)
+    goto bad;
+
+  s->in_len = size;
+  s->hdr_len = 12 + xlen;
+  return 1;
+
+ bad:
+  fprintf(stderr, "error: truncated or non-BGZF block in \"%s\"\n", r->file);
+  return -1;
+}
+
+#ifdef HAVE_LIBDEFLATE
+typedef struct libdeflate_decompressor * bgzf_inflater;
+#else
+typedef z_stream bgzf_inflater;
+#endif
+
+static bool
+bgzf_inflate_block(bgzf_inflater * inf, struct bgzf_slot * s)
+{
+  unsigned char const * footer = s->in + s->in_len - BGZF_FOOTER_SIZE;
+  uint32_t isize = get_le32(footer + 4);
+
+  if (isize > BGZF_MAX_BLOCK_SIZE)
+    return false;
+#ifdef HAVE_LIBDEFLATE
+  if (libdeflate_deflate_decompress(*inf, s->in + s->hdr_len, s->in_len - s->hdr_len - BGZF_FOOTER_SIZE,
+				    s->out, isize, NULL) != LIBDEFLATE_SUCCESS)
+    return false;
+  s->out_len = isize;
+  return libdeflate_crc32(0, s->out, isize) == get_le32(footer);
+#else
+  inflateReset(inf);
+  inf->next_in = s->in + s->hdr_len;
+  inf->avail_in = s->in_len - s->hdr_len - BGZF_FOOTER_SIZE;
+  inf->next_out = s->out;
+  inf->avail_out = BGZF_MAX_BLOCK_SIZE;
+  if (inflate(inf, Z_FINISH) != Z_STREAM_END || inf->total_out != isize)
+    return false;
+  s->out_len = isize;
+  return crc32(crc32(0, NULL, 0), s->out, isize) == get_le32(footer);
+#endif
+}
+
+static void *
+bgzf_worker(void * arg)
+{
+  bgzf_reader_t r = (bgzf_reader_t)arg;
+  struct bgzf_slot * s;
+  bgzf_inflater inf;
+  bool ok;
+
+#ifdef HAVE_LIBDEFLATE
+  inf = libdeflate_alloc_decompressor();
+  assert(inf != NULL);
+#else
+  memset(&inf, 0, sizeof(inf));
+  if (inflateInit2(&inf, -15) != Z_OK)
+    assert(0);
+#endif
+
+  pthread_mutex_lock(&r->lock);
+  for (;;) {
+    while (!r->closing && r->next_job == r->tail)
+      pthread_cond_wait(&r->work, &r->lock);
+    if (r->closing)
+      break;
+    s = &r->slot[r->next_job++ % r->n_slots];
+    pthread_mutex_unlock(&r->lock);
+
+    ok = bgzf_inflate_block(&inf, s);
+
+    pthread_mutex_lock(&r->lock);
+    s->state = (ok ? SLOT_DONE : SLOT_BAD);
+    pthread_cond_broadcast(&r->done);
+  }
+  pthread_mutex_unlock(&r->lock);
+
+#ifdef HAVE_LIBDEFLATE
+  libdeflate_free_decompressor(inf);
+#else
+  inflateEnd(&inf);
+#endif
+  return NULL;
+}
+
+/*
+ * Open a BGZF file for reading, inflating on n_threads threads, and skip the
+ * first skip bytes of inflated data. Returns NULL on failure.
+ */
+bgzf_reader_t
+bgzf_reader_open(char const * file, int n_threads, size_t skip)
+{
+  bgzf_reader_t r;
+  char buf[4096];
+  ssize_t n;
+  int i;
+
+  assert(n_threads > 0);
+
+  r = (bgzf_reader_t)calloc(1, sizeof(*r));
+  if (r == NULL)
+    return NULL;
+  r->fd = open(file, O_RDONLY);
+  if (r->fd < 0) {
+    free(r);
+    return NULL;
+  }
+  r->file = strdup(file);
+  r->n_slots = n_threads * BGZF_READ_AHEAD;
+  r->slot = (struct bgzf_slot *)malloc(r->n_slots * sizeof(r->slot[0]));
+  r->thread = (pthread_t *)malloc(n_threads * sizeof(r->thread[0]));
+  if (r->file == NULL || r->slot == NULL || r->thread == NULL) {
+    bgzf_reader_close(r);
+    return NULL;
+  }
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->work, NULL);
+  pthread_cond_init(&r->done, NULL);
+
+  for (i = 0; i < n_threads; i++) {
+    if (pthread_create(&r->thread[i], NULL, bgzf_worker, r) != 0)
+      break;
+    r->n_threads++;
+  }
+  if (r->n_threads == 0) {
+    bgzf_reader_close(r);
+    return NULL;
+  }
+
+  while (skip > 0) {
+    n = bgzf_read(r, buf, skip < sizeof(buf) ? skip : sizeof(buf));
+    if (n <= 0) {
+      bgzf_reader_close(r);
+      return NULL;
+    }
+    skip -= n;
+  }
+  return r;
+}
+
+/*
+ * Read up to len bytes of inflated data. Returns the number of bytes read,
+ * which is short only at the end of the file, or -1 on error.
+ */
+ssize_t
+bgzf_read(bgzf_reader_t r, void * buf, size_t len)
+{
+  struct bgzf_slot * s;
+  size_t n = 0, c;
+  int ret;
+
+  while (n < len) {
+    // top up the ring; slots past head are not touched by the pool until queued
+    while (!r->file_eof && r->tail - r->head < (uint64_t)r->n_slots) {
+      s = &r->slot[r->tail % r->n_slots];
+      ret = bgzf_read_block(r, s);
+      if (ret < 0)
+	return -1;
+      if (ret == 0) {
+	r->file_eof = true;
+	break;
+      }
+      s->state = SLOT_PENDING;
+      pthread_mutex_lock(&r->lock);
+      r->tail++;
+      pthread_cond_signal(&r->work);
+      pthread_mutex_unlock(&r->lock);
+    }
+    if (r->head == r->tail)
+      break;
+
+    s = &r->slot[r->head % r->n_slots];
+    pthread_mutex_lock(&r->lock);
+    while (s->state == SLOT_PENDING)
+      pthread_cond_wait(&r->done, &r->lock);
+    pthread_mutex_unlock(&r->lock);
+    if (s->state == SLOT_BAD) {
+      fprintf(stderr, "error: corrupt BGZF block in \"%s\"\n", r->file);
+      return -1;
+    }
+
+    c = s->out_len - r->pos;
+    if (c > len - n)
+      c = len - n;
+    memcpy((char *)buf + n, s->out + r->pos, c);
+    n += c;
+    r->pos += c;
+    if (r->pos == s->out_len) {
+      r->head++;
+      r->pos = 0;
+    }
+  }
+  return n;
+}
+
+void
+bgzf_reader_close(bgzf_reader_t r)
+{
+  int i;
+
+  if (r->n_threads > 0) {
+    pthread_mutex_lock(&r->lock);
+    r->closing = true;
+    pthread_cond_broadcast(&r->work);
+    pthread_mutex_unlock(&r->lock);
+    for (i = 0; i < r->n_threads; i++)
+      pthread_join(r->thread[i], NULL);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->work);
+    pthread_cond_destroy(&r->done);
+  }
+  close(r->fd);
+  free(r->thread);
+  free(r->slot);
+  free(r->file);
+  free(r);
+}
@@ -0,0 +1,42 @@
+#ifndef _BGZF_H
+#define _BGZF_H
+
+/*
+ * BGZF: the blocked gzip format used by BAM files. Each block is a complete gzip
+ * member holding at most BGZF_BLOCK_DATA bytes of input, so that independent
+ * chunks of output can be compressed concurrently and simply concatenated.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define BGZF_MAX_BLOCK_SIZE	65536
+#define BGZF_BLOCK_DATA		65280	/* input per block; its deflate bound fits in a block */
+#define BGZF_EOF_SIZE		28
+
+extern unsigned char const bgzf_eof[BGZF_EOF_SIZE];
+
+/*
+ * Space needed to compress len bytes.
+ */
+static inline size_t
+bgzf_bound(size_t len)
+{
+  return (len + BGZF_BLOCK_DATA - 1) / BGZF_BLOCK_DATA * BGZF_MAX_BLOCK_SIZE;
+}
+
+ssize_t	bgzf_compress(void *, void const *, size_t, int);
+
+/*
+ * Reading side: blocks are inflated ahead on a small pool of threads and handed
+ * back in file order, so the caller sees one plain stream.
+ */
+typedef struct bgzf_reader * bgzf_reader_t;
+
+bool		bgzf_is_bgzf(char const *);
+bgzf_reader_t	bgzf_reader_open(char const *, int, size_t);
+ssize_t		bgzf_read(bgzf_reader_t, void *, size_t);
+void		bgzf_reader_close(bgzf_reader_t);
+
+#endif
@@ -37,7 +37,55 @@ typedef struct f1_window_cache_entry {
 } f1_window_cache_entry;
 EXTERN(struct f1_window_cache_entry *, f1_window_cache, NULL);
 
-#pragma omp threadprivate(f1_hash_tag, f1_window_cache)
+/*
+ * Scores kept across reads, keyed on the read and the genome window, so that
+ * duplicate reads do not rescore the windows their copies already did.
+ * Off unless sw_cache_size is set.
+ *
+ * The window is stored as such (contig array, offset, length), so it always
+ * matches exactly. The read only goes in as its length and a 64-bit hash of
+ * all its codes, so a hit is probabilistic: two distinct reads scored at the
+ * same window collide with probability about 2^-64.
+ */
+typedef struct f1_read_cache_entry {
+  uint64_t read_key;
+  uint32_t * genome;	/* NULL if empty */
+  int32_t goff;
+  int32_t glen;
+  int32_t rlen;
+  int32_t score;
+} f1_read_cache_entry;
+EXTERN(struct f1_read_cache_entry *, f1_read_cache, NULL);
+EXTERN(uint64_t, f1_read_cache_lookups, 0);
+EXTERN(uint64_t, f1_read_cache_hits, 0);
+
+#pragma omp threadprivate(f1_hash_tag, f1_window_cache, f1_read_cache, f1_read_cache_lookups, f1_read_cache_hits)
+
+
+/* 64-bit hash of a packed read, its length and initial base */
+static inline uint64_t
+f1_read_key(uint32_t * read, int rlen, int init_bp)
+{
+  uint64_t key = ((uint64_t)rlen << 8) | (uint64_t)(init_bp + 1);
+  int i, n = BPTO32BW(rlen);
+
+  for (i = 0; i < n; i++) {
+    uint32_t x = read[i];
+    if (i == n - 1 && rlen % 8 != 0)
+      x &= (1u << (4 * (rlen % 8))) - 1; // codes past the end are not set
+    key = (key ^ x) * 0x9E3779B97F4A7C15ull;
+    key ^= key >> 29;
+  }
+  key *= 0xBF58476D1CE4E5B9ull;
+  return key ^ (key >> 32);
+}
+
+static inline struct f1_read_cache_entry *
+f1_read_cache_slot(uint64_t read_key, struct sw_vector_window const * w)
+{
+  uint64_t x = read_key ^ (uint64_t)(uintptr_t)w->genome ^ ((uint64_t)w->goff << 20);
+  return &f1_read_cache[((x * 0x9E3779B97F4A7C15ull) >> 32) % sw_cache_size];
+}
 
 
 /*
@@ -51,6 +99,12 @@ f1_setup(int _dblen, int _qrlen,
 {
   f1_hash_tag = 0;
   f1_window_cache = (struct f1_window_cache_entry *)xcalloc(f1_window_cache_size * sizeof(f1_window_cache[0]));
+  if (sw_cache_size > 0)
+    f1_read_cache = (struct f1_read_cache_entry *)xcalloc(sw_cache_size * sizeof(f1_read_cache[0]));
+  if (reset_stats) {
+    f1_read_cache_lookups = 0;
+    f1_read_cache_hits = 0;
+  }
 
   if (gapless_sw && shrimp_mode == MODE_LETTER_SPACE)
     return sw_gapless_setup(_match, _mismatch, reset_stats)
@@ -70,6 +124,8 @@ static inline int
 f1_free(void) 
 {
 	free(f1_window_cache);
+	free(f1_read_cache);
+	f1_read_cache = NULL;
 	return 0;
 }
 
@@ -90,6 +146,17 @@ f1_stats(uint64_t *invocs, uint64_t *cells, double *secs, uint64_t *calls_bypass
 }
 
 
+/*
+ * Lookups and hits of the cross-read score cache of this thread.
+ */
+static inline void
+f1_read_cache_stats(uint64_t *lookups, uint64_t *hits)
+{
+  *lookups = f1_read_cache_lookups;
+  *hits = f1_read_cache_hits;
+}
+
+
 /*
  * Run SW filter. Called independently by different threads.
  * If tag != 0, look up score in hash table.
@@ -134,4 +201,112 @@ f1_run(uint32_t * genome, int glen, int goff, int wlen, uint32_t * read, int rle
 }
 
 
+/*
+ * Most windows f1_run_batch() takes at once.
+ */
+#define F1_BATCH_MAX 64
+
+/*
+ * Run gapped SW filter on several windows of the same read; scores are
+ * returned in w[].score. Caching is as in f1_run(), run in window order:
+ * a window landing in the same cache slot as an earlier one of the batch
+ * gets that window's score. Windows missing there are then looked up in the
+ * cross-read cache, which checks the window and the read hash.
+ */
+static inline void
+f1_run_batch(struct sw_vector_window * w, int n, uint32_t * read, int rlen,
+	     int init_bp, bool is_rna, uint tag)
+{
+  struct sw_vector_window run[F1_BATCH_MAX];
+  uint32_t hash_val[F1_BATCH_MAX];
+  int src[F1_BATCH_MAX]; // index in run[], or -1 if already cached
+  bool fresh[F1_BATCH_MAX]; // first window to need run[src]
+  uint64_t read_key = 0;
+  uint32_t h;
+  int i, j, n_run = 0;
+
+  assert(n <= F1_BATCH_MAX);
+
+  if (f1_read_cache != NULL)
+    read_key = f1_read_key(read, rlen, init_bp);
+
+  /* Look-up */
+  for (i = 0; i < n; i++) {
+    fresh[i] = false;
+    if (hash_filter_calls && tag != 0) {
+      h = hash_genome_window(w[i].genome, w[i].goff, w[i].glen);
+      hash_val[i] = h % f1_window_cache_size;
+
+      if (f1_window_cache[hash_val[i]].tag == tag) { // Cache hit
+#pragma omp atomic
+	f1_calls_bypassed++;
+
+	w[i].score = f1_window_cache[hash_val[i]].score;
+	src[i] = -1;
+	continue;
+      }
+
+      for (j = 0; j < i; j++)
+	if (src[j] >= 0 && hash_val[j] == hash_val[i])
+	  break;
+      if (j < i) { // would hit the entry saved by window j
+#pragma omp atomic
+	f1_calls_bypassed++;
+
+	src[i] = src[j];
+	continue;
+      }
+    }
+
+    if (f1_read_cache != NULL) {
+      // in colour space, genome_ls goes with the genome array, so the window
+      // also fixes the letters the kernel scores
+      struct f1_read_cache_entry * e = f1_read_cache_slot(read_key, &w[i]);
+
+      f1_read_cache_lookups++;
+      if (e->genome == w[i].genome && e->goff == w[i].goff && e->glen == w[i].glen
+	  && e->rlen == rlen && e->read_key == read_key) {
+	f1_read_cache_hits++;
+
+	w[i].score = e->score;
+	src[i] = -1;
+	if (hash_filter_calls && tag != 0) { // later windows of the read may hit this
+	  f1_window_cache[hash_val[i]].tag = tag;
+	  f1_window_cache[hash_val[i]].score = w[i].score;
+	}
+	continue;
+      }
+    }
+
+    src[i] = n_run;
+    fresh[i] = true;
+    run[n_run++] = w[i];
+  }
+
+  /* Compute */
+  sw_vector_batch(run, n_run, read, rlen, init_bp, is_rna);
+
+  /* Save */
+  for (i = 0; i < n; i++) {
+    if (src[i] < 0)
+      continue;
+
+    w[i].score = run[src[i]].score;
+    if (hash_filter_calls && tag != 0) {
+      f1_window_cache[hash_val[i]].tag = tag;
+      f1_window_cache[hash_val[i]].score = w[i].score;
+    }
+    if (f1_read_cache != NULL && fresh[i]) {
+      struct f1_read_cache_entry * e = f1_read_cache_slot(read_key, &w[i]);
+
+      e->read_key = read_key;
+      e->genome = w[i].genome;
+      e->goff = w[i].goff;
+      e->glen = w[i].glen;
+      e->rlen = rlen;
+      e->score = w[i].score;
+    }
+  }
+}
+
 #endif
@@ -25,6 +25,8 @@
 //static uint64_t total_ticks;
 static time_counter fasta_tc;
 
+int fasta_inflate_threads = 0;
+
 int fasta_basemap_char_to_int[128] = {
   /*  0 */ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
   /* 10 */ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
@@ -141,6 +143,21 @@ fasta_open(const char *file, int space, bool fastq, bool * fastq_var)
 		gzseek(fp,0,SEEK_SET);
 	}*/
 
+	/*
+	 * BGZF input is handed to a reader that inflates blocks in parallel. It
+	 * picks up where autodetection left off. Other gzip files, including
+	 * concatenated ones, cannot be split without inflating them and stay on
+	 * zlib.
+	 */
+	if (fasta_inflate_threads > 0 && strcmp(file, "-") != 0 && bgzf_is_bgzf(file)) {
+	  z_off_t pos = gztell(fp);
+	  fasta->bgzf = bgzf_reader_open(file, fasta_inflate_threads, pos);
+	  if (fasta->bgzf != NULL) {
+	    gzclose(fp);
+	    fp = NULL;
+	  }
+	}
+
 	fasta->fp = fp;
 	fasta->file = xstrdup(file);
 	fasta->space = space;
@@ -210,16 +227,32 @@ fasta_close(fasta_t fasta)
 	//uint64_t before = rdtsc();
 	TIME_COUNTER_START(fasta_tc);
 
-	gzclose(fasta->fp);
+	if (fasta->bgzf != NULL)
+		bgzf_reader_close(fasta->bgzf);
+	else
+		gzclose(fasta->fp);
 	free(fasta->file);
 	free(fasta->parse_buffer);
 	fasta->parse_buffer=0;
+	free(fasta->blk);
 	free(fasta);
 
 	TIME_COUNTER_STOP(fasta_tc);
 	//total_ticks += (rdtsc() - before);
 }
 
+/*
+ * Read up to len bytes of (inflated) input.
+ */
+int
+fasta_read(fasta_t fasta, char * buf, int len)
+{
+	if (fasta->bgzf != NULL)
+		return (int)bgzf_read(fasta->bgzf, buf, len);
+	else
+		return gzread(fasta->fp, buf, len);
+}
+
 fasta_stats_t
 fasta_stats()
 {
@@ -552,6 +585,267 @@ fasta_get_next_read_with_range(fasta_t fasta, read_entry * re )
 	return (true);
 }
 
+/*
+ * Block reader: the input is decompressed into a large buffer and records are
+ * cut out of it by looking for newlines with memchr(). The fields of a read
+ * are copied once, straight from that buffer into an arena owned by the
+ * caller, and the sequence can be packed into its bitfield in the same pass.
+ * Not to be mixed with fasta_get_next_read_with_range() on the same file.
+ */
+#define FASTA_BLOCK_SIZE	(4*1024*1024)
+
+/*
+ * Next line of the input, its newline replaced by a nul, or NULL at the end of
+ * the input. The line stays valid until the next call.
+ */
+static char *
+fasta_block_line(fasta_t f, int * len)
+{
+	char *p, *nl;
+	int n, ret;
+
+	if (f->leftover) {
+		f->leftover = false;
+		*len = f->blk_line_len;
+		return (f->blk_line);
+	}
+
+	for (;;) {
+		p = f->blk + f->blk_start;
+		n = f->blk_end - f->blk_start;
+		nl = (n > 0 ? (char *)memchr(p, '\n', n) : NULL);
+		if (nl != NULL) {
+			*nl = '\0';
+			*len = (int)(nl - p);
+			f->blk_start += *len + 1;
+			f->blk_line = p;
+			f->blk_line_len = *len;
+			return (p);
+		}
+
+		if (f->blk_eof) {
+			if (n == 0)
+				return (NULL);
+			// last line, without a newline; there is always room for the nul
+			p[n] = '\0';
+			*len = n;
+			f->blk_start = f->blk_end;
+			f->blk_line = p;
+			f->blk_line_len = n;
+			return (p);
+		}
+
+		// keep the partial line, and fill the rest of the buffer behind it
+		if (n + 1 >= f->blk_size) {
+			f->blk_size = (f->blk_size == 0 ? FASTA_BLOCK_SIZE : 2 * f->blk_size);
+			if (f->blk_start > 0)
+				memmove(f->blk, p, n);
+			f->blk = (char *)xrealloc(f->blk, f->blk_size);
+		} else if (f->blk_start > 0) {
+			memmove(f->blk, p, n);
+		}
+		f->blk_start = 0;
+		f->blk_end = n;
+
+		ret = fasta_read(f, f->blk + n, f->blk_size - 1 - n);
+		if (ret < 0)
+			crash(1, 0, "error reading input file [%s]", f->file);
+		if (ret == 0)
+			f->blk_eof = true;
+		f->blk_end += ret;
+	}
+}
+
+static char *
+arena_strndup(my_arena * a, char const * s, int len)
+{
+	char *ret = (char *)my_arena_malloc(a, len + 17);
+
+	memcpy(ret, s, len);
+	memset(ret + len, 0, 17);
+	return (ret);
+}
+
+/*
+ * Append a sequence line to the read: copy it to seq, and pack it into the
+ * bitfield bf while going. *packed drops to false on a character the bitfield
+ * cannot hold (or, in colour space, on a first character that is not a
+ * letter); the read is then packed later, as the other reads used to be.
+ */
+static void
+fasta_block_seq(fasta_t fasta, char * seq, uint32_t * bf, char const * line, int len,
+		int pos, bool * packed, bool * got_thymine, bool * got_uracil)
+{
+	int i, a;
+	uint32_t idx;
+
+	idx = (fasta->space == COLOUR_SPACE ? pos - 1 : pos);
+	for (i = 0; i < len; i++, idx++) {
+		unsigned char chr = (unsigned char)line[i];
+
+		seq[i] = chr;
+		*got_thymine |= (chr == 'T' || chr == 't');
+		*got_uracil  |= (chr == 'U' || chr == 'u');
+
+		if (!*packed)
+			continue;
+		if (fasta->space == COLOUR_SPACE && pos + i == 0) {
+			*packed = (fasta_get_initial_base(COLOUR_SPACE, (char *)&line[i]) >= 0);
+			continue;
+		}
+		a = fasta->translate[chr];
+		if (a == -1) {
+			*packed = false;
+			continue;
+		}
+		bf[idx / 8] |= (uint32_t)a << (4 * (idx % 8));
+	}
+}
+
+/*
+ * Like fasta_get_next_read_with_range(), but name, seq, qual, plus_line and
+ * range_string are carved from arena, which owns them. If pack, read[0] gets
+ * the packed sequence, unless it has characters only read preparation
+ * reports; read_len is the length of seq.
+ */
+bool
+fasta_get_next_read_block(fasta_t fasta, read_entry * re, my_arena * arena, bool pack)
+{
+	char *line, *name, *tok_save;
+	char c = (fasta->fastq ? '@' : '>');
+	int len, seq_len, qual_len, want, i;
+	uint32_t *bf = NULL;
+	int bf_words = 0;
+	bool packed = pack, got_thymine = false, got_uracil = false;
+
+	TIME_COUNTER_START(fasta_tc);
+	re->name = re->seq = NULL;
+	re->paired = false;
+	re->first_in_pair = false;
+	re->mate_pair = NULL;
+
+	/*
+	 * The name of the read
+	 */
+	do {
+		line = fasta_block_line(fasta, &len);
+	} while (line != NULL && line[0] == '#');
+	if (line == NULL) {
+		TIME_COUNTER_STOP(fasta_tc);
+		return (false);
+	}
+	if (line[0] != c) {
+		if (c == '>' && line[0] == '@')
+			fprintf(stderr, "Expecting \">\" but got \"%c\" are you sure it's not FASTQ format?\n", line[0]);
+		else if (c == '@' && line[0] == '>')
+			fprintf(stderr, "Expecting \"@\" but got \"%c\" are you sure it's not FASTA format?\n", line[0]);
+		else
+			fprintf(stderr, "Expecting \"%c\" but got \"%c\" are you sure it's right format?\n", c, line[0]);
+		TIME_COUNTER_STOP(fasta_tc);
+		return (false);
+	}
+	if (len <= 1) {
+		fprintf(stderr, "error: Invalid read name! Are you sure this is a FASTA or FASTQ file?\n%s\n", line);
+		TIME_COUNTER_STOP(fasta_tc);
+		return (false);
+	}
+
+	// as in extract_name(): the first word of the first tab field; ranges follow
+	name = strtok_r(&line[1], "\t", &tok_save);
+	name = strtrim(name != NULL ? name : &line[len]);
+	for (i = 0; name[i] != '\0' && name[i] != ' ' && name[i] != '\t'; i++);
+	re->name = arena_strndup(arena, name, i);
+	if ((name = strtok_r(NULL, "\t", &tok_save)) != NULL)
+		re->range_string = arena_strndup(arena, name, strlen(name));
+
+	/*
+	 * The read sequence
+	 */
+	seq_len = 0;
+	while ((line = fasta_block_line(fasta, &len)) != NULL) {
+		if (fasta->fastq && line[0] == '+') {
+			break;
+		} else if (!fasta->fastq && line[0] == '>') {
+			fasta->leftover = true;
+			break;
+		} else if (line[0] == '#') {
+			continue;
+		}
+
+		re->seq = (char *)(re->seq == NULL ? my_arena_malloc(arena, len + 17)
+				   : my_arena_realloc(arena, re->seq, seq_len + len + 17, seq_len + 17));
+		if (pack && BPTO32BW(seq_len + len) > bf_words) {
+			int old = bf_words;
+			bf_words = BPTO32BW(seq_len + len);
+			bf = (uint32_t *)xrealloc(bf, bf_words * sizeof(bf[0]));
+			memset(bf + old, 0, (bf_words - old) * sizeof(bf[0]));
+		}
+		fasta_block_seq(fasta, re->seq + seq_len, bf, line, len, seq_len,
+				&packed, &got_thymine, &got_uracil);
+		seq_len += len;
+	}
+	if (seq_len == 0) {
+		fprintf(stderr, "Read in sequence of length zero!\n");
+		free(bf);
+		TIME_COUNTER_STOP(fasta_tc);
+		return (false);
+	}
+	memset(re->seq + seq_len, 0, 17);
+	re->orig_seq = re->seq;
+	re->read_len = seq_len;
+
+	if (fasta->fastq) {
+		if (line == NULL) {
+			fprintf(stderr, "error: Error while readingin FASTQ entry!\n");
+			free(bf);
+			TIME_COUNTER_STOP(fasta_tc);
+			return (false);
+		}
+		/*
+		 * The plus line, then as many quality lines as it takes
+		 */
+		re->plus_line = arena_strndup(arena, line, len);
+
+		want = (fasta->space == COLOUR_SPACE ? seq_len - 1 : seq_len);
+		re->qual = (char *)my_arena_malloc(arena, want + 17);
+		qual_len = 0;
+		do {
+			if ((line = fasta_block_line(fasta, &len)) == NULL)
+				break;
+			if (qual_len + len > want) {
+				fprintf(stderr, "There has been a problem reading in the read \"%s\", the quality length exceeds the sequence length!\n", re->name);
+				fprintf(stderr, "Are you using the right executable? gmapper-cs for color space? and gmapper-ls for letter space?\n");
+				exit(1);
+			}
+			for (i = 0; i < len; i++)
+				re->qual[qual_len + i] = MAX(line[i], '!');
+			qual_len += len;
+		} while (qual_len < want);
+		if (qual_len != want) {
+			fprintf(stderr, "Read in quality string of wrong length!, %d vs %d\n", qual_len, seq_len);
+			free(bf);
+			TIME_COUNTER_STOP(fasta_tc);
+			return (false);
+		}
+		memset(re->qual + qual_len, 0, 17);
+		re->orig_qual = re->qual;
+	}
+
+	/* check if the sequence is rna (contains uracil and not thymine) */
+	if (got_uracil && got_thymine)
+		fprintf(stderr, "WARNING: sequence has both uracil and "
+		    "thymine!?!\n");
+	re->is_rna = (got_uracil && !got_thymine);
+
+	if (packed)
+		re->read[0] = bf;
+	else
+		free(bf);
+
+	TIME_COUNTER_STOP(fasta_tc);
+	return (true);
+}
+
 int
 fasta_get_initial_base(int space, char *sequence)
 {
@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "../gmapper/gmapper-definitions.h"
+#include "../common/bgzf.h"
 
 
 #define LETTER_SPACE	1
@@ -56,11 +57,13 @@
 
 
 extern int fasta_basemap_char_to_int[128];
+extern int fasta_inflate_threads;	/* inflate BGZF input on this many threads; 0 for zlib */
 extern char fasta_basemap_int_to_char[2][16];
 
 
 typedef struct _fasta_t {
 	gzFile fp;
+	bgzf_reader_t bgzf;	/* used instead of fp for BGZF input */
 	char  *file;
 	int space;
 	char   buffer[8*1024*1024];
@@ -75,6 +78,14 @@ typedef struct _fasta_t {
 	int   save_bytes;
 	int   save_skip;
 	bool header;
+	//for fasta_get_next_read_block
+	char *	blk;
+	int	blk_size;
+	int	blk_start;
+	int	blk_end;
+	bool	blk_eof;
+	char *	blk_line;	/* line put back by the last read, if leftover */
+	int	blk_line_len;
 } * fasta_t;
 
 typedef struct _fasta_stats_t {
@@ -85,8 +96,10 @@ typedef struct _fasta_stats_t {
 
 fasta_t	  fasta_open(const char *, int, bool, bool * = NULL);
 void	  fasta_close(fasta_t);
+int	  fasta_read(fasta_t, char *, int);
 //bool	  fasta_get_next_with_range(fasta_t, char **, char **, bool *, char **, char **);
 bool	  fasta_get_next_read_with_range(fasta_t, read_entry * re);
+bool	  fasta_get_next_read_block(fasta_t, read_entry * re, my_arena *, bool);
 int	  fasta_get_initial_base(int, char *);
 uint32_t *fasta_bitfield_to_colourspace(fasta_t, uint32_t *, uint32_t, bool);
 uint32_t *bitfield_to_colourspace(uint32_t *, uint32_t, bool);
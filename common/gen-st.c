@@ -12,10 +12,10 @@
  * with the keys from the given a. The subtree will have the given h.
  */
 static void
-gen_st_fill(gen_st * t, int d, int lev_idx, int h, uint32_t * a, int n)
+gen_st_fill(gen_st * t, int d, int lev_idx, int h, gen_st_key_t * a, int n)
 {
   int abs_idx, delta, k, i, j, prev_j, left_child_lev_idx;
-  uint32_t * node;
+  gen_st_key_t * node;
 
   if (n == 0) return;
 
@@ -76,10 +76,10 @@ gen_st_fill(gen_st * t, int d, int lev_idx, int h, uint32_t * a, int n)
 
 
 void
-gen_st_init(gen_st * t, int b, uint32_t * a, int n)
+gen_st_init(gen_st * t, int b, gen_st_key_t * a, int n)
 {
   int tmp;
-  uint32_t * a_aux;
+  gen_st_key_t * a_aux;
 
   assert(t != NULL);
   assert(b >= 2);
@@ -87,10 +87,10 @@ gen_st_init(gen_st * t, int b, uint32_t * a, int n)
   t->b = b;
   t->b = GEN_ST_BASE; // hard-coded to be equal to 17 during searching
   t->n_keys = (n == 0? 0 : ((n - 1) / (t->b - 1) + 1) * (t->b - 1));
-  a_aux = (uint32_t *)malloc(t->n_keys * sizeof(uint32_t));
-  memcpy(a_aux, a, n * sizeof(uint32_t));
+  a_aux = (gen_st_key_t *)malloc(t->n_keys * sizeof(gen_st_key_t));
+  memcpy(a_aux, a, n * sizeof(gen_st_key_t));
   for (int i = n; i < t->n_keys; i++)
-    a_aux[i] = UINT_MAX;
+    a_aux[i] = GEN_ST_KEY_MAX;
   t->n_nodes = t->n_keys / (t->b - 1);
 
   for (t->h = 0, tmp = 1; n > tmp - 1; t->h++, tmp *= t->b);
@@ -102,7 +102,7 @@ gen_st_init(gen_st * t, int b, uint32_t * a, int n)
     t->pow[i] = t->pow[i - 1] * t->b;
 
   // finally, set up a
-  t->a = (uint32_t *)malloc(t->n_keys * sizeof(uint32_t));
+  t->a = (gen_st_key_t *)malloc(t->n_keys * sizeof(gen_st_key_t));
   gen_st_fill(t, 0, 0, t->h, a_aux, t->n_keys);
 
   free(a_aux);
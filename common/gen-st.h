@@ -7,8 +7,17 @@
 //#define GEN_ST_BASE t->b
 #define GEN_ST_BASE 17
 
+/* keys are absolute genome positions, which are 64-bit in LONG_GENOME builds */
+#ifdef LONG_GENOME
+typedef uint64_t	gen_st_key_t;
+#define GEN_ST_KEY_MAX	UINT64_MAX
+#else
+typedef uint32_t	gen_st_key_t;
+#define GEN_ST_KEY_MAX	UINT32_MAX
+#endif
+
 typedef struct {
-  uint32_t *	a;
+  gen_st_key_t *	a;
   int *	pow;
   int	b;
   int	h;
@@ -17,12 +26,12 @@ typedef struct {
 } gen_st;
 
 
-void gen_st_init(gen_st *, int, uint32_t *, int);
+void gen_st_init(gen_st *, int, gen_st_key_t *, int);
 void gen_st_delete(gen_st *);
 
 
 static inline int
-gen_st_search_node(uint32_t * node, int load, uint32_t val)
+gen_st_search_node(gen_st_key_t * node, int load, gen_st_key_t val)
 {
   assert(node != NULL);
 
@@ -52,10 +61,10 @@ gen_st_search_node(uint32_t * node, int load, uint32_t val)
 
 
 static inline int
-gen_st_search(gen_st * t, uint32_t val)
+gen_st_search(gen_st * t, gen_st_key_t val)
 {
   int node_depth, node_lev_idx, node_abs_idx, nodes_above;
-  uint32_t * node;
+  gen_st_key_t * node;
   int range_start, range_end;
   int k, h, idx, delta;
 
@@ -398,7 +398,171 @@ my_free(void * p, size_t size, count_t * counter, char const * msg = NULL, ...)
 }
 
 
+/*
+ * Arena: a bump allocator for short-lived state owned by a single thread, such
+ * as the mapping structures of the reads in a chunk. Memory is carved out of
+ * blocks that are kept across resets, so once the arena has grown to its working
+ * size an allocation is a pointer bump, with no malloc() and no critical section.
+ * Freeing only reclaims the most recent allocation; my_arena_reset() releases
+ * everything at once. The blocks themselves are accounted on the arena counter.
+ */
+#define MYALLOC_ARENA_ALIGN	16
+
+typedef struct my_arena_block {
+  struct my_arena_block *	next;
+  size_t			size;
+  size_t			used;
+  size_t			pad;	/* keep the data aligned */
+} my_arena_block;
+
+typedef struct my_arena {
+  my_arena_block *	head;
+  my_arena_block *	crt;		/* block being filled */
+  void *		last;		/* most recent allocation, if not freed */
+  size_t		block_size;
+  count_t *		counter;
+} my_arena;
+
+#define MY_ARENA_DATA(_b) ((char *)((_b) + 1))
+
+/* round up, giving every allocation its own address */
+static inline size_t
+my_arena_round(size_t size)
+{
+  return (size == 0 ? MYALLOC_ARENA_ALIGN : (size + MYALLOC_ARENA_ALIGN - 1) & ~((size_t)MYALLOC_ARENA_ALIGN - 1));
+}
+
+
+static inline void
+my_arena_init(my_arena * a, size_t block_size, count_t * counter)
+{
+  a->head = NULL;
+  a->crt = NULL;
+  a->last = NULL;
+  a->block_size = block_size;
+  a->counter = counter;
+}
+
+
+/*
+ * Move on to a block with room for size bytes: the next free one kept from
+ * before the last reset, or a new one at the end of the list.
+ */
+static inline my_arena_block *
+my_arena_grow(my_arena * a, size_t size)
+{
+  my_arena_block * b, * tail = NULL;
+
+  for (b = (a->crt != NULL ? a->crt->next : a->head); b != NULL; tail = b, b = b->next) {
+    if (b->size >= size) {
+      a->crt = b;
+      return b;
+    }
+  }
+  if (tail == NULL)
+    tail = a->crt;
+
+  size_t block_size = (size > a->block_size ? size : a->block_size);
+  b = (my_arena_block *)
+    my_malloc(sizeof(my_arena_block) + block_size, a->counter, "arena block");
+  b->next = NULL;
+  b->size = block_size;
+  b->used = 0;
+  if (tail != NULL)
+    tail->next = b;
+  else
+    a->head = b;
+  a->crt = b;
+  return b;
+}
+
+
+static inline void *
+my_arena_malloc(my_arena * a, size_t size)
+{
+  my_arena_block * b = a->crt;
+  void * res;
+
+  size = my_arena_round(size);
+  if (b == NULL || b->used + size > b->size)
+    b = my_arena_grow(a, size);
+
+  res = MY_ARENA_DATA(b) + b->used;
+  b->used += size;
+  a->last = res;
+  return res;
+}
+
+
+static inline void *
+my_arena_calloc(my_arena * a, size_t size)
+{
+  void * res = my_arena_malloc(a, size);
+
+  memset(res, 0, size);
+  return res;
+}
+
 
+static inline void *
+my_arena_realloc(my_arena * a, void * p, size_t size, size_t old_size)
+{
+  void * res;
+
+  if (p == NULL)
+    return my_arena_malloc(a, size);
+
+  // the most recent allocation can grow or shrink in place
+  if (p == a->last) {
+    my_arena_block * b = a->crt;
+    size_t off = (char *)p - MY_ARENA_DATA(b);
+    size_t new_used = off + my_arena_round(size);
+
+    if (new_used <= b->size) {
+      b->used = new_used;
+      return p;
+    }
+  }
+
+  res = my_arena_malloc(a, size);
+  memcpy(res, p, (size < old_size ? size : old_size));
+  return res;
+}
+
+
+static inline void
+my_arena_free(my_arena * a, void * p)
+{
+  if (p != NULL && p == a->last) {
+    a->crt->used = (char *)p - MY_ARENA_DATA(a->crt);
+    a->last = NULL;
+  }
+}
+
+
+static inline void
+my_arena_reset(my_arena * a)
+{
+  my_arena_block * b;
+
+  for (b = a->head; b != NULL; b = b->next)
+    b->used = 0;
+  a->crt = a->head;
+  a->last = NULL;
+}
+
+
+static inline void
+my_arena_destroy(my_arena * a)
+{
+  my_arena_block * b, * next;
+
+  for (b = a->head; b != NULL; b = next) {
+    next = b->next;
+    my_free(b, sizeof(my_arena_block) + b->size, a->counter, "arena block");
+  }
+  my_arena_init(a, a->block_size, a->counter);
+}
 
 
 #endif
@@ -56,20 +56,21 @@ readtostr(const uint32_t *read, u_int len, bool use_colours, int initbp)
  *	A four-base deletion in the reference: 5----20
  *	Two sequencing errors: 4x15x6	(25 total matches)
  *	etc.
+ *
+ * alignment_edit_string_fill() writes it to str, which must hold
+ * ALIGNMENT_EDIT_STRING_SIZE(strlen(dbalign)) chars, and returns its length.
  */
-char *
-alignment_edit_string(const char *dbalign, const char *qralign)
+int
+alignment_edit_string_fill(char *str, const char *dbalign, const char *qralign)
 {
-	strbuf_t sb;
-	char *str;
+	char *s;
 	int i, len, consec;
 	bool refgap = false;
 
 	len = strlen(dbalign);
 	assert(len == (int)strlen(qralign));
 
-	sb = strbuf_create();
-
+	s = str;
 	consec = 0;
 	for (i = 0; i <= len; i++) {
 		if (i != len && dbalign[i] == qralign[i] && dbalign[i] != '-') {
@@ -78,12 +79,12 @@ alignment_edit_string(const char *dbalign, const char *qralign)
 		}
 
 		if (refgap && (consec != 0 || dbalign[i] != '-')) {
-			strbuf_append(sb, ")");
+			*s++ = ')';
 			refgap = false;
 		}
 
 		if (consec != 0) {
-			strbuf_append(sb, "%d", consec);
+			s += sprintf(s, "%d", consec);
 			consec = 0;
 		}
 
@@ -92,32 +93,41 @@ alignment_edit_string(const char *dbalign, const char *qralign)
 
 		if (dbalign[i] == '-') {
 			if (islower((int)qralign[i]))
-				strbuf_append(sb, "x");
+				*s++ = 'x';
 			if (!refgap)
-				strbuf_append(sb, "(");
-			strbuf_append(sb, "%c", toupper((int)qralign[i]));
+				*s++ = '(';
+			*s++ = toupper((int)qralign[i]);
 			refgap = true;
 			continue;
 		}
 
 		if (qralign[i] == '-') {
-			strbuf_append(sb, "-");
+			*s++ = '-';
 		} else {
 			//assert(i > 0 || dbalign[i] == toupper((int)qralign[i]));
 			if (dbalign[i] == toupper((int)qralign[i])) {
-				strbuf_append(sb, "x");
+				*s++ = 'x';
 				consec++;
 			} else if (islower((int)qralign[i])) {
-				strbuf_append(sb, "x");
-				strbuf_append(sb, "%c", toupper((int)qralign[i]));
+				*s++ = 'x';
+				*s++ = toupper((int)qralign[i]);
 			} else {
-				strbuf_append(sb, "%c", qralign[i]);
+				*s++ = qralign[i];
 			}
 		}
 	}
 
-	str = strbuf_string(sb, NULL);
-	strbuf_destroy(sb);
+	*s = '\0';
+	return (s - str);
+}
+
+char *
+alignment_edit_string(const char *dbalign, const char *qralign)
+{
+	char *str;
+
+	str = (char *)xmalloc(ALIGNMENT_EDIT_STRING_SIZE(strlen(dbalign)));
+	alignment_edit_string_fill(str, dbalign, qralign);
 	return (str);
 }
 
@@ -7,3 +7,7 @@ char *output_pretty(const char *, const char *, const struct
 char *output_normal(const char *, const char *, const struct
     sw_full_results *, uint32_t, bool, uint32_t *, u_int, int, bool, bool);
 char *alignment_edit_string(char const *, char const *);
+int alignment_edit_string_fill(char *, char const *, char const *);
+
+/* at most 4 chars per alignment column, e.g. "x(A)" */
+#define ALIGNMENT_EDIT_STRING_SIZE(_len)	(4 * (_len) + 1)
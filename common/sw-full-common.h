@@ -7,6 +7,7 @@
 #include <string.h>
 #include "../gmapper/gmapper-definitions.h"
 #include "../common/my-alloc.h"
+#include "../common/util.h"
 #include "../common/stats.h"
 
 
@@ -27,6 +28,8 @@ struct sw_full_results {
 
 	char *dbalign;				/* genome align string */
 	char *qralign;				/* read align string */
+	uint32_t *edit_ops;			/* alignment runs, len << 4 | op */
+	int n_edit_ops;
 	char * qual;	/* base qualities string, used in CS only */
 	double posterior;
 
@@ -47,11 +50,52 @@ struct sw_full_results {
   bool	in_use; // when set, this sfrp is part of a pair selected for output
 };
 
+/*
+ * Edit operations, numbered as BAM CIGAR operations. The full SW backtraces
+ * emit runs of these along with the align strings, so that output can render
+ * CIGARs without going back over the strings.
+ */
+#define SW_OP_MATCH		0
+#define SW_OP_INSERTION		1	/* bases in the read, not in the genome */
+#define SW_OP_DELETION		2
+#define SW_OP_SOFT_CLIP		4
+#define SW_OP_HARD_CLIP		5
+#define SW_OP_CHARS		"MIDNSHP=X"
+
+#define SW_OP(_len, _op)	(((uint32_t)(_len) << 4) | (_op))
+#define SW_OP_LEN(_x)		((_x) >> 4)
+#define SW_OP_TYPE(_x)		((_x) & 0xf)
+
+/* append one column of type op to the runs in ops[0..n), return the new n */
+static inline int
+sw_full_push_op(uint32_t *ops, int n, int op)
+{
+	if (n > 0 && (int)SW_OP_TYPE(ops[n - 1]) == op)
+		ops[n - 1] += SW_OP(1, 0);
+	else
+		ops[n++] = SW_OP(1, op);
+	return (n);
+}
+
+/*
+ * The align strings and edit runs come from the allocator the caller gives,
+ * as gmapper does with its per-chunk read arena; otherwise they are
+ * malloc()ed and the caller frees them.
+ */
+typedef void *	(*sw_full_alloc_t)(size_t);
+
+static inline void *
+sw_full_alloc(sw_full_alloc_t alloc, size_t size)
+{
+	return (alloc != NULL ? alloc(size) : xmalloc(size));
+}
+
 static inline bool
 sw_full_results_equal(struct sw_full_results *sfr1, struct sw_full_results *sfr2)
 {
 	char *dbalign1, *dbalign2;
 	char *qralign1, *qralign2;
+	uint32_t *edit_ops1, *edit_ops2;
 	bool dup1, dup2;
 	bool equal;
 
@@ -63,9 +107,12 @@ sw_full_results_equal(struct sw_full_results *sfr1, struct sw_full_results *sfr2
 	dbalign2 = sfr2->dbalign;
 	qralign1 = sfr1->qralign;
 	qralign2 = sfr2->qralign;
+	edit_ops1 = sfr1->edit_ops;
+	edit_ops2 = sfr2->edit_ops;
 
 	sfr1->dbalign = sfr2->dbalign = NULL;
 	sfr1->qralign = sfr2->qralign = NULL;
+	sfr1->edit_ops = sfr2->edit_ops = NULL;
 
 	equal = memcmp(sfr1, sfr2, sizeof(*sfr1)) == 0;
 	sfr1->dup=dup1;
@@ -74,6 +121,8 @@ sw_full_results_equal(struct sw_full_results *sfr1, struct sw_full_results *sfr2
 	sfr2->dbalign = dbalign2;
 	sfr1->qralign = qralign1;
 	sfr2->qralign = qralign2;
+	sfr1->edit_ops = edit_ops1;
+	sfr2->edit_ops = edit_ops2;
 
 	return (equal);
 }
@@ -83,16 +132,18 @@ sw_full_results_equal(struct sw_full_results *sfr1, struct sw_full_results *sfr2
  * Free sfrp for given hit.
  */
 static inline void
-free_sfrp(struct sw_full_results * * sfrp, struct read_entry * re, count_t * counter = NULL)
+free_sfrp(struct sw_full_results * * sfrp, struct read_entry * re, my_arena * arena)
 {
   assert(sfrp != NULL);
   assert(re != NULL);
 
   if (*sfrp != NULL) {
-    free((*sfrp)->dbalign);
-    free((*sfrp)->qralign);
     free((*sfrp)->qual);
-    my_free(*sfrp, sizeof(**sfrp), counter, "sfrp [%s]", re->name);
+    // newest first, so that the arena gets them all back if nothing followed
+    my_arena_free(arena, (*sfrp)->edit_ops);
+    my_arena_free(arena, (*sfrp)->qralign);
+    my_arena_free(arena, (*sfrp)->dbalign);
+    my_arena_free(arena, *sfrp);
     *sfrp = NULL;
   }
 }
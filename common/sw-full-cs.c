@@ -13,6 +13,8 @@
 #include <zlib.h>
 #include <limits.h>
 
+#include <emmintrin.h>	/* SSE2 */
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -23,16 +25,18 @@
 #include "../common/sw-full-cs.h"
 #include "../common/time_counter.h"
 
+/*
+ * One matrix cell, for all four letter space translations: element k of each
+ * field belongs to qr[k], so that full_sw() can work on the layers together.
+ */
 typedef struct swcell {
-  struct {
-    int	score_n;
-    int	score_w;
-    int	score_nw;
-
-    int8_t	back_n;
-    int8_t	back_w;
-    int8_t	back_nw;
-  } from[4];
+  int32_t	score_nw[4];
+  int32_t	score_n[4];
+  int32_t	score_w[4];
+
+  int8_t	back_nw[4];
+  int8_t	back_n[4];
+  int8_t	back_w[4];
 } swcell;
 
 #define FROM_A	0x00
@@ -103,6 +107,8 @@ static int		global_xover_penalty;
 static struct swcell   *swmatrix;
 static uint8_t	       *backtrace;
 static char	       *dbalign, *qralign;
+static uint32_t	       *edit_ops;
+static int		n_edit_ops;
 static int		anchor_width;
 static int		indel_taboo_len;
 
@@ -111,7 +117,7 @@ static uint64_t		swcells, swinvocs;
 static time_counter	sw_tc;
 
 #pragma omp threadprivate(initialised,db,qr,dblen,qrlen,a_gap_open,a_gap_ext,b_gap_open,b_gap_ext,match,mismatch,global_xover_penalty,\
-			  swmatrix,backtrace,dbalign,qralign,sw_tc,swcells,swinvocs,indel_taboo_len)
+			  swmatrix,backtrace,dbalign,qralign,edit_ops,n_edit_ops,sw_tc,swcells,swinvocs,indel_taboo_len)
 
 #define BT_CROSSOVER		0x80
 #define BT_CLIPPED		0xf0
@@ -146,8 +152,8 @@ static void print_sw(int lena, int lenb) {
 			for (j=0; j<lena+1; j++) {
 				swcell curr=swmatrix[i*(lena+1)+j];
 				int tmp=0;
-				tmp=MAX(curr.from[k].score_n,curr.from[k].score_w);
-				tmp=MAX(tmp,curr.from[k].score_nw);
+				tmp=MAX(curr.score_n[k],curr.score_w[k]);
+				tmp=MAX(tmp,curr.score_nw[k]);
 				if (tmp<-99) {	
 					tmp=-99;	
 				} 
@@ -197,53 +203,100 @@ static void print_sw_backtrace(int lena, int lenb) {
 
 inline static void
 init_cell(int idx, int local_alignment, int xover_penalty) {
-  if (local_alignment) {
-	  swmatrix[idx].from[0].score_nw = 0;
-	  swmatrix[idx].from[0].score_n  = -b_gap_open;
-	  swmatrix[idx].from[0].score_w  = -a_gap_open;
-	  swmatrix[idx].from[1].score_nw = xover_penalty;
-	  swmatrix[idx].from[1].score_n  = -b_gap_open + xover_penalty;
-	  swmatrix[idx].from[1].score_w  = -a_gap_open + xover_penalty;
-	  swmatrix[idx].from[2].score_nw = xover_penalty;
-	  swmatrix[idx].from[2].score_n  = -b_gap_open + xover_penalty;
-	  swmatrix[idx].from[2].score_w  = -a_gap_open + xover_penalty;
-	  swmatrix[idx].from[3].score_nw = xover_penalty;
-	  swmatrix[idx].from[3].score_n  = -b_gap_open + xover_penalty;
-	  swmatrix[idx].from[3].score_w  = -a_gap_open + xover_penalty;
-  } else {
-	  swmatrix[idx].from[0].score_nw = -INT_MAX/2;
-	  swmatrix[idx].from[0].score_n  = -INT_MAX/2;
-	  swmatrix[idx].from[0].score_w  = -INT_MAX/2;
-	  swmatrix[idx].from[1].score_nw = -INT_MAX/2;
-	  swmatrix[idx].from[1].score_n  = -INT_MAX/2;
-	  swmatrix[idx].from[1].score_w  = -INT_MAX/2;
-	  swmatrix[idx].from[2].score_nw = -INT_MAX/2;
-	  swmatrix[idx].from[2].score_n  = -INT_MAX/2;
-	  swmatrix[idx].from[2].score_w  = -INT_MAX/2;
-	  swmatrix[idx].from[3].score_nw = -INT_MAX/2;
-	  swmatrix[idx].from[3].score_n  = -INT_MAX/2;
-	  swmatrix[idx].from[3].score_w  = -INT_MAX/2;
+  int k, resetval;
+
+  for (k = 0; k < 4; k++) {
+    if (local_alignment) {
+      resetval = (k == 0 ? 0 : xover_penalty);
+      swmatrix[idx].score_nw[k] = resetval;
+      swmatrix[idx].score_n[k]  = -b_gap_open + resetval;
+      swmatrix[idx].score_w[k]  = -a_gap_open + resetval;
+    } else {
+      swmatrix[idx].score_nw[k] = -INT_MAX/2;
+      swmatrix[idx].score_n[k]  = -INT_MAX/2;
+      swmatrix[idx].score_w[k]  = -INT_MAX/2;
+    }
 
+    swmatrix[idx].back_nw[k] = 0;
+    swmatrix[idx].back_n[k]  = 0;
+    swmatrix[idx].back_w[k]  = 0;
   }
+}
+
+#define CS_LOAD(p)		_mm_loadu_si128((__m128i const *)(p))
+#define CS_STORE(p, v)		_mm_storeu_si128((__m128i *)(p), v)
+
+static inline __m128i
+cs_select(__m128i m, __m128i a, __m128i b)
+{
+  return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b));
+}
+
+/*
+ * Take candidate (v2, c2) in the lanes where it beats (v, c) strictly:
+ * trying candidates in the order full_sw() always did keeps its tie breaks.
+ */
+static inline void
+cs_max(__m128i * v, __m128i * c, __m128i v2, __m128i c2)
+{
+  __m128i m = _mm_cmpgt_epi32(v2, *v);
 
-  swmatrix[idx].from[0].back_nw = 0;
-  swmatrix[idx].from[0].back_n  = 0;
-  swmatrix[idx].from[0].back_w  = 0;
-  swmatrix[idx].from[1].back_nw = 0;
-  swmatrix[idx].from[1].back_n  = 0;
-  swmatrix[idx].from[1].back_w  = 0;
-  swmatrix[idx].from[2].back_nw = 0;
-  swmatrix[idx].from[2].back_n  = 0;
-  swmatrix[idx].from[2].back_w  = 0;
-  swmatrix[idx].from[3].back_nw = 0;
-  swmatrix[idx].from[3].back_n  = 0;
-  swmatrix[idx].from[3].back_w  = 0;
+  *v = cs_select(m, v2, *v);
+  *c = cs_select(m, c2, *c);
+}
+
+/*
+ * Crossovers: lane k tries the best of each other layer, in ascending order,
+ * with the crossover penalty on top. Lane l of the codes already names l.
+ */
+static inline void
+cs_crossover(__m128i * v, __m128i * c, __m128i v_xover)
+{
+  __m128i v_x = _mm_add_epi32(*v, v_xover);
+  __m128i c_x = *c;
+
+  cs_max(v, c, _mm_shuffle_epi32(v_x, _MM_SHUFFLE(0, 0, 0, 1)),
+	 _mm_shuffle_epi32(c_x, _MM_SHUFFLE(0, 0, 0, 1)));
+  cs_max(v, c, _mm_shuffle_epi32(v_x, _MM_SHUFFLE(1, 1, 2, 2)),
+	 _mm_shuffle_epi32(c_x, _MM_SHUFFLE(1, 1, 2, 2)));
+  cs_max(v, c, _mm_shuffle_epi32(v_x, _MM_SHUFFLE(2, 3, 3, 3)),
+	 _mm_shuffle_epi32(c_x, _MM_SHUFFLE(2, 3, 3, 3)));
+}
+
+/* local alignment: lanes not above their reset value start afresh */
+static inline void
+cs_clamp(__m128i * v, __m128i * c, __m128i v_reset, __m128i v_keep)
+{
+  __m128i m = _mm_or_si128(_mm_cmpgt_epi32(*v, v_reset), v_keep);
+
+  *v = cs_select(m, *v, v_reset);
+  *c = _mm_and_si128(m, *c);
+}
+
+static inline void
+cs_store_back(int8_t * back, __m128i c)
+{
+  int32_t x;
+
+  c = _mm_packs_epi32(c, c);
+  x = _mm_cvtsi128_si32(_mm_packus_epi16(c, c));
+  memcpy(back, &x, sizeof(x));
 }
 
 /*
  * Perform a full Smith-Waterman alignment. For the colour case, this means
  * computing each possible letter space read string and doing a four layer
  * scan.
+ *
+ * The four layers of a cell are computed together, one per 32-bit lane, so
+ * scores are exactly those of the scalar recurrences. Within a layer the
+ * candidates are tried in the same order as always, and across layers each
+ * lane tries its own layer first and then the others in ascending order,
+ * so tie breaking is unchanged too.
+ *
+ * Rows are confined to the anchor band. Once no cell of a row, nor a fresh
+ * start below it, can still reach threshscore, the scan stops and returns
+ * the (failing) best score found so far: the caller drops such hits anyway.
  */
 //lena - genome length
 static int
@@ -251,27 +304,23 @@ full_sw(int lena, int lenb, int threshscore, int *iret, int *jret,
 	int *kret, bool revcmpl,
 	struct anchor * anchors, int anchors_cnt, int local_alignment, int * crossover_score)
 {
-  int i, j, k, l, max_i, max_j, max_k;
-  int score, ms, tmp, resetval, xover_penalty;
-  //int go, ge;
-  //int sw_band, ne_band;
-  int8_t tmp2;
+  int i, j, k, max_i, max_j, max_k;
+  int score, xover_penalty, step, rest, lim;
+  bool taboo, track, check;
   struct anchor rectangle;
+  __m128i v_layer, v_match, v_mismatch, v_keep;
+  __m128i v_a_goe, v_a_ge, v_b_goe, v_b_ge;
+  __m128i v_c_nw_nw, v_c_nw_n, v_c_nw_w, v_c_n_nw, v_c_n_n, v_c_w_nw, v_c_w_w;
 
 
   /* shut up gcc */
   max_i = max_j = max_k = j = 0;
 
   score = 0;
-  //go = gap_open;
-  //ge = gap_ext;
 
   for (j = 0; j < lena + 1; j++) {
     init_cell(j, 1, global_xover_penalty);
   }
-  //for (j = 0; j < lenb + 1; j++) {
-  //init_cell(j * (lena + 1));
-  //}
 
   /*
    * Figure out our band.
@@ -279,9 +328,6 @@ full_sw(int lena, int lenb, int threshscore, int *iret, int *jret,
    *   cells, which could never be part of an alignment corresponding
    *   to our threshhold score.
    */
-  //sw_band = ((lenb * match - threshscore + match - 1) / match) + 1;
-  //ne_band = lena - (lenb - sw_band);
-
   if (anchors != NULL && anchor_width >= 0) {
     anchor_join(anchors, anchors_cnt, &rectangle);
     anchor_widen(&rectangle, anchor_width);
@@ -301,311 +347,237 @@ full_sw(int lena, int lenb, int threshscore, int *iret, int *jret,
     anchor_join(tmp_anchors, 2, &rectangle);
   }
 
-
+  /*
+   * Early exit: going down a row adds at most the best match score, plus
+   * the crossover score should it be positive. rest is what the rows below
+   * the current one can still add.
+   */
+  step = MAX(MAX(match, mismatch), 0);
+  rest = 0;
+  for (i = 1; i < lenb; i++)
+    rest += step + MAX(crossover_score == NULL ? global_xover_penalty : crossover_score[i], 0);
+
+  v_layer = _mm_set_epi32(3, 2, 1, 0);
+  v_match = _mm_set1_epi32(match);
+  v_mismatch = _mm_set1_epi32(mismatch);
+  v_keep = _mm_set1_epi32(local_alignment ? 0 : -1);
+  v_a_goe = _mm_set1_epi32(a_gap_open + a_gap_ext);
+  v_a_ge = _mm_set1_epi32(a_gap_ext);
+  v_b_goe = _mm_set1_epi32(b_gap_open + b_gap_ext);
+  v_b_ge = _mm_set1_epi32(b_gap_ext);
+  v_c_nw_nw = _mm_or_si128(_mm_set1_epi32(FROM_x(0, FROM_NORTHWEST_NORTHWEST)), v_layer);
+  v_c_nw_n = _mm_or_si128(_mm_set1_epi32(FROM_x(0, FROM_NORTHWEST_NORTH)), v_layer);
+  v_c_nw_w = _mm_or_si128(_mm_set1_epi32(FROM_x(0, FROM_NORTHWEST_WEST)), v_layer);
+  v_c_n_nw = _mm_or_si128(_mm_set1_epi32(FROM_x(0, FROM_NORTH_NORTHWEST)), v_layer);
+  v_c_n_n = _mm_or_si128(_mm_set1_epi32(FROM_x(0, FROM_NORTH_NORTH)), v_layer);
+  v_c_w_nw = _mm_or_si128(_mm_set1_epi32(FROM_x(0, FROM_WEST_NORTHWEST)), v_layer);
+  v_c_w_w = _mm_or_si128(_mm_set1_epi32(FROM_x(0, FROM_WEST_WEST)), v_layer);
 
   for (i = 0; i < lenb; i++) {
     /*
      * computing row i of virtual matrix, stored in row i+1
      */
     int x_min, x_max;
+    __m128i v_qr, v_qr_n, v_xover, v_reset, v_score, v_lim, v_hit;
 
     xover_penalty = (crossover_score == NULL? global_xover_penalty : crossover_score[i]);
+    if (i > 0)
+      rest -= step + MAX(xover_penalty, 0);
 
     anchor_get_x_range(&rectangle, lena, lenb, i, &x_min, &x_max);
     if (!local_alignment) {
-    	//x_max=MIN(lena,x_max); x_min=MAX(0,x_min-lenb/40); 
-    	//init_cell(i * (lena + 1) + x_max  + 1,  0);
-    	//init_cell((i + 1) * (lena + 1) + (x_min - 1) + 1, x_min == 0  ?  1 : 0);
       init_cell((i + 1) * (lena + 1) + (x_min - 1) + 1, 0, xover_penalty);
     } else {
       init_cell((i + 1) * (lena + 1) + (x_min - 1) + 1, 1, xover_penalty);
     }
-    //if (x_min > 0) {
-    //fprintf(stderr,"INIT cell %d , %d, %d\n",i+1, (x_min-1)+1,x_max);
-    //}
 
     swcells += x_max - x_min + 1;
+
+    taboo = !(i < lenb - indel_taboo_len);
+    track = local_alignment || i == lenb - 1;
+
+    /* nothing below this row reaches threshscore unless a cell beats lim */
+    lim = threshscore - rest - 1;
+    check = score < threshscore && lim >= MAX(xover_penalty, 0) && i < lenb - 1;
+
+    v_qr = _mm_set_epi32(qr[3][i], qr[2][i], qr[1][i], qr[0][i]);
+    v_qr_n = _mm_cmpeq_epi32(v_qr, _mm_set1_epi32(BASE_N));
+    v_xover = _mm_set1_epi32(xover_penalty);
+    v_reset = _mm_set_epi32(xover_penalty, xover_penalty, xover_penalty, 0);
+    v_score = _mm_set1_epi32(score);
+    v_lim = _mm_set1_epi32(lim);
+    v_hit = _mm_setzero_si128();
+
     for (j = x_min; j <= x_max; j++) {
       /*
        * computing column j of virtual matrix, stored in column j+1
        */
       struct swcell *cell_nw, *cell_n, *cell_w, *cell_cur;
+      __m128i v_ms, v_a, v_b, v_c, v_nw, v_n, v_w, c_nw, c_n, c_w;
 
       cell_nw  = &swmatrix[i * (lena + 1) + j];
       cell_n   = cell_nw + 1;
       cell_w   = cell_nw + (lena + 1);
       cell_cur = cell_w + 1;
 
-      /* banding */
-      //if (i >= sw_band + j) {
-      //memset(cell_cur, 0, sizeof(*cell_cur));
-      //continue;
-      //}
-      //if (j >= ne_band + i) {
-      //memset(cell_cur, 0, sizeof(*cell_cur));
-      //break;
-      //}
-
-      for (k = 0; k < 4; k++) {
-	if (k != 0)
-	  resetval = xover_penalty;
-	else
-	  resetval = 0;
-
-	/*
-	 * northwest
-	 */
-	if (db[j] == BASE_N || qr[k][i] == BASE_N)
-	  ms = 0;
-	else
-	  ms = (db[j] == qr[k][i]) ? match : mismatch;
-
-	if (!revcmpl) {
-	  tmp  = cell_nw->from[k].score_nw + ms;
-	  tmp2 = FROM_x(k, FROM_NORTHWEST_NORTHWEST);
-
-	  // end of an insertion: not in taboo zone
-	  if (i < lenb - indel_taboo_len && cell_nw->from[k].score_n + ms > tmp) {
-	    tmp  = cell_nw->from[k].score_n + ms;
-	    tmp2 = FROM_x(k, FROM_NORTHWEST_NORTH);
-	  }
-
-	  // end of a deletion
-	  if (cell_nw->from[k].score_w + ms > tmp) {
-	    tmp  = cell_nw->from[k].score_w + ms;
-	    tmp2 = FROM_x(k, FROM_NORTHWEST_WEST);
-	  }
-	} else {
-	  //end of a deletion
-	  tmp  = cell_nw->from[k].score_w + ms;
-	  tmp2 = FROM_x(k, FROM_NORTHWEST_WEST);
-
-	  //end of an insertion: not in taboo zone
-	  if (i < lenb - indel_taboo_len && cell_nw->from[k].score_n + ms > tmp) {
-	    tmp  = cell_nw->from[k].score_n + ms;
-	    tmp2 = FROM_x(k, FROM_NORTHWEST_NORTH);
-	  }
-
-	  if (cell_nw->from[k].score_nw + ms > tmp) {
-	    tmp  = cell_nw->from[k].score_nw + ms;
-	    tmp2 = FROM_x(k, FROM_NORTHWEST_NORTHWEST);
-	  }
-	}
-
-	/* check neighbours */
-	for (l = 0; l < 4; l++) {
-	  if (l == k)
-	    continue;
-
-	  if (!revcmpl) {
-	    /* northwest */
-	    if (cell_nw->from[l].score_nw + ms + xover_penalty > tmp) {
-	      tmp  = cell_nw->from[l].score_nw + ms + xover_penalty;
-	      tmp2 = FROM_x(l, FROM_NORTHWEST_NORTHWEST);
-	    }
-
-	    /* north */ // end of insertion, not in taboo zone
-	    if (i < lenb - indel_taboo_len && cell_nw->from[l].score_n + ms + xover_penalty > tmp) {
-	      tmp  = cell_nw->from[l].score_n + ms + xover_penalty;
-	      tmp2 = FROM_x(l, FROM_NORTHWEST_NORTH);
-	    }
-
-	    /* west */
-	    if (cell_nw->from[l].score_w + ms + xover_penalty > tmp) {
-	      tmp  = cell_nw->from[l].score_w + ms + xover_penalty;
-	      tmp2 = FROM_x(l, FROM_NORTHWEST_WEST);
-	    }
-	  } else {
-	    /* west */
-	    if (cell_nw->from[l].score_w + ms + xover_penalty > tmp) {
-	      tmp  = cell_nw->from[l].score_w + ms + xover_penalty;
-	      tmp2 = FROM_x(l, FROM_NORTHWEST_WEST);
-	    }
-
-	    /* north */ // end of insertion, not in taboo zone
-	    if (i < lenb - indel_taboo_len && cell_nw->from[l].score_n + ms + xover_penalty > tmp) {
-	      tmp  = cell_nw->from[l].score_n + ms + xover_penalty;
-	      tmp2 = FROM_x(l, FROM_NORTHWEST_NORTH);
-	    }
-
-	    /* northwest */
-	    if (cell_nw->from[l].score_nw + ms + xover_penalty > tmp) {
-	      tmp  = cell_nw->from[l].score_nw + ms + xover_penalty;
-	      tmp2 = FROM_x(l, FROM_NORTHWEST_NORTHWEST);
-	    }
-	  }
-	}
-
-	if (tmp <= resetval && local_alignment) {
-	  tmp = resetval;
-	  tmp2 = 0;
-	}
-
-	cell_cur->from[k].score_nw = tmp;
-	cell_cur->from[k].back_nw  = tmp2;
-
-
-	/*
-	 * north
-	 */
-	if (!revcmpl) {
-	  // insertion start
-	  tmp  = cell_n->from[k].score_nw - b_gap_open - b_gap_ext;
-	  tmp2 = FROM_x(k, FROM_NORTH_NORTHWEST);
+      if (db[j] == BASE_N) {
+	v_ms = _mm_setzero_si128();
+      } else {
+	v_ms = _mm_cmpeq_epi32(v_qr, _mm_set1_epi32(db[j]));
+	v_ms = _mm_andnot_si128(v_qr_n, cs_select(v_ms, v_match, v_mismatch));
+      }
 
-	  if (!(i < lenb - indel_taboo_len) || cell_n->from[k].score_n - b_gap_ext > tmp) {
-	    tmp  = cell_n->from[k].score_n - b_gap_ext;
-	    tmp2 = FROM_x(k, FROM_NORTH_NORTH);
-	  }
-	} else {
-	  tmp  = cell_n->from[k].score_n - b_gap_ext;
-	  tmp2 = FROM_x(k, FROM_NORTH_NORTH);
-
-	  // insertion start
-	  if (i < lenb - indel_taboo_len && cell_n->from[k].score_nw - b_gap_open - b_gap_ext > tmp) {
-	    tmp  = cell_n->from[k].score_nw - b_gap_open - b_gap_ext;
-	    tmp2 = FROM_x(k, FROM_NORTH_NORTHWEST);
-	  }
-	}
+      /*
+       * northwest
+       */
+      v_a = CS_LOAD(cell_nw->score_nw);
+      v_b = CS_LOAD(cell_nw->score_n);
+      v_c = CS_LOAD(cell_nw->score_w);
+      if (!revcmpl) {
+	v_nw = v_a;
+	c_nw = v_c_nw_nw;
+	// end of an insertion: not in taboo zone
+	if (!taboo)
+	  cs_max(&v_nw, &c_nw, v_b, v_c_nw_n);
+	// end of a deletion
+	cs_max(&v_nw, &c_nw, v_c, v_c_nw_w);
+      } else {
+	v_nw = v_c;
+	c_nw = v_c_nw_w;
+	if (!taboo)
+	  cs_max(&v_nw, &c_nw, v_b, v_c_nw_n);
+	cs_max(&v_nw, &c_nw, v_a, v_c_nw_nw);
+      }
+      cs_crossover(&v_nw, &c_nw, v_xover);
+      v_nw = _mm_add_epi32(v_nw, v_ms);
+      cs_clamp(&v_nw, &c_nw, v_reset, v_keep);
 
-	/* check neighbours */
-	for (l = 0; l < 4; l++) {
-	  if (l == k)
-	    continue;
+      /*
+       * north
+       */
+      v_a = _mm_sub_epi32(CS_LOAD(cell_n->score_nw), v_b_goe);
+      v_b = _mm_sub_epi32(CS_LOAD(cell_n->score_n), v_b_ge);
+      if (taboo) {
+	v_n = v_b;
+	c_n = v_c_n_n;
+      } else if (!revcmpl) {
+	// insertion start
+	v_n = v_a;
+	c_n = v_c_n_nw;
+	cs_max(&v_n, &c_n, v_b, v_c_n_n);
+      } else {
+	v_n = v_b;
+	c_n = v_c_n_n;
+	cs_max(&v_n, &c_n, v_a, v_c_n_nw);
+      }
+      cs_crossover(&v_n, &c_n, v_xover);
+      cs_clamp(&v_n, &c_n, v_reset, v_keep);
 
-	  if (!revcmpl) {
-	    /* northwest */ // insertion start
-	    if (i < lenb - indel_taboo_len && cell_n->from[l].score_nw - b_gap_open - b_gap_ext + xover_penalty > tmp) {
-	      tmp  = cell_n->from[l].score_nw - b_gap_open - b_gap_ext + xover_penalty;
-	      tmp2 = FROM_x(l, FROM_NORTH_NORTHWEST);
-	    }
+      /*
+       * west
+       *
+       * NB: It doesn't make sense to cross over on a
+       *     genomic gap, so we won't.
+       */
+      v_a = _mm_sub_epi32(CS_LOAD(cell_w->score_nw), v_a_goe);
+      v_b = _mm_sub_epi32(CS_LOAD(cell_w->score_w), v_a_ge);
+      if (taboo) {
+	v_w = v_b;
+	c_w = v_c_w_w;
+      } else if (!revcmpl) {
+	// deletion start
+	v_w = v_a;
+	c_w = v_c_w_nw;
+	cs_max(&v_w, &c_w, v_b, v_c_w_w);
+      } else {
+	v_w = v_b;
+	c_w = v_c_w_w;
+	cs_max(&v_w, &c_w, v_a, v_c_w_nw);
+      }
+      cs_clamp(&v_w, &c_w, v_reset, v_keep);
 
-	    /* north */
-	    if (cell_n->from[l].score_n - b_gap_ext + xover_penalty > tmp) {
-	      tmp  = cell_n->from[l].score_n - b_gap_ext + xover_penalty;
-	      tmp2 = FROM_x(l, FROM_NORTH_NORTH);
-	    }
-	  } else {
-	    /* north */
-	    if (cell_n->from[l].score_n - b_gap_ext + xover_penalty > tmp) {
-	      tmp  = cell_n->from[l].score_n - b_gap_ext + xover_penalty;
-	      tmp2 = FROM_x(l, FROM_NORTH_NORTH);
-	    }
+      CS_STORE(cell_cur->score_nw, v_nw);
+      CS_STORE(cell_cur->score_n, v_n);
+      CS_STORE(cell_cur->score_w, v_w);
+      cs_store_back(cell_cur->back_nw, c_nw);
+      cs_store_back(cell_cur->back_n, c_n);
+      cs_store_back(cell_cur->back_w, c_w);
 
-	    /* northwest */ // insertion start
-	    if (i < lenb - indel_taboo_len && cell_n->from[l].score_nw - b_gap_open - b_gap_ext + xover_penalty > tmp) {
-	      tmp  = cell_n->from[l].score_nw - b_gap_open - b_gap_ext + xover_penalty;
-	      tmp2 = FROM_x(l, FROM_NORTH_NORTHWEST);
+      /*
+       * max score: rarely improves, so only then go through the layers in
+       * order
+       */
+      if (track) {
+	v_a = _mm_or_si128(_mm_cmpgt_epi32(v_nw, v_score), _mm_cmpgt_epi32(v_n, v_score));
+	v_a = _mm_or_si128(v_a, _mm_cmpgt_epi32(v_w, v_score));
+	if (_mm_movemask_epi8(v_a) != 0) {
+	  for (k = 0; k < 4; k++) {
+	    if (!revcmpl) {
+	      if (cell_cur->score_nw[k] > score) {
+		score = cell_cur->score_nw[k];
+		max_i = i, max_j = j, max_k = k;
+	      }
+	      if (cell_cur->score_n[k] > score) {
+		score = cell_cur->score_n[k];
+		max_i = i, max_j = j, max_k = k;
+	      }
+	      if (cell_cur->score_w[k] > score) {
+		score = cell_cur->score_w[k];
+		max_i = i, max_j = j, max_k = k;
+	      }
+	    } else {
+	      if (cell_cur->score_w[k] > score) {
+		score = cell_cur->score_w[k];
+		max_i = i, max_j = j, max_k = k;
+	      }
+	      if (cell_cur->score_n[k] > score) {
+		score = cell_cur->score_n[k];
+		max_i = i, max_j = j, max_k = k;
+	      }
+	      if (cell_cur->score_nw[k] > score) {
+		score = cell_cur->score_nw[k];
+		max_i = i, max_j = j, max_k = k;
+	      }
 	    }
 	  }
+	  v_score = _mm_set1_epi32(score);
 	}
+      }
 
-	if (tmp <= resetval && local_alignment) {
-	  tmp = resetval;
-	  tmp2 = 0;
-	}
-					
-	cell_cur->from[k].score_n = tmp;
-	cell_cur->from[k].back_n  = tmp2;
-
-				
-	/*
-	 * west
-	 */
-	if (!revcmpl) {
-	  // deletion start
-	  tmp  = cell_w->from[k].score_nw - a_gap_open - a_gap_ext;
-	  tmp2 = FROM_x(k, FROM_WEST_NORTHWEST);
-
-	  if (!(i < lenb - indel_taboo_len) || cell_w->from[k].score_w - a_gap_ext > tmp) {
-	    tmp  = cell_w->from[k].score_w - a_gap_ext;
-	    tmp2 = FROM_x(k, FROM_WEST_WEST);
-	  }
-	} else {
-	  tmp  = cell_w->from[k].score_w - a_gap_ext;
-	  tmp2 = FROM_x(k, FROM_WEST_WEST);
-
-	  // deletion start
-	  if (i < lenb - indel_taboo_len && cell_w->from[k].score_nw - a_gap_open - a_gap_ext > tmp) {
-	    tmp  = cell_w->from[k].score_nw - a_gap_open - a_gap_ext;
-	    tmp2 = FROM_x(k, FROM_WEST_NORTHWEST);
-	  }
-	}
-
-	/*
-	 * NB: It doesn't make sense to cross over on a
-	 *     genomic gap, so we won't.
-	 */
-
-	if (tmp <= resetval && local_alignment) {
-	  tmp = resetval;
-	  tmp2 = 0;
-	}
-
-	cell_cur->from[k].score_w = tmp;
-	cell_cur->from[k].back_w  = tmp2;
-
-
-	/*
-	 * max score
-	 */
-	if (local_alignment || i==lenb-1) {
-	if (!revcmpl) {
-	  if (cell_cur->from[k].score_nw > score) {
-	    score = cell_cur->from[k].score_nw;
-	    max_i = i, max_j = j, max_k = k;
-	  }
-	  if (cell_cur->from[k].score_n > score) {
-	    score = cell_cur->from[k].score_n;
-	    max_i = i, max_j = j, max_k = k;
-	  }
-	  if (cell_cur->from[k].score_w > score) {
-	    score = cell_cur->from[k].score_w;
-	    max_i = i, max_j = j, max_k = k;
-	  }
-	} else {
-	  if (cell_cur->from[k].score_w > score) {
-	    score = cell_cur->from[k].score_w;
-	    max_i = i, max_j = j, max_k = k;
-	  }
-	  if (cell_cur->from[k].score_n > score) {
-	    score = cell_cur->from[k].score_n;
-	    max_i = i, max_j = j, max_k = k;
-	  }
-	  if (cell_cur->from[k].score_nw > score) {
-	    score = cell_cur->from[k].score_nw;
-	    max_i = i, max_j = j, max_k = k;
-	  }
-	}
-	}
+      if (check) {
+	v_a = _mm_or_si128(_mm_cmpgt_epi32(v_nw, v_lim), _mm_cmpgt_epi32(v_n, v_lim));
+	v_hit = _mm_or_si128(v_hit, _mm_or_si128(v_a, _mm_cmpgt_epi32(v_w, v_lim)));
+      }
 
 #ifdef DEBUG_SW
+      for (k = 0; k < 4; k++) {
 	fprintf(stderr, "i:%d j:%d k:%d score_nw:%d [%u,%s] score_n:%d [%u,%s] score_w:%d [%u,%s] xover_penalty:%d\n", i+1, j+1, k,
-		cell_cur->from[k].score_nw, cell_cur->from[k].back_nw & 0x3,
-		(cell_cur->from[k].back_nw >> 2 == 0 ? "!" :
-		 (cell_cur->from[k].back_nw >> 2 == FROM_NORTHWEST_NORTH ? "n" :
-		  (cell_cur->from[k].back_nw >> 2 == FROM_NORTHWEST_NORTHWEST ? "nw" : "w"))),
+		cell_cur->score_nw[k], cell_cur->back_nw[k] & 0x3,
+		(cell_cur->back_nw[k] >> 2 == 0 ? "!" :
+		 (cell_cur->back_nw[k] >> 2 == FROM_NORTHWEST_NORTH ? "n" :
+		  (cell_cur->back_nw[k] >> 2 == FROM_NORTHWEST_NORTHWEST ? "nw" : "w"))),
 
-		cell_cur->from[k].score_n, cell_cur->from[k].back_n & 0x3,
-		(cell_cur->from[k].back_n >> 2 == 0 ? "!" :
-		 (cell_cur->from[k].back_n >> 2 == FROM_NORTH_NORTH ? "n" : "nw")),
+		cell_cur->score_n[k], cell_cur->back_n[k] & 0x3,
+		(cell_cur->back_n[k] >> 2 == 0 ? "!" :
+		 (cell_cur->back_n[k] >> 2 == FROM_NORTH_NORTH ? "n" : "nw")),
 
-		cell_cur->from[k].score_w, cell_cur->from[k].back_w & 0x3,
-		(cell_cur->from[k].back_w >> 2 == 0 ? "!" :
-		 (cell_cur->from[k].back_w >> 2 == FROM_WEST_NORTHWEST ? "nw" : "w")),
+		cell_cur->score_w[k], cell_cur->back_w[k] & 0x3,
+		(cell_cur->back_w[k] >> 2 == 0 ? "!" :
+		 (cell_cur->back_w[k] >> 2 == FROM_WEST_NORTHWEST ? "nw" : "w")),
 
 		xover_penalty);
-#endif
-
       }
+#endif
     }
 
+    if (check && _mm_movemask_epi8(v_hit) == 0)
+      break;
+
     if (i+1 < lenb) {
       int next_x_min, next_x_max;
 
       anchor_get_x_range(&rectangle, lena, lenb, i+1, &next_x_min, &next_x_max);
       for (j = x_max + 1; j <= next_x_max; j++) {
-	//fprintf(stderr,"Init cell %d , , %d\n",i+1,j+1);
 	init_cell((i + 1) * (lena + 1) + (j + 1), local_alignment, xover_penalty); // still xover on i-th color
       }
     }
@@ -640,15 +612,15 @@ do_backtrace(int lena, int i, int j, int k, struct sw_full_results *sfr)
 
   cell = &swmatrix[(i + 1) * (lena + 1) + j + 1];
 
-  from = cell->from[k].back_nw;
-  fromscore = cell->from[k].score_nw;
+  from = cell->back_nw[k];
+  fromscore = cell->score_nw[k];
 
-  if (cell->from[k].score_w > fromscore) {
-    from = cell->from[k].back_w;
-    fromscore = cell->from[k].score_w;
+  if (cell->score_w[k] > fromscore) {
+    from = cell->back_w[k];
+    fromscore = cell->score_w[k];
   }
-  if (cell->from[k].score_n > fromscore)
-    from = cell->from[k].back_n;
+  if (cell->score_n[k] > fromscore)
+    from = cell->back_n[k];
 
   if (from == 0) {
     int l, base;
@@ -870,49 +842,49 @@ do_backtrace(int lena, int i, int j, int k, struct sw_full_results *sfr)
     case FROM_B_NORTH_NORTH:
     case FROM_C_NORTH_NORTH:
     case FROM_D_NORTH_NORTH:
-      from = cell->from[k].back_n;
+      from = cell->back_n[k];
       break;
 
     case FROM_A_NORTH_NORTHWEST:
     case FROM_B_NORTH_NORTHWEST:
     case FROM_C_NORTH_NORTHWEST:
     case FROM_D_NORTH_NORTHWEST:
-      from = cell->from[k].back_nw;
+      from = cell->back_nw[k];
       break;
 
     case FROM_A_WEST_WEST:
     case FROM_B_WEST_WEST:
     case FROM_C_WEST_WEST:
     case FROM_D_WEST_WEST:
-      from = cell->from[k].back_w;
+      from = cell->back_w[k];
       break;
 
     case FROM_A_WEST_NORTHWEST:
     case FROM_B_WEST_NORTHWEST:
     case FROM_C_WEST_NORTHWEST:
     case FROM_D_WEST_NORTHWEST:
-      from = cell->from[k].back_nw;
+      from = cell->back_nw[k];
       break;
 
     case FROM_A_NORTHWEST_NORTH:
     case FROM_B_NORTHWEST_NORTH:
     case FROM_C_NORTHWEST_NORTH:
     case FROM_D_NORTHWEST_NORTH:
-      from = cell->from[k].back_n;
+      from = cell->back_n[k];
       break;
 
     case FROM_A_NORTHWEST_NORTHWEST:
     case FROM_B_NORTHWEST_NORTHWEST:
     case FROM_C_NORTHWEST_NORTHWEST:
     case FROM_D_NORTHWEST_NORTHWEST:
-      from = cell->from[k].back_nw;
+      from = cell->back_nw[k];
       break;
 
     case FROM_A_NORTHWEST_WEST:
     case FROM_B_NORTHWEST_WEST:
     case FROM_C_NORTHWEST_WEST:
     case FROM_D_NORTHWEST_WEST:
-      from = cell->from[k].back_w;
+      from = cell->back_w[k];
       break;
 
     default:
@@ -937,7 +909,8 @@ do_backtrace(int lena, int i, int j, int k, struct sw_full_results *sfr)
 }
 
 /*
- * Pretty print our alignment of 'db' and 'qr' in 'dbalign' and 'qralign'.
+ * Pretty print our alignment of 'db' and 'qr' in 'dbalign' and 'qralign',
+ * and its runs of edit operations in 'edit_ops'.
  *
  * i, j represent the beginning cell in the matrix.
  * k is the first valid offset in the backtrace buffer.
@@ -950,6 +923,7 @@ pretty_print(int i, int j, int k)
 
   d = dbalign;
   q = qralign;
+  n_edit_ops = 0;
 
   for (l = k; l < (dblen + qrlen); l++) {
 
@@ -1046,6 +1020,13 @@ pretty_print(int i, int j, int k)
       fprintf(stderr, "INTERNAL ERROR: backtrace[l] = 0x%x\n", backtrace[l]);
       assert(0);
     }
+    if (BT_TYPE(backtrace[l]) == BACK_INSERTION)
+      n_edit_ops = sw_full_push_op(edit_ops, n_edit_ops, SW_OP_DELETION);
+    else if (BT_TYPE(backtrace[l]) == BACK_A_DELETION || BT_TYPE(backtrace[l]) == BACK_B_DELETION
+	     || BT_TYPE(backtrace[l]) == BACK_C_DELETION || BT_TYPE(backtrace[l]) == BACK_D_DELETION)
+      n_edit_ops = sw_full_push_op(edit_ops, n_edit_ops, SW_OP_INSERTION);
+    else
+      n_edit_ops = sw_full_push_op(edit_ops, n_edit_ops, SW_OP_MATCH);
     if ((BT_TYPE(backtrace[l]) == BACK_A_MATCH_MISMATCH || BT_TYPE(backtrace[l]) == BACK_B_MATCH_MISMATCH
 	 || BT_TYPE(backtrace[l]) == BACK_C_MATCH_MISMATCH || BT_TYPE(backtrace[l]) == BACK_D_MATCH_MISMATCH)
 	&& (*(q-1) == 'n' || *(q-1) == 'N')) {
@@ -1070,6 +1051,7 @@ sw_full_cs_cleanup(void) {
 	free(backtrace);
 	free(dbalign);
 	free(qralign);
+	free(edit_ops);
 	return 0;
 }
 
@@ -1109,6 +1091,10 @@ sw_full_cs_setup(int _dblen, int _qrlen, int _a_gap_open, int _a_gap_ext, int _b
   if (qralign == NULL)
     return (1);
 
+  edit_ops = (uint32_t *)malloc((dblen + qrlen) * sizeof(edit_ops[0]));
+  if (edit_ops == NULL)
+    return (1);
+
   a_gap_open = -(_a_gap_open);
   a_gap_ext = -(_a_gap_ext);
   b_gap_open = -(_b_gap_open);
@@ -1146,7 +1132,8 @@ sw_full_cs_stats(uint64_t *invocs, uint64_t *cells, double *secs)
 void
 sw_full_cs(uint32_t *genome_ls, int goff, int glen, uint32_t *read, int rlen,
 	   int initbp, int threshscore, struct sw_full_results *sfr, bool revcmpl, bool is_rna,
-	   struct anchor * anchors, int anchors_cnt, int local_alignment, int * crossover_score)
+	   struct anchor * anchors, int anchors_cnt, int local_alignment, int * crossover_score,
+	   sw_full_alloc_t alloc)
 {
   struct sw_full_results scratch;
   int i, j, k;
@@ -1219,8 +1206,13 @@ sw_full_cs(uint32_t *genome_ls, int goff, int glen, uint32_t *read, int rlen,
     sfr->gmapped = j - sfr->genome_start + 1;
     sfr->genome_start += goff;
     sfr->rmapped = i - sfr->read_start + 1;
-    sfr->dbalign = xstrdup(dbalign);
-    sfr->qralign = xstrdup(qralign);
+    sfr->dbalign = (char *)sw_full_alloc(alloc, (strlen(dbalign) + 1) * sizeof(sfr->dbalign[0]));
+    strcpy(sfr->dbalign, dbalign);
+    sfr->qralign = (char *)sw_full_alloc(alloc, (strlen(qralign) + 1) * sizeof(sfr->qralign[0]));
+    strcpy(sfr->qralign, qralign);
+    sfr->edit_ops = (uint32_t *)sw_full_alloc(alloc, n_edit_ops * sizeof(sfr->edit_ops[0]));
+    memcpy(sfr->edit_ops, edit_ops, n_edit_ops * sizeof(sfr->edit_ops[0]));
+    sfr->n_edit_ops = n_edit_ops;
   } else {
     sfr->score = 0;
   }
@@ -8,6 +8,7 @@ int	sw_full_cs_cleanup(void);
 int	sw_full_cs_setup(int, int, int, int, int, int, int, int, int, bool, int, int = 0);
 void	sw_full_cs_stats(uint64_t *, uint64_t *, double *);
 void	sw_full_cs(uint32_t *, int, int, uint32_t *, int, int, int,
-		   struct sw_full_results *, bool, bool, struct anchor *, int, int, int * = NULL);
+		   struct sw_full_results *, bool, bool, struct anchor *, int, int, int * = NULL,
+		   sw_full_alloc_t = NULL);
 
 #endif
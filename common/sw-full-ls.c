@@ -17,6 +17,8 @@
 #include <sys/time.h>
 #include <limits.h>
 
+#include <emmintrin.h>	/* SSE2 */
+
 #include "../common/fasta.h"
 #include "../common/sw-full-common.h"
 #include "../common/sw-full-ls.h"
@@ -45,6 +47,28 @@ typedef struct swcell {
 #define BACK_DELETION			0x2
 #define BACK_MATCH_MISMATCH		0x3
 
+/*
+ * Banded kernel: 16-bit lanes along anti-diagonals.
+ *
+ * Each cell keeps one traceback byte: a 2-bit direction per state (0 means
+ * the state was clamped to 0, i.e. the alignment starts here) and, in the
+ * top bits, the state holding the cell score.
+ */
+#define BAND_LANES			8
+
+#define BAND_NW				0
+#define BAND_N				1
+#define BAND_W				2
+
+#define BAND_FROM_N			0x1	/* NW state */
+#define BAND_FROM_NW			0x2
+#define BAND_FROM_W			0x3
+#define BAND_FROM_GAP			0x1	/* N, W states: extend */
+#define BAND_FROM_OPEN			0x2	/* N, W states: open */
+
+#define BAND_TB(_tb, _state)		(((_tb) >> (2 * (_state))) & 0x3)
+#define BAND_TB_BEST(_tb)		((_tb) >> 6)
+
 static int		initialised;
 static int8_t	       *db, *qr;
 static int		dblen, qrlen;
@@ -53,15 +77,27 @@ static int		b_gap_open, b_gap_ext;
 static int		match, mismatch;
 static struct swcell   *swmatrix;
 static int8_t	       *backtrace;
-static char	       *dbalign, *qralign;
+static uint32_t	       *edit_ops;
 static int		anchor_width;
 
+/* banded kernel */
+static int16_t	       *band_db, *band_qr;	/* genome reversed, read; padded */
+static int16_t	       *band_xmin, *band_xmax;	/* band per row */
+static int16_t	       *band_diag;		/* 3 anti-diagonals x 3 states */
+static int16_t	       *band_rowmax, *band_rowarg;
+static int	       *band_dlo, *band_dhi;	/* anti-diagonals of each row */
+static uint8_t	       *band_tb;
+static int	       *band_tb_off, *band_tb_p0, *band_tb_n;
+static int		band_rows;		/* row array length */
+
 /* statistics */
 static uint64_t		swcells, swinvocs;
 static time_counter	sw_tc;
 
 #pragma omp threadprivate(initialised,db,qr,dblen,qrlen,a_gap_open,a_gap_ext,b_gap_open,b_gap_ext,\
-		match,mismatch,swmatrix,backtrace,dbalign,qralign,anchor_width,sw_tc,swcells,swinvocs)
+		match,mismatch,swmatrix,backtrace,edit_ops,anchor_width,sw_tc,swcells,swinvocs,\
+		band_db,band_qr,band_xmin,band_xmax,band_diag,band_rowmax,band_rowarg,band_dlo,band_dhi,\
+		band_tb,band_tb_off,band_tb_p0,band_tb_n,band_rows)
 
 
 inline static void
@@ -151,27 +187,16 @@ static void print_sw_backtrace(int lena, int lenb) {
 #endif
 
 
-static int
-full_sw(int lena, int lenb, int threshscore, int maxscore, int *iret, int *jret, bool revcmpl,
-	struct anchor * anchors, int anchors_cnt, int local_alignment)
+/*
+ * Region of the matrix worth computing: around the anchors, or else the cells
+ * which could still reach the threshold.
+ */
+static void
+full_sw_rectangle(int lena, int lenb, int threshscore, struct anchor * anchors, int anchors_cnt,
+		  struct anchor * rectangle_ret)
 {
-  //fprintf(stderr,"Executing full_sw\n");
-  int max_i=0; int max_j=0;
-  int i, j;
-  //int sw_band, ne_band;
-  int score, ms, a_go, a_ge, b_go, b_ge, tmp;
-  int8_t tmp2;
   struct anchor rectangle;
 
-  /* shut up gcc */
-  j = 0;
-
-  score = 0;
-  a_go = a_gap_open;
-  a_ge = a_gap_ext;
-  b_go = b_gap_open;
-  b_ge = b_gap_ext;
-
   if (anchors != NULL && anchor_width >= 0) {
     anchor_join(anchors, anchors_cnt, &rectangle);
     anchor_widen(&rectangle, anchor_width);
@@ -191,6 +216,33 @@ full_sw(int lena, int lenb, int threshscore, int maxscore, int *iret, int *jret,
     anchor_join(tmp_anchors, 2, &rectangle);
   }
 
+  *rectangle_ret = rectangle;
+}
+
+
+static int
+full_sw(int lena, int lenb, int threshscore, int maxscore, int *iret, int *jret, bool revcmpl,
+	struct anchor * anchors, int anchors_cnt, int local_alignment)
+{
+  //fprintf(stderr,"Executing full_sw\n");
+  int max_i=0; int max_j=0;
+  int i, j;
+  //int sw_band, ne_band;
+  int score, ms, a_go, a_ge, b_go, b_ge, tmp;
+  int8_t tmp2;
+  struct anchor rectangle;
+
+  /* shut up gcc */
+  j = 0;
+
+  score = 0;
+  a_go = a_gap_open;
+  a_ge = a_gap_ext;
+  b_go = b_gap_open;
+  b_ge = b_gap_ext;
+
+  full_sw_rectangle(lena, lenb, threshscore, anchors, anchors_cnt, &rectangle);
+
   for (j = 0; j < lena + 1; j++) {
     init_cell(j,1);
   }
@@ -402,6 +454,293 @@ full_sw(int lena, int lenb, int threshscore, int maxscore, int *iret, int *jret,
   }
 }
 
+static inline __m128i
+band_select(__m128i m, __m128i a, __m128i b)
+{
+  return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b));
+}
+
+#define BAND_LOAD(p)		_mm_loadu_si128((__m128i const *)(p))
+#define BAND_STORE(p, v)	_mm_storeu_si128((__m128i *)(p), v)
+
+/* lanes of v moved up by one, the first taken from the top of prev */
+#define BAND_SHIFT1(v, prev)	_mm_or_si128(_mm_slli_si128(v, 2), _mm_srli_si128(prev, 14))
+
+/*
+ * full_sw() with the same recurrences, tie breaking and band, computed one
+ * anti-diagonal at a time: all three neighbours of a cell lie on the two
+ * previous anti-diagonals, so the cells of a diagonal are independent.
+ * Diagonals are stored by row (p = i + 1); cells on the border of the band
+ * hold the values full_sw() initialises them with, the -INT_MAX/2 of global
+ * alignment becoming INT16_MIN. The caller makes sure real scores stay far
+ * enough from it that every comparison on the alignment path comes out the
+ * same.
+ *
+ * In local mode full_sw() stops at the first cell (in row order) reaching
+ * maxscore; here the whole band is computed and that cell is recovered from
+ * the per-row maxima, which cannot exceed maxscore when it is the vector
+ * filter score. Should they, or should a global alignment have no positive
+ * cell to end on, -1 is returned and the caller falls back on full_sw().
+ */
+static int
+full_sw_banded(int lena, int lenb, int threshscore, int maxscore, int *iret, int *jret, bool revcmpl,
+	       struct anchor * anchors, int anchors_cnt, int local_alignment)
+{
+  struct anchor rectangle;
+  int16_t * d0, * d1, * d2, * tmp;
+  __m128i v_lane, v_zero, v_match, v_mismatch, v_noclamp;
+  __m128i v_l_n, v_l_w, v_b_nw, v_b_n, v_b_w, v_lane0;
+  __m128i v_nw0, v_n0, v_w0, v_nw1, v_n1;
+  __m128i v_a_goe, v_a_ge, v_b_goe, v_b_ge;
+  __m128i v_1, v_2, v_3;
+  int16_t b_nw, b_n, b_w;
+  int i, p, d, p0, p1, n, ilo, ihi, tb_len, score, rows;
+
+  full_sw_rectangle(lena, lenb, threshscore, anchors, anchors_cnt, &rectangle);
+
+  rows = band_rows;
+#define NW(_d) ((_d))
+#define N(_d) ((_d) + rows)
+#define W(_d) ((_d) + 2 * rows)
+
+  for (p = 0; p < rows - 1; p++) {
+    band_xmin[p] = 1;
+    band_xmax[p] = 0;
+    band_qr[p] = -1;
+    band_rowmax[p] = 0;
+    band_rowarg[p] = 0;
+  }
+  for (i = 0; i < lenb; i++) {
+    int x_min, x_max;
+
+    anchor_get_x_range(&rectangle, lena, lenb, i, &x_min, &x_max);
+    band_xmin[i + 1] = x_min;
+    band_xmax[i + 1] = x_max;
+    band_dlo[i] = i + x_min;
+    band_dhi[i] = i + x_max;
+    band_qr[i + 1] = qr[i];
+    if (x_min <= x_max)
+      swcells += x_max - x_min + 1;
+  }
+  for (i = 0; i < lena; i++)
+    band_db[lena - 1 - i] = db[i];
+
+  /* border cells: those of row -1 are always initialised as local */
+  if (local_alignment) {
+    b_nw = 0;
+    b_n = -b_gap_open;
+    b_w = -a_gap_open;
+  } else {
+    b_nw = b_n = b_w = INT16_MIN;
+  }
+
+  /* two diagonals before the first one: all border */
+  d0 = band_diag;
+  d1 = d0 + 3 * rows;
+  d2 = d1 + 3 * rows;
+  for (p = -BAND_LANES; p < rows - BAND_LANES; p++) {
+    NW(d0)[p] = NW(d1)[p] = NW(d2)[p] = (p == 0 ? 0 : b_nw);
+    N(d0)[p] = N(d1)[p] = N(d2)[p] = (p == 0 ? -b_gap_open : b_n);
+    W(d0)[p] = W(d1)[p] = W(d2)[p] = (p == 0 ? -a_gap_open : b_w);
+  }
+
+  v_lane = _mm_set_epi16(7, 6, 5, 4, 3, 2, 1, 0);
+  v_lane0 = _mm_set_epi16(0, 0, 0, 0, 0, 0, 0, -1);
+  v_zero = _mm_setzero_si128();
+  v_match = _mm_set1_epi16(match);
+  v_mismatch = _mm_set1_epi16(mismatch);
+  v_noclamp = _mm_set1_epi16(local_alignment ? 0 : -1);
+  v_l_n = _mm_set1_epi16(-b_gap_open);
+  v_l_w = _mm_set1_epi16(-a_gap_open);
+  v_b_nw = _mm_set1_epi16(b_nw);
+  v_b_n = _mm_set1_epi16(b_n);
+  v_b_w = _mm_set1_epi16(b_w);
+  v_a_goe = _mm_set1_epi16(a_gap_open + a_gap_ext);
+  v_a_ge = _mm_set1_epi16(a_gap_ext);
+  v_b_goe = _mm_set1_epi16(b_gap_open + b_gap_ext);
+  v_b_ge = _mm_set1_epi16(b_gap_ext);
+  v_1 = _mm_set1_epi16(1);
+  v_2 = _mm_set1_epi16(2);
+  v_3 = _mm_set1_epi16(3);
+
+  tb_len = 0;
+  ilo = 0;
+  ihi = -1;
+  for (d = 0; d < lena + lenb - 1; d++) {
+    /* rows of the band on this diagonal, plus the border on either side */
+    while (ilo < lenb && band_dhi[ilo] < d)
+      ilo++;
+    while (ihi + 1 < lenb && band_dlo[ihi + 1] <= d)
+      ihi++;
+    /*
+     * Vectors stay on a fixed grid of rows: cells from the previous
+     * diagonals are then reloaded exactly as they were stored, and the
+     * ones of the row above are shifted in from the vector before.
+     */
+    p0 = ilo & ~(BAND_LANES - 1);
+    p1 = MIN(MAX(ihi + 2, ilo), lenb);
+    n = (p1 - p0 + BAND_LANES) / BAND_LANES * BAND_LANES;
+
+    band_tb_off[d] = tb_len;
+    band_tb_p0[d] = p0;
+    band_tb_n[d] = n;
+
+    v_nw0 = BAND_LOAD(NW(d0) + p0 - BAND_LANES);
+    v_n0 = BAND_LOAD(N(d0) + p0 - BAND_LANES);
+    v_w0 = BAND_LOAD(W(d0) + p0 - BAND_LANES);
+    v_nw1 = BAND_LOAD(NW(d1) + p0 - BAND_LANES);
+    v_n1 = BAND_LOAD(N(d1) + p0 - BAND_LANES);
+
+    for (p = p0; p < p0 + n; p += BAND_LANES) {
+      __m128i v_j, v_in, v_ms, v_a, v_b, v_c, v_t, v_m, v_code;
+      __m128i v_nw, v_n, v_w, v_cnw, v_cn, v_cw, v_best, v_max;
+      __m128i v_bnw, v_bn, v_bw, v_cur;
+
+      v_j = _mm_sub_epi16(_mm_set1_epi16(d + 1 - p), v_lane);
+      v_in = _mm_or_si128(_mm_cmpgt_epi16(BAND_LOAD(band_xmin + p), v_j),
+			  _mm_cmpgt_epi16(v_j, BAND_LOAD(band_xmax + p)));
+      v_in = _mm_cmpeq_epi16(v_in, v_zero);
+
+      if (p == 0) {
+	/* row -1 */
+	v_bnw = _mm_andnot_si128(v_lane0, v_b_nw);
+	v_bn = band_select(v_lane0, v_l_n, v_b_n);
+	v_bw = band_select(v_lane0, v_l_w, v_b_w);
+      } else {
+	v_bnw = v_b_nw;
+	v_bn = v_b_n;
+	v_bw = v_b_w;
+      }
+
+      v_ms = _mm_cmpeq_epi16(BAND_LOAD(band_db + (lena - 2 - d + p)), BAND_LOAD(band_qr + p));
+      v_ms = band_select(v_ms, v_match, v_mismatch);
+
+      /* northwest: from any state of (i - 1, j - 1) */
+      v_cur = BAND_LOAD(NW(d0) + p);
+      v_a = BAND_SHIFT1(v_cur, v_nw0);
+      v_nw0 = v_cur;
+      v_cur = BAND_LOAD(N(d0) + p);
+      v_b = BAND_SHIFT1(v_cur, v_n0);
+      v_n0 = v_cur;
+      v_cur = BAND_LOAD(W(d0) + p);
+      v_c = BAND_SHIFT1(v_cur, v_w0);
+      v_w0 = v_cur;
+      if (!revcmpl) {
+	v_t = v_a;
+	v_code = v_2;
+	v_m = _mm_cmpgt_epi16(v_b, v_t);
+	v_t = _mm_max_epi16(v_t, v_b);
+	v_code = band_select(v_m, v_1, v_code);
+	v_m = _mm_cmpgt_epi16(v_c, v_t);
+	v_t = _mm_max_epi16(v_t, v_c);
+	v_code = band_select(v_m, v_3, v_code);
+      } else {
+	v_t = v_c;
+	v_code = v_3;
+	v_m = _mm_cmpgt_epi16(v_b, v_t);
+	v_t = _mm_max_epi16(v_t, v_b);
+	v_code = band_select(v_m, v_1, v_code);
+	v_m = _mm_cmpgt_epi16(v_a, v_t);
+	v_t = _mm_max_epi16(v_t, v_a);
+	v_code = band_select(v_m, v_2, v_code);
+      }
+      v_t = _mm_adds_epi16(v_t, v_ms);
+      v_m = _mm_or_si128(_mm_cmpgt_epi16(v_t, v_zero), v_noclamp);
+      v_nw = band_select(v_in, _mm_and_si128(v_t, v_m), v_bnw);
+      v_cnw = _mm_and_si128(v_code, _mm_and_si128(v_m, v_in));
+
+      /* north: from (i - 1, j) */
+      v_cur = BAND_LOAD(NW(d1) + p);
+      v_a = _mm_subs_epi16(BAND_SHIFT1(v_cur, v_nw1), v_b_goe);
+      v_nw1 = v_cur;
+      v_cur = BAND_LOAD(N(d1) + p);
+      v_b = _mm_subs_epi16(BAND_SHIFT1(v_cur, v_n1), v_b_ge);
+      v_n1 = v_cur;
+      if (!revcmpl) {
+	v_m = _mm_cmpgt_epi16(v_b, v_a);
+	v_code = band_select(v_m, v_1, v_2);
+      } else {
+	v_m = _mm_cmpgt_epi16(v_a, v_b);
+	v_code = band_select(v_m, v_2, v_1);
+      }
+      v_t = _mm_max_epi16(v_a, v_b);
+      v_m = _mm_or_si128(_mm_cmpgt_epi16(v_t, v_zero), v_noclamp);
+      v_n = band_select(v_in, _mm_and_si128(v_t, v_m), v_bn);
+      v_cn = _mm_and_si128(v_code, _mm_and_si128(v_m, v_in));
+
+      /* west: from (i, j - 1) */
+      v_a = _mm_subs_epi16(BAND_LOAD(NW(d1) + p), v_a_goe);
+      v_b = _mm_subs_epi16(BAND_LOAD(W(d1) + p), v_a_ge);
+      if (!revcmpl) {
+	v_m = _mm_cmpgt_epi16(v_b, v_a);
+	v_code = band_select(v_m, v_1, v_2);
+      } else {
+	v_m = _mm_cmpgt_epi16(v_a, v_b);
+	v_code = band_select(v_m, v_2, v_1);
+      }
+      v_t = _mm_max_epi16(v_a, v_b);
+      v_m = _mm_or_si128(_mm_cmpgt_epi16(v_t, v_zero), v_noclamp);
+      v_w = band_select(v_in, _mm_and_si128(v_t, v_m), v_bw);
+      v_cw = _mm_and_si128(v_code, _mm_and_si128(v_m, v_in));
+
+      BAND_STORE(NW(d2) + p, v_nw);
+      BAND_STORE(N(d2) + p, v_n);
+      BAND_STORE(W(d2) + p, v_w);
+
+      /* cell score: NW, then W, then N on ties, as do_backtrace() */
+      v_m = _mm_cmpgt_epi16(v_w, v_nw);
+      v_best = _mm_and_si128(v_m, v_2);
+      v_max = _mm_max_epi16(v_nw, v_w);
+      v_m = _mm_cmpgt_epi16(v_n, v_max);
+      v_best = band_select(v_m, v_1, v_best);
+      v_max = _mm_max_epi16(v_max, v_n);
+
+      v_code = _mm_or_si128(v_cnw, _mm_slli_epi16(v_cn, 2));
+      v_code = _mm_or_si128(v_code, _mm_slli_epi16(v_cw, 4));
+      v_code = _mm_or_si128(v_code, _mm_slli_epi16(v_best, 6));
+      _mm_storel_epi64((__m128i *)(band_tb + tb_len + (p - p0)), _mm_packus_epi16(v_code, v_code));
+
+      /* first best cell of each row */
+      v_t = BAND_LOAD(band_rowmax + p);
+      v_m = _mm_cmpgt_epi16(v_max, v_t);
+      BAND_STORE(band_rowmax + p, _mm_max_epi16(v_max, v_t));
+      BAND_STORE(band_rowarg + p, band_select(v_m, v_j, BAND_LOAD(band_rowarg + p)));
+    }
+    tb_len += n;
+
+    tmp = d0;
+    d0 = d1;
+    d1 = d2;
+    d2 = tmp;
+  }
+#undef NW
+#undef N
+#undef W
+
+  score = 0;
+  *iret = *jret = 0;
+  for (p = (local_alignment ? 1 : lenb); p <= lenb; p++) {
+    if (band_rowmax[p] > score) {
+      score = band_rowmax[p];
+      *iret = p - 1;
+      *jret = band_rowarg[p];
+    }
+  }
+
+  if (!local_alignment)
+    return (score > 0 ? score : -1);
+  else if (score == maxscore)
+    return score;
+  else if (score > maxscore)
+    return -1;
+  else if (anchors != NULL)
+    return full_sw_banded(lena, lenb, threshscore, maxscore, iret, jret, revcmpl, NULL, 0, local_alignment);
+  else {
+    assert(0);
+    return 0;
+  }
+}
+
 /*
  * Fill in the backtrace in order to do a pretty printout.
  *
@@ -515,37 +854,123 @@ do_backtrace(int lena, int i, int j, struct sw_full_results *sfr)
 	return (k + 1);
 }
 
+/* traceback byte of cell (i, j) of full_sw_banded(); 0 on the border */
+static inline int
+band_tb_get(int i, int j)
+{
+  int d, p;
+
+  if (i < 0 || j < 0)
+    return 0;
+
+  d = i + j;
+  p = i + 1;
+  if (p < band_tb_p0[d] || p >= band_tb_p0[d] + band_tb_n[d])
+    return 0;
+
+  return band_tb[band_tb_off[d] + (p - band_tb_p0[d])];
+}
+
+/*
+ * do_backtrace() for full_sw_banded().
+ */
+static int
+do_backtrace_banded(int i, int j, struct sw_full_results *sfr)
+{
+	int k, tb, state, from;
+
+	tb = band_tb_get(i, j);
+	state = BAND_TB_BEST(tb);
+	from = BAND_TB(tb, state);
+
+	assert(from != 0);
+
+	/* fill out the backtrace */
+	k = (dblen + qrlen) - 1;
+	while (i >= 0 && j >= 0) {
+		assert(k >= 0);
+
+		switch (state) {
+		case BAND_N:
+			backtrace[k] = BACK_DELETION;
+			sfr->deletions++;
+			sfr->read_start = i--;
+			state = (from == BAND_FROM_GAP) ? BAND_N : BAND_NW;
+			break;
+
+		case BAND_W:
+			backtrace[k] = BACK_INSERTION;
+			sfr->insertions++;
+			sfr->genome_start = j--;
+			state = (from == BAND_FROM_GAP) ? BAND_W : BAND_NW;
+			break;
+
+		case BAND_NW:
+			backtrace[k] = BACK_MATCH_MISMATCH;
+			if (db[j] == qr[i])
+				sfr->matches++;
+			else
+				sfr->mismatches++;
+			sfr->read_start = i--;
+			sfr->genome_start = j--;
+			state = (from == BAND_FROM_N) ? BAND_N
+			    : (from == BAND_FROM_NW) ? BAND_NW : BAND_W;
+			break;
+
+		default:
+			fprintf(stderr, "INTERNAL ERROR: state = %d\n", state);
+			assert(0);
+		}
+
+		/* continue backtrace (nb: i and j have already been changed) */
+		from = BAND_TB(band_tb_get(i, j), state);
+
+		k--;
+
+		if (from == 0)
+			break;
+	}
+
+	return (k + 1);
+}
+
 /*
- * Pretty print our alignment of 'db' and 'qr' in 'dbalign' and 'qralign'.
+ * Pretty print our alignment of 'db' and 'qr' in 'dbalign' and 'qralign',
+ * and its runs of edit operations in 'edit_ops'.
  *
  * i, j represent the beginning cell in the matrix.
  * k is the first valid offset in the backtrace buffer.
+ * Returns the number of runs.
  */
-static void
-pretty_print(int i, int j, int k)
+static int
+pretty_print(int i, int j, int k, char *dbalign, char *qralign)
 {
 	char *d, *q;
-	int l, done;
+	int l, n, done;
 
 	d = dbalign;
 	q = qralign;
 
+	n = 0;
 	done = 0;
 	for (l = k; l < (dblen + qrlen); l++) {
 		switch (backtrace[l]) {
 		case BACK_DELETION:
 			*d++ = '-';
 			*q++ = base_translate(qr[i++], false);
+			n = sw_full_push_op(edit_ops, n, SW_OP_INSERTION);
 			break;
 
 		case BACK_INSERTION:
 			*d++ = base_translate(db[j++], false);
 			*q++ = '-';
+			n = sw_full_push_op(edit_ops, n, SW_OP_DELETION);
 			break;
 
 		case BACK_MATCH_MISMATCH:
 			*d++ = base_translate(db[j++], false);
 			*q++ = base_translate(qr[i++], false);
+			n = sw_full_push_op(edit_ops, n, SW_OP_MATCH);
 			break;
 
 		default:
@@ -557,6 +982,7 @@ pretty_print(int i, int j, int k)
 	}
 
 	*d = *q = '\0';
+	return (n);
 }
 
 int
@@ -566,8 +992,22 @@ sw_full_ls_cleanup(void)
 	free(qr);
 	free(swmatrix);
 	free(backtrace);
-	free(dbalign);
-	free(qralign);
+	free(edit_ops);
+	if (band_db != NULL)
+		free(band_db - band_rows);
+	free(band_qr);
+	free(band_xmin);
+	free(band_xmax);
+	if (band_diag != NULL)
+		free(band_diag - BAND_LANES);
+	free(band_rowmax);
+	free(band_rowarg);
+	free(band_dlo);
+	free(band_dhi);
+	free(band_tb);
+	free(band_tb_off);
+	free(band_tb_p0);
+	free(band_tb_n);
 	return (0);
 }
 int
@@ -575,6 +1015,7 @@ sw_full_ls_setup(int _dblen, int _qrlen, int _a_gap_open, int _a_gap_ext,
     int _b_gap_open, int _b_gap_ext, int _match, int _mismatch,
 		 bool reset_stats, int _anchor_width)
 {
+	int i;
 
 	dblen = _dblen;
 	db = (int8_t *)malloc(dblen * sizeof(db[0]));
@@ -594,14 +1035,40 @@ sw_full_ls_setup(int _dblen, int _qrlen, int _a_gap_open, int _a_gap_ext,
 	if (backtrace == NULL)
 		return (1);
 
-	dbalign = (char *)malloc((dblen + qrlen + 1) * sizeof(dbalign[0]));
-	if (dbalign == NULL)
+	edit_ops = (uint32_t *)malloc((dblen + qrlen) * sizeof(edit_ops[0]));
+	if (edit_ops == NULL)
 		return (1);
 
-	qralign = (char *)malloc((dblen + qrlen + 1) * sizeof(dbalign[0]));
-	if (qralign == NULL)
+	/*
+	 * Row arrays are indexed by i + 1, read a vector before that and up
+	 * to a vector past the last row. The reversed genome is also read up
+	 * to a diagonal's worth of rows past either end.
+	 */
+	band_rows = (qrlen + 3 * BAND_LANES) & ~(BAND_LANES - 1);
+	band_db = (int16_t *)malloc((dblen + 2 * band_rows) * sizeof(band_db[0]));
+	band_qr = (int16_t *)malloc(band_rows * sizeof(band_qr[0]));
+	band_xmin = (int16_t *)malloc(band_rows * sizeof(band_xmin[0]));
+	band_xmax = (int16_t *)malloc(band_rows * sizeof(band_xmax[0]));
+	band_diag = (int16_t *)malloc((9 * band_rows + BAND_LANES) * sizeof(band_diag[0]));
+	band_rowmax = (int16_t *)malloc(band_rows * sizeof(band_rowmax[0]));
+	band_rowarg = (int16_t *)malloc(band_rows * sizeof(band_rowarg[0]));
+	band_dlo = (int *)malloc(qrlen * sizeof(band_dlo[0]));
+	band_dhi = (int *)malloc(qrlen * sizeof(band_dhi[0]));
+	band_tb = (uint8_t *)malloc((dblen + qrlen) * band_rows * sizeof(band_tb[0]));
+	band_tb_off = (int *)malloc((dblen + qrlen) * sizeof(band_tb_off[0]));
+	band_tb_p0 = (int *)malloc((dblen + qrlen) * sizeof(band_tb_p0[0]));
+	band_tb_n = (int *)malloc((dblen + qrlen) * sizeof(band_tb_n[0]));
+	if (band_db == NULL || band_qr == NULL || band_xmin == NULL || band_xmax == NULL
+	    || band_diag == NULL || band_rowmax == NULL || band_rowarg == NULL
+	    || band_dlo == NULL || band_dhi == NULL || band_tb == NULL
+	    || band_tb_off == NULL || band_tb_p0 == NULL || band_tb_n == NULL)
 		return (1);
 
+	band_db += band_rows;
+	for (i = -band_rows; i < dblen + band_rows; i++)
+		band_db[i] = -2;
+	band_diag += BAND_LANES;
+
 	a_gap_open = -(_a_gap_open);
 	a_gap_ext = -(_a_gap_ext);
 	b_gap_open = -(_b_gap_open);
@@ -637,10 +1104,10 @@ sw_full_ls_stats(uint64_t *invocs, uint64_t *cells, double *secs)
 void
 sw_full_ls(uint32_t *genome, int goff, int glen, uint32_t *read, int rlen,
     int threshscore, int maxscore, struct sw_full_results *sfr, bool revcmpl,
-    struct anchor * anchors, int anchors_cnt, int local_alignment)
+    struct anchor * anchors, int anchors_cnt, int local_alignment, sw_full_alloc_t alloc)
 {
 	struct sw_full_results scratch;
-	int i, j, k;
+	int i, j, k, score;
 
 	//llint before = rdtsc(), after;
 	TIME_COUNTER_START(sw_tc);
@@ -659,22 +1126,41 @@ sw_full_ls(uint32_t *genome, int goff, int glen, uint32_t *read, int rlen,
 	}
 	memset(backtrace, 0, (dblen + qrlen) * sizeof(backtrace[0]));
 
-	dbalign[0] = qralign[0] = '\0';
-
 	for (i = 0; i < glen; i++)
 		db[i] = (int8_t)EXTRACT(genome, goff + i);
 
 	for (i = 0; i < rlen; i++)
 		qr[i] = (int8_t)EXTRACT(read, i);
 
-	sfr->score = full_sw(glen, rlen, threshscore, maxscore, &i, &j,revcmpl, anchors, anchors_cnt,local_alignment);
-	k = do_backtrace(glen, i, j, sfr);
-	pretty_print(sfr->read_start, sfr->genome_start, k);
+	/*
+	 * 16-bit lanes: no path can lose more than this much, nor can one
+	 * from the border gain more than rlen * match.
+	 */
+	score = -1;
+	if (maxscore > 0
+	    && (long)(glen + rlen) * MAX(MAX(-mismatch, match), MAX(a_gap_open + a_gap_ext, b_gap_open + b_gap_ext))
+	       + (long)rlen * match < INT16_MAX - 256) {
+		score = full_sw_banded(glen, rlen, threshscore, maxscore, &i, &j, revcmpl, anchors, anchors_cnt,
+				       local_alignment);
+		if (score >= 0) {
+			sfr->score = score;
+			k = do_backtrace_banded(i, j, sfr);
+		}
+	}
+	if (score < 0) {
+		sfr->score = full_sw(glen, rlen, threshscore, maxscore, &i, &j,revcmpl, anchors, anchors_cnt,local_alignment);
+		k = do_backtrace(glen, i, j, sfr);
+	}
+
+	/* the backtrace runs from k to the end of the buffer */
+	sfr->dbalign = (char *)sw_full_alloc(alloc, (dblen + qrlen - k + 1) * sizeof(sfr->dbalign[0]));
+	sfr->qralign = (char *)sw_full_alloc(alloc, (dblen + qrlen - k + 1) * sizeof(sfr->qralign[0]));
+	sfr->n_edit_ops = pretty_print(sfr->read_start, sfr->genome_start, k, sfr->dbalign, sfr->qralign);
+	sfr->edit_ops = (uint32_t *)sw_full_alloc(alloc, sfr->n_edit_ops * sizeof(sfr->edit_ops[0]));
+	memcpy(sfr->edit_ops, edit_ops, sfr->n_edit_ops * sizeof(sfr->edit_ops[0]));
 	sfr->gmapped = j - sfr->genome_start + 1;
 	sfr->genome_start += goff;
 	sfr->rmapped = i - sfr->read_start + 1;
-	sfr->dbalign = xstrdup(dbalign);
-	sfr->qralign = xstrdup(qralign);
 
 	//swcells += (glen * rlen);
 	//after = rdtsc();
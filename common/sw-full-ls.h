@@ -10,7 +10,7 @@ int	sw_full_ls_setup(int, int, int, int, int, int, int, int, bool, int);
 int	sw_full_ls_cleanup(void);
 void	sw_full_ls_stats(uint64_t *, uint64_t *, double *);
 void	sw_full_ls(uint32_t *, int, int, uint32_t *, int, int, int,
-		   struct sw_full_results *, bool, struct anchor *, int, int);
+		   struct sw_full_results *, bool, struct anchor *, int, int, sw_full_alloc_t = NULL);
 
 
 #endif
@@ -26,6 +26,8 @@
 #include <zlib.h>
 #include <limits.h>
 
+#include <xmmintrin.h>	/* SSE */
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -59,19 +61,13 @@ static int	len;
 //static double	neglogfourth;
 
 typedef struct column{
-  double forwards[16]; //we'll misuse this for the viterbi
-  double backwards[16];
-  double forwscale; //adding numerical stability
-  double backscale; //adding numerical stability
-  int ncols;
-  int nlets;
-  int letssize;
-  int colssize;
-  int* lets;
-  int* cols;
-  double* letserrrate;
-  double* colserrrate;
-  char backpointer[16]; //previous state for viterbi
+  float forwards[16]; //scaled, by node (left << 2) | right
+  float backwards[4]; //scaled, by right letter
+  float prior[16]; //emission probabilities, by node
+  int let; //genome letter, -1 if none
+  int col; //read colour
+  double letserrrate;
+  double colserrrate;
   double posterior[4];
   int max_posterior;
   int base_call;
@@ -100,277 +96,186 @@ static int check;
 
 #define left(i) ( ((i) >> 2) & 3)
 #define right(i) ( (i) & 3)
-#define MIN2(i,j) ( ((i)< (j))? (i):(j))
 
 /* In order to understand any of the code below, you need to understand color-space;
-   Specifically that LETTER ^ LETTER = COLOR : T (00) ^ C (10) = 2 (10), etc. 
+   Specifically that LETTER ^ LETTER = COLOR : T (00) ^ C (10) = 2 (10), etc.
    And that LETTER ^ COLOR = NEXTLETTER: T (00) ^ 3 (11) = A (11). */
 
-/* compute prior probability of the node given the emissions. letters are thought to be at the
-   left "side" of the pair emitted by the node */
-
-double nodePrior(states* allstates, int i, int j) { //i  is state, j is node in the state
-  double val = 0;
-  double errrate;
-  int let, col, k;
-  for (k = 0; k < allstates[i].nlets; k++) {
-    let = allstates[i].lets[k];
-    errrate = allstates[i].letserrrate[k];
-    if (right(j) == let) {
-      val = val - log(1-errrate);
-    }
-    else {
-      val = val - log(errrate/3.0);
-    }
-  }
-  //fprintf(stderr, "nodeprior: %g", val);
-  for (k = 0; k < allstates[i].ncols; k++) {
-    col = allstates[i].cols[k];
-    errrate = allstates[i].colserrrate[k];
-    if ((left(j) ^ right(j)) == col) {
-      val = val - log(1-errrate);
-    }
-    else {
-      val = val - log(errrate/3.0);
-    }
-    //fprintf(stderr, " %g\n", val);
-  }
-  return val;
+/*
+ * The node of state j emits the colour left(j) ^ right(j) and the letter
+ * right(j). All 16 nodes of a state fit in four vectors, vector l holding
+ * the nodes with left letter l, lane r the one with right letter r.
+ *
+ * Probabilities are kept as such, in single precision, and every column of
+ * forwards is scaled to sum to 1; the log of the scale factors adds up to
+ * the probability of the read. Backwards only depend on the right letter
+ * (the next node has to start with it) and are simply rescaled, as the
+ * posteriors are normalised per column anyway.
+ */
+
+static inline float
+hsum(__m128 v)
+{
+  v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+  v = _mm_add_ss(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1)));
+  return _mm_cvtss_f32(v);
+}
+
+/* compute the emission probabilities of the nodes of state i */
+static void
+node_priors(states* allstates, int i)
+{
+  float let[4], col[4];
+  __m128 v_let, v_col;
+  int r;
+
+  for (r = 0; r < 4; r++) {
+    if (allstates[i].let < 0)
+      let[r] = 1.0f;
+    else if (r == allstates[i].let)
+      let[r] = (float)(1 - allstates[i].letserrrate);
+    else
+      let[r] = (float)(allstates[i].letserrrate / 3.0);
+
+    if (r == allstates[i].col)
+      col[r] = (float)(1 - allstates[i].colserrrate);
+    else
+      col[r] = (float)(allstates[i].colserrrate / 3.0);
+  }
+  v_let = _mm_loadu_ps(let);
+  v_col = _mm_loadu_ps(col);
+
+  /* vector l, lane r: colour l ^ r */
+  _mm_storeu_ps(&allstates[i].prior[0], _mm_mul_ps(v_let, v_col));
+  _mm_storeu_ps(&allstates[i].prior[4], _mm_mul_ps(v_let, _mm_shuffle_ps(v_col, v_col, _MM_SHUFFLE(2, 3, 0, 1))));
+  _mm_storeu_ps(&allstates[i].prior[8], _mm_mul_ps(v_let, _mm_shuffle_ps(v_col, v_col, _MM_SHUFFLE(1, 0, 3, 2))));
+  _mm_storeu_ps(&allstates[i].prior[12], _mm_mul_ps(v_let, _mm_shuffle_ps(v_col, v_col, _MM_SHUFFLE(0, 1, 2, 3))));
 }
 
+#ifdef DEBUG_POST_SW
 /* Little helper for debugging */
 
-void printStates(states* allstates, int stateslen, FILE* stream) {
-  int i,j,k;
+static void
+printStates(states* allstates, int stateslen, FILE* stream) {
+  int i,j;
   fprintf(stream, "\nCONTIG %d", stateslen);
 
   for (i=0; i< stateslen; i++) {
-    fprintf(stream, "\nCOLORS[%d] ",i);
-    for (k = 0; k < allstates[i].ncols; k++) {
-      fprintf(stream, "%d (%g)",allstates[i].cols[k], allstates[i].colserrrate[k]);
-    }
+    fprintf(stream, "\nCOLORS[%d] %d (%g)", i, allstates[i].col, allstates[i].colserrrate);
   }
   for (i=0; i< stateslen; i++) {
     fprintf(stream, "\nFORWARDSS[%d] ",i);
     for (j=0; j< 16; j++) {
-      fprintf(stream, "%.5g ",allstates[i].forwards[j] + allstates[i].forwscale);
-    }    
+      fprintf(stream, "%.5g ",allstates[i].forwards[j]);
+    }
   }
   for (i=0; i< stateslen; i++) {
     fprintf(stream, "\nBACKWARDSS[%d] ",i);
-    for (j=0; j< 16; j++) {
-      fprintf(stream, "%.5g ",allstates[i].backwards[j] + allstates[i].backscale);
-    }    
+    for (j=0; j< 4; j++) {
+      fprintf(stream, "%.5g ",allstates[i].backwards[j]);
+    }
   }
 
   for (i=0; i< stateslen; i++) {
-    fprintf(stream, "\nLETS[%d] ",i);
-    for (k = 0; k < allstates[i].nlets; k++) {
-      fprintf(stream, "%d ",allstates[i].lets[k]);
-    }
-  
+    fprintf(stream, "\nLETS[%d] %d ", i, allstates[i].let);
     fprintf(stream, "%c",base_to_char(allstates[i].max_posterior, LETTER_SPACE));
     fprintf(stream, " %.5g %.5g %.5g %.5g",
 	    allstates[i].posterior[0],allstates[i].posterior[1],allstates[i].posterior[2],allstates[i].posterior[3]);
   }
-  
+
   fprintf(stream, "\n");
 }
+#endif
 
 /*maximum posterior traceback */
 
-void post_traceback (states* allstates, int stateslen, double norm_px) {
-  int i = 0, j, maxval;
+static void
+post_traceback (states* allstates, int stateslen) {
+  int i, j, maxval;
+  float post[4];
+  __m128 v;
 
   for (i = 0; i < stateslen; i++) {
-    for (j=0; j< 4; j++) allstates[i].posterior[j] = 0;
-    for (j = 0; j < 16; j++) {
-      //     fprintf(stderr, "%g %g %g\n",allstates[i].forwards[j], allstates[i].backwards[j], norm_px); 
-      allstates[i].posterior[right(j)] += exp(-1 * (allstates[i].forwards[j] + allstates[i].backwards[j] + allstates[i].forwscale + allstates[i].backscale - norm_px)); 
-      //      fprintf(stderr, "distrib[%d,%d] = %g\n", i,j, exp(-1 * (allstates[i].forwards[j] + allstates[i].backwards[j] + allstates[i].forwscale + allstates[i].backscale - norm_px)));
-    }
-    maxval = 0;
-    for (j=1; j< 4; j++)  {
-      //      fprintf(stderr, "let_distrib[%d,%d] = %g\n", i,j, distrib[j]);
+    v = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(&allstates[i].forwards[0]), _mm_loadu_ps(&allstates[i].forwards[4])),
+		   _mm_add_ps(_mm_loadu_ps(&allstates[i].forwards[8]), _mm_loadu_ps(&allstates[i].forwards[12])));
+    v = _mm_mul_ps(v, _mm_loadu_ps(allstates[i].backwards));
+    v = _mm_mul_ps(v, _mm_set1_ps(1.0f / hsum(v)));
+    _mm_storeu_ps(post, v);
 
-      if (allstates[i].posterior[j] >allstates[i].posterior[maxval]) 
+    maxval = 0;
+    for (j = 0; j < 4; j++) {
+      allstates[i].posterior[j] = post[j];
+      if (allstates[i].posterior[j] > allstates[i].posterior[maxval])
 	maxval = j;
     }
-    //    fprintf (stderr, "\n");
-    //if (allstates[i].posterior[maxval] > confrate) {
     allstates[i].max_posterior = maxval;
-    //}
-    //else {
-    //  allstates[i].max_posterior = BASE_N;
-    //}
   }
-
 }
 
+static void
+do_backwards (states* allstates, int stateslen) {
+  int i;
+  __m128 b, q0, q1, q2, q3;
 
-/*viterbi traceback */
-/*
-char* vit_traceback (states* allstates, int stateslen) {
-  char* result = (char*) calloc (stateslen + 1, 1);
-  int i,j;
-  int minval, prev;
-
-  assert(0); // not changed to right letter emission
-
-  for (i = stateslen -1; i >= 0; i--) {
-    minval = 0;
-    for (j = 0; j< 16; j++) {
-      if (allstates[i].forwards[j] < allstates[i].forwards[minval]) {
-	minval = j;
-      }
-    }
-    prev = allstates[i].backpointer[minval];
-    if (i && (left(minval) != right (prev))) {
-      fprintf (stderr, "BACKTRACE error %d %d %d\n", i, minval, prev);
-      exit(2);
-    }
-    result[i] = letmap[left(minval)];
-  }
-  return result;
-}
-
-
-void viterbi (states* allstates, int stateslen) {
-  int i,j,k,let,col;
-  int minback;
-  double valback;
-  double val;
-
-  assert(0); // not changed to right letter emission
-
-  i = 0;
-  for (j = 0; j < 16; j++) {
-    allstates[i].forwards[j] = nodePrior(allstates,i,j);
-  }
+  b = _mm_set1_ps(1.0f);
+  _mm_storeu_ps(allstates[stateslen - 1].backwards, b);
 
-  for (i=1; i < stateslen; i++) {    
-    for (j = 0; j < 16; j++) {
-      allstates[i].forwards[j] = nodePrior(allstates,i,j);
+  for (i = stateslen-2; i >=0; i--) {
+    q0 = _mm_mul_ps(_mm_loadu_ps(&allstates[i+1].prior[0]), b);
+    q1 = _mm_mul_ps(_mm_loadu_ps(&allstates[i+1].prior[4]), b);
+    q2 = _mm_mul_ps(_mm_loadu_ps(&allstates[i+1].prior[8]), b);
+    q3 = _mm_mul_ps(_mm_loadu_ps(&allstates[i+1].prior[12]), b);
 
-      minback = left(j);
-      for (k = 1; k < 16; k++) {
-	if (left(j) == right(k)) {
-	  if (allstates[i-1].forwards[k] < allstates[i-1].forwards[minback]) {
-	    minback = k;
-	  }
-	}
-      }
-      valback = allstates[i-1].forwards[minback];
-      allstates[i].forwards[j] += valback;
-      allstates[i].backpointer[j] = minback;
-    }
+    /* lane r: everything the next node starting with letter r can emit */
+    _MM_TRANSPOSE4_PS(q0, q1, q2, q3);
+    b = _mm_add_ps(_mm_add_ps(q0, q1), _mm_add_ps(q2, q3));
+    b = _mm_mul_ps(b, _mm_set1_ps(1.0f / hsum(b)));
+    _mm_storeu_ps(allstates[i].backwards, b);
   }
 }
-*/
 
-double do_backwards (states* allstates, int stateslen) {
-  int i,j,k; //,let,col;
+static double
+do_forwards (states* allstates, int stateslen) {
+  int i;
   double val;
-  
-  i = stateslen-1;
-  allstates[i].backscale = 999999999;
-  for (j = 0; j < 16; j++) {
-    allstates[i].backwards[j] = 0; // matei change: bug fix
-    allstates[i].backscale = MIN2 (allstates[i].backscale, allstates[i].backwards[j]);
-  }
-  for (j = 0; j < 16; j++) {
-    allstates[i].backwards[j] -= allstates[i].backscale;
-  }
+  float scale;
+  __m128 f0, f1, f2, f3, s, zero;
 
-  for (i = stateslen-2; i >=0; i--) {    
-    allstates[i].backscale = 999999999;
-    memset(allstates[i].backwards, 0, 16 * sizeof(allstates[i].backwards[0])); // matei: bug fix
-    for (j = 0; j < 16; j++) {
-      for (k = 0; k < 16; k++) {
-	if (right(j) == left(k)) {
-	  val = nodePrior(allstates,i+1,k);
-	  allstates[i].backwards[j] += exp(-1*(val + allstates[i+1].backwards[k]));
-	}
-      }
-      //      fprintf(stdout, "bw was [%d, %d] = %g\n", i, j, allstates[i].backwards[j]); 
+  zero = _mm_setzero_ps();
+  node_priors(allstates, 0);
+  f0 = (init_bp == 0 ? _mm_loadu_ps(&allstates[0].prior[0]) : zero); // matei change: second letter emission
+  f1 = (init_bp == 1 ? _mm_loadu_ps(&allstates[0].prior[4]) : zero);
+  f2 = (init_bp == 2 ? _mm_loadu_ps(&allstates[0].prior[8]) : zero);
+  f3 = (init_bp == 3 ? _mm_loadu_ps(&allstates[0].prior[12]) : zero);
 
-      allstates[i].backwards[j] = -log(allstates[i].backwards[j]); // + neglogfourth;
-      allstates[i].backscale = MIN2 (allstates[i].backscale, allstates[i].backwards[j]);
-    }
-    for (j = 0; j < 16; j++) {
-
-      allstates[i].backwards[j] -= allstates[i].backscale;
-      //      fprintf(stdout, "bw is [%d, %d] = %g\n", i, j, allstates[i].backwards[j]); 
-    }
-    allstates[i].backscale += allstates[i+1].backscale;
-
-  }
   val = 0;
-  i = 0;
-  for (j = 0; j < 16; j++) {
-    if (left(j) == init_bp) { // matei change: second letter emission
-      val += exp(-1*(allstates[i].backwards[j] + nodePrior(allstates,i,j))); // + neglogfourth));
-    }
-  }
-  return -log(val) + allstates[0].backscale;
-}
-
-double do_forwards (states* allstates, int stateslen) {
-  int i,j,k; //,let,col;
-  double val;
-  
-  i = 0; j = 0;
-  allstates[i].forwscale = 999999999;
-  for (j = 0; j < 16; j++) {
-    if (left(j) == init_bp) { // matei change: second letter emission
-      allstates[i].forwards[j] = nodePrior(allstates,i,j); // + neglogfourth;
-      allstates[i].forwscale = MIN2 (allstates[i].forwscale, allstates[i].forwards[j]);
-    } else {
-      allstates[i].forwards[j] = HUGE_VAL;
-    }
-  }
-  for (j = 0; j < 16; j++) {
-    allstates[i].forwards[j] -= allstates[i].forwscale;
-  }
-
-  for (i=1; i < stateslen; i++) {    
-    allstates[i].forwscale = 999999999;
-    memset(allstates[i].forwards, 0, 16 * sizeof(allstates[i].forwards[0])); // matei: bug fix
-    for (j = 0; j < 16; j++) {
-      val = nodePrior(allstates,i,j);
-      for (k = 0; k < 16; k++) {
-	if (left(j) == right(k)) {
-	  allstates[i].forwards[j] += exp(-1*(allstates[i-1].forwards[k]));
-	}
-      }
-      allstates[i].forwards[j] = val - log(allstates[i].forwards[j]); //+ neglogfourth;
-      allstates[i].forwscale = MIN2 (allstates[i].forwscale, allstates[i].forwards[j]);
-    }
-    for (j = 0; j < 16; j++) {
-      allstates[i].forwards[j] -= allstates[i].forwscale;
-    }
-    allstates[i].forwscale += allstates[i-1].forwscale;
-  }
+  for (i = 0; ; i++) {
+    s = _mm_add_ps(_mm_add_ps(f0, f1), _mm_add_ps(f2, f3));
+    scale = hsum(s);
+    val -= log(scale);
+
+    s = _mm_mul_ps(s, _mm_set1_ps(1.0f / scale));
+    f0 = _mm_mul_ps(f0, _mm_set1_ps(1.0f / scale));
+    f1 = _mm_mul_ps(f1, _mm_set1_ps(1.0f / scale));
+    f2 = _mm_mul_ps(f2, _mm_set1_ps(1.0f / scale));
+    f3 = _mm_mul_ps(f3, _mm_set1_ps(1.0f / scale));
+    _mm_storeu_ps(&allstates[i].forwards[0], f0);
+    _mm_storeu_ps(&allstates[i].forwards[4], f1);
+    _mm_storeu_ps(&allstates[i].forwards[8], f2);
+    _mm_storeu_ps(&allstates[i].forwards[12], f3);
+
+    if (i == stateslen - 1)
+      break;
 
-  val = 0;
-  i = stateslen-1;
-  for (j = 0; j < 16; j++) {
-    val += exp(-1*(allstates[i].forwards[j])); // matei change: bug fix
+    /* lane r of s: reaching a node starting with letter r */
+    node_priors(allstates, i + 1);
+    f0 = _mm_mul_ps(_mm_loadu_ps(&allstates[i+1].prior[0]), _mm_shuffle_ps(s, s, _MM_SHUFFLE(0, 0, 0, 0)));
+    f1 = _mm_mul_ps(_mm_loadu_ps(&allstates[i+1].prior[4]), _mm_shuffle_ps(s, s, _MM_SHUFFLE(1, 1, 1, 1)));
+    f2 = _mm_mul_ps(_mm_loadu_ps(&allstates[i+1].prior[8]), _mm_shuffle_ps(s, s, _MM_SHUFFLE(2, 2, 2, 2)));
+    f3 = _mm_mul_ps(_mm_loadu_ps(&allstates[i+1].prior[12]), _mm_shuffle_ps(s, s, _MM_SHUFFLE(3, 3, 3, 3)));
   }
-  return -log(val)+ allstates[i].forwscale;
-}
 
-double forward_backward (states* allstates, int stateslen) {
-  double no1, no2;
-  no1 = do_forwards(allstates, stateslen);
-  no2 = do_backwards(allstates, stateslen);
-
-#ifdef DEBUG_POST_SW
-  fprintf (stderr, "SANITY CHECK: no1 == no2 %g %g\n", no1, no2);
-#endif
-
-  // don't really want a hard assert due to precision issues
-  return no1;
+  return val;
 }
 
 
@@ -417,12 +322,6 @@ post_sw_setup(int _max_len,
 
   max_len = _max_len;
   columns = (struct column *)xmalloc(max_len * sizeof(columns[0]));
-  for (int i = 0; i < max_len; i++) {
-    columns[i].lets = (int *)xmalloc(1 * sizeof(columns[i].lets[0]));
-    columns[i].cols = (int *)xmalloc(1 * sizeof(columns[i].cols[0]));
-    columns[i].letserrrate = (double *)xmalloc(1 * sizeof(columns[i].letserrrate[0]));
-    columns[i].colserrrate = (double *)xmalloc(1 * sizeof(columns[i].colserrrate[0]));
-  }
 
   if (reset_stats) {
     cells = invocs = 0;
@@ -441,12 +340,6 @@ post_sw_setup(int _max_len,
 int
 post_sw_cleanup()
 {
-  for (int i = 0; i < max_len; i++) {
-    free(columns[i].lets);
-    free(columns[i].cols);
-    free(columns[i].letserrrate);
-    free(columns[i].colserrrate);
-  }
   free(columns);
   return 1;
 }
@@ -495,30 +388,27 @@ load_local_vectors(uint32_t * read, int _init_bp, char * qual, struct sw_full_re
   for (i = 0; sfrp->dbalign[i] != 0; i++) {
     if (sfrp->qralign[i] != '-') { // ow, it's a deletion; nothing to do
       if (sfrp->dbalign[i] != '-') { // MATCH
-	columns[len].nlets = 1;
-	columns[len].lets[0] = fasta_get_initial_base(COLOUR_SPACE, &sfrp->dbalign[i]); // => BASE_A/C/G/T
-	columns[len].letserrrate[0] = pr_snp;
+	columns[len].let = fasta_get_initial_base(COLOUR_SPACE, &sfrp->dbalign[i]); // => BASE_A/C/G/T
+	columns[len].letserrrate = pr_snp;
       } else {
-	columns[len].nlets = 0;
+	columns[len].let = -1;
       }
 
       // MATCH or INSERTION
-      columns[len].ncols = 1;
       col = EXTRACT(read, j);
       if ((len == 0 && start_run == BASE_N) || col == BASE_N) {
-	//columns[len].ncols = 0; // no emission
-	columns[len].cols[0] = BASE_0;
-	columns[len].colserrrate[0] = .75;
+	columns[len].col = BASE_0;
+	columns[len].colserrrate = .75;
       } else {
-	columns[len].cols[0] = EXTRACT(read, j) ^ (len == 0? start_run : 0);
+	columns[len].col = EXTRACT(read, j) ^ (len == 0? start_run : 0);
 	if (use_read_qvs) {
-	  columns[len].colserrrate[0] = pr_err_from_qv((len == 0? MIN(min_qv, (int)qual[qual_vector_offset + j]) : (int)qual[qual_vector_offset + j]) - qual_delta);
+	  columns[len].colserrrate = pr_err_from_qv((len == 0? MIN(min_qv, (int)qual[qual_vector_offset + j]) : (int)qual[qual_vector_offset + j]) - qual_delta);
 	  if (!use_sanger_qvs) {
-	    columns[len].colserrrate[0] /= (1 + columns[len].colserrrate[0]);
+	    columns[len].colserrrate /= (1 + columns[len].colserrrate);
 	  }
-	  if (columns[len].colserrrate[0] > .75) columns[len].colserrrate[0] = .75;
+	  if (columns[len].colserrrate > .75) columns[len].colserrrate = .75;
 	} else {
-	  columns[len].colserrrate[0] = pr_xover;
+	  columns[len].colserrrate = pr_xover;
 	} 
       }
       columns[len].base_call = char_to_base(sfrp->qralign[i]);
@@ -534,17 +424,17 @@ load_local_vectors(uint32_t * read, int _init_bp, char * qual, struct sw_full_re
   int _i;
   fprintf(stderr, "db:  ");
   for (_i = 0; _i < len; _i++) {
-    fprintf(stderr, "    %c", columns[_i].nlets > 0 ? base_to_char(columns[_i].lets[0], LETTER_SPACE) : '-');
+    fprintf(stderr, "    %c", columns[_i].let >= 0 ? base_to_char(columns[_i].let, LETTER_SPACE) : '-');
   }
   fprintf(stderr, "\n");
   fprintf(stderr, "qr: %c", base_to_char(init_bp, LETTER_SPACE));
   for (_i = 0; _i < len; _i++) {
-    fprintf(stderr, "  %c  ", (columns[_i].ncols > 0 ? base_to_char(columns[_i].cols[0], COLOUR_SPACE) : '-'));
+    fprintf(stderr, "  %c  ", base_to_char(columns[_i].col, COLOUR_SPACE));
   }
   fprintf(stderr, "\n");
   fprintf(stderr, "qv:  ");
   for (_i = 0; _i < len; _i++) {
-    fprintf(stderr, "%3d  ", qv_from_pr_err(columns[_i].colserrrate[0]));
+    fprintf(stderr, "%3d  ", qv_from_pr_err(columns[_i].colserrrate));
   }
   fprintf(stderr, "\n");
 #endif
@@ -566,7 +456,7 @@ fix_base_calls(uint32_t * read, struct sw_full_results * sfrp,
       // position i in qralign corresponds to pos j in allstates
       int crt_base = allstates[j].max_posterior;
       sfrp->qralign[i] = base_to_char(crt_base, LETTER_SPACE);
-      if ((prev_base ^ crt_base) == allstates[j].cols[0]) {
+      if ((prev_base ^ crt_base) == allstates[j].col) {
 	sfrp->qralign[i] = toupper(base_to_char(crt_base, LETTER_SPACE));
       } else {
 	sfrp->qralign[i] = tolower(base_to_char(crt_base, LETTER_SPACE));
@@ -635,10 +525,14 @@ get_posterior(struct sw_full_results * sfrp, double total_score)
 
 /*
  * Main method, called after full SW.
+ *
+ * The probability of the read only takes the forward pass. Unless decode is
+ * set, the base calls and qualities are left alone: they are only needed for
+ * hits that get output, and can be filled in by a second call then.
  */
 void
 post_sw(uint32_t * read, int _init_bp, char * qual,
-	struct sw_full_results * sfrp)
+	struct sw_full_results * sfrp, bool decode)
 {
   double total_score;
 
@@ -712,11 +606,15 @@ post_sw(uint32_t * read, int _init_bp, char * qual,
 #endif
 
   load_local_vectors(read, _init_bp, qual, sfrp);
-  total_score = forward_backward(columns, len);
-  post_traceback(columns, len, total_score);
+  total_score = do_forwards(columns, len);
+  sfrp->posterior = get_posterior(sfrp, total_score);
+  if (!decode)
+    goto done;
+
+  do_backwards(columns, len);
+  post_traceback(columns, len);
   fix_base_calls(read, sfrp, columns, len);
   get_base_qualities(sfrp);
-  sfrp->posterior = get_posterior(sfrp, total_score);
 
 #ifdef DEBUG_POST_SW
   fprintf(stderr, "don: ");
@@ -751,6 +649,7 @@ post_sw(uint32_t * read, int _init_bp, char * qual,
   printStates(columns, len, stderr);
 #endif
 
+ done:
   cells += 16*len;
   //after = rdtsc();
   //ticks += MAX(after - before, 0);
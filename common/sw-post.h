@@ -9,7 +9,7 @@ int	post_sw_setup(int, double, double, double, double, double, double, bool, boo
 int	post_sw_cleanup();
 int	post_sw_stats(uint64_t *, uint64_t *, double *);
 
-void	post_sw(uint32_t *, int, char *, struct sw_full_results *);
+void	post_sw(uint32_t *, int, char *, struct sw_full_results *, bool);
 
 
 #endif
@@ -0,0 +1,75 @@
+/*
+ * Striped and inter-task Smith-Waterman kernels, 256-bit AVX2
+ * (32 x 8 or 16 x 16 lanes).
+ */
+
+#include <stdint.h>
+
+#include <immintrin.h>	/* AVX2 */
+
+#include "../common/sw-vector-striped.h"
+
+#define V		__m256i
+#define V_BYTES		32
+#define V_ZERO()	_mm256_setzero_si256()
+#define V_LOAD(p)	_mm256_load_si256(p)
+#define V_STORE(p, v)	_mm256_store_si256(p, v)
+#define V_STOREU(p, v)	_mm256_storeu_si256((V *)(p), v)
+#define V_ANY(v)	avx2_any(v)
+#define V_SHIFT_BYTES(v, n) avx2_shift_bytes(v, n)
+
+static inline int
+avx2_any(__m256i v)
+{
+	return !_mm256_testz_si256(v, v);
+}
+
+/*
+ * Shift towards higher lanes across the 128-bit halves: the permute moves
+ * the low half up (zeroing the low half), alignr then pulls the top bytes of
+ * the low half into the high one. n is always a constant, so the switch
+ * folds away once inlined.
+ */
+#define AVX2_SHIFT(v, n) \
+	_mm256_alignr_epi8(v, _mm256_permute2x128_si256(v, v, 0x08), 16 - (n))
+
+static inline __m256i
+avx2_shift_bytes(__m256i v, int n)
+{
+	switch (n) {
+	case 1: return AVX2_SHIFT(v, 1);
+	case 2: return AVX2_SHIFT(v, 2);
+	case 4: return AVX2_SHIFT(v, 4);
+	case 8: return AVX2_SHIFT(v, 8);
+	case 16: return _mm256_permute2x128_si256(v, v, 0x08);
+	default: return _mm256_setzero_si256();
+	}
+}
+
+#define STRIPED_FN	sw_striped_byte_avx2
+#define E_TYPE		uint8_t
+#define E_MAXVAL	255
+#define E_SET1(x)	_mm256_set1_epi8((char)(x))
+#define E_ADDS(a, b)	_mm256_adds_epu8(a, b)
+#define E_SUBS(a, b)	_mm256_subs_epu8(a, b)
+#define E_MAX(a, b)	_mm256_max_epu8(a, b)
+#include "../common/sw-vector-striped-kernel.h"
+
+#define STRIPED_FN	sw_striped_word_avx2
+#define E_TYPE		uint16_t
+#define E_MAXVAL	65535
+#define E_SET1(x)	_mm256_set1_epi16((short)(x))
+#define E_ADDS(a, b)	_mm256_adds_epu16(a, b)
+#define E_SUBS(a, b)	_mm256_subs_epu16(a, b)
+#define E_MAX(a, b)	_mm256_max_epu16(a, b)
+#include "../common/sw-vector-striped-kernel.h"
+
+#define BATCH_FN	sw_batch_avx2
+#define B_SET1(x)	_mm256_set1_epi16((short)(x))
+#define B_ADDS(a, b)	_mm256_adds_epi16(a, b)
+#define B_SUBS(a, b)	_mm256_subs_epi16(a, b)
+#define B_MAX(a, b)	_mm256_max_epi16(a, b)
+#define B_AND(a, b)	_mm256_and_si256(a, b)
+#define B_CMPEQ(a, b)	_mm256_cmpeq_epi16(a, b)
+#define B_SELECT(m, a, b) _mm256_blendv_epi8(b, a, m)
+#include "../common/sw-vector-batch-kernel.h"
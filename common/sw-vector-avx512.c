@@ -0,0 +1,77 @@
+/*
+ * Striped and inter-task Smith-Waterman kernels, 512-bit AVX-512BW
+ * (64 x 8 or 32 x 16 lanes).
+ */
+
+#include <stdint.h>
+
+#include <immintrin.h>	/* AVX-512F/BW */
+
+#include "../common/sw-vector-striped.h"
+
+#define V		__m512i
+#define V_BYTES		64
+#define V_ZERO()	_mm512_setzero_si512()
+#define V_LOAD(p)	_mm512_load_si512(p)
+#define V_STORE(p, v)	_mm512_store_si512(p, v)
+#define V_STOREU(p, v)	_mm512_storeu_si512((V *)(p), v)
+#define V_ANY(v)	avx512_any(v)
+#define V_SHIFT_BYTES(v, n) avx512_shift_bytes(v, n)
+
+static inline int
+avx512_any(__m512i v)
+{
+	return _mm512_test_epi8_mask(v, v) != 0;
+}
+
+/*
+ * Shift towards higher lanes across the 128-bit quarters: the masked
+ * shuffles move every quarter up by one or two (zeroing the bottom ones),
+ * alignr then pulls the top bytes of the quarter below into each quarter.
+ * n is always a constant, so the switch folds away once inlined.
+ */
+#define AVX512_UP1(v)	_mm512_maskz_shuffle_i64x2(0xfc, v, v, _MM_SHUFFLE(2, 1, 0, 0))
+#define AVX512_UP2(v)	_mm512_maskz_shuffle_i64x2(0xf0, v, v, _MM_SHUFFLE(1, 0, 0, 0))
+#define AVX512_SHIFT(v, n) _mm512_alignr_epi8(v, AVX512_UP1(v), 16 - (n))
+
+static inline __m512i
+avx512_shift_bytes(__m512i v, int n)
+{
+	switch (n) {
+	case 1: return AVX512_SHIFT(v, 1);
+	case 2: return AVX512_SHIFT(v, 2);
+	case 4: return AVX512_SHIFT(v, 4);
+	case 8: return AVX512_SHIFT(v, 8);
+	case 16: return AVX512_UP1(v);
+	case 32: return AVX512_UP2(v);
+	default: return _mm512_setzero_si512();
+	}
+}
+
+#define STRIPED_FN	sw_striped_byte_avx512
+#define E_TYPE		uint8_t
+#define E_MAXVAL	255
+#define E_SET1(x)	_mm512_set1_epi8((char)(x))
+#define E_ADDS(a, b)	_mm512_adds_epu8(a, b)
+#define E_SUBS(a, b)	_mm512_subs_epu8(a, b)
+#define E_MAX(a, b)	_mm512_max_epu8(a, b)
+#include "../common/sw-vector-striped-kernel.h"
+
+#define STRIPED_FN	sw_striped_word_avx512
+#define E_TYPE		uint16_t
+#define E_MAXVAL	65535
+#define E_SET1(x)	_mm512_set1_epi16((short)(x))
+#define E_ADDS(a, b)	_mm512_adds_epu16(a, b)
+#define E_SUBS(a, b)	_mm512_subs_epu16(a, b)
+#define E_MAX(a, b)	_mm512_max_epu16(a, b)
+#include "../common/sw-vector-striped-kernel.h"
+
+#define BATCH_FN	sw_batch_avx512
+#define B_SET1(x)	_mm512_set1_epi16((short)(x))
+#define B_ADDS(a, b)	_mm512_adds_epi16(a, b)
+#define B_SUBS(a, b)	_mm512_subs_epi16(a, b)
+#define B_MAX(a, b)	_mm512_max_epi16(a, b)
+#define B_AND(a, b)	_mm512_and_si512(a, b)
+#define B_CMPEQ(a, b)	_mm512_movm_epi16(_mm512_cmpeq_epi16_mask(a, b))
+#define B_SELECT(m, a, b) _mm512_mask_blend_epi16(_mm512_movepi16_mask(m), b, a)
+#include "../common/sw-vector-batch-kernel.h"
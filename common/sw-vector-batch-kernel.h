@@ -0,0 +1,98 @@
+/*
+ * Inter-task Smith-Waterman kernel body: one database window per 16-bit
+ * lane, all lanes aligned against the same query. Included once by each
+ * sw-vector-<isa>.c file, which defines the vector macros of
+ * sw-vector-striped-kernel.h plus the signed 16-bit lane macros below.
+ *
+ *	BATCH_FN, B_SET1(x), B_ADDS(a, b), B_SUBS(a, b), B_MAX(a, b),
+ *	B_AND(a, b), B_CMPEQ(a, b) (all-ones lanes), B_SELECT(m, a, b)
+ *
+ * Unlike the striped kernels there is no dependency between lanes, so the
+ * recurrence is the plain Gotoh one, walked down the query for every
+ * database column. The per-column profile holds one vector per query code
+ * that occurs in the read (plus the colour space first base), so the inner
+ * loop only has to load the score.
+ *
+ * F is carried from the cell score before F is folded in (x below): since
+ * opening costs at least as much as extending, a gap leaving a cell whose
+ * best score came from F can never beat extending that F. This keeps the
+ * dependency chain down the column to one subtract and one max.
+ */
+
+void
+BATCH_FN(struct sw_batch_args const *args)
+{
+	V *pv_h = (V *)args->h;
+	V *pv_e = (V *)args->e;
+	V *pv_s = (V *)args->prof;
+	V const *pv_db = (V const *)args->db;
+	uint8_t const *qr = args->qr;
+	int const rlen = args->rlen;
+	int const dblen = args->dblen;
+	V v_zero, v_match, v_mismatch, v_code_mask, v_first, v_score;
+	V v_a_gap_open_ext, v_a_gap_ext, v_b_gap_open_ext, v_b_gap_ext;
+	V v_db, v_eq, v_x, v_h, v_h_old, v_diag, v_e, v_f;
+	uint32_t codes;
+	int i, j, c;
+
+	v_zero = V_ZERO();
+	v_match = B_SET1(args->match);
+	v_mismatch = B_SET1(args->mismatch);
+	v_code_mask = B_SET1(~SW_BATCH_FIRST);
+	v_first = B_SET1(SW_BATCH_FIRST);
+	v_a_gap_open_ext = B_SET1(args->a_gap_open_ext);
+	v_a_gap_ext = B_SET1(args->a_gap_ext);
+	v_b_gap_open_ext = B_SET1(args->b_gap_open_ext);
+	v_b_gap_ext = B_SET1(args->b_gap_ext);
+	v_score = v_zero;
+
+	for (i = 0; i < rlen; i++) {
+		V_STORE(pv_h + i, v_zero);
+		V_STORE(pv_e + i, v_zero);
+	}
+
+	for (j = 0; j < dblen; j++) {
+		v_db = V_LOAD(pv_db + j);
+		for (codes = args->codes; codes != 0; codes &= codes - 1) {
+			c = __builtin_ctz(codes);
+			if (c == SW_BATCH_FIRST)
+				v_eq = B_CMPEQ(B_AND(v_db, v_first), v_first);
+			else
+				v_eq = B_CMPEQ(B_AND(v_db, v_code_mask), B_SET1(c));
+			V_STORE(pv_s + c, B_SELECT(v_eq, v_match, v_mismatch));
+		}
+
+		v_diag = v_zero;
+		v_f = v_zero;
+		for (i = 0; i < rlen; i++) {
+			v_h_old = V_LOAD(pv_h + i);
+
+			v_e = B_SUBS(V_LOAD(pv_e + i), v_a_gap_ext);
+			v_e = B_MAX(v_e, B_SUBS(v_h_old, v_a_gap_open_ext));
+			V_STORE(pv_e + i, v_e);
+
+			v_x = B_ADDS(v_diag, V_LOAD(pv_s + qr[i]));
+			v_x = B_MAX(v_x, v_e);
+			v_x = B_MAX(v_x, v_zero);
+			v_h = B_MAX(v_x, v_f);
+			V_STORE(pv_h + i, v_h);
+			v_score = B_MAX(v_score, v_h);
+
+			v_f = B_SUBS(v_f, v_b_gap_ext);
+			v_f = B_MAX(v_f, B_SUBS(v_x, v_b_gap_open_ext));
+
+			v_diag = v_h_old;
+		}
+	}
+
+	V_STOREU(args->scores, v_score);
+}
+
+#undef BATCH_FN
+#undef B_SET1
+#undef B_ADDS
+#undef B_SUBS
+#undef B_MAX
+#undef B_AND
+#undef B_CMPEQ
+#undef B_SELECT
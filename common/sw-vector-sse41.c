@@ -0,0 +1,67 @@
+/*
+ * Striped and inter-task Smith-Waterman kernels, 128-bit SSE4.1
+ * (16 x 8 or 8 x 16 lanes).
+ * SSE4.1 brings the unsigned 16-bit max the word kernel relies on.
+ */
+
+#include <stdint.h>
+
+#include <smmintrin.h>	/* SSE4.1 */
+
+#include "../common/sw-vector-striped.h"
+
+#define V		__m128i
+#define V_BYTES		16
+#define V_ZERO()	_mm_setzero_si128()
+#define V_LOAD(p)	_mm_load_si128(p)
+#define V_STORE(p, v)	_mm_store_si128(p, v)
+#define V_STOREU(p, v)	_mm_storeu_si128((V *)(p), v)
+#define V_ANY(v)	sse41_any(v)
+#define V_SHIFT_BYTES(v, n) sse41_shift_bytes(v, n)
+
+static inline int
+sse41_any(__m128i v)
+{
+	return !_mm_testz_si128(v, v);
+}
+
+/* n is always a constant, so the switch folds away once inlined */
+static inline __m128i
+sse41_shift_bytes(__m128i v, int n)
+{
+	switch (n) {
+	case 1: return _mm_slli_si128(v, 1);
+	case 2: return _mm_slli_si128(v, 2);
+	case 4: return _mm_slli_si128(v, 4);
+	case 8: return _mm_slli_si128(v, 8);
+	default: return _mm_setzero_si128();
+	}
+}
+
+#define STRIPED_FN	sw_striped_byte_sse41
+#define E_TYPE		uint8_t
+#define E_MAXVAL	255
+#define E_SET1(x)	_mm_set1_epi8((char)(x))
+#define E_ADDS(a, b)	_mm_adds_epu8(a, b)
+#define E_SUBS(a, b)	_mm_subs_epu8(a, b)
+#define E_MAX(a, b)	_mm_max_epu8(a, b)
+#include "../common/sw-vector-striped-kernel.h"
+
+#define STRIPED_FN	sw_striped_word_sse41
+#define E_TYPE		uint16_t
+#define E_MAXVAL	65535
+#define E_SET1(x)	_mm_set1_epi16((short)(x))
+#define E_ADDS(a, b)	_mm_adds_epu16(a, b)
+#define E_SUBS(a, b)	_mm_subs_epu16(a, b)
+#define E_MAX(a, b)	_mm_max_epu16(a, b)
+#include "../common/sw-vector-striped-kernel.h"
+
+#define BATCH_FN	sw_batch_sse41
+#define B_SET1(x)	_mm_set1_epi16((short)(x))
+#define B_ADDS(a, b)	_mm_adds_epi16(a, b)
+#define B_SUBS(a, b)	_mm_subs_epi16(a, b)
+#define B_MAX(a, b)	_mm_max_epi16(a, b)
+#define B_AND(a, b)	_mm_and_si128(a, b)
+#define B_CMPEQ(a, b)	_mm_cmpeq_epi16(a, b)
+#define B_SELECT(m, a, b) _mm_blendv_epi8(b, a, m)
+#include "../common/sw-vector-batch-kernel.h"
@@ -0,0 +1,137 @@
+/*
+ * Striped Smith-Waterman kernel body; included once per lane width by the
+ * sw-vector-<isa>.c files, which define the vector and lane macros below.
+ *
+ * Vector macros (per instruction set):
+ *	V, V_BYTES, V_ZERO(), V_LOAD(p), V_STORE(p, v), V_STOREU(p, v),
+ *	V_ANY(v), V_SHIFT_BYTES(v, n)	(towards higher lanes, zero filling)
+ *
+ * Lane macros (per lane width, undefined again at the end of this file):
+ *	STRIPED_FN, E_TYPE, E_MAXVAL, E_SET1(x), E_ADDS(a, b), E_SUBS(a, b),
+ *	E_MAX(a, b)
+ *
+ * All lanes are unsigned and saturate at zero, which is exactly the local
+ * alignment floor: gap scores that would go negative can never beat a fresh
+ * start, so clamping them loses nothing.
+ *
+ * Query gaps (F) are not resolved with Farrar's lazy loop: with our scores
+ * (small gap extension, large match) a gap chain leaving a good diagonal
+ * stays live for most of the column, and the lazy loop then walks every
+ * stripe boundary one pass at a time. Instead, since
+ *
+ *	F(i) = max_{k < i} (H'(k) - b_open_ext - (i - 1 - k) * b_ext)
+ *
+ * where H' is the cell score without F, each column takes one pass for H'
+ * and the in-lane part of that maximum, a log-step prefix maximum across
+ * lanes, and one pass to fold F in and update E.
+ */
+
+#define E_LANES		((int)(V_BYTES / sizeof(E_TYPE)))
+#define E_SHIFT(v, n)	V_SHIFT_BYTES(v, (n) * (int)sizeof(E_TYPE))
+
+int
+STRIPED_FN(struct sw_striped_args const *args)
+{
+	int const seglen = args->seglen;
+	V const *profile = (V const *)args->profile;
+	V *pv_h = (V *)args->h;
+	V *pv_ht = (V *)args->ht;
+	V *pv_e = (V *)args->e;
+	V const *pv_p;
+	V v_zero, v_bias, v_limit, v_score, v_h, v_ht, v_e, v_g;
+	V v_a_gap_open_ext, v_a_gap_ext, v_b_gap_open_ext, v_b_gap_ext;
+	V v_step[6];
+	E_TYPE lanes[E_LANES];
+	int i, j, score;
+
+	v_zero = V_ZERO();
+	v_bias = E_SET1(args->bias);
+	v_limit = E_SET1(E_MAXVAL - 1 - args->bias);
+	v_a_gap_open_ext = E_SET1(args->a_gap_open_ext);
+	v_a_gap_ext = E_SET1(args->a_gap_ext);
+	v_b_gap_open_ext = E_SET1(args->b_gap_open_ext);
+	v_b_gap_ext = E_SET1(args->b_gap_ext);
+	v_score = v_zero;
+
+	/* gap extension across 1, 2, 4, ... whole lanes of the stripe */
+	for (i = 0; i < 6; i++) {
+		long pen = ((long)seglen * args->b_gap_ext) << i;
+
+		v_step[i] = E_SET1(pen < E_MAXVAL ? pen : E_MAXVAL);
+	}
+
+	for (i = 0; i < seglen; i++) {
+		V_STORE(pv_h + i, v_zero);
+		V_STORE(pv_e + i, v_zero);
+	}
+
+	for (j = 0; j < args->dblen; j++) {
+		pv_p = profile + args->db[j] * seglen;
+
+		/* H' = max(diagonal + score, E), and the in-lane F chain */
+		v_g = v_zero;
+		v_h = E_SHIFT(V_LOAD(pv_h + seglen - 1), 1);
+		for (i = 0; i < seglen; i++) {
+			v_ht = E_ADDS(v_h, V_LOAD(pv_p + i));
+			v_ht = E_SUBS(v_ht, v_bias);
+			v_ht = E_MAX(v_ht, V_LOAD(pv_e + i));
+			V_STORE(pv_ht + i, v_ht);
+
+			v_g = E_SUBS(v_g, v_b_gap_ext);
+			v_g = E_MAX(v_g, v_ht);
+
+			v_h = V_LOAD(pv_h + i);
+		}
+
+		/* carry the chains across lanes: prefix maximum */
+		v_g = E_SHIFT(v_g, 1);
+		v_g = E_MAX(v_g, E_SUBS(E_SHIFT(v_g, 1), v_step[0]));
+		if (E_LANES > 2)
+			v_g = E_MAX(v_g, E_SUBS(E_SHIFT(v_g, 2), v_step[1]));
+		if (E_LANES > 4)
+			v_g = E_MAX(v_g, E_SUBS(E_SHIFT(v_g, 4), v_step[2]));
+		if (E_LANES > 8)
+			v_g = E_MAX(v_g, E_SUBS(E_SHIFT(v_g, 8), v_step[3]));
+		if (E_LANES > 16)
+			v_g = E_MAX(v_g, E_SUBS(E_SHIFT(v_g, 16), v_step[4]));
+		if (E_LANES > 32)
+			v_g = E_MAX(v_g, E_SUBS(E_SHIFT(v_g, 32), v_step[5]));
+
+		/* H = max(H', F); E for the next column */
+		for (i = 0; i < seglen; i++) {
+			v_ht = V_LOAD(pv_ht + i);
+			v_h = E_MAX(v_ht, E_SUBS(v_g, v_b_gap_open_ext));
+			v_score = E_MAX(v_score, v_h);
+			V_STORE(pv_h + i, v_h);
+
+			v_e = E_SUBS(V_LOAD(pv_e + i), v_a_gap_ext);
+			v_e = E_MAX(v_e, E_SUBS(v_h, v_a_gap_open_ext));
+			V_STORE(pv_e + i, v_e);
+
+			v_g = E_SUBS(v_g, v_b_gap_ext);
+			v_g = E_MAX(v_g, v_ht);
+		}
+
+		/* saturated: the caller has to retry with wider lanes */
+		if (V_ANY(E_SUBS(v_score, v_limit)))
+			return (-1);
+	}
+
+	V_STOREU(lanes, v_score);
+	score = 0;
+	for (i = 0; i < E_LANES; i++)
+		if (lanes[i] > score)
+			score = lanes[i];
+
+	return (score);
+}
+
+#undef STRIPED_FN
+#undef E_TYPE
+#undef E_MAXVAL
+#undef E_SET1
+#undef E_ADDS
+#undef E_SUBS
+#undef E_MAX
+#undef E_LANES
+#undef E_SHIFT
@@ -0,0 +1,68 @@
+/*
+ * Striped (Farrar) Smith-Waterman score kernels.
+ *
+ * The query is laid out in a striped query profile so that the inner loop
+ * only ever loads whole vectors; the database is walked one column at a time.
+ * Every kernel works on biased, unsigned, saturating lanes: the byte kernels
+ * return -1 when the score may have saturated and the caller must rerun the
+ * word kernel.
+ *
+ * Each instruction set lives in its own translation unit, compiled with the
+ * matching -m flags, together with the inter-task kernel below; sw-vector.c
+ * picks one at run time.
+ */
+#ifndef _SW_VECTOR_STRIPED_H
+#define _SW_VECTOR_STRIPED_H
+
+#include <stdint.h>
+
+struct sw_striped_args {
+	uint8_t const  *db;		/* database, one profile code per column */
+	int		dblen;
+	void const     *profile;	/* [code][seglen] vectors */
+	int		seglen;
+	void	       *h, *ht, *e;	/* seglen vectors each, aligned */
+	int		bias;		/* added to every profile score */
+	int		a_gap_open_ext, a_gap_ext;	/* along the database */
+	int		b_gap_open_ext, b_gap_ext;	/* along the query */
+};
+
+typedef int (*sw_striped_fn)(struct sw_striped_args const *);
+
+int	sw_striped_byte_sse41(struct sw_striped_args const *);
+int	sw_striped_word_sse41(struct sw_striped_args const *);
+int	sw_striped_byte_avx2(struct sw_striped_args const *);
+int	sw_striped_word_avx2(struct sw_striped_args const *);
+int	sw_striped_byte_avx512(struct sw_striped_args const *);
+int	sw_striped_word_avx512(struct sw_striped_args const *);
+
+/*
+ * Inter-task kernels: one window per 16-bit lane against a shared query, for
+ * scoring many windows of one read in a single sweep. Window codes carry
+ * SW_BATCH_FIRST when, in colour space, the letter under the window matches
+ * the read's first base; SW_BATCH_PAD fills lanes past a window's end.
+ */
+#define SW_BATCH_FIRST	16
+#define SW_BATCH_PAD	32
+
+struct sw_batch_args {
+	uint16_t const *db;		/* [dblen][lanes] window codes */
+	int		dblen;
+	uint8_t const  *qr;		/* profile index per query position */
+	int		rlen;
+	uint32_t	codes;		/* bitmap of the indices in qr */
+	void	       *h, *e;		/* rlen vectors each, aligned */
+	void	       *prof;		/* SW_BATCH_FIRST + 1 vectors, aligned */
+	int		match, mismatch;
+	int		a_gap_open_ext, a_gap_ext;
+	int		b_gap_open_ext, b_gap_ext;
+	int16_t	       *scores;		/* one per lane */
+};
+
+typedef void (*sw_batch_fn)(struct sw_batch_args const *);
+
+void	sw_batch_sse41(struct sw_batch_args const *);
+void	sw_batch_avx2(struct sw_batch_args const *);
+void	sw_batch_avx512(struct sw_batch_args const *);
+
+#endif
@@ -21,6 +21,7 @@
 
 #include "../common/util.h"
 #include "../common/sw-vector.h"
+#include "../common/sw-vector-striped.h"
 #include "../common/time_counter.h"
 
 
@@ -38,8 +39,78 @@ static int	use_colours;
 static uint64_t swcells, swinvocs;
 time_counter sw_tc;
 
+/*
+ * Striped kernels, widest first; striped_isa points at the widest one the CPU
+ * supports, or stays NULL on CPUs without SSE4.1, which keep using the SSE2
+ * kernels below.
+ */
+static struct sw_striped_isa {
+	char const     *name;
+	int		vec_bytes;
+	sw_striped_fn	byte, word;
+	sw_batch_fn	batch;
+} const striped_isas[] = {
+	{ "avx512bw",	64, sw_striped_byte_avx512, sw_striped_word_avx512, sw_batch_avx512 },
+	{ "avx2",	32, sw_striped_byte_avx2,   sw_striped_word_avx2,   sw_batch_avx2 },
+	{ "sse4.1",	16, sw_striped_byte_sse41,  sw_striped_word_sse41,  sw_batch_sse41 },
+};
+#define STRIPED_ISAS	(int)(sizeof(striped_isas) / sizeof(striped_isas[0]))
+
+/*
+ * Narrower kernels win on short reads: each column pays for the scan across
+ * lanes, which only amortises over this many segments per stripe.
+ */
+#define STRIPED_MIN_SEGLEN	4
+
+/*
+ * Query profiles of the last few reads. A read's windows are scored for both
+ * strands (and, when paired, interleaved with its mate's), so a single entry
+ * would be rebuilt on nearly every call.
+ */
+#define STRIPED_QUERIES		4
+
+struct striped_query {
+	uint32_t       *read;		/* packed copy, the cache key */
+	int		rlen;
+	uint8_t	       *qr;		/* one base per byte */
+	void	       *prof_byte, *prof_word;
+	struct sw_striped_isa const *isa_byte, *isa_word;
+	int		seglen_byte, seglen_word;
+	bool		byte_ok, word_ok;
+};
+
+/*
+ * Byte passes that saturate are wasted work; after each one in a row, skip
+ * the byte pass for twice as many calls (up to this many).
+ */
+#define STRIPED_MAX_BACKOFF	255
+
+static struct sw_striped_isa const *striped_isa;
+static struct striped_query *sq;
+static int	sq_next;
+static uint8_t *dbc, *striped_qm, *striped_qv;
+static void    *striped_h, *striped_ht, *striped_e;
+static int	bias;
+static bool	use_byte;
+static int	byte_backoff, byte_skip;
+
+/*
+ * Below this many windows, sw_vector_batch() leaves too many lanes idle and
+ * scores the windows one by one instead.
+ */
+#define SW_BATCH_MIN		12
+
+static uint16_t *batch_db;
+static uint8_t *batch_qr;
+static void    *batch_h, *batch_e, *batch_prof;
+
 #pragma omp threadprivate(initialised,db,db_ls,qr,dblen,qrlen,nogap,b_gap,a_gap_open,a_gap_ext,\
-		b_gap_open,b_gap_ext,match,mismatch,use_colours,sw_tc,swcells,swinvocs)
+		b_gap_open,b_gap_ext,match,mismatch,use_colours,sw_tc,swcells,swinvocs,\
+		striped_isa,sq,sq_next,dbc,striped_qm,striped_qv,striped_h,striped_ht,striped_e,\
+		bias,use_byte,byte_backoff,byte_skip,batch_db,batch_qr,batch_h,batch_e,batch_prof)
+
+/* colour space profiles also key on whether the first (letter) base matches */
+#define STRIPED_CODES(_use_colours) ((_use_colours) ? 32 : 16)
 
 /*
  * Calculate the Smith-Waterman score.
@@ -376,12 +447,410 @@ vect_sw_same_gap(int8_t *seqA, int lena, int8_t *seqB, int lenb,
 	return (score);
 }
 
+/*
+ * Unpack 4-bit bases into one byte each. Whole 32-base runs are split into
+ * low and high nibbles and interleaved back into order with SSE2.
+ */
+static inline void
+unpack_bases(uint32_t *bf, int off, int len, uint8_t *dst)
+{
+	__m128i v_mask = _mm_set1_epi8(0xf);
+	__m128i v, v_lo, v_hi;
+	int i = 0;
+
+	for (; i < len && ((off + i) % 8) != 0; i++)
+		dst[i] = (uint8_t)EXTRACT(bf, off + i);
+
+	for (; i + 32 <= len; i += 32) {
+		v = _mm_loadu_si128((__m128i *)&bf[(off + i) / 8]);
+		v_lo = _mm_and_si128(v, v_mask);
+		v_hi = _mm_and_si128(_mm_srli_epi16(v, 4), v_mask);
+		_mm_storeu_si128((__m128i *)&dst[i], _mm_unpacklo_epi8(v_lo, v_hi));
+		_mm_storeu_si128((__m128i *)&dst[i + 16], _mm_unpackhi_epi8(v_lo, v_hi));
+	}
+
+	for (; i < len; i++)
+		dst[i] = (uint8_t)EXTRACT(bf, off + i);
+}
+
+static struct sw_striped_isa const *
+striped_select(void)
+{
+#if defined(__GNUC__) && !defined(__INTEL_COMPILER)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512bw"))
+		return (&striped_isas[0]);
+	if (__builtin_cpu_supports("avx2"))
+		return (&striped_isas[1]);
+	if (__builtin_cpu_supports("sse4.1"))
+		return (&striped_isas[2]);
+#endif
+	return (NULL);
+}
+
+static void *
+striped_alloc(size_t size)
+{
+	void *p;
+
+	if (posix_memalign(&p, 64, size) != 0)
+		return (NULL);
+
+	return (p);
+}
+
+/*
+ * Lay out a query profile: for every database code, seglen vectors whose
+ * lane l of segment s scores query position l * seglen + s. Each lane gets a
+ * mask and value such that code c matches iff (c & mask) == value, which
+ * covers the colour space first base; positions past the read never match,
+ * exactly like the padding of the SSE2 kernels.
+ */
+static void
+striped_profile(struct striped_query *q, void *prof, int lanes, int esize,
+    int seglen)
+{
+	__m128i v_match, v_mismatch, v_c, v_eq, v_tmp;
+	int c, s, l, i, pos;
+	int n = seglen * lanes;
+
+	for (s = 0; s < seglen; s++) {
+		for (l = 0; l < lanes; l++) {
+			pos = l * seglen + s;
+			i = s * lanes + l;
+			if (pos >= q->rlen) {
+				striped_qm[i] = 0;
+				striped_qv[i] = 0xff;
+			} else if (use_colours && pos == 0) {
+				striped_qm[i] = 16;
+				striped_qv[i] = 16;
+			} else {
+				striped_qm[i] = 15;
+				striped_qv[i] = q->qr[pos];
+			}
+		}
+	}
+	for (i = n; i % 16 != 0; i++) {
+		striped_qm[i] = 0;
+		striped_qv[i] = 0xff;
+	}
+
+	if (esize == 1) {
+		v_match = _mm_set1_epi8((char)(match + bias));
+		v_mismatch = _mm_set1_epi8((char)(mismatch + bias));
+	} else {
+		v_match = _mm_set1_epi16((short)(match + bias));
+		v_mismatch = _mm_set1_epi16((short)(mismatch + bias));
+	}
+
+	/*
+	 * Word profiles are written 16 lanes at a time too; an odd tail spills
+	 * into the next code, which is laid out right after, or into the slack
+	 * at the end of the buffer.
+	 */
+	for (c = 0; c < STRIPED_CODES(use_colours); c++) {
+		v_c = _mm_set1_epi8((char)c);
+		for (i = 0; i < n; i += 16) {
+			v_eq = _mm_and_si128(v_c, _mm_load_si128((__m128i *)&striped_qm[i]));
+			v_eq = _mm_cmpeq_epi8(v_eq, _mm_load_si128((__m128i *)&striped_qv[i]));
+			if (esize == 1) {
+				v_tmp = _mm_or_si128(_mm_and_si128(v_eq, v_match),
+				    _mm_andnot_si128(v_eq, v_mismatch));
+				_mm_store_si128((__m128i *)((uint8_t *)prof + c * n + i), v_tmp);
+			} else {
+				uint16_t *dst = (uint16_t *)prof + c * n + i;
+
+				v_tmp = _mm_unpacklo_epi8(v_eq, v_eq);
+				v_tmp = _mm_or_si128(_mm_and_si128(v_tmp, v_match),
+				    _mm_andnot_si128(v_tmp, v_mismatch));
+				_mm_store_si128((__m128i *)dst, v_tmp);
+				v_tmp = _mm_unpackhi_epi8(v_eq, v_eq);
+				v_tmp = _mm_or_si128(_mm_and_si128(v_tmp, v_match),
+				    _mm_andnot_si128(v_tmp, v_mismatch));
+				_mm_store_si128((__m128i *)(dst + 8), v_tmp);
+			}
+		}
+	}
+}
+
+/* widest supported kernel leaving STRIPED_MIN_SEGLEN segments, if any */
+static struct sw_striped_isa const *
+striped_pick(int rlen, int esize)
+{
+	struct sw_striped_isa const *isa = striped_isa;
+	int lanes;
+
+	for (; isa < &striped_isas[STRIPED_ISAS - 1]; isa++) {
+		lanes = isa->vec_bytes / esize;
+		if ((rlen + lanes - 1) / lanes >= STRIPED_MIN_SEGLEN)
+			break;
+	}
+
+	return (isa);
+}
+
+/* largest (segments x vector bytes) any usable kernel needs for this width */
+static int
+striped_span(int rlen, int esize)
+{
+	struct sw_striped_isa const *isa;
+	int lanes, span = 0;
+
+	for (isa = striped_isa; isa < &striped_isas[STRIPED_ISAS]; isa++) {
+		lanes = isa->vec_bytes / esize;
+		span = MAX(span, (rlen + lanes - 1) / lanes * isa->vec_bytes);
+	}
+
+	return (span);
+}
+
+static struct striped_query *
+striped_query(uint32_t *read, int rlen)
+{
+	struct striped_query *q;
+	int i, nwords = BPTO32BW(rlen);
+
+	for (i = 0; i < STRIPED_QUERIES; i++) {
+		q = &sq[i];
+		if (q->rlen == rlen
+		    && memcmp(q->read, read, nwords * sizeof(read[0])) == 0)
+			return (q);
+	}
+
+	q = &sq[sq_next];
+	sq_next = (sq_next + 1) % STRIPED_QUERIES;
+
+	memcpy(q->read, read, nwords * sizeof(read[0]));
+	q->rlen = rlen;
+	unpack_bases(read, 0, rlen, q->qr);
+	q->byte_ok = q->word_ok = false;
+
+	return (q);
+}
+
+/*
+ * Score one window with the striped kernels: bytes first, words if the
+ * bytes saturated.
+ */
+static int
+sw_vector_striped(uint32_t *genome, int goff, int glen, uint32_t *read,
+    int rlen, uint32_t *genome_ls, int initbp, bool is_rna)
+{
+	struct sw_striped_args args;
+	struct striped_query *q;
+	int i, lanes, score = -1;
+
+	q = striped_query(read, rlen);
+
+	unpack_bases(genome, goff, glen, dbc);
+	if (use_colours) {
+		uint8_t first[16];
+
+		unpack_bases(genome_ls, goff, glen, (uint8_t *)db_ls);
+		for (i = 0; i < 16; i++)
+			first[i] = (lstocs(i, initbp, is_rna) == q->qr[0]) ? 16 : 0;
+		for (i = 0; i < glen; i++)
+			dbc[i] |= first[(uint8_t)db_ls[i]];
+	}
+
+	args.db = dbc;
+	args.dblen = glen;
+	args.h = striped_h;
+	args.ht = striped_ht;
+	args.e = striped_e;
+	args.bias = bias;
+	args.a_gap_open_ext = a_gap_open + a_gap_ext;
+	args.a_gap_ext = a_gap_ext;
+	args.b_gap_open_ext = b_gap_open + b_gap_ext;
+	args.b_gap_ext = b_gap_ext;
+
+	if (use_byte && byte_skip > 0) {
+		byte_skip--;
+	} else if (use_byte) {
+		if (!q->byte_ok) {
+			q->isa_byte = striped_pick(rlen, 1);
+			lanes = q->isa_byte->vec_bytes;
+			q->seglen_byte = (rlen + lanes - 1) / lanes;
+			striped_profile(q, q->prof_byte, lanes, 1, q->seglen_byte);
+			q->byte_ok = true;
+		}
+		args.profile = q->prof_byte;
+		args.seglen = q->seglen_byte;
+		score = q->isa_byte->byte(&args);
+
+		if (score < 0) {
+			byte_backoff = MIN(2 * byte_backoff + 1, STRIPED_MAX_BACKOFF);
+			byte_skip = byte_backoff;
+		} else {
+			byte_backoff = 0;
+		}
+	}
+
+	if (score < 0) {
+		if (!q->word_ok) {
+			q->isa_word = striped_pick(rlen, 2);
+			lanes = q->isa_word->vec_bytes / 2;
+			q->seglen_word = (rlen + lanes - 1) / lanes;
+			striped_profile(q, q->prof_word, lanes, 2, q->seglen_word);
+			q->word_ok = true;
+		}
+		args.profile = q->prof_word;
+		args.seglen = q->seglen_word;
+		score = q->isa_word->word(&args);
+	}
+
+	return (score);
+}
+
+/* narrowest kernel holding all n windows, else the widest */
+static struct sw_striped_isa const *
+batch_pick(int n)
+{
+	struct sw_striped_isa const *isa = &striped_isas[STRIPED_ISAS - 1];
+
+	for (; isa > striped_isa; isa--)
+		if (isa->vec_bytes / 2 >= n)
+			break;
+
+	return (isa);
+}
+
+/*
+ * Score several windows of one read. Windows are packed one per lane of the
+ * inter-task kernel and swept together; with only a few of them (or on CPUs
+ * without SSE4.1), each goes through sw_vector() instead.
+ */
+void
+sw_vector_batch(struct sw_vector_window *w, int n, uint32_t *read, int rlen,
+    int initbp, bool is_rna)
+{
+	struct sw_batch_args args;
+	struct sw_striped_isa const *isa;
+	struct striped_query *q;
+	int16_t scores[32];
+	uint8_t first[16];
+	int i, j, k, l, lanes, maxlen;
+
+	/* 16-bit signed lanes: very long reads could saturate */
+	if (striped_isa == NULL || n < SW_BATCH_MIN || rlen * match >= INT16_MAX) {
+		for (i = 0; i < n; i++)
+			w[i].score = sw_vector(w[i].genome, w[i].goff, w[i].glen,
+			    read, rlen, w[i].genome_ls, initbp, is_rna);
+		return;
+	}
+
+	TIME_COUNTER_START(sw_tc);
+
+	if (!initialised)
+		abort();
+
+	assert(rlen > 0 && rlen <= qrlen);
+
+	q = striped_query(read, rlen);
+
+	args.codes = 0;
+	for (i = 0; i < rlen; i++) {
+		batch_qr[i] = (use_colours && i == 0) ? SW_BATCH_FIRST : q->qr[i];
+		args.codes |= 1u << batch_qr[i];
+	}
+	if (use_colours) {
+		for (i = 0; i < 16; i++)
+			first[i] = (lstocs(i, initbp, is_rna) == q->qr[0]) ? SW_BATCH_FIRST : 0;
+	}
+
+	args.db = batch_db;
+	args.qr = batch_qr;
+	args.rlen = rlen;
+	args.h = batch_h;
+	args.e = batch_e;
+	args.prof = batch_prof;
+	args.match = match;
+	args.mismatch = mismatch;
+	args.a_gap_open_ext = a_gap_open + a_gap_ext;
+	args.a_gap_ext = a_gap_ext;
+	args.b_gap_open_ext = b_gap_open + b_gap_ext;
+	args.b_gap_ext = b_gap_ext;
+	args.scores = scores;
+
+	for (k = 0; k < n; k += lanes) {
+		isa = batch_pick(n - k);
+		lanes = isa->vec_bytes / 2;
+
+		maxlen = 0;
+		for (l = 0; l < lanes && k + l < n; l++) {
+			assert(w[k + l].glen > 0 && w[k + l].glen <= dblen);
+			maxlen = MAX(maxlen, w[k + l].glen);
+		}
+
+		/* transpose: column j of every window becomes one vector */
+		for (l = 0; l < lanes; l++) {
+			struct sw_vector_window *wl = &w[k + l];
+
+			if (k + l >= n) {
+				for (j = 0; j < maxlen; j++)
+					batch_db[j * lanes + l] = SW_BATCH_PAD;
+				continue;
+			}
+
+			unpack_bases(wl->genome, wl->goff, wl->glen, dbc);
+			if (use_colours) {
+				unpack_bases(wl->genome_ls, wl->goff, wl->glen, (uint8_t *)db_ls);
+				for (j = 0; j < wl->glen; j++)
+					dbc[j] |= first[(uint8_t)db_ls[j]];
+			}
+			for (j = 0; j < wl->glen; j++)
+				batch_db[j * lanes + l] = dbc[j];
+			for (; j < maxlen; j++)
+				batch_db[j * lanes + l] = SW_BATCH_PAD;
+		}
+
+		args.dblen = maxlen;
+		isa->batch(&args);
+
+		for (l = 0; l < lanes && k + l < n; l++) {
+			w[k + l].score = scores[l];
+			swinvocs++;
+			swcells += w[k + l].glen * rlen;
+		}
+	}
+
+	TIME_COUNTER_STOP(sw_tc);
+}
+
+char const *
+sw_vector_isa(void)
+{
+	struct sw_striped_isa const *isa = striped_select();
+
+	return (isa != NULL ? isa->name : "sse2");
+}
+
 int sw_vector_cleanup(void) {
 	free(db);
 	free(db_ls);
 	free(qr);
 	free(nogap);
 	free(b_gap);
+	if (sq != NULL) {
+		for (int i = 0; i < STRIPED_QUERIES; i++) {
+			free(sq[i].read);
+			free(sq[i].qr);
+			free(sq[i].prof_byte);
+			free(sq[i].prof_word);
+		}
+		free(sq);
+	}
+	free(dbc);
+	free(striped_qm);
+	free(striped_qv);
+	free(striped_h);
+	free(striped_ht);
+	free(striped_e);
+	free(batch_db);
+	free(batch_qr);
+	free(batch_h);
+	free(batch_e);
+	free(batch_prof);
 	return 0;
 }
 
@@ -427,6 +896,53 @@ sw_vector_setup(int _dblen, int _qrlen, int _a_gap_open, int _a_gap_ext,
 	mismatch = _mismatch;
 	use_colours = _use_colours;
 
+	striped_isa = striped_select();
+	if (striped_isa != NULL) {
+		int span_b = striped_span(qrlen, 1);
+		int span_w = striped_span(qrlen, 2);
+		int codes = STRIPED_CODES(use_colours);
+
+		/* +16: word profiles and the lane masks are built 16 at a time */
+		sq = (struct striped_query *)calloc(STRIPED_QUERIES, sizeof(sq[0]));
+		if (sq == NULL)
+			return (1);
+		for (int i = 0; i < STRIPED_QUERIES; i++) {
+			sq[i].read = (uint32_t *)malloc(BPTO32BW(qrlen) * sizeof(sq[i].read[0]));
+			sq[i].qr = (uint8_t *)malloc(qrlen * sizeof(sq[i].qr[0]));
+			sq[i].prof_byte = striped_alloc(codes * span_b);
+			sq[i].prof_word = striped_alloc(codes * span_w + 16 * 2);
+			if (sq[i].read == NULL || sq[i].qr == NULL
+			    || sq[i].prof_byte == NULL || sq[i].prof_word == NULL)
+				return (1);
+		}
+		sq_next = 0;
+
+		dbc = (uint8_t *)malloc(dblen * sizeof(dbc[0]));
+		striped_qm = (uint8_t *)striped_alloc(MAX(span_b, span_w / 2) + 16);
+		striped_qv = (uint8_t *)striped_alloc(MAX(span_b, span_w / 2) + 16);
+		striped_h = striped_alloc(MAX(span_b, span_w));
+		striped_ht = striped_alloc(MAX(span_b, span_w));
+		striped_e = striped_alloc(MAX(span_b, span_w));
+		if (dbc == NULL || striped_qm == NULL || striped_qv == NULL
+		    || striped_h == NULL || striped_ht == NULL || striped_e == NULL)
+			return (1);
+
+		batch_db = (uint16_t *)striped_alloc(dblen * striped_isa->vec_bytes);
+		batch_qr = (uint8_t *)malloc(qrlen * sizeof(batch_qr[0]));
+		batch_h = striped_alloc(qrlen * striped_isa->vec_bytes);
+		batch_e = striped_alloc(qrlen * striped_isa->vec_bytes);
+		batch_prof = striped_alloc((SW_BATCH_FIRST + 1) * striped_isa->vec_bytes);
+		if (batch_db == NULL || batch_qr == NULL || batch_h == NULL
+		    || batch_e == NULL || batch_prof == NULL)
+			return (1);
+
+		byte_backoff = byte_skip = 0;
+		bias = MAX(-mismatch, 0);
+		use_byte = (match + bias <= 255
+		    && a_gap_open + a_gap_ext <= 255
+		    && b_gap_open + b_gap_ext <= 255);
+	}
+
 	if (reset_stats) {
 	  swcells = swinvocs = 0;
 	  sw_tc.type = DEF_FAST_TIME_COUNTER;
@@ -454,7 +970,7 @@ int
 sw_vector(uint32_t *genome, int goff, int glen, uint32_t *read, int rlen,
     uint32_t *genome_ls, int initbp, bool is_rna)
 {
-	int i, score;
+	int score;
 
 	//llint before = rdtsc(), after;
 	TIME_COUNTER_START(sw_tc);
@@ -467,19 +983,21 @@ sw_vector(uint32_t *genome, int goff, int glen, uint32_t *read, int rlen,
 	assert(glen > 0 && glen <= dblen);
 	assert(rlen > 0 && rlen <= qrlen);
 
+	if (striped_isa != NULL) {
+		score = sw_vector_striped(genome, goff, glen, read, rlen,
+		    genome_ls, initbp, is_rna);
+		goto out;
+	}
+
 	memset(db, -1, (dblen + 14) * sizeof(db[0]));
 	memset(qr, -2, (qrlen + 14) * sizeof(qr[0]));
 
-	for (i = 0; i < glen; i++)
-		db[i+7] = (int8_t)EXTRACT(genome, goff + i);
+	unpack_bases(genome, goff, glen, (uint8_t *)&db[7]);
 
-	if (genome_ls != NULL) {
-		for (i = 0; i < glen; i++)
-			db_ls[i+7] = (int8_t)EXTRACT(genome_ls, goff + i);
-	}
+	if (genome_ls != NULL)
+		unpack_bases(genome_ls, goff, glen, (uint8_t *)&db_ls[7]);
 
-	for (i = 0; i < rlen; i++)
-		qr[i+7] = (int8_t)EXTRACT(read, i);
+	unpack_bases(read, 0, rlen, (uint8_t *)&qr[7]);
 
 #ifdef DEBUG_SW_VECTOR
 	fprintf(stderr, "SW vector call:\ndb cs: ");
@@ -506,6 +1024,7 @@ sw_vector(uint32_t *genome, int goff, int glen, uint32_t *read, int rlen,
 		    &db_ls[0], initbp, is_rna);
 	}
 
+ out:
 	swcells += (glen * rlen);
 	//after = rdtsc();
 	//swticks += MAX(after - before, 0);
@@ -1,6 +1,21 @@
 /*	$Id: sw-vector.h,v 1.7 2009/06/16 23:26:21 rumble Exp $	*/
 
+#ifndef _SW_VECTOR_H
+#define _SW_VECTOR_H
+
 int sw_vector_cleanup(void);
 int	sw_vector_setup(int, int, int, int, int, int, int, int, int, bool);
 void	sw_vector_stats(uint64_t *, uint64_t *, double *);
 int	sw_vector(uint32_t *, int, int, uint32_t *, int, uint32_t *, int, bool);
+
+/* one window for sw_vector_batch(); score is filled in */
+struct sw_vector_window {
+	uint32_t       *genome, *genome_ls;
+	int		goff, glen;
+	int		score;
+};
+
+void	sw_vector_batch(struct sw_vector_window *, int, uint32_t *, int, int, bool);
+char const *sw_vector_isa(void);
+
+#endif
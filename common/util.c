@@ -973,7 +973,7 @@ fast_gzgets_safe(fasta_t f)
 		assert(f->save_skip < f->save_len);
 
 		if (f->save_bytes == 0) {
-			ret = gzread(f->fp, f->save_buf, f->save_len - 1);
+			ret = fasta_read(f, f->save_buf, f->save_len - 1);
 			if (ret < 0)
 				break;
 			f->save_skip = 0;
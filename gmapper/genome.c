@@ -1,6 +1,7 @@
 #define _MODULE_GENOME
 
 #include <sys/types.h> //shm_open
+#include <sys/stat.h>
 #include <sys/mman.h>
 #include <fcntl.h>
 #include "genome.h"
@@ -9,6 +10,42 @@
 #define MMAP_ALIGN 8
 
 
+/*
+ * Check the shrimp_mode word of an index file against the position width of this
+ * build, and return it without the index flags.
+ */
+static uint32_t
+index_mode(uint32_t m, char const * file)
+{
+  if ((m & INDEX_LONG_GENOME) != INDEX_MODE_FLAGS) {
+    crash(1, 0, "index file %s uses %d-bit genome positions, but this gmapper uses %d-bit positions;"
+	  " recreate the index, or rebuild gmapper %s LONG_GENOME=1", file,
+	  (m & INDEX_LONG_GENOME)? 64 : 32, (int)(8 * sizeof(genome_pos_t)),
+	  (m & INDEX_LONG_GENOME)? "with" : "without");
+  }
+  return m & ~INDEX_LONG_GENOME;
+}
+
+/*
+ * Read capacity list lengths from a seed file and turn them into list offsets.
+ */
+static void
+read_genomemap_offsets(gzFile fp, genome_pos_t * offsets, uint32_t capacity)
+{
+  uint32_t len[1024];
+  uint32_t j, k;
+
+  offsets[0] = 0;
+  for (j = 0; j < capacity; j += k) {
+    k = MIN(capacity - j, 1024);
+    xgzread(fp, len, sizeof(len[0]) * k);
+    for (uint32_t i = 0; i < k; i++) {
+      offsets[j + i + 1] = offsets[j + i] + len[i];
+    }
+  }
+}
+
+
 /*
  * Loading and saving the genome projection.
  */
@@ -25,8 +62,10 @@ bool save_genome_map_seed(const char *file, int sn)
    * seed_type			: Seed
    * uint32_t				: capacity
    * uint32_t * capacity	: genomemap_len
-   * uint32_t				: total (= sum from 0 to capacity - 1 of genomemap_len)
-   * uint32_t * total		: genomemap (each entry of length genomemap_len)
+   * genome_pos_t			: total (= sum from 0 to capacity - 1 of genomemap_len)
+   * genome_pos_t * total	: genomemap (each entry of length genomemap_len)
+   *
+   * genome_pos_t is 64-bit in LONG_GENOME builds, which set INDEX_LONG_GENOME in shrimp_mode
    *
    */
   gzFile fp = gzopen(file, "wb");
@@ -36,7 +75,7 @@ bool save_genome_map_seed(const char *file, int sn)
 
   // shrimp_mode
   uint32_t m;
-  m = (uint32_t)shrimp_mode;
+  m = (uint32_t)shrimp_mode | INDEX_MODE_FLAGS;
   xgzwrite(fp, &m, sizeof(uint32_t));
 
   // Hflag
@@ -46,22 +85,23 @@ bool save_genome_map_seed(const char *file, int sn)
   // Seed
   xgzwrite(fp, &seed[sn], sizeof(seed_type));
 
-  // genomemap_len
+  // genomemap_len, computed from the offsets a buffer at a time
   uint32_t capacity = (uint32_t)power4(Hflag? HASH_TABLE_POWER : seed[sn].weight);
-  xgzwrite(fp, genomemap_len[sn], sizeof(genomemap_len[0][0]) * capacity);
+  uint32_t len[1024];
+  uint32_t j, k;
+  for (j = 0; j < capacity; j += k) {
+    for (k = 0; k < 1024 && j + k < capacity; k++) {
+      len[k] = genomemap_list_len(sn, j + k);
+    }
+    xgzwrite(fp, len, sizeof(len[0]) * k);
+  }
 
   // total
-  uint32_t total = 0;
-  uint32_t j;
-  for (j = 0; j < capacity; j++){
-    total += genomemap_len[sn][j];
-  }
-  xgzwrite(fp, &total, sizeof(uint32_t));
+  genome_pos_t total = genomemap_offsets[sn][capacity];
+  xgzwrite(fp, &total, sizeof(total));
 
   // genome_map
-  for (j = 0; j < capacity; j++) {
-    xgzwrite(fp, (void *)genomemap[sn][j], sizeof(genomemap[0][0][0]) * genomemap_len[sn][j]);
-  }
+  xgzwrite(fp, (void *)genomemap[sn], sizeof(genomemap[0][0]) * total);
 
   gzclose(fp);
   return true;
@@ -81,12 +121,13 @@ bool load_genome_map_seed(const char *file)
    * seed_type			: Seed
    * uint32_t				: capacity
    * uint32_t * capacity	: genomemap_len
-   * uint32_t				: total (= sum from 0 to capacity - 1 of genomemap_len)
-   * uint32_t * total		: genomemap (each entry of length genomemap_len)
+   * genome_pos_t			: total (= sum from 0 to capacity - 1 of genomemap_len)
+   * genome_pos_t * total	: genomemap (each entry of length genomemap_len)
+   *
+   * genome_pos_t is 64-bit in LONG_GENOME builds, which set INDEX_LONG_GENOME in shrimp_mode
    *
    */
   int i;
-  uint32_t j;
   //uint32_t total;
 
   gzFile fp = gzopen(file, "rb");
@@ -98,6 +139,7 @@ bool load_genome_map_seed(const char *file)
   // shrimp_mode
   uint32_t m;
   xgzread(fp, &m, sizeof(uint32_t));
+  m = index_mode(m, file);
   if(m != (uint32_t)shrimp_mode) {
     fprintf(stderr,"Shrimp mode in file %s does not match\n",file);
   }
@@ -116,17 +158,13 @@ bool load_genome_map_seed(const char *file)
     //xrealloc(seed, sizeof(seed_type) * n_seeds);
     my_realloc(seed, sizeof(seed_type) * n_seeds, (n_seeds - 1) * sizeof(seed_type),
 	       &mem_small, "seed");
-  genomemap_len = (uint32_t **)
-    //xrealloc_c(genomemap_len, sizeof(genomemap_len[0]) * n_seeds, sizeof(genomemap_len[0]) * (n_seeds - 1), &mem_genomemap);
-    my_realloc(genomemap_len, sizeof(genomemap_len[0]) * n_seeds, sizeof(genomemap_len[0]) * (n_seeds - 1),
-	       &mem_genomemap, "genomemap_len");
-  genomemap = (uint32_t ***)
+  genomemap_offsets = (genome_pos_t **)
+    my_realloc(genomemap_offsets, sizeof(genomemap_offsets[0]) * n_seeds, sizeof(genomemap_offsets[0]) * (n_seeds - 1),
+	       &mem_genomemap, "genomemap_offsets");
+  genomemap = (genome_pos_t **)
     //xrealloc_c(genomemap, sizeof(genomemap[0]) * n_seeds, sizeof(genomemap[0]) * (n_seeds - 1), &mem_genomemap);
     my_realloc(genomemap, sizeof(genomemap[0]) * n_seeds, sizeof(genomemap[0]) * (n_seeds - 1),
 	       &mem_genomemap, "genomemap");
-  genomemap_block = (ptr_and_sz *)
-    my_realloc(genomemap_block, n_seeds * sizeof(genomemap_block[0]), (n_seeds - 1) * sizeof(genomemap_block[0]),
-	       &mem_genomemap, "genomemap_block");
 
   xgzread(fp,seed + sn,sizeof(seed_type));
   max_seed_span = MAX(max_seed_span, seed[sn].span);
@@ -137,39 +175,28 @@ bool load_genome_map_seed(const char *file)
   }
   avg_seed_span = avg_seed_span/n_seeds;
 
-  // genomemap_len
+  // genomemap_len, turned into offsets
   uint32_t capacity = (uint32_t)power4(Hflag? HASH_TABLE_POWER : seed[sn].weight);
-  genomemap_len[sn] = (uint32_t *)
-    //xmalloc_c(sizeof(genomemap_len[0][0]) * capacity, &mem_genomemap);
-    my_malloc(sizeof(genomemap_len[0][0]) * capacity,
-	      &mem_genomemap, "genomemap_len[%d]", sn);
-  genomemap[sn] = (uint32_t **)
-    //xmalloc_c(sizeof(genomemap[0][0]) * capacity, &mem_genomemap);
-    my_malloc(sizeof(genomemap[0][0]) * capacity,
-	      &mem_genomemap, "genomemap[%d]", sn);
-  xgzread(fp, genomemap_len[sn], sizeof(uint32_t) * capacity);
+  genomemap_offsets[sn] = (genome_pos_t *)
+    my_malloc(sizeof(genomemap_offsets[0][0]) * (capacity + 1),
+	      &mem_genomemap, "genomemap_offsets[%d]", sn);
+  read_genomemap_offsets(fp, genomemap_offsets[sn], capacity);
 
   // total
-  {
-    uint32_t total;
-    xgzread(fp, &total, sizeof(uint32_t));
-    genomemap_block[sn].sz = (size_t)total * sizeof(uint32_t);
+  genome_pos_t total;
+  xgzread(fp, &total, sizeof(total));
+  if (total != genomemap_offsets[sn][capacity]) {
+    fprintf(stderr,"Corrupt seed file %s\n",file);
+    gzclose(fp);
+    return false;
   }
 
   // genome_map
-  //uint32_t * map;
-  genomemap_block[sn].ptr =
+  genomemap[sn] = (genome_pos_t *)
     //xmalloc_c(sizeof(uint32_t) * total, &mem_genomemap);
-    my_malloc(genomemap_block[sn].sz,
-	      &mem_genomemap, "genomemap_block[%d].ptr", sn);
-  xgzread(fp, genomemap_block[sn].ptr, genomemap_block[sn].sz);
-  uint32_t * ptr;
-  ptr = (uint32_t *)genomemap_block[sn].ptr;
-
-  for (j = 0; j < capacity; j++) {
-    genomemap[sn][j] = ptr;
-    ptr += genomemap_len[sn][j];
-  }
+    my_malloc((size_t)total * sizeof(genomemap[0][0]),
+	      &mem_genomemap, "genomemap[%d]", sn);
+  xgzread(fp, genomemap[sn], (size_t)total * sizeof(genomemap[0][0]));
 
   gzclose(fp);
   return true;
@@ -190,11 +217,11 @@ bool save_genome_map(const char *prefix)
    * uint32_t					: Hflag
    * uint32_t 				: num_contigs
    * uint32_t * num_contigs	: genome_len (the length of each contig)
-   * uint32_t * num_contigs	: contig_offsets
+   * genome_pos_t * num_contigs	: contig_offsets
    * per contig
    * 		uint32_t					: name_length
    * 		char * (name_length + 1)	: name including null termination
-   * uint32_t					: total (= sum of BPTO32BW(genome_len)
+   * genome_pos_t				: total (= sum of BPTO32BW(genome_len)
    * per contig
    * 		uint32_t * BPTO32BW(contig_len)	: genome_contigs
    * per contig
@@ -223,7 +250,7 @@ bool save_genome_map(const char *prefix)
 
   //shrimp mode
   uint32_t m;
-  m = (uint32_t)(shrimp_mode);
+  m = (uint32_t)(shrimp_mode) | INDEX_MODE_FLAGS;
   xgzwrite(fp,&m,sizeof(uint32_t));
 
   //Hflag
@@ -237,18 +264,18 @@ bool save_genome_map(const char *prefix)
   xgzwrite(fp,genome_len,sizeof(uint32_t)*num_contigs);
 
   // contig_offsets
-  xgzwrite(fp,contig_offsets,sizeof(uint32_t)*num_contigs);
+  xgzwrite(fp,contig_offsets,sizeof(contig_offsets[0])*num_contigs);
 
   //names / total
   int i;
-  uint32_t total = 0;
+  genome_pos_t total = 0;
   for(i = 0; i < num_contigs; i++){
     uint32_t len = (uint32_t)strlen(contig_names[i]);
     xgzwrite(fp, &len, sizeof(uint32_t));
     xgzwrite(fp, contig_names[i], len + 1);
     total += BPTO32BW(genome_len[i]);
   }
-  xgzwrite(fp,&total,sizeof(uint32_t));
+  xgzwrite(fp,&total,sizeof(total));
 
   for (i = 0; i < num_contigs; i++) {
     xgzwrite(fp, (void *)genome_contigs[i], BPTO32BW(genome_len[i]) * sizeof(uint32_t));
@@ -276,22 +303,51 @@ up_align(size_t size)
   return (size % MMAP_ALIGN == 0? size : ((size / MMAP_ALIGN) + 1) * MMAP_ALIGN);
 }
 
-static void
-add_to_mmap(char * addr, char * * crt_end, size_t size, char * src = NULL)
+/*
+ * Reserve size bytes at crt_end in the map h, copying src there if given.
+ * The offset of the space in the map is stored in *off; its address is returned.
+ */
+static char *
+add_to_mmap(map_header * h, map_off_t * off, char * * crt_end, size_t size, char const * src = NULL)
 {
-  *(char **)addr = *crt_end;
+  char * res = *crt_end;
+
+  *off = (map_off_t)(res - (char *)h);
   *crt_end += up_align(size);
   if (src != NULL) {
-    memcpy(*(char **)addr, src, size);
+    memcpy(res, src, size);
+  }
+  return res;
+}
+
+#define MAP_PTR(h, off) ((char *)(h) + (off))
+
+/*
+ * Open an mmap index. A name of the form "/name" is a POSIX shared memory object;
+ * anything else is the path of a regular file.
+ */
+static int
+mmap_open(char const * mmap_name, bool create)
+{
+  int flags = (create? O_CREAT | O_EXCL | O_RDWR : O_RDONLY);
+  mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+
+  if (mmap_name[0] == '/' && strchr(mmap_name + 1, '/') == NULL) {
+    return shm_open(mmap_name, flags, mode);
+  } else {
+    return open(mmap_name, flags, mode);
   }
 }
 
+/* the mapped index, kept for genome_unload_mmap() */
+static map_header *	mmap_header = NULL;
+
 
 bool
 genome_load_map_save_mmap(char * map_name, char const * mmap_name)
 {
   map_header * h;
-  int shm_fd;
+  int fd;
   size_t map_size, capacity;
 
   gzFile genome_file;
@@ -362,7 +418,7 @@ genome_load_map_save_mmap(char * map_name, char const * mmap_name)
   // from this, can estimate memory requirement directly
   uint32_t _shrimp_mode, _Hflag;
   xgzread(genome_file, &_shrimp_mode, sizeof(uint32_t));
-  shrimp_mode = (shrimp_mode_t)_shrimp_mode;
+  shrimp_mode = (shrimp_mode_t)index_mode(_shrimp_mode, map_name);
 
   xgzread(genome_file, &_Hflag, sizeof(uint32_t));
   Hflag = _Hflag;
@@ -376,10 +432,10 @@ genome_load_map_save_mmap(char * map_name, char const * mmap_name)
   xgzread(genome_file, genome_len, num_contigs * sizeof(uint32_t));
 
   // contig_offsets
-  contig_offsets = (uint32_t *)
-    my_malloc(num_contigs * sizeof(uint32_t),
+  contig_offsets = (genome_pos_t *)
+    my_malloc(num_contigs * sizeof(contig_offsets[0]),
               &mem_genomemap, "contig_offsets");
-  xgzread(genome_file, contig_offsets, num_contigs * sizeof(uint32_t));
+  xgzread(genome_file, contig_offsets, num_contigs * sizeof(contig_offsets[0]));
 
   // names / total
   contig_names = (char **)
@@ -400,7 +456,7 @@ genome_load_map_save_mmap(char * map_name, char const * mmap_name)
 	      &mem_small, "seed");
   for (sn = 0; sn < n_seeds; sn++) {
     xgzread(seed_file[sn], &_shrimp_mode, sizeof(uint32_t));
-    if ((shrimp_mode_t)_shrimp_mode != shrimp_mode) {
+    if ((shrimp_mode_t)index_mode(_shrimp_mode, map_name) != shrimp_mode) {
       crash(1, 0, "shrimp_mode in seed file %d does not match shrimp mode from genome file", sn);
     }
 
@@ -428,18 +484,18 @@ genome_load_map_save_mmap(char * map_name, char const * mmap_name)
   // 1-dim arrays
   map_size += up_align(num_contigs * sizeof(genome_len[0]));
   map_size += up_align(num_contigs * sizeof(contig_offsets[0]));
-  map_size += up_align(num_contigs * sizeof(contig_names[0]));
-  map_size += up_align(num_contigs * sizeof(genome_contigs[0]));
-  map_size += up_align(num_contigs * sizeof(genome_contigs_rc[0]));
+  map_size += up_align(num_contigs * sizeof(map_off_t)); // contig_names
+  map_size += up_align(num_contigs * sizeof(map_off_t)); // genome_contigs
+  map_size += up_align(num_contigs * sizeof(map_off_t)); // genome_contigs_rc
   if (shrimp_mode == MODE_COLOUR_SPACE) {
-    map_size += up_align(num_contigs * sizeof(genome_cs_contigs[0]));
-    map_size += up_align(num_contigs * sizeof(genome_cs_contigs_rc[0]));
+    map_size += up_align(num_contigs * sizeof(map_off_t)); // genome_cs_contigs
+    map_size += up_align(num_contigs * sizeof(map_off_t)); // genome_cs_contigs_rc
   }
   map_size += up_align(n_seeds * sizeof(seed[0]));
-  map_size += up_align(n_seeds * sizeof(genomemap_len[0]));
-  map_size += up_align(n_seeds * sizeof(genomemap[0]));
+  map_size += up_align(n_seeds * sizeof(map_off_t)); // genomemap_offsets
+  map_size += up_align(n_seeds * sizeof(map_off_t)); // genomemap
   if (Hflag) {
-    map_size += up_align(n_seeds * sizeof(seed_hash_mask[0]));
+    map_size += up_align(n_seeds * sizeof(map_off_t)); // seed_hash_mask
   }
 
   // 2-dim arrays indexed by cn
@@ -461,28 +517,26 @@ genome_load_map_save_mmap(char * map_name, char const * mmap_name)
       map_size += up_align(BPTO32BW(max_seed_span) * sizeof(uint32_t));
     }
     capacity = power4(Hflag? HASH_TABLE_POWER : seed[sn].weight);
-    map_size += up_align(capacity * sizeof(genomemap_len[0][0]));
-    map_size += up_align(capacity * sizeof(genomemap[0][0]));
+    map_size += up_align((capacity + 1) * sizeof(genomemap_offsets[0][0]));
   }
 
   // for genomemap, in the worst case, each location appears once for every seed
-  map_size += up_align((size_t)total_len * (size_t)n_seeds * sizeof(uint32_t));
+  map_size += up_align((size_t)total_len * (size_t)n_seeds * sizeof(genomemap[0][0]));
 
   fprintf(stderr, "Allocating map of size: %.3gG\n", (double)map_size/(1024.0 * 1024.0 * 1024.0));
 
-  if ((shm_fd = shm_open(mmap_name, O_CREAT | O_EXCL | O_RDWR, S_IREAD)) < 0 ) {
+  if ((fd = mmap_open(mmap_name, true)) < 0) {
     crash(1, 1, "could not open mmap file %s for writing\n", mmap_name);
   }
-  if (ftruncate(shm_fd, map_size) < 0) {
+  if (ftruncate(fd, map_size) < 0) {
     crash(1, 1, "could not set size of mmap file %s to %lld", mmap_name, (long long)map_size);
   }
-  if((h = (map_header *)mmap(0, map_size, (PROT_READ | PROT_WRITE), MAP_SHARED, shm_fd, 0)) == MAP_FAILED) {
+  if((h = (map_header *)mmap(0, map_size, (PROT_READ | PROT_WRITE), MAP_SHARED, fd, 0)) == MAP_FAILED) {
     crash(1, 1, "could not mmap");
   }
 
-  h->map_start = h;
-  h->map_end = (char *)h + map_size;
-  h->map_version = 1;
+  h->map_version = 4;
+  h->genome_pos_bits = 8 * sizeof(genome_pos_t);
 
   h->shrimp_mode = shrimp_mode;
   h->Hflag = Hflag;
@@ -492,140 +546,176 @@ genome_load_map_save_mmap(char * map_name, char const * mmap_name)
   h->max_seed_span = max_seed_span;
   h->avg_seed_span = avg_seed_span;
 
-  // start copying pointers
-  char * crt_end = (char *)h->map_start + up_align(sizeof(map_header));
+  // start copying arrays
+  char * crt_end = (char *)h + up_align(sizeof(map_header));
+  map_off_t * offs;
 
   // genome_len: 1-dim; already loaded
-  add_to_mmap((char*)&h->genome_len, &crt_end, num_contigs * sizeof(genome_len[0]), (char*)genome_len);
+  add_to_mmap(h, &h->genome_len, &crt_end, num_contigs * sizeof(genome_len[0]), (char*)genome_len);
 
   // contig_offsets: 1-dim; already loaded
-  add_to_mmap((char*)&h->contig_offsets, &crt_end, num_contigs * sizeof(contig_offsets[0]), (char*)contig_offsets);
+  add_to_mmap(h, &h->contig_offsets, &crt_end, num_contigs * sizeof(contig_offsets[0]), (char*)contig_offsets);
 
   // contig_names: 2-dim, already loaded
-  add_to_mmap((char*)&h->contig_names, &crt_end, num_contigs * sizeof(contig_names[0]));
+  offs = (map_off_t *)add_to_mmap(h, &h->contig_names, &crt_end, num_contigs * sizeof(map_off_t));
   for (cn = 0; cn < num_contigs; cn++) {
-    add_to_mmap((char*)&h->contig_names[cn], &crt_end, (strlen(contig_names[cn]) + 1) * sizeof(char), (char*)contig_names[cn]);
+    add_to_mmap(h, &offs[cn], &crt_end, (strlen(contig_names[cn]) + 1) * sizeof(char), contig_names[cn]);
   }
 
   // genome_XX_contigs_YY: 2-dim; not loaded; block in file (except for _cs_rc)
-  add_to_mmap((char*)&h->genome_contigs, &crt_end, num_contigs * sizeof(genome_contigs[0]));
-  add_to_mmap((char*)&h->genome_contigs_rc, &crt_end, num_contigs * sizeof(genome_contigs_rc[0]));
+  map_off_t * contigs_offs, * contigs_rc_offs, * cs_contigs_offs = NULL, * cs_contigs_rc_offs = NULL;
+  contigs_offs = (map_off_t *)add_to_mmap(h, &h->genome_contigs, &crt_end, num_contigs * sizeof(map_off_t));
+  contigs_rc_offs = (map_off_t *)add_to_mmap(h, &h->genome_contigs_rc, &crt_end, num_contigs * sizeof(map_off_t));
   if (shrimp_mode == MODE_COLOUR_SPACE) {
-    add_to_mmap((char*)&h->genome_cs_contigs, &crt_end, num_contigs * sizeof(genome_cs_contigs[0]));
-    add_to_mmap((char*)&h->genome_cs_contigs_rc, &crt_end, num_contigs * sizeof(genome_cs_contigs_rc[0]));
+    cs_contigs_offs = (map_off_t *)add_to_mmap(h, &h->genome_cs_contigs, &crt_end, num_contigs * sizeof(map_off_t));
+    cs_contigs_rc_offs = (map_off_t *)add_to_mmap(h, &h->genome_cs_contigs_rc, &crt_end, num_contigs * sizeof(map_off_t));
   }
 
-  // read blocks from file -- THESE ARE NOT ALIGNED on 8 bytes, only on 4!!
-  uint32_t *ptr1, *ptr2, *ptr3 = NULL;
-  uint32_t total;
-  xgzread(genome_file, &total, sizeof(uint32_t));
-
-  add_to_mmap((char*)&h->genome_contigs[0], &crt_end, (size_t)total * sizeof(uint32_t));
-  xgzread(genome_file, h->genome_contigs[0], (size_t)total * sizeof(uint32_t));
-  ptr1 = (uint32_t *)h->genome_contigs[0];
-
-  add_to_mmap((char*)&h->genome_contigs_rc[0], &crt_end, (size_t)total * sizeof(uint32_t));
-  xgzread(genome_file, h->genome_contigs_rc[0], (size_t)total * sizeof(uint32_t));
-  ptr2 = (uint32_t *)h->genome_contigs_rc[0];
+  // read blocks from file -- contigs inside a block are NOT ALIGNED on 8 bytes, only on 4!!
+  map_off_t block[3] = { 0, 0, 0 };
+  genome_pos_t total;
+  xgzread(genome_file, &total, sizeof(total));
 
+  xgzread(genome_file, add_to_mmap(h, &block[0], &crt_end, (size_t)total * sizeof(uint32_t)), (size_t)total * sizeof(uint32_t));
+  xgzread(genome_file, add_to_mmap(h, &block[1], &crt_end, (size_t)total * sizeof(uint32_t)), (size_t)total * sizeof(uint32_t));
   if (shrimp_mode == MODE_COLOUR_SPACE) {
-    add_to_mmap((char*)&h->genome_cs_contigs[0], &crt_end, (size_t)total * sizeof(uint32_t));
-    xgzread(genome_file, h->genome_cs_contigs[0], (size_t)total * sizeof(uint32_t));
-    ptr3 = (uint32_t *)h->genome_cs_contigs[0];
-  }  
-  
+    xgzread(genome_file, add_to_mmap(h, &block[2], &crt_end, (size_t)total * sizeof(uint32_t)), (size_t)total * sizeof(uint32_t));
+  }
+
   for (cn = 0; cn < num_contigs; cn++) {
-    h->genome_contigs[cn] = ptr1;
-    ptr1 += BPTO32BW(genome_len[cn]);
-    h->genome_contigs_rc[cn] = ptr2;
-    ptr2 += BPTO32BW(genome_len[cn]);
+    contigs_offs[cn] = block[0];
+    block[0] += BPTO32BW(genome_len[cn]) * sizeof(uint32_t);
+    contigs_rc_offs[cn] = block[1];
+    block[1] += BPTO32BW(genome_len[cn]) * sizeof(uint32_t);
     if (shrimp_mode == MODE_COLOUR_SPACE) {
-      h->genome_cs_contigs[cn] = ptr3;
-      ptr3 += BPTO32BW(genome_len[cn]);
+      cs_contigs_offs[cn] = block[2];
+      block[2] += BPTO32BW(genome_len[cn]) * sizeof(uint32_t);
     }
   }
 
   if (shrimp_mode == MODE_COLOUR_SPACE) {
     for (cn = 0; cn < num_contigs; cn++) {
-      uint32_t * res = bitfield_to_colourspace(h->genome_contigs_rc[cn], genome_len[cn], false);
-      add_to_mmap((char*)&h->genome_cs_contigs_rc[cn], &crt_end, BPTO32BW(genome_len[cn]) * sizeof(uint32_t), (char*)res);
+      uint32_t * res = bitfield_to_colourspace((uint32_t *)MAP_PTR(h, contigs_rc_offs[cn]), genome_len[cn], false);
+      add_to_mmap(h, &cs_contigs_rc_offs[cn], &crt_end, BPTO32BW(genome_len[cn]) * sizeof(uint32_t), (char*)res);
+      free(res);
     }
   }
   // done with per-contig data
 
   // next, seeds
-  add_to_mmap((char*)&h->seed, &crt_end, n_seeds * sizeof(struct seed_type), (char*)seed);
+  add_to_mmap(h, &h->seed, &crt_end, n_seeds * sizeof(struct seed_type), (char*)seed);
   if (Hflag) {
     init_seed_hash_mask();
-    add_to_mmap((char*)&h->seed_hash_mask, &crt_end, n_seeds * sizeof(seed_hash_mask[0]));
+    offs = (map_off_t *)add_to_mmap(h, &h->seed_hash_mask, &crt_end, n_seeds * sizeof(map_off_t));
     for (sn = 0; sn < n_seeds; sn++) {
-      add_to_mmap((char*)&h->seed_hash_mask[sn], &crt_end, BPTO32BW(max_seed_span) * sizeof(uint32_t), (char*)seed_hash_mask[sn]);
+      add_to_mmap(h, &offs[sn], &crt_end, BPTO32BW(max_seed_span) * sizeof(uint32_t), (char*)seed_hash_mask[sn]);
     }
   }
 
-  // genomemap_len, genomemap: these are not loaded yet
-  add_to_mmap((char*)&h->genomemap_len, &crt_end, n_seeds * sizeof(genomemap_len[0]));
-  add_to_mmap((char*)&h->genomemap, &crt_end, n_seeds * sizeof(genomemap[0]));
+  // genomemap_offsets, genomemap: these are not loaded yet
+  map_off_t * genomemap_offsets_offs, * genomemap_offs;
+  genomemap_offsets_offs = (map_off_t *)add_to_mmap(h, &h->genomemap_offsets, &crt_end, n_seeds * sizeof(map_off_t));
+  genomemap_offs = (map_off_t *)add_to_mmap(h, &h->genomemap, &crt_end, n_seeds * sizeof(map_off_t));
   for (sn = 0; sn < n_seeds; sn++) {
     capacity = power4(Hflag? HASH_TABLE_POWER : seed[sn].weight);
 
-    add_to_mmap((char*)&h->genomemap_len[sn], &crt_end, capacity * sizeof(genomemap_len[0][0]));
-    xgzread(seed_file[sn], h->genomemap_len[sn], capacity * sizeof(genomemap_len[0][0]));
+    // the file has list lengths; turn them into offsets
+    genome_pos_t * offsets = (genome_pos_t *)
+      add_to_mmap(h, &genomemap_offsets_offs[sn], &crt_end, (capacity + 1) * sizeof(genomemap_offsets[0][0]));
+    read_genomemap_offsets(seed_file[sn], offsets, capacity);
 
-    add_to_mmap((char*)&h->genomemap[sn], &crt_end, capacity * sizeof(genomemap[0][0]));
-
-    // genomemap is block-alloc-ed
-    uint32_t total;
-    xgzread(seed_file[sn], &total, sizeof(uint32_t));
-
-    add_to_mmap((char*)&h->genomemap[sn][0], &crt_end, (size_t)total * sizeof(uint32_t));
-    xgzread(seed_file[sn], h->genomemap[sn][0], (size_t)total * sizeof(uint32_t));
-
-    uint32_t * ptr = (uint32_t *)h->genomemap[sn][0];
-    for (size_t j = 0; j < capacity; j++) {
-      h->genomemap[sn][j] = ptr;
-      ptr += h->genomemap_len[sn][j];
+    genome_pos_t total;
+    xgzread(seed_file[sn], &total, sizeof(total));
+    if (total != offsets[capacity]) {
+      crash(1, 0, "corrupt seed file %d", sn);
     }
+
+    xgzread(seed_file[sn], add_to_mmap(h, &genomemap_offs[sn], &crt_end, (size_t)total * sizeof(genomemap[0][0])),
+	    (size_t)total * sizeof(genomemap[0][0]));
   }
 
-  // DONE!!
-  assert(crt_end < (char *)h->map_end);
+  // DONE!! the size estimate was for the worst case; drop the rest
+  assert(crt_end <= (char *)h + map_size);
+  h->map_size = crt_end - (char *)h;
+  map_size = h->map_size;
 
   for (sn = 0; sn < n_seeds; sn++) {
     gzclose(seed_file[sn]);
   }
   gzclose(genome_file);
-  close(shm_fd);
+  if (munmap(h, map_size) < 0 || ftruncate(fd, map_size) < 0) {
+    crash(1, 1, "could not write mmap file %s", mmap_name);
+  }
+  close(fd);
 
-  fprintf(stderr, "Index successfully loaded index from [%s] to shared memory file [%s]\n", map_name, mmap_name);
+  fprintf(stderr, "Index successfully loaded index from [%s] to mmap file [%s] (%.3gG)\n", map_name, mmap_name,
+	  (double)map_size/(1024.0 * 1024.0 * 1024.0));
 
   return true;
 }
 
 
+/*
+ * Pointers to the n arrays of the map at the offsets in the table at off.
+ */
+static void * *
+map_ptr_array(map_header * h, map_off_t off, int n, char const * name)
+{
+  map_off_t * offs = (map_off_t *)MAP_PTR(h, off);
+  void * * res;
+  int i;
+
+  res = (void * *)
+    my_malloc(n * sizeof(res[0]),
+	      &mem_genomemap, name);
+  for (i = 0; i < n; i++) {
+    res[i] = MAP_PTR(h, offs[i]);
+  }
+  return res;
+}
+
+
+/*
+ * Map an index saved by genome_load_map_save_mmap(). The map is read-only and
+ * shared, so all processes using the same index share its pages in the page cache.
+ * It can be placed at any address; only the small per-contig and per-seed pointer
+ * tables are rebuilt here.
+ */
 bool genome_load_mmap(char const * mmap_name)
 {
-  int shm_fd;
+  int fd;
   map_header * h;
-  void * map_start;
-  void * map_end;
+  map_header hdr;
+  struct stat st;
 
-  if ((shm_fd = shm_open(mmap_name, O_RDONLY, S_IREAD)) < 0) {
+  if ((fd = mmap_open(mmap_name, false)) < 0) {
     crash(1, 1, "could not open mmap file %s", mmap_name);
   }
-  if ((h = (map_header *)mmap(NULL, sizeof(map_header), PROT_READ, MAP_PRIVATE, shm_fd, 0)) == MAP_FAILED) {
+  if (read(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr)) {
     crash(1, 1, "could not read map header from mmap file %s", mmap_name);
   }
-  map_start = h->map_start;
-  map_end = h->map_end;
-  fprintf(stderr, "\nLoading shared memory index [%s] of size %.3gG\n", mmap_name,
-	  (double)((char *)map_end - (char *)map_start)/(1024.0 * 1024.0 * 1024.0));
-  munmap(h, sizeof(map_header));
-  if ((h = (map_header *)mmap(map_start, (char *)map_end - (char *)map_start, PROT_READ, MAP_PRIVATE | MAP_FIXED, shm_fd, 0)) == MAP_FAILED
-      || h != map_start) {
-    crash(1, 1, "could not place mmap file %s at address %p", mmap_name, map_start);
+  if (hdr.map_version != 4) {
+    crash(1, 0, "mmap file %s has index version %d; recreate it with this version of gmapper", mmap_name, hdr.map_version);
+  }
+  if (hdr.genome_pos_bits != (int)(8 * sizeof(genome_pos_t))) {
+    crash(1, 0, "mmap file %s uses %d-bit genome positions, but this gmapper uses %d-bit positions",
+	  mmap_name, hdr.genome_pos_bits, (int)(8 * sizeof(genome_pos_t)));
+  }
+  // a truncated file would fault on the first access past its end
+  if (fstat(fd, &st) != 0) {
+    crash(1, 1, "could not stat mmap file %s", mmap_name);
   }
-  close(shm_fd);
+  if ((size_t)st.st_size < (size_t)hdr.map_size) {
+    crash(1, 0, "mmap file %s is truncated: %lld bytes, but its index takes %lld; recreate or copy it again",
+	  mmap_name, (long long)st.st_size, (long long)hdr.map_size);
+  }
+  fprintf(stderr, "\nLoading mmap index [%s] of size %.3gG\n", mmap_name,
+	  (double)hdr.map_size/(1024.0 * 1024.0 * 1024.0));
+  if ((h = (map_header *)mmap(NULL, hdr.map_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    crash(1, 1, "could not mmap file %s", mmap_name);
+  }
+  close(fd);
+  mmap_header = h;
 
   shrimp_mode = h->shrimp_mode;
   Hflag = h->Hflag;
@@ -635,20 +725,24 @@ bool genome_load_mmap(char const * mmap_name)
   max_seed_span = h->max_seed_span;
   avg_seed_span = h->avg_seed_span;
 
-  genome_len = h->genome_len;
-  contig_offsets = h->contig_offsets;
-  contig_names = h->contig_names;
+  genome_len = (uint32_t *)MAP_PTR(h, h->genome_len);
+  contig_offsets = (genome_pos_t *)MAP_PTR(h, h->contig_offsets);
+  contig_names = (char **)map_ptr_array(h, h->contig_names, num_contigs, "contig_names");
 
-  genome_contigs = h->genome_contigs;
-  genome_contigs_rc = h->genome_contigs_rc;
-  genome_cs_contigs = h->genome_cs_contigs;
-  genome_cs_contigs_rc = h->genome_cs_contigs_rc;
+  genome_contigs = (uint32_t **)map_ptr_array(h, h->genome_contigs, num_contigs, "genome_contigs");
+  genome_contigs_rc = (uint32_t **)map_ptr_array(h, h->genome_contigs_rc, num_contigs, "genome_contigs_rc");
+  if (shrimp_mode == MODE_COLOUR_SPACE) {
+    genome_cs_contigs = (uint32_t **)map_ptr_array(h, h->genome_cs_contigs, num_contigs, "genome_cs_contigs");
+    genome_cs_contigs_rc = (uint32_t **)map_ptr_array(h, h->genome_cs_contigs_rc, num_contigs, "genome_cs_contigs_rc");
+  }
 
-  seed = h->seed;
-  seed_hash_mask = h->seed_hash_mask;
+  seed = (struct seed_type *)MAP_PTR(h, h->seed);
+  if (Hflag) {
+    seed_hash_mask = (uint32_t **)map_ptr_array(h, h->seed_hash_mask, n_seeds, "seed_hash_mask");
+  }
 
-  genomemap_len = h->genomemap_len;
-  genomemap = h->genomemap;
+  genomemap_offsets = (genome_pos_t **)map_ptr_array(h, h->genomemap_offsets, n_seeds, "genomemap_offsets");
+  genomemap = (genome_pos_t **)map_ptr_array(h, h->genomemap, n_seeds, "genomemap");
 
   fprintf(stderr, "Found %d contig%s:\n", num_contigs, num_contigs > 1? "s" : "");
   int cn;
@@ -658,7 +752,7 @@ bool genome_load_mmap(char const * mmap_name)
   fprintf(stderr, "\n");
 
 #ifndef NDEBUG
-  for (char * crt = (char *)h->map_start; crt < (char *)h->map_end; crt += 64) {
+  for (char * crt = (char *)h; crt < (char *)h + h->map_size; crt += 64) {
     not_used += *crt;
   }  
 #endif
@@ -667,6 +761,34 @@ bool genome_load_mmap(char const * mmap_name)
 }
 
 
+void genome_unload_mmap()
+{
+  my_free(contig_names, num_contigs * sizeof(contig_names[0]),
+	  &mem_genomemap, "contig_names");
+  my_free(genome_contigs, num_contigs * sizeof(genome_contigs[0]),
+	  &mem_genomemap, "genome_contigs");
+  my_free(genome_contigs_rc, num_contigs * sizeof(genome_contigs_rc[0]),
+	  &mem_genomemap, "genome_contigs_rc");
+  if (shrimp_mode == MODE_COLOUR_SPACE) {
+    my_free(genome_cs_contigs, num_contigs * sizeof(genome_cs_contigs[0]),
+	    &mem_genomemap, "genome_cs_contigs");
+    my_free(genome_cs_contigs_rc, num_contigs * sizeof(genome_cs_contigs_rc[0]),
+	    &mem_genomemap, "genome_cs_contigs_rc");
+  }
+  if (Hflag) {
+    my_free(seed_hash_mask, n_seeds * sizeof(seed_hash_mask[0]),
+	    &mem_genomemap, "seed_hash_mask");
+  }
+  my_free(genomemap_offsets, n_seeds * sizeof(genomemap_offsets[0]),
+	  &mem_genomemap, "genomemap_offsets");
+  my_free(genomemap, n_seeds * sizeof(genomemap[0]),
+	  &mem_genomemap, "genomemap");
+
+  munmap(mmap_header, mmap_header->map_size);
+  mmap_header = NULL;
+}
+
+
 bool load_genome_map(const char *file)
 {
   /*
@@ -679,11 +801,11 @@ bool load_genome_map(const char *file)
    * uint32_t					: Hflag
    * uint32_t 				: num_contigs
    * uint32_t * num_contigs	: genome_len (the length of each contig)
-   * uint32_t * num_contigs	: contig_offsets
+   * genome_pos_t * num_contigs	: contig_offsets
    * per contig
    * 		uint32_t					: name_length
    * 		char * (name_length + 1)	: name including null termination
-   * uint32_t					: total (= sum of BPTO32BW(genome_len)
+   * genome_pos_t				: total (= sum of BPTO32BW(genome_len)
    * per contig
    * 		uint32_t * BPTO32BW(contig_len)	: genome_contigs
    * per contig
@@ -703,7 +825,7 @@ bool load_genome_map(const char *file)
   //shrimp mode
   uint32_t m;
   xgzread(fp, &m, sizeof(uint32_t));
-  if (shrimp_mode != (shrimp_mode_t)m) {
+  if (shrimp_mode != (shrimp_mode_t)index_mode(m, file)) {
     fprintf(stderr, "error: shrimp mode does not match genome file (%s)\n", file);
     exit(1);
   }
@@ -724,11 +846,11 @@ bool load_genome_map(const char *file)
   xgzread(fp, genome_len, num_contigs * sizeof(uint32_t));
 
   // contig_offsets
-  contig_offsets = (uint32_t *)
+  contig_offsets = (genome_pos_t *)
     //xmalloc(sizeof(uint32_t) * num_contigs);
-    my_malloc(num_contigs * sizeof(uint32_t),
+    my_malloc(num_contigs * sizeof(contig_offsets[0]),
 	      &mem_genomemap, "contig_offsets");
-  xgzread(fp, contig_offsets, num_contigs * sizeof(uint32_t));
+  xgzread(fp, contig_offsets, num_contigs * sizeof(contig_offsets[0]));
 
   // names / total
   contig_names = (char **)
@@ -775,8 +897,8 @@ bool load_genome_map(const char *file)
   uint32_t *ptr1, *ptr2, *ptr3 = NULL;
   //total;
   {
-    uint32_t total;
-    xgzread(fp, &total, sizeof(uint32_t));
+    genome_pos_t total;
+    xgzread(fp, &total, sizeof(total));
     genome_contigs_block.sz = (size_t)total * sizeof(uint32_t);
   }
 
@@ -853,17 +975,17 @@ void print_genomemap_stats()
     stat_init(&list_size_non0);
     max = 0;
     for (mapidx = 0; mapidx < capacity; mapidx++) {
-      if (genomemap_len[sn][mapidx] > list_cutoff) {
+      if (genomemap_list_len(sn, mapidx) > list_cutoff) {
 	stat_add(&list_size, 0);
 	continue;
       }
 
-      stat_add(&list_size, genomemap_len[sn][mapidx]);
-      if (genomemap_len[sn][mapidx] > 0)
-	stat_add(&list_size_non0, genomemap_len[sn][mapidx]);
+      stat_add(&list_size, genomemap_list_len(sn, mapidx));
+      if (genomemap_list_len(sn, mapidx) > 0)
+	stat_add(&list_size_non0, genomemap_list_len(sn, mapidx));
 
-      if (genomemap_len[sn][mapidx] > max)
-	max = genomemap_len[sn][mapidx];
+      if (genomemap_list_len(sn, mapidx) > max)
+	max = genomemap_list_len(sn, mapidx);
     }
 
     fprintf(stderr, "sn:%d weight:%d total_kmers:%llu lists:%llu (non-zero:%llu) list_sz_avg:%.2f (%.2f) list_sz_stddev:%.2f (%.2f) max:%u\n",
@@ -878,10 +1000,10 @@ void print_genomemap_stats()
 
     bucket_size = ceil_div((max+1), 100); // values in [0..max]
     for (mapidx = 0; mapidx < capacity; mapidx++) {
-      if (genomemap_len[sn][mapidx] > list_cutoff) {
+      if (genomemap_list_len(sn, mapidx) > list_cutoff) {
 	bucket = 0;
       } else {
-	bucket = genomemap_len[sn][mapidx] / bucket_size;
+	bucket = genomemap_list_len(sn, mapidx) / bucket_size;
 	if (bucket >= 100)
 	  bucket = 99;
       }
@@ -905,39 +1027,35 @@ void print_genomemap_stats()
 void free_genome(void)
 {
   int i, sn;
-  uint32_t j, capacity;
+  uint32_t capacity;
 
   for (sn = 0; sn < n_seeds; sn++){
     capacity = (uint32_t)power4(Hflag? HASH_TABLE_POWER : seed[sn].weight);
-    //uint32_t mapidx = kmer_to_mapidx(kmerWindow, sn);
-    if (load_file != NULL) {
-      my_free(genomemap_block[sn].ptr, genomemap_block[sn].sz,
-	      &mem_genomemap, "genomemap_block[%d].ptr", sn);
+    if (genomemap_packed != NULL) {
+      my_free(genomemap_packed[sn], (genomemap_packed_offsets[sn][capacity] + 1) * sizeof(genomemap_packed[0][0]),
+	      &mem_genomemap, "genomemap_packed[%d]", sn);
+      my_free(genomemap_packed_offsets[sn], (capacity + 1) * sizeof(genomemap_packed_offsets[0][0]),
+	      &mem_genomemap, "genomemap_packed_offsets[%d]", sn);
     } else {
-      for (j = 0; j < capacity; j++) {
-	if (genomemap[sn][j] != NULL) {
-	  //free(genomemap[sn][j]);
-	  my_free(genomemap[sn][j], genomemap_len[sn][j] * sizeof(genomemap[0][0][0]),
-		  &mem_genomemap, "genomemap[%d][%u]", sn, j);
-	}
-      }
+      //free(genomemap[sn]);
+      my_free(genomemap[sn], genomemap_offsets[sn][capacity] * sizeof(genomemap[0][0]),
+	      &mem_genomemap, "genomemap[%d]", sn);
     }
-    //free(genomemap[sn]);
-    my_free(genomemap[sn], capacity * sizeof(genomemap[0][0]),
-	    &mem_genomemap, "genomemap[%d]", sn);
-    //free(genomemap_len[sn]);
-    my_free(genomemap_len[sn], capacity * sizeof(genomemap_len[0][0]),
-	    &mem_genomemap, "genomemap_len[%d]", sn);
+    my_free(genomemap_offsets[sn], (capacity + 1) * sizeof(genomemap_offsets[0][0]),
+	    &mem_genomemap, "genomemap_offsets[%d]", sn);
   }
-  //free(genomemap);
-  my_free(genomemap, n_seeds * sizeof(genomemap[0]),
-	  &mem_genomemap, "genomemap");
-  //free(genomemap_len);
-  my_free(genomemap_len, n_seeds * sizeof(genomemap_len[0]),
-	  &mem_genomemap, "genomemap_len");
-  if (load_file != NULL)
-    my_free(genomemap_block, n_seeds * sizeof(genomemap_block[0]),
-	    &mem_genomemap, "genomemap_block");
+  if (genomemap_packed != NULL) {
+    my_free(genomemap_packed, n_seeds * sizeof(genomemap_packed[0]),
+	    &mem_genomemap, "genomemap_packed");
+    my_free(genomemap_packed_offsets, n_seeds * sizeof(genomemap_packed_offsets[0]),
+	    &mem_genomemap, "genomemap_packed_offsets");
+  } else {
+    //free(genomemap);
+    my_free(genomemap, n_seeds * sizeof(genomemap[0]),
+	    &mem_genomemap, "genomemap");
+  }
+  my_free(genomemap_offsets, n_seeds * sizeof(genomemap_offsets[0]),
+	  &mem_genomemap, "genomemap_offsets");
 
   if (load_file != NULL) {
     my_free(genome_contigs_block.ptr, genome_contigs_block.sz,
@@ -987,7 +1105,7 @@ void free_genome(void)
   my_free(genome_len, num_contigs * sizeof(uint32_t),
 	  &mem_genomemap, "genome_len");
   //free(contig_offsets);
-  my_free(contig_offsets, num_contigs * sizeof(uint32_t),
+  my_free(contig_offsets, num_contigs * sizeof(contig_offsets[0]),
 	  &mem_genomemap, "contig_offsets");
 
   // contig_names
@@ -1005,6 +1123,165 @@ void free_genome(void)
 }
 
 
+/*
+ * A piece of a contig projected by one thread.
+ */
+typedef struct genome_slice {
+  int cn;
+  uint32_t from;
+  uint32_t to;
+} genome_slice;
+
+
+/*
+ * Project kmers ending in [from, to) of one contig onto the seed lists.
+ * The scan starts max_seed_span - 1 bases early so that the kmer window and the
+ * N-run counter are the same as for a scan starting at the contig start.
+ *
+ * With fill == false, count the kmers of list mapidx in genomemap_offsets[sn][mapidx + 1].
+ * With fill == true, store each position at genomemap_offsets[sn][mapidx], used
+ * as a cursor; the caller must have set the offsets to the list starts.
+ * Several slices are projected at once, so updates to the offsets are atomic.
+ */
+static void
+project_slice(genome_slice * gs, bool fill)
+{
+  uint32_t * contig = (shrimp_mode == MODE_COLOUR_SPACE? genome_cs_contigs[gs->cn] : genome_contigs[gs->cn]);
+  uint32_t kmerWindow[BPTO32BW(max_seed_span)];
+  uint32_t i, mapidx;
+  genome_pos_t k;
+  int load = 0;
+  int sn, base;
+
+  memset(kmerWindow, 0, sizeof(kmerWindow));
+  i = (gs->from >= (uint32_t)max_seed_span - 1? gs->from - (max_seed_span - 1) : 0);
+  for ( ; i < gs->to; i++) {
+    base = EXTRACT(contig, i);
+    bitfield_prepend(kmerWindow, max_seed_span, base);
+
+    //skip past any Ns or Xs
+    if (base == BASE_N || base == BASE_X)
+      load = 0;
+    else if (load < max_seed_span)
+      load++;
+    if (i < gs->from)
+      continue;
+
+    for (sn = 0; sn < n_seeds; sn++) {
+      if (load < seed[sn].span)
+	continue;
+
+      mapidx = KMER_TO_MAPIDX(kmerWindow, sn);
+      if (fill) {
+#pragma omp atomic capture
+	k = genomemap_offsets[sn][mapidx]++;
+	genomemap[sn][k] = contig_offsets[gs->cn] + i - seed[sn].span + 1;
+      } else {
+#pragma omp atomic
+	genomemap_offsets[sn][mapidx + 1]++;
+      }
+    }
+  }
+}
+
+
+static int
+genome_pos_cmp(const void * a, const void * b)
+{
+  genome_pos_t x = *(genome_pos_t const *)a;
+  genome_pos_t y = *(genome_pos_t const *)b;
+
+  return (x < y? -1 : (x > y? 1 : 0));
+}
+
+
+/*
+ * Build the kmer lists of all seeds with a counting sort: one pass counts the
+ * occurrences of every kmer, a prefix sum turns the counts into list offsets,
+ * and a second pass fills the positions of each seed.
+ *
+ * Both passes split the genome in slices projected by num_threads threads.
+ * Slices fill the same lists concurrently, so lists are sorted at the end.
+ */
+static void
+project_genome()
+{
+  genome_slice * slices;
+  uint32_t j, capacity, from, slice_len;
+  size_t total;
+  int cn, sn, i, n_slices, max_slices;
+
+  // aim for a few slices per thread, but keep them long compared to the warm-up
+  total = 0;
+  for (cn = 0; cn < num_contigs; cn++)
+    total += genome_len[cn];
+  slice_len = (uint32_t)MAX((total + (size_t)num_threads * 8 - 1) / ((size_t)num_threads * 8), (size_t)(1 << 16));
+
+  max_slices = 0;
+  for (cn = 0; cn < num_contigs; cn++)
+    max_slices += ceil_div(genome_len[cn], slice_len);
+  slices = (genome_slice *)
+    my_malloc(max_slices * sizeof(slices[0]),
+	      &mem_small, "slices");
+  n_slices = 0;
+  for (cn = 0; cn < num_contigs; cn++) {
+    for (from = 0; from < genome_len[cn]; from += slice_len) {
+      slices[n_slices].cn = cn;
+      slices[n_slices].from = from;
+      slices[n_slices].to = MIN(genome_len[cn], from + slice_len);
+      n_slices++;
+    }
+  }
+
+#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 1)
+  for (i = 0; i < n_slices; i++)
+    project_slice(&slices[i], false);
+
+  for (sn = 0; sn < n_seeds; sn++) {
+    capacity = (uint32_t)power4(Hflag? HASH_TABLE_POWER : seed[sn].weight);
+
+    for (j = 1; j <= capacity; j++)
+      genomemap_offsets[sn][j] += genomemap_offsets[sn][j - 1];
+
+    genomemap[sn] = (genome_pos_t *)
+      my_malloc(genomemap_offsets[sn][capacity] * sizeof(genomemap[0][0]),
+		&mem_genomemap, "genomemap[%d]", sn);
+  }
+
+#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 1)
+  for (i = 0; i < n_slices; i++)
+    project_slice(&slices[i], true);
+
+  // each cursor stopped at the start of the next list
+  for (sn = 0; sn < n_seeds; sn++) {
+    capacity = (uint32_t)power4(Hflag? HASH_TABLE_POWER : seed[sn].weight);
+
+    memmove(&genomemap_offsets[sn][1], &genomemap_offsets[sn][0], capacity * sizeof(genomemap_offsets[0][0]));
+    genomemap_offsets[sn][0] = 0;
+  }
+
+  // the lists must be in genome order
+  if (num_threads > 1) {
+    for (sn = 0; sn < n_seeds; sn++) {
+      capacity = (uint32_t)power4(Hflag? HASH_TABLE_POWER : seed[sn].weight);
+
+#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 4096) private(i)
+      for (j = 0; j < capacity; j++) {
+	for (i = 1; i < (int)genomemap_list_len(sn, j); i++) {
+	  if (genomemap_list(sn, j)[i - 1] > genomemap_list(sn, j)[i]) {
+	    qsort(genomemap_list(sn, j), genomemap_list_len(sn, j), sizeof(genomemap[0][0]), genome_pos_cmp);
+	    break;
+	  }
+	}
+      }
+    }
+  }
+
+  my_free(slices, max_slices * sizeof(slices[0]),
+	  &mem_small, "slices");
+}
+
+
 /*
  * index the kmers in the genome contained in the file.
  * This can then be used to align reads against.
@@ -1015,37 +1292,28 @@ bool load_genome(char **files, int nfiles)
   size_t seqlen, capacity;
   uint32_t *read;
   char *seq, *name;
-  //uint32_t *kmerWindow;
   int sn;
   char *file;
   bool is_rna;
 
-  //allocate memory for the genome map
-  genomemap = (uint32_t ***)
+  //allocate memory for the genome map; the lists are allocated by project_genome()
+  genomemap = (genome_pos_t **)
     //xmalloc_c(n_seeds * sizeof(genomemap[0]), &mem_genomemap);
     my_malloc(n_seeds * sizeof(genomemap[0]),
 	      &mem_genomemap, "genomemap");
-  genomemap_len = (uint32_t **)
-    //xmalloc_c(n_seeds * sizeof(genomemap_len[0]), &mem_genomemap);
-    my_malloc(n_seeds * sizeof(genomemap_len[0]),
-	      &mem_genomemap, "genomemap_len");
+  genomemap_offsets = (genome_pos_t **)
+    my_malloc(n_seeds * sizeof(genomemap_offsets[0]),
+	      &mem_genomemap, "genomemap_offsets");
 
   for (sn = 0; sn < n_seeds; sn++) {
     capacity = (uint32_t)power4(Hflag? HASH_TABLE_POWER : seed[sn].weight);
 
-    genomemap[sn] = (uint32_t **)
-      //xcalloc_c(sizeof(uint32_t *) * capacity, &mem_genomemap);
-      my_calloc(sizeof(uint32_t *) * capacity,
-		&mem_genomemap, "genomemap[%d]", sn);
-    //memset(genomemap[sn],0,sizeof(uint32_t *) * capacity); //???
-    genomemap_len[sn] = (uint32_t *)
-      //xcalloc_c(sizeof(uint32_t) * capacity, &mem_genomemap);
-      my_calloc(sizeof(uint32_t) * capacity,
-		&mem_genomemap, "genomemap_len[%d]", sn);
-
+    genomemap_offsets[sn] = (genome_pos_t *)
+      my_calloc(sizeof(genomemap_offsets[0][0]) * (capacity + 1),
+		&mem_genomemap, "genomemap_offsets[%d]", sn);
   }
   num_contigs = 0;
-  u_int i = 0;
+  uint64_t i = 0;
   int cfile;
   for(cfile = 0; cfile < nfiles; cfile++){
     file = files[cfile];
@@ -1063,9 +1331,9 @@ bool load_genome(char **files, int nfiles)
     while(fasta_get_next_contig(fasta, &name, &seq, &is_rna)){
       genome_is_rna = is_rna;
       num_contigs++;
-      contig_offsets = (uint32_t *)
+      contig_offsets = (genome_pos_t *)
 	//xrealloc(contig_offsets,sizeof(uint32_t)*num_contigs);
-	my_realloc(contig_offsets, num_contigs * sizeof(uint32_t), (num_contigs - 1) * sizeof(uint32_t),
+	my_realloc(contig_offsets, num_contigs * sizeof(contig_offsets[0]), (num_contigs - 1) * sizeof(contig_offsets[0]),
 		   &mem_genomemap, "contig_offsets");
       contig_offsets[num_contigs - 1] = i;
       contig_names = (char **)
@@ -1088,6 +1356,15 @@ bool load_genome(char **files, int nfiles)
 		name);
 	return false;
       }
+      if (seqlen > UINT32_MAX) {
+	fprintf(stderr, "error: contig [%s] is longer than %u bases\n", name, UINT32_MAX);
+	return false;
+      }
+      if (i + seqlen > GENOME_POS_MAX) {
+	fprintf(stderr, "error: genome is longer than %llu bases; "
+		"rebuild gmapper with LONG_GENOME=1 to index it\n", (long long unsigned int)GENOME_POS_MAX);
+	return false;
+      }
 
       read = fasta_sequence_to_bitfield(fasta,seq);
 
@@ -1123,86 +1400,169 @@ bool load_genome(char **files, int nfiles)
 		   &mem_genomemap, "genome_len");
       genome_len[num_contigs - 1] = seqlen;
 
-      if (shrimp_mode == MODE_COLOUR_SPACE){
-	/*
-	genome_initbp = (int *)
-	  //xrealloc(genome_initbp,sizeof(genome_initbp[0])*num_contigs);
-	  my_realloc(genome_initbp, sizeof(genome_initbp[0]) * num_contigs, (num_contigs - 1) * sizeof(genome_initbp[0]),
-		     &mem_genomemap, "realloc genomeinitbp[%d]", num_contigs);
-	genome_initbp[num_contigs - 1] = BASE_T; // EXTRACT(read,0); NOT REALLY NEEDED
-	*/
-	read = fasta_bitfield_to_colourspace(fasta,read,seqlen,is_rna);
-      }
-
-      //kmerWindow = (uint32_t *)xcalloc(sizeof(kmerWindow[0])*BPTO32BW(max_seed_span));
-      uint32_t kmerWindow[BPTO32BW(max_seed_span)];
-
-      int load = 0;
-      for ( ; i < seqlen + contig_offsets[num_contigs-1]; i++) {
-	int base;
-
-	base = EXTRACT(read, i - contig_offsets[num_contigs-1]);
-	bitfield_prepend(kmerWindow, max_seed_span, base);
-
-	//skip past any Ns or Xs
-	if (base == BASE_N || base == BASE_X)
-	  load = 0;
-	else if (load < max_seed_span)
-	  load++;;
-	for (sn = 0; sn < n_seeds; sn++) {
-	  if (load < seed[sn].span)
-	    continue;
-
-	  uint32_t mapidx = KMER_TO_MAPIDX(kmerWindow, sn);
-	  //increase the match count and store the location of the match
-	  genomemap_len[sn][mapidx]++;
-	  genomemap[sn][mapidx] = (uint32_t *)
-	    //xrealloc_c(genomemap[sn][mapidx], sizeof(uint32_t) * (genomemap_len[sn][mapidx]), sizeof(uint32_t) * (genomemap_len[sn][mapidx] - 1), &mem_genomemap);
-	    my_realloc(genomemap[sn][mapidx], sizeof(uint32_t) * (genomemap_len[sn][mapidx]), sizeof(uint32_t) * (genomemap_len[sn][mapidx] - 1),
-		       &mem_genomemap, "genomemap[%d][%u]", sn, mapidx);
-	  genomemap[sn][mapidx][genomemap_len[sn][mapidx] - 1] = i - seed[sn].span + 1;
+      i += seqlen;
 
-	}
-      }
-      if (shrimp_mode==MODE_COLOUR_SPACE) {
-	free(read);
-      }
-			
       free(seq);
       seq = NULL;
       name = NULL;
-
-      //free(kmerWindow);
     }
     fasta_close(fasta);
   }
 
+  // the contigs are kept in memory anyway, so project them all at once
+  project_genome();
+
   fprintf(stderr,"Loaded Genome\n");
   return (true);
 }
 
 
 /*
- * Trim long genome lists
+ * Trim long genome lists, compacting the remaining ones in place.
  */
 void trim_genome()
 {
   int sn;
-  uint32_t mapidx, capacity;
+  uint32_t mapidx, capacity, len;
+  genome_pos_t start, total, new_total;
 
   for (sn = 0; sn < n_seeds; sn++) {
     capacity = (uint32_t)power4(Hflag? HASH_TABLE_POWER : seed[sn].weight);
+    total = genomemap_offsets[sn][capacity];
 
+    new_total = 0;
     for (mapidx = 0; mapidx < capacity; mapidx++) {
-      if (genomemap_len[sn][mapidx] > list_cutoff) {
-	genomemap_len[sn][mapidx] = 0;
-	if (load_file == NULL) {
-	  //free(genomemap[sn][mapidx]);
-	  my_free(genomemap[sn][mapidx], genomemap_len[sn][mapidx],
-		  &mem_genomemap, "genomemap[%d][%u]", sn, mapidx);
-	} // otherwise, this memory is block-allocated
-	genomemap[sn][mapidx] = NULL;
+      start = genomemap_offsets[sn][mapidx];
+      len = (uint32_t)(genomemap_offsets[sn][mapidx + 1] - start);
+      genomemap_offsets[sn][mapidx] = new_total;
+      if (len > list_cutoff)
+	continue;
+
+      memmove(&genomemap[sn][new_total], &genomemap[sn][start], len * sizeof(genomemap[0][0]));
+      new_total += len;
+    }
+    genomemap_offsets[sn][capacity] = new_total;
+
+    genomemap[sn] = (genome_pos_t *)
+      my_realloc(genomemap[sn], new_total * sizeof(genomemap[0][0]), total * sizeof(genomemap[0][0]),
+		 &mem_genomemap, "genomemap[%d]", sn);
+  }
+}
+
+
+/*
+ * Words used by a list in the compressed genome map, and the width of its deltas.
+ * Lists that packing would not make shorter, or with deltas that do not fit in
+ * 32 bits, are stored as is, in len * GENOMEMAP_POS_WORDS words.
+ */
+static uint32_t
+packed_list_words(genome_pos_t * list, uint32_t len, uint32_t * b)
+{
+  genome_pos_t max_delta;
+  uint32_t i, words;
+
+  if (len <= 2)
+    return len * GENOMEMAP_POS_WORDS;
+
+  max_delta = 0;
+  for (i = 1; i < len; i++) {
+    if (list[i] - list[i - 1] > max_delta)
+      max_delta = list[i] - list[i - 1];
+  }
+  if (max_delta > UINT32_MAX)
+    return len * GENOMEMAP_POS_WORDS;
+  for (*b = 1; *b < 32 && (max_delta >> *b) != 0; (*b)++);
+
+  words = GENOMEMAP_POS_WORDS + 1 + (uint32_t)(((uint64_t)(len - 1) * *b + 31) / 32);
+  return MIN(words, len * GENOMEMAP_POS_WORDS);
+}
+
+
+/*
+ * Replace genomemap with the compressed genomemap_packed.
+ * Lists longer than list_cutoff are never read by the mapper, so they are dropped;
+ * genomemap_offsets still holds all list lengths.
+ */
+void compress_genome()
+{
+  int sn;
+  uint32_t mapidx, capacity, len, b, i, d, s;
+  genome_pos_t * list;
+  uint32_t * w;
+  uint64_t bit, total, plain_total = 0, packed_total = 0;
+
+  genomemap_packed = (uint32_t **)
+    my_malloc(n_seeds * sizeof(genomemap_packed[0]),
+	      &mem_genomemap, "genomemap_packed");
+  genomemap_packed_offsets = (genome_pos_t **)
+    my_malloc(n_seeds * sizeof(genomemap_packed_offsets[0]),
+	      &mem_genomemap, "genomemap_packed_offsets");
+
+  for (sn = 0; sn < n_seeds; sn++) {
+    capacity = (uint32_t)power4(Hflag? HASH_TABLE_POWER : seed[sn].weight);
+
+    genomemap_packed_offsets[sn] = (genome_pos_t *)
+      my_malloc((capacity + 1) * sizeof(genomemap_packed_offsets[0][0]),
+		&mem_genomemap, "genomemap_packed_offsets[%d]", sn);
+    genomemap_packed_offsets[sn][0] = 0;
+
+#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 4096) private(len, b)
+    for (mapidx = 0; mapidx < capacity; mapidx++) {
+      len = genomemap_list_len(sn, mapidx);
+      genomemap_packed_offsets[sn][mapidx + 1] =
+	(len <= list_cutoff? packed_list_words(genomemap_list(sn, mapidx), len, &b) : 0);
+    }
+
+    total = 0;
+    for (mapidx = 1; mapidx <= capacity; mapidx++) {
+      total += genomemap_packed_offsets[sn][mapidx];
+      if (total >= GENOME_POS_MAX)
+	crash(1, 0, "compressed genome map for seed %d is too large", sn);
+      genomemap_packed_offsets[sn][mapidx] = (genome_pos_t)total;
+    }
+
+    // one extra word lets the decoder always load two words
+    genomemap_packed[sn] = (uint32_t *)
+      my_calloc((total + 1) * sizeof(genomemap_packed[0][0]),
+		&mem_genomemap, "genomemap_packed[%d]", sn);
+
+#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 4096) private(len, b, list, w, bit, i, d, s)
+    for (mapidx = 0; mapidx < capacity; mapidx++) {
+      len = genomemap_list_len(sn, mapidx);
+      if (len == 0 || len > list_cutoff)
+	continue;
+
+      list = genomemap_list(sn, mapidx);
+      w = genomemap_packed[sn] + genomemap_packed_offsets[sn][mapidx];
+      if (genomemap_packed_offsets[sn][mapidx + 1] - genomemap_packed_offsets[sn][mapidx] == len * GENOMEMAP_POS_WORDS) {
+	memcpy(w, list, len * sizeof(list[0]));
+	continue;
+      }
+
+      packed_list_words(list, len, &b);
+      memcpy(w, &list[0], sizeof(list[0]));
+      w += GENOMEMAP_POS_WORDS;
+      *w++ = b;
+      for (i = 1, bit = 0; i < len; i++, bit += b) {
+	d = (uint32_t)(list[i] - list[i - 1]);
+	s = (uint32_t)(bit & 31);
+	w[bit >> 5] |= d << s;
+	if (s + b > 32)
+	  w[(bit >> 5) + 1] |= d >> (32 - s);
       }
     }
+
+    plain_total += genomemap_offsets[sn][capacity];
+    packed_total += total;
+
+    my_free(genomemap[sn], genomemap_offsets[sn][capacity] * sizeof(genomemap[0][0]),
+	    &mem_genomemap, "genomemap[%d]", sn);
   }
+
+  my_free(genomemap, n_seeds * sizeof(genomemap[0]),
+	  &mem_genomemap, "genomemap");
+  genomemap = NULL;
+
+  fprintf(stderr, "Compressed genome map: %.2f bits per position\n",
+	  plain_total > 0? (double)packed_total * 32.0 / (double)plain_total : 0.0);
 }
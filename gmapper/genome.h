@@ -28,8 +28,10 @@ void		print_genomemap_stats();
 void		free_genome();
 bool		load_genome(char **, int);
 void		trim_genome();
+void		compress_genome();
 bool		genome_load_map_save_mmap(char *, char const *);
 bool		genome_load_mmap(char const *);
+void		genome_unload_mmap();
 
 
 #ifdef __cplusplus
@@ -11,16 +11,24 @@
 #define DEF_NUM_THREADS		1
 #define DEF_MAX_THREADS		100
 #define DEF_CHUNK_SIZE		1000
+#define DEF_READ_BATCH		16	/* reads prepared together by a mapping thread */
+#define DEF_INFLATE_THREADS	2	/* threads inflating BGZF input */
+#define DEF_READ_TEXT_BLOCK_SIZE (1024*1024)	/* text arena blocks of a read chunk */
+#define DEF_READ_QUEUE_CHUNKS	2	/* chunk buffers per mapping thread */
+#define DEF_OUTPUT_WINDOW_CHUNKS	4	/* chunks in flight per mapping thread */
+#define DEF_READ_ARENA_BLOCK	(1024*1024)	/* per-thread arena block size */
 #define DEF_PROGRESS		100000
 #define USE_PREFETCH
 
 #define DEF_HASH_FILTER_CALLS	true
+#define DEF_SW_CACHE_SIZE	0	/* cross-read vector SW scores kept per thread */
 #define DEF_GAPLESS_SW		false
 #define DEF_LIST_CUTOFF		4294967295u // 2^32 - 1
 
 #define DEF_USE_REGIONS		true
 #define DEF_REGION_BITS		11
 #define DEF_REGION_OVERLAP	50
+#define DEF_USE_REGION_HASH	false
 
 #define DEF_ANCHOR_LIST_BIG_GAP	1024
 
@@ -29,6 +37,9 @@
 #define DEF_MAX_INSERT_SIZE	1000
 #define DEF_INSERT_SIZE_MEAN	200
 #define DEF_INSERT_SIZE_STDDEV	100
+#define DEF_INSERT_LEARN_PAIRS	0	/* read pairs the insert sizes are learned from */
+#define DEF_INSERT_LEARN_SIGMAS	4	/* learned pairing window, in stddevs around the mean */
+#define DEF_INSERT_LEARN_MIN	30	/* fewest confident pairs to trust the estimate */
 
 #define DEF_WINDOW_LEN		140.0
 #define DEF_WINDOW_OVERLAP	90.0
@@ -155,7 +166,14 @@
 	{"local",0,0,124},\
 	{"no-qv-check",0,0,123},\
 	{"ignore-qvs",0,0,125},\
-	{"pr-xover",1,0,126}\
+	{"pr-xover",1,0,126},\
+	{"compress-index",0,0,127},\
+	{"bam",0,0,128},\
+	{"region-map",1,0,129},\
+	{"read-batch",1,0,130},\
+	{"sw-cache",1,0,131},\
+	{"inflate-threads",1,0,132},\
+	{"insert-size-learn",1,0,133}\
 }
 
 #define DEF_COLOUR_SPACE_OPTIONS \
@@ -241,6 +259,7 @@
 #define DEF_THREAD_OUTPUT_BUFFER_INITIAL	1024*1024*10
 #define DEF_THREAD_OUTPUT_BUFFER_INCREMENT	1024*1024*10
 #define DEF_THREAD_OUTPUT_BUFFER_SAFETY		1024*500
+#define DEF_BAM_COMPRESSION_LEVEL		6	/* zlib level of BGZF blocks */
 #define DEF_THREAD_OUTPUT_HEAP_CAPACITY		1024
 
 
@@ -21,6 +21,22 @@
 
 typedef long long int llint;
 
+/*
+ * Absolute genome positions (contig offsets plus offset in contig). These are 32-bit
+ * unless gmapper is built with LONG_GENOME, for references above 4 Gbp.
+ * Index files record the width, so an index is only loaded by a matching build.
+ */
+#define INDEX_LONG_GENOME 0x100	/* flag in the shrimp_mode word of index files */
+#ifdef LONG_GENOME
+typedef uint64_t genome_pos_t;
+#define GENOME_POS_MAX UINT64_MAX
+#define INDEX_MODE_FLAGS INDEX_LONG_GENOME
+#else
+typedef uint32_t genome_pos_t;
+#define GENOME_POS_MAX UINT32_MAX
+#define INDEX_MODE_FLAGS 0
+#endif
+
 
 typedef struct {
   char ** argv;
@@ -194,14 +210,6 @@ struct range_restriction {
 };
 
 
-/* cigar string */
-typedef struct {
-	uint32_t * lengths;
-	char * ops;
-	int size;
-} cigar_t;
-
-
 typedef struct regions_options {
   bool		recompute;
   //int		min_seed;
@@ -294,10 +302,17 @@ typedef struct readpair_mapping_options_t {
 } readpair_mapping_options_t;
 
 
+/*
+ * Header of an mmap index. The index is position independent: arrays are given by
+ * their offset from the start of the map, and per-contig and per-seed arrays by
+ * the offset of a table of offsets.
+ */
+typedef uint64_t map_off_t;
+
 typedef struct map_header {
-  void *	map_start;
-  void *	map_end;
   int		map_version;
+  int		genome_pos_bits;
+  uint64_t	map_size;
 
   shrimp_mode_t	shrimp_mode;
   bool		Hflag;
@@ -307,37 +322,33 @@ typedef struct map_header {
   int		max_seed_span;
   int		avg_seed_span;
 
-  uint32_t *	genome_len;
-  uint32_t *	contig_offsets;
-  char * *	contig_names;
-
-  uint32_t * *	genome_contigs;
-  uint32_t * *	genome_contigs_rc;
-  uint32_t * *	genome_cs_contigs;
-  uint32_t * *	genome_cs_contigs_rc;
-
-  struct seed_type *	seed;
-  uint32_t * *	seed_hash_mask;
-
-  uint32_t * *	genomemap_len;
-  uint32_t * * *genomemap;
+  map_off_t	genome_len;		/* uint32_t[num_contigs] */
+  map_off_t	contig_offsets;		/* genome_pos_t[num_contigs] */
+  map_off_t	contig_names;		/* tables of num_contigs offsets */
+  map_off_t	genome_contigs;
+  map_off_t	genome_contigs_rc;
+  map_off_t	genome_cs_contigs;
+  map_off_t	genome_cs_contigs_rc;
+
+  map_off_t	seed;			/* struct seed_type[n_seeds] */
+  map_off_t	seed_hash_mask;		/* tables of n_seeds offsets */
+  map_off_t	genomemap_offsets;
+  map_off_t	genomemap;
 } map_header;
 
 
 static inline void
-read_free_anchor_list(struct read_entry * re, count_t * counter)
+read_free_anchor_list(struct read_entry * re, my_arena * arena)
 {
   if (re->anchors[0] != NULL) {
     //free(re->anchors[0]);
-    my_free(re->anchors[0], re->n_anchors[0] * sizeof(re->anchors[0][0]),
-	    counter, "anchors [%s]", re->name);
+    my_arena_free(arena, re->anchors[0]);
     re->anchors[0] = NULL;
     re->n_anchors[0] = 0;
   }
   if (re->anchors[1] != NULL) {
     //free(re->anchors[1]);
-    my_free(re->anchors[1], re->n_anchors[1] * sizeof(re->anchors[0][0]),
-	    counter, "anchors [%s]", re->name);
+    my_arena_free(arena, re->anchors[1]);
     re->anchors[1] = NULL;
     re->n_anchors[1] = 0;
   }
@@ -345,19 +356,17 @@ read_free_anchor_list(struct read_entry * re, count_t * counter)
 
 
 static inline void
-read_free_hit_list(struct read_entry * re, count_t * counter)
+read_free_hit_list(struct read_entry * re, my_arena * arena)
 {
   if (re->hits[0] != NULL) {
     //free(re->hits[0]);
-    my_free(re->hits[0], re->n_hits[0] * sizeof(re->hits[0][0]),
-	    counter, "hits [%s]", re->name);
+    my_arena_free(arena, re->hits[0]);
     re->hits[0] = NULL;
     re->n_hits[0] = 0;
   }
   if (re->hits[1] != NULL) {
     //free(re->hits[1]);
-    my_free(re->hits[1], re->n_hits[1] * sizeof(re->hits[0][0]),
-	    counter, "hits [%s]", re->name);
+    my_arena_free(arena, re->hits[1]);
     re->hits[1] = NULL;
     re->n_hits[1] = 0;
   }
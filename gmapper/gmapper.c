@@ -18,15 +18,19 @@
 #include <unistd.h>
 #include <zlib.h>
 #include <omp.h>	// OMP multithreading
+#include <pthread.h>	// reader and writer threads
+#include <semaphore.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <getopt.h>
 
 #include "../gmapper/gmapper.h"
 #include "../gmapper/seeds.h"
 #include "../gmapper/genome.h"
 #include "../gmapper/mapping.h"
+#include "../gmapper/output.h"
 
 #include "../common/hash.h"
 #include "../common/fasta.h"
@@ -40,6 +44,7 @@
 #include "../common/input.h"
 #include "../common/read_hit_heap.h"
 #include "../common/sw-post.h"
+#include "../common/bgzf.h"
 
 /* heaps */
 /*
@@ -78,25 +83,21 @@ hit_edit_distance(struct read_hit * rh) {
 void 
 read_free(struct read_entry * re)
 {
-  free(re->name);
-  free(re->seq);
+  // name, seq, qual and plus_line belong to the text of the read chunk
   if (re->orig_seq!=re->seq) {
     free(re->orig_seq);
   }
   if (Qflag) {
     assert(re->qual!=NULL);
-    free(re->qual);
     if (re->qual!=re->orig_qual) {
       free(re->orig_qual);
     }
-    assert(re->plus_line!=NULL);
-    free(re->plus_line);
   }
 }
 
 
 void
-read_free_full(struct read_entry * re, count_t * counter)
+read_free_full(struct read_entry * re, my_arena * arena)
 {
   if (shrimp_mode == MODE_COLOUR_SPACE && Qflag) {
     if (re->crossover_score != NULL) {
@@ -105,12 +106,12 @@ read_free_full(struct read_entry * re, count_t * counter)
     }
   }
   if (re->mapidx[0] != NULL)
-    my_free(re->mapidx[0], n_seeds * re->max_n_kmers * sizeof(re->mapidx[0][0]), counter, "mapidx [%s]", re->name);
+    my_arena_free(arena, re->mapidx[0]);
   if (re->mapidx[1] != NULL)
-    my_free(re->mapidx[1], n_seeds * re->max_n_kmers * sizeof(re->mapidx[0][0]), counter, "mapidx [%s]", re->name);
+    my_arena_free(arena, re->mapidx[1]);
 
-  read_free_hit_list(re, counter);
-  read_free_anchor_list(re, counter);
+  read_free_hit_list(re, arena);
+  read_free_anchor_list(re, arena);
 
   if (re->n_ranges > 0)
     free(re->ranges);
@@ -118,9 +119,8 @@ read_free_full(struct read_entry * re, count_t * counter)
   if (re->n_final_unpaired_hits > 0) {
     int i;
     for (i = 0; i < re->n_final_unpaired_hits; i++)
-      free_sfrp(&re->final_unpaired_hits[i].sfrp, re, counter);
-    my_free(re->final_unpaired_hits, re->n_final_unpaired_hits * sizeof(re->final_unpaired_hits[0]),
-            counter, "final_unpaired_hits [%s]", re->name);
+      free_sfrp(&re->final_unpaired_hits[i].sfrp, re, arena);
+    my_arena_free(arena, re->final_unpaired_hits);
     re->n_final_unpaired_hits = 0;
     re->final_unpaired_hits = NULL;
   }
@@ -132,13 +132,12 @@ read_free_full(struct read_entry * re, count_t * counter)
 
 
 void
-readpair_free_full(pair_entry * peP, count_t * counterP)
+readpair_free_full(pair_entry * peP, my_arena * arena)
 {
   int nip, i;
 
   if (peP->n_final_paired_hits > 0) {
-    my_free(peP->final_paired_hits, peP->n_final_paired_hits * sizeof(peP->final_paired_hits[0]),
-	counterP, "final_paired_hits [%s,%s]", peP->re[0]->name, peP->re[1]->name);
+    my_arena_free(arena, peP->final_paired_hits);
     peP->n_final_paired_hits = 0;
     peP->final_paired_hits = NULL;
   }
@@ -146,23 +145,21 @@ readpair_free_full(pair_entry * peP, count_t * counterP)
   for (nip = 0; nip < 2; nip++) {
     if (peP->final_paired_hit_pool_size[nip] > 0) {
       for (i = 0; i < peP->final_paired_hit_pool_size[nip]; i++) {
-	free_sfrp(&peP->final_paired_hit_pool[nip][i].sfrp, peP->re[nip], counterP);
+	free_sfrp(&peP->final_paired_hit_pool[nip][i].sfrp, peP->re[nip], arena);
 	if (peP->final_paired_hit_pool[nip][i].n_paired_hit_idx > 0) {
-	  my_free(peP->final_paired_hit_pool[nip][i].paired_hit_idx, peP->final_paired_hit_pool[nip][i].n_paired_hit_idx * sizeof(peP->final_paired_hit_pool[nip][i].paired_hit_idx[0]),
-	      counterP, "paired_hit_idx [%s]", peP->re[nip]->name);
+	  my_arena_free(arena, peP->final_paired_hit_pool[nip][i].paired_hit_idx);
 	  peP->final_paired_hit_pool[nip][i].n_paired_hit_idx = 0;
 	  peP->final_paired_hit_pool[nip][i].paired_hit_idx = NULL;
 	}
       }
-      my_free(peP->final_paired_hit_pool[nip], peP->final_paired_hit_pool_size[nip] * sizeof(peP->final_paired_hit_pool[nip][0]),
-              counterP, "final_paired_hit_pool[%d] [%s,%s]", nip, peP->re[0]->name, peP->re[1]->name);
+      my_arena_free(arena, peP->final_paired_hit_pool[nip]);
       peP->final_paired_hit_pool_size[nip] = 0;
       peP->final_paired_hit_pool[nip] = NULL;
     }
   }
 
-  read_free_full(peP->re[0], counterP);
-  read_free_full(peP->re[1], counterP);
+  read_free_full(peP->re[0], arena);
+  read_free_full(peP->re[1], arena);
 }
 
 
@@ -280,15 +277,649 @@ static void trim_read(struct read_entry * re) {
 	return;
 }
 
+/*
+ * Output: mapping threads hand their finished output buffers to a writer thread,
+ * which puts them back in chunk order and writes them to stdout with writev().
+ * Buffers are pushed on a lock-free stack, and counted by a semaphore the writer
+ * waits on. The reader thread takes a slot of the output window before handing
+ * out a chunk, and the writer frees it once the chunk is written; this bounds
+ * the chunks waiting for output when stdout is slow.
+ */
+typedef struct out_chunk {
+  struct out_chunk *	next;
+  unsigned int		id;
+  struct ptr_and_sz	buf;	/* NUL-terminated output; NULL marks the end */
+} out_chunk;
+
+#define OUTPUT_IOV_MAX 64
+
+static struct {
+  out_chunk *		stack;
+  sem_t			pending;	/* chunks pushed on the stack */
+  sem_t			window;		/* chunks that can be handed out */
+  int			window_size;
+} oq;
+
+
+static void
+output_queue_push(unsigned int id, char * ptr, size_t sz)
+{
+  out_chunk * c = (out_chunk *)
+    my_malloc(sizeof(out_chunk),
+	      &mem_thread_buffer, "out_chunk");
+
+  c->id = id;
+  c->buf.ptr = ptr;
+  c->buf.sz = sz;
+  do {
+    c->next = oq.stack;
+  } while (!__sync_bool_compare_and_swap(&oq.stack, c->next, c));
+  sem_post(&oq.pending);
+}
+
+static void
+output_writev(int fd, struct iovec * iov, int n)
+{
+  ssize_t res;
+
+  while (n > 0) {
+    res = writev(fd, iov, n);
+    if (res < 0) {
+      if (errno == EINTR)
+	continue;
+      crash(1, 1, "could not write output");
+    }
+    while (n > 0 && (size_t)res >= iov->iov_len) {
+      res -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + res;
+      iov->iov_len -= res;
+    }
+  }
+}
+
+/*
+ * Write the chunks at the top of the heap that are next in order.
+ */
+static void
+output_write_in_order(struct heap_out * h, unsigned int * next_chunk_to_print)
+{
+  struct heap_out_elem tmp;
+  struct iovec iov[OUTPUT_IOV_MAX];
+  struct ptr_and_sz buf[OUTPUT_IOV_MAX];
+  int n = 0, i;
+
+  while (true) {
+    if (h->load > 0 && n < OUTPUT_IOV_MAX) {
+      heap_out_get_min(h, &tmp);
+      if (tmp.key == *next_chunk_to_print) {
+	heap_out_extract_min(h, &tmp);
+	buf[n] = tmp.rest;
+	iov[n].iov_base = tmp.rest.ptr;
+	iov[n].iov_len = tmp.rest.sz - 1;
+	n++;
+	(*next_chunk_to_print)++;
+	continue;
+      }
+    }
+    if (n == 0)
+      break;
+
+    output_writev(STDOUT_FILENO, iov, n);
+    for (i = 0; i < n; i++) {
+      my_free(buf[i].ptr, buf[i].sz,
+	      &mem_thread_buffer, "thread_output_buffer[]");
+      sem_post(&oq.window);
+    }
+    n = 0;
+  }
+}
+
+static void *
+output_writer(void *)
+{
+  struct heap_out h;
+  struct heap_out_elem tmp;
+  out_chunk * c, * next;
+  unsigned int next_chunk_to_print = 1;
+  bool done = false;
+
+  heap_out_init(&h, oq.window_size);
+  while (!done) {
+    while (sem_wait(&oq.pending) < 0 && errno == EINTR);
+
+    for (c = __sync_lock_test_and_set(&oq.stack, (out_chunk *)NULL); c != NULL; c = next) {
+      next = c->next;
+      if (c->buf.ptr == NULL) {
+	done = true;
+      } else {
+	tmp.key = c->id;
+	tmp.rest = c->buf;
+	heap_out_insert(&h, &tmp);
+      }
+      my_free(c, sizeof(out_chunk),
+	      &mem_thread_buffer, "out_chunk");
+    }
+    output_write_in_order(&h, &next_chunk_to_print);
+  }
+  assert(h.load == 0);
+  heap_out_destroy(&h);
+
+  return NULL;
+}
+
+static void
+output_queue_start(pthread_t * writer)
+{
+  // the headers were written through stdio
+  fflush(stdout);
+
+  oq.stack = NULL;
+  oq.window_size = (int)MIN(thread_output_heap_capacity, (unsigned int)(num_threads * DEF_OUTPUT_WINDOW_CHUNKS));
+  sem_init(&oq.pending, 0, 0);
+  sem_init(&oq.window, 0, oq.window_size);
+
+  if (pthread_create(writer, NULL, output_writer, NULL) != 0) {
+    crash(1, 1, "could not create writer thread");
+  }
+}
+
+static void
+output_queue_stop(pthread_t writer)
+{
+  output_queue_push(0, NULL, 0);
+  pthread_join(writer, NULL);
+
+  sem_destroy(&oq.window);
+  sem_destroy(&oq.pending);
+}
+
+
+/*
+ * Insert size learning: the chunks the pairs are learned from map with the
+ * configured windows, and chunks after them wait until the estimate is in, so
+ * the output does not depend on thread timing.
+ */
+static struct {
+  pthread_mutex_t	mutex;
+  pthread_cond_t	done;
+  unsigned int		n_chunks_done;
+} il;
+
+
+static int
+int_cmp(void const * a, void const * b)
+{
+  return *(int const *)a - *(int const *)b;
+}
+
+/*
+ * Estimate the insert size distribution from the sample, ignoring outliers
+ * beyond two interquartile ranges, then narrow the pairing windows to the
+ * learned mean +/- DEF_INSERT_LEARN_SIGMAS stddevs. Windows only shrink.
+ */
+static void
+insert_learn_apply()
+{
+  int n = insert_learn_load, q1, q3, lo, hi, i, j, cnt;
+  double sum, sumsq, mean, stddev;
+
+  if (n < DEF_INSERT_LEARN_MIN) {
+    logit(0, "only %d confident pairs to learn insert sizes from; keeping the configured ones", n);
+    return;
+  }
+  qsort(insert_learn_sample, n, sizeof(insert_learn_sample[0]), int_cmp);
+  q1 = insert_learn_sample[n / 4];
+  q3 = insert_learn_sample[3 * n / 4];
+  lo = q1 - 2 * (q3 - q1);
+  hi = q3 + 2 * (q3 - q1);
+
+  cnt = 0;
+  sum = sumsq = 0;
+  for (i = 0; i < n; i++) {
+    if (insert_learn_sample[i] < lo || insert_learn_sample[i] > hi)
+      continue;
+    cnt++;
+    sum += insert_learn_sample[i];
+    sumsq += (double)insert_learn_sample[i] * insert_learn_sample[i];
+  }
+  mean = sum / cnt;
+  // no real library is tighter than a few percent of its mean; simulated ones can be
+  stddev = MAX(sqrt(MAX(sumsq / cnt - mean * mean, 0.0)), MAX(0.05 * mean, 1.0));
+
+  lo = (int)floor(mean - DEF_INSERT_LEARN_SIGMAS * stddev);
+  hi = (int)ceil(mean + DEF_INSERT_LEARN_SIGMAS * stddev);
+  for (j = 0; j < n_paired_mapping_options; j++) {
+    struct pairing_options * po = &paired_mapping_options[j].pairing;
+    po->min_insert_size = MAX(po->min_insert_size, lo);
+    po->max_insert_size = MAX(MIN(po->max_insert_size, hi), po->min_insert_size);
+  }
+  if (!insert_size_dist_given) {
+    insert_size_mean = mean;
+    insert_size_stddev = stddev;
+  }
+
+  insert_learned_pairs = cnt;
+  insert_learned_mean = mean;
+  insert_learned_stddev = stddev;
+  logit(0, "learned insert sizes from %d pairs: mean %.1f, stddev %.1f; pairing window min:%d max:%d",
+	cnt, mean, stddev, paired_mapping_options[0].pairing.min_insert_size,
+	paired_mapping_options[0].pairing.max_insert_size);
+}
+
+static void
+insert_learn_chunk_done()
+{
+  pthread_mutex_lock(&il.mutex);
+  if (++il.n_chunks_done == insert_learn_chunks) {
+    insert_learn_apply();
+    insert_learn_done = true;
+    pthread_cond_broadcast(&il.done);
+  }
+  pthread_mutex_unlock(&il.mutex);
+}
+
+static void
+insert_learn_wait()
+{
+  pthread_mutex_lock(&il.mutex);
+  while (!insert_learn_done)
+    pthread_cond_wait(&il.done, &il.mutex);
+  pthread_mutex_unlock(&il.mutex);
+}
+
+
+/*
+ * Read ingestion: a reader thread parses the input into chunks of reads, which the
+ * mapping threads take from a bounded queue. The chunk buffers cycle between a
+ * free list and the queue, so the reader is at most n_chunks chunks ahead.
+ */
+typedef struct read_chunk {
+  struct read_entry *	re;
+  my_arena		text;	/* the names, sequences and qualities of re[] */
+  int			load;
+  unsigned int		id;	/* chunks are numbered in input order, from 1 */
+} read_chunk;
+
+static struct {
+  pthread_mutex_t	mutex;
+  pthread_cond_t	chunk_ready;	/* a chunk was queued, or the input ended */
+  pthread_cond_t	buffer_free;	/* a buffer was returned to the free list */
+  read_chunk *		chunks;
+  int			n_chunks;
+  read_chunk * *	free_list;
+  int			n_free;
+  read_chunk * *	queue;		/* ring buffer of full chunks */
+  int			queue_head;
+  int			queue_load;
+  bool			done;
+  fasta_t		fasta;
+  fasta_t		left_fasta;
+  fasta_t		right_fasta;
+} rq;
+
+
+static void *
+read_queue_reader(void *)
+{
+  read_chunk * c;
+  unsigned int next_id = 1;
+  // reads that are not trimmed can be packed as they are parsed
+  bool pack = !trim && !(shrimp_mode == MODE_LETTER_SPACE && trim_illumina);
+  bool read_more = true, more_in_left_file = true, more_in_right_file = true;
+  llint last_nreads = 0, last_time_usecs = gettimeinusecs();
+
+  while (read_more) {
+    pthread_mutex_lock(&rq.mutex);
+    while (rq.n_free == 0)
+      pthread_cond_wait(&rq.buffer_free, &rq.mutex);
+    c = rq.free_list[--rq.n_free];
+    pthread_mutex_unlock(&rq.mutex);
+
+    memset(c->re, 0, chunk_size * sizeof(c->re[0]));
+    my_arena_reset(&c->text);
+    c->load = 0;
+    assert(chunk_size>2);
+    while (read_more && ((single_reads_file && c->load < chunk_size) || (!single_reads_file && c->load < chunk_size-1))) {
+      if (single_reads_file) {
+	if (fasta_get_next_read_block(rq.fasta, &c->re[c->load], &c->text, pack)) {
+	  c->load++;
+	} else {
+	  read_more = false;
+	}
+      } else {
+	//read from the left file
+	if (fasta_get_next_read_block(rq.left_fasta, &c->re[c->load], &c->text, pack)) {
+	  c->load++;
+	} else {
+	  more_in_left_file = false;
+	}
+	//read from the right file
+	if (fasta_get_next_read_block(rq.right_fasta, &c->re[c->load], &c->text, pack)) {
+	  c->load++;
+	} else {
+	  more_in_right_file = false;
+	}
+	//make sure that one is not smaller then the other
+	if (more_in_left_file != more_in_right_file) {
+	  fprintf(stderr,"error: when using options -1 and -2, both files specified must have the same number of entries\n");
+	  exit(1);
+	}
+	//keep reading?
+	read_more = more_in_left_file && more_in_right_file;
+      }
+    }
+
+    nreads += c->load;
+
+    // progress reporting
+    if (progress > 0) {
+      nreads_mod += c->load;
+      if (nreads_mod >= progress) {
+	llint time_usecs = gettimeinusecs();
+#pragma omp critical (cs_stderr)
+	{
+	fprintf(stderr, "%lld %d %d.\r", nreads,
+		(int)(((double)(nreads - last_nreads)/(double)(time_usecs - last_time_usecs)) * 3600.0 * 1.0e6),
+		(int)(((double)(nreads - last_nreads)/(double)(time_usecs - last_time_usecs)) * 3600.0 * 1.0e6 * (1/(double)num_threads)) );
+	}
+	last_nreads = nreads;
+	last_time_usecs = time_usecs;
+      }
+      nreads_mod %= progress;
+    }
+
+    if (c->load > 0) {
+      while (sem_wait(&oq.window) < 0 && errno == EINTR);
+    }
+
+    pthread_mutex_lock(&rq.mutex);
+    if (c->load > 0) {
+      c->id = next_id++;
+      rq.queue[(rq.queue_head + rq.queue_load) % rq.n_chunks] = c;
+      rq.queue_load++;
+      pthread_cond_signal(&rq.chunk_ready);
+    } else {
+      rq.free_list[rq.n_free++] = c;
+    }
+    pthread_mutex_unlock(&rq.mutex);
+  }
+
+  pthread_mutex_lock(&rq.mutex);
+  rq.done = true;
+  pthread_cond_broadcast(&rq.chunk_ready);
+  pthread_mutex_unlock(&rq.mutex);
+
+  return NULL;
+}
+
+/*
+ * Next chunk of reads, or NULL at the end of the input.
+ */
+static read_chunk *
+read_queue_get()
+{
+  read_chunk * c = NULL;
+
+  pthread_mutex_lock(&rq.mutex);
+  while (rq.queue_load == 0 && !rq.done)
+    pthread_cond_wait(&rq.chunk_ready, &rq.mutex);
+  if (rq.queue_load > 0) {
+    c = rq.queue[rq.queue_head];
+    rq.queue_head = (rq.queue_head + 1) % rq.n_chunks;
+    rq.queue_load--;
+  }
+  pthread_mutex_unlock(&rq.mutex);
+
+  return c;
+}
+
+static void
+read_queue_put_back(read_chunk * c)
+{
+  pthread_mutex_lock(&rq.mutex);
+  rq.free_list[rq.n_free++] = c;
+  pthread_cond_signal(&rq.buffer_free);
+  pthread_mutex_unlock(&rq.mutex);
+}
+
+static void
+read_queue_start(fasta_t fasta, fasta_t left_fasta, fasta_t right_fasta, pthread_t * reader)
+{
+  int i;
+
+  memset(&rq, 0, sizeof(rq));
+  pthread_mutex_init(&rq.mutex, NULL);
+  pthread_cond_init(&rq.chunk_ready, NULL);
+  pthread_cond_init(&rq.buffer_free, NULL);
+  rq.fasta = fasta;
+  rq.left_fasta = left_fasta;
+  rq.right_fasta = right_fasta;
+
+  rq.n_chunks = num_threads * DEF_READ_QUEUE_CHUNKS;
+  rq.chunks = (read_chunk *)
+    my_malloc(rq.n_chunks * sizeof(rq.chunks[0]),
+	      &mem_thread_buffer, "read_queue chunks");
+  rq.free_list = (read_chunk * *)
+    my_malloc(rq.n_chunks * sizeof(rq.free_list[0]),
+	      &mem_thread_buffer, "read_queue free_list");
+  rq.queue = (read_chunk * *)
+    my_malloc(rq.n_chunks * sizeof(rq.queue[0]),
+	      &mem_thread_buffer, "read_queue queue");
+  for (i = 0; i < rq.n_chunks; i++) {
+    rq.chunks[i].re = (read_entry *)
+      my_malloc(chunk_size * sizeof(rq.chunks[i].re[0]),
+		&mem_thread_buffer, "re_buffer");
+    my_arena_init(&rq.chunks[i].text, DEF_READ_TEXT_BLOCK_SIZE, &mem_thread_buffer);
+    rq.free_list[rq.n_free++] = &rq.chunks[i];
+  }
+
+  if (pthread_create(reader, NULL, read_queue_reader, NULL) != 0) {
+    crash(1, 1, "could not create reader thread");
+  }
+}
+
+static void
+read_queue_stop(pthread_t reader)
+{
+  int i;
+
+  pthread_join(reader, NULL);
+  assert(rq.n_free == rq.n_chunks);
+
+  for (i = 0; i < rq.n_chunks; i++) {
+    my_free(rq.chunks[i].re, chunk_size * sizeof(rq.chunks[i].re[0]),
+	    &mem_thread_buffer, "re_buffer");
+    my_arena_destroy(&rq.chunks[i].text);
+  }
+  my_free(rq.queue, rq.n_chunks * sizeof(rq.queue[0]),
+	  &mem_thread_buffer, "read_queue queue");
+  my_free(rq.free_list, rq.n_chunks * sizeof(rq.free_list[0]),
+	  &mem_thread_buffer, "read_queue free_list");
+  my_free(rq.chunks, rq.n_chunks * sizeof(rq.chunks[0]),
+	  &mem_thread_buffer, "read_queue chunks");
+  pthread_cond_destroy(&rq.buffer_free);
+  pthread_cond_destroy(&rq.chunk_ready);
+  pthread_mutex_destroy(&rq.mutex);
+}
+
+
+/*
+ * Get read i of the chunk ready for mapping: trimming, quality checks, the
+ * packed sequences and, once the second read of a pair is in, the pair itself.
+ * Returns false if the read (or pair) is dropped and has been freed.
+ */
+static bool
+read_prepare(fasta_t fasta, struct read_entry * re_buffer, int i)
+{
+  // if running in paired mode and first foot is ignored, ignore this one, too
+  if (pair_mode != PAIR_NONE && i % 2 == 1 && re_buffer[i-1].ignore) {
+    //read_free(&re_buffer[i-1]);
+    free(re_buffer[i].read[0]); // if packed by the parser
+    read_free(&re_buffer[i]);
+    return false;
+  }
+
+  //if (!(strcspn(re_buffer[i].seq, "nNxX.") == strlen(re_buffer[i].seq))) {
+  //  if (pair_mode != PAIR_NONE && i % 2 == 1) {
+  //    read_free(re_buffer+i-1);
+  //    read_free(re_buffer+i);
+  //  }
+  //  return false;
+  //}
+  
+  //Trim the reads
+  if (trim) {
+    if (pair_mode != PAIR_NONE) {
+      if ((i % 2 == 0 && trim_first) || (i % 2 == 1 && trim_second)) {
+	trim_read(&re_buffer[i]);
+      }
+    } else {
+      trim_read(&re_buffer[i]);
+    }
+  }
+  if (shrimp_mode == MODE_LETTER_SPACE && trim_illumina) { 
+	int trailing_Bs=0;
+	int qual_len=strlen(re_buffer[i].qual);
+	for (int j=0; j<qual_len; j++) {
+		if (re_buffer[i].qual[j]!='B') {
+			trailing_Bs=0;
+		} else {
+			trailing_Bs+=1;
+		}
+	}
+	if (trailing_Bs>0) {
+		re_buffer[i].seq[strlen(re_buffer[i].seq)-trailing_Bs]='\0';
+		re_buffer[i].qual[qual_len-trailing_Bs]='\0';
+	}
+  }
+  //compute average quality value; the parser knows the length of untrimmed reads
+  if (trim || (shrimp_mode == MODE_LETTER_SPACE && trim_illumina))
+    re_buffer[i].read_len = strlen(re_buffer[i].seq);
+  if (Qflag && !ignore_qvs && min_avg_qv >= 0) {
+    //fprintf(stderr, "read:[%s] qual:[%s]", re_buffer[i].name, re_buffer[i].qual);
+    re_buffer[i].avg_qv = 0;
+    for (char * c = re_buffer[i].qual; *c != 0; c++) {
+      re_buffer[i].avg_qv += (*c - qual_delta);
+    }
+    //fprintf(stderr, " avg_qv:%d\n", re_buffer[i].avg_qv);
+  }
+  if (Qflag && !ignore_qvs && !no_qv_check) {
+	for (char * c =re_buffer[i].qual; *c !=0; c++) {
+		int qual_value=(*c-qual_delta);
+		if (qual_value<-10 || qual_value>50) {
+			fprintf(stderr,"The qv-offset might be set incorrectly! Currenty qvs are interpreted as PHRED+%d\
+ and a qv of %d was observed. To disable this error, etiher set the offset correctly or disable this check (see README).\n",qual_delta,qual_value);
+			exit(1);
+		}
+	}
+  }
+
+  re_buffer[i].max_n_kmers = re_buffer[i].read_len - min_seed_span + 1;
+  if (re_buffer[i].read[0] == NULL)
+    re_buffer[i].read[0] = fasta_sequence_to_bitfield(fasta, re_buffer[i].seq);
+  if (shrimp_mode == MODE_COLOUR_SPACE) {
+    re_buffer[i].read_len--;
+    re_buffer[i].max_n_kmers -= 2; // 1st color always discarded from kmers
+    re_buffer[i].min_kmer_pos = 1;
+    re_buffer[i].initbp[0] = fasta_get_initial_base(shrimp_mode,re_buffer[i].seq);
+    re_buffer[i].initbp[1] = re_buffer[i].initbp[0];
+    re_buffer[i].read[1] = reverse_complement_read_cs(re_buffer[i].read[0], (int8_t)re_buffer[i].initbp[0],
+						    (int8_t)re_buffer[i].initbp[1],
+						    re_buffer[i].read_len, re_buffer[i].is_rna);
+  } else {
+    re_buffer[i].read[1] = reverse_complement_read_ls(re_buffer[i].read[0], re_buffer[i].read_len, re_buffer[i].is_rna);
+  }
+  if (re_buffer[i].max_n_kmers < 0)
+    re_buffer[i].max_n_kmers = 0;
+  if (re_buffer[i].read_len > 0)
+    re_buffer[i].avg_qv /= re_buffer[i].read_len;
+
+  //Check if we can actually use this read
+  if (//re_buffer[i].max_n_kmers <= 0
+      //|| 
+      re_buffer[i].read_len > longest_read_len
+      || (Qflag && !ignore_qvs && re_buffer[i].avg_qv < min_avg_qv) // ignore reads with low avg qv
+      ) {
+    if (re_buffer[i].max_n_kmers <= 0) {
+      fprintf(stderr, "warning: skipping read [%s]; smaller then any seed!\n",
+	    re_buffer[i].name);
+      re_buffer[i].max_n_kmers=1;
+    } else if (re_buffer[i].read_len > longest_read_len) {
+      fprintf(stderr, "warning: skipping read [%s]; it has length %d, maximum allowed is %d. Use --longest-read ?\n",
+	    re_buffer[i].name, re_buffer[i].read_len, longest_read_len);
+    } else {
+      //fprintf(stderr, "skipping read [%s] with avg_qv:%g\n", re_buffer[i].name, (double)re_buffer[i].avg_qv);
+    }
+    if (pair_mode == PAIR_NONE) {
+      #pragma omp atomic
+      total_reads_dropped++;
+
+      read_free_full(&re_buffer[i], &read_arena);
+    } else {
+      #pragma omp atomic
+      total_pairs_dropped++;
+
+      if (i%2 == 1) {
+	read_free_full(&re_buffer[i-1], &read_arena);
+	read_free_full(&re_buffer[i], &read_arena);
+      } else {
+	read_free_full(&re_buffer[i], &read_arena);
+	re_buffer[i].ignore = true;
+      }
+    }
+    return false;       
+  }
+
+  re_buffer[i].window_len = (uint16_t)abs_or_pct(window_len,re_buffer[i].read_len);
+  // compute position-based crossover scores based on qvs
+  if (shrimp_mode == MODE_COLOUR_SPACE && Qflag && !ignore_qvs) {
+    int j;
+
+    re_buffer[i].crossover_score = (int *)xmalloc(re_buffer[i].read_len * sizeof(re_buffer[i].crossover_score[0]));
+    for (j = 0; j < re_buffer[i].read_len; j++) {
+      re_buffer[i].crossover_score[j] = (int)(score_alpha * log(pr_err_from_qv(re_buffer[i].qual[j] - qual_delta) / 3.0) / log(2.0));
+      if (re_buffer[i].crossover_score[j] > -1) {
+	re_buffer[i].crossover_score[j] = -1;
+      } else if (re_buffer[i].crossover_score[j] < 2*crossover_score) {
+	re_buffer[i].crossover_score[j] = 2*crossover_score;
+      }
+    }
+  }
+
+  if (re_buffer[i].range_string != NULL) {
+    assert(0); // not maintained
+    //read_compute_ranges(&re_buffer[i]);
+    re_buffer[i].range_string = NULL;
+  }
+  //free(re_buffer[i].seq);
+
+  if (pair_mode != PAIR_NONE && i % 2 == 1) {
+    if (pair_reverse[pair_mode][0])
+      read_reverse(&re_buffer[i-1]);
+    if (pair_reverse[pair_mode][1])
+      read_reverse(&re_buffer[i]);
+    re_buffer[i-1].paired=true;
+    re_buffer[i-1].first_in_pair=true;
+    re_buffer[i-1].mate_pair=&re_buffer[i];
+    re_buffer[i].paired=true;
+    re_buffer[i].first_in_pair=false;
+    re_buffer[i].mate_pair=&re_buffer[i-1];
+  }
+  return true;
+}
+
+
 /*
  * Launch the threads that will scan the reads
  */
 static bool
 launch_scan_threads(fasta_t fasta, fasta_t left_fasta, fasta_t right_fasta)
 {
-  llint last_nreads, last_time_usecs;
-
-  bool read_more = true, more_in_left_file = true, more_in_right_file=true;
+  pthread_t reader, writer;
 
   /* initiate the thread buffers */
   //thread_output_buffer_sizes = (size_t *)xcalloc_m(sizeof(size_t) * num_threads, "thread_output_buffer_sizes");
@@ -308,98 +939,46 @@ launch_scan_threads(fasta_t fasta, fasta_t left_fasta, fasta_t right_fasta)
     my_calloc(num_threads * sizeof(unsigned int),
 	      &mem_thread_buffer, "thread_output_buffer_chunk");
   
-  unsigned int current_thread_chunk = 1;
-  unsigned int next_chunk_to_print = 1;
-  struct heap_out h; 
-  heap_out_init(&h, thread_output_heap_capacity );
-
   if (progress > 0) {
     fprintf(stderr, "done r/hr r/core-hr\n");
-    last_nreads = 0;
-    last_time_usecs = gettimeinusecs();
   }
 
-#pragma omp parallel shared(read_more,more_in_left_file,more_in_right_file, fasta) num_threads(num_threads)
+  output_queue_start(&writer);
+  read_queue_start(fasta, left_fasta, right_fasta, &reader);
+
+#pragma omp parallel shared(fasta) num_threads(num_threads)
   {
     int thread_id = omp_get_thread_num();
     struct read_entry * re_buffer;
-    int load, i;
-    //llint before, after;
-    //re_buffer = (struct read_entry *)xmalloc_m(chunk_size * sizeof(re_buffer[0]), "re_buffer");
-    re_buffer = (read_entry *)my_malloc(chunk_size * sizeof(re_buffer[0]), &mem_thread_buffer, "re_buffer");
+    read_chunk * c;
+    int load, i, b;
 
-    while (read_more) {
-      memset(re_buffer, 0, chunk_size * sizeof(re_buffer[0]));
+    my_arena_init(&read_arena, DEF_READ_ARENA_BLOCK, &mem_mapping);
 
+    while (true) {
       //before = rdtsc();
       TIME_COUNTER_START(tpg.wait_tc);
 
-      //Read in this threads 'chunk'
-#pragma omp critical (fill_reads_buffer)
-      {
-	//after = rdtsc();
-	//tpg.wait_ticks += MAX(after - before, 0);
-	TIME_COUNTER_STOP(tpg.wait_tc);
-
-	thread_output_buffer_chunk[thread_id]=current_thread_chunk++;
-
-	load = 0;
-	assert(chunk_size>2);
-	while (read_more && ((single_reads_file && load < chunk_size) || (!single_reads_file && load < chunk_size-1))) {
-	  //if (!fasta_get_next_with_range(fasta, &re_buffer[load].name, &re_buffer[load].seq, &re_buffer[load].is_rna,
-	  //				 &re_buffer[load].range_string, &re_buffer[load].qual))
-	  if (single_reads_file) { 
-	    if (fasta_get_next_read_with_range(fasta, &re_buffer[load])) {
-	      load++;
-	    } else { 
-	      read_more = false;
-	    }
-	  } else {
-	    //read from the left file
-	    if (fasta_get_next_read_with_range(left_fasta, &re_buffer[load])) {
-	      load++;
-	    } else {
-	      more_in_left_file = false;
-	    }
-	    //read from the right file
-	    if (fasta_get_next_read_with_range(right_fasta, &re_buffer[load])) {
-	      load++;
-	    } else {
-	      more_in_right_file = false;
-	    }
-	    //make sure that one is not smaller then the other
-	    if (more_in_left_file != more_in_right_file) {
-	      fprintf(stderr,"error: when using options -1 and -2, both files specified must have the same number of entries\n");
-	      exit(1);
-	    }
-	    //keep reading?
-	    read_more = more_in_left_file && more_in_right_file; 
-	  }
-	}
+      // get the next chunk from the reader thread
+      c = read_queue_get();
+      TIME_COUNTER_STOP(tpg.wait_tc);
+      if (c == NULL)
+	break;
 
-	nreads += load;
+      // past the learning chunks, map with the learned insert sizes
+      if (insert_learn_chunks > 0 && c->id > insert_learn_chunks)
+	insert_learn_wait();
 
-	// progress reporting
-	if (progress > 0) {
-	  nreads_mod += load;
-	  if (nreads_mod >= progress) {
-	    llint time_usecs = gettimeinusecs();
-#pragma omp critical (cs_stderr)
-	    {
-	    fprintf(stderr, "%lld %d %d.\r", nreads,
-		    (int)(((double)(nreads - last_nreads)/(double)(time_usecs - last_time_usecs)) * 3600.0 * 1.0e6),
-		    (int)(((double)(nreads - last_nreads)/(double)(time_usecs - last_time_usecs)) * 3600.0 * 1.0e6 * (1/(double)num_threads)) );
-	    }
-	    last_nreads = nreads;
-	    last_time_usecs = time_usecs;
-	  }
-	  nreads_mod %= progress;
-	}
-      } // end critical section
+      re_buffer = c->re;
+      load = c->load;
+      thread_output_buffer_chunk[thread_id] = c->id;
 
       if (pair_mode != PAIR_NONE)
 	assert(load % 2 == 0); // read even number of reads
 
+      // the mapping state of the previous chunk is all gone
+      my_arena_reset(&read_arena);
+
       thread_output_buffer_sizes[thread_id] = thread_output_buffer_initial;
       //thread_output_buffer[thread_id] = (char *)xmalloc_m(sizeof(char) * thread_output_buffer_sizes[thread_id], "thread_buffer");
       thread_output_buffer[thread_id] = (char *)
@@ -408,174 +987,76 @@ launch_scan_threads(fasta_t fasta, fasta_t left_fasta, fasta_t right_fasta)
       thread_output_buffer_filled[thread_id] = thread_output_buffer[thread_id];
       thread_output_buffer[thread_id][0] = '\0';
 
-      for (i = 0; i < load; i++) {
-	// if running in paired mode and first foot is ignored, ignore this one, too
-	if (pair_mode != PAIR_NONE && i % 2 == 1 && re_buffer[i-1].ignore) {
-	  //read_free(&re_buffer[i-1]);
-	  read_free(&re_buffer[i]);
-	  continue;
-	}
-
-	//if (!(strcspn(re_buffer[i].seq, "nNxX.") == strlen(re_buffer[i].seq))) {
-	//  if (pair_mode != PAIR_NONE && i % 2 == 1) {
-	//    read_free(re_buffer+i-1);
-	//    read_free(re_buffer+i);
-	//  }
-	//  continue;
-	//}
-	
-	//Trim the reads
-	if (trim) {
-	  if (pair_mode != PAIR_NONE) {
-	    if (trim_first) {
-	      trim_read(&re_buffer[i-1]);
-	    }
-	    if (trim_second) {
-	      trim_read(&re_buffer[i]);
-	    }
-	  } else {
-	    trim_read(&re_buffer[i]);
-	  }
-	}
-        if (shrimp_mode == MODE_LETTER_SPACE && trim_illumina) { 
-		int trailing_Bs=0;
-		for (int j=0; j<(int)strlen(re_buffer[i].qual); j++) {
-			if (re_buffer[i].qual[j]!='B') {
-				trailing_Bs=0;
-			} else {
-				trailing_Bs+=1;
-			}
-		}
-		if (trailing_Bs>0) {
-			re_buffer[i].seq[strlen(re_buffer[i].seq)-trailing_Bs]='\0';
-			re_buffer[i].qual[strlen(re_buffer[i].qual)-trailing_Bs]='\0';
-		}
-	}
-	//compute average quality value
-	re_buffer[i].read_len = strlen(re_buffer[i].seq);
-	if (Qflag && !ignore_qvs && min_avg_qv >= 0) {
-	  //fprintf(stderr, "read:[%s] qual:[%s]", re_buffer[i].name, re_buffer[i].qual);
-	  re_buffer[i].avg_qv = 0;
-	  for (char * c = re_buffer[i].qual; *c != 0; c++) {
-	    re_buffer[i].avg_qv += (*c - qual_delta);
+      /*
+       * Reads go through in batches: all the reads of a batch are prepared and
+       * their kmers extracted first, then, while a read is mapped, the genome
+       * map lists of the next one are prefetched. Reads still map one at a time
+       * and in order, so the output is the same for any batch size.
+       */
+      for (b = 0; b < load; b += read_batch) {
+	int end = MIN(load, b + read_batch);
+	bool ready[read_batch];
+
+	for (i = b; i < end; i++)
+	  ready[i - b] = read_prepare(fasta, re_buffer, i);
+
+	// the kmers of reads (or pairs) still in
+	for (i = b; i < end; i++) {
+	  if (pair_mode == PAIR_NONE && ready[i - b])
+	    read_get_kmers(&re_buffer[i]);
+	  else if (i % 2 == 1 && ready[i - b]) {
+	    read_get_kmers(&re_buffer[i-1]);
+	    read_get_kmers(&re_buffer[i]);
 	  }
-	  //fprintf(stderr, " avg_qv:%d\n", re_buffer[i].avg_qv);
 	}
-	if (Qflag && !ignore_qvs && !no_qv_check) {
-		for (char * c =re_buffer[i].qual; *c !=0; c++) {
-			int qual_value=(*c-qual_delta);
-			if (qual_value<-10 || qual_value>50) {
-				fprintf(stderr,"The qv-offset might be set incorrectly! Currenty qvs are interpreted as PHRED+%d\
- and a qv of %d was observed. To disable this error, etiher set the offset correctly or disable this check (see README).\n",qual_delta,qual_value);
-				exit(1);
-			}
-		}
-	}
-
-	re_buffer[i].max_n_kmers = re_buffer[i].read_len - min_seed_span + 1;
-	re_buffer[i].read[0] = fasta_sequence_to_bitfield(fasta, re_buffer[i].seq);
-	if (shrimp_mode == MODE_COLOUR_SPACE) {
-	  re_buffer[i].read_len--;
-	  re_buffer[i].max_n_kmers -= 2; // 1st color always discarded from kmers
-	  re_buffer[i].min_kmer_pos = 1;
-	  re_buffer[i].initbp[0] = fasta_get_initial_base(shrimp_mode,re_buffer[i].seq);
-	  re_buffer[i].initbp[1] = re_buffer[i].initbp[0];
-	  re_buffer[i].read[1] = reverse_complement_read_cs(re_buffer[i].read[0], (int8_t)re_buffer[i].initbp[0],
-							    (int8_t)re_buffer[i].initbp[1],
-							    re_buffer[i].read_len, re_buffer[i].is_rna);
-	} else {
-	  re_buffer[i].read[1] = reverse_complement_read_ls(re_buffer[i].read[0], re_buffer[i].read_len, re_buffer[i].is_rna);
-	}
-	if (re_buffer[i].max_n_kmers < 0)
-	  re_buffer[i].max_n_kmers = 0;
-	if (re_buffer[i].read_len > 0)
-	  re_buffer[i].avg_qv /= re_buffer[i].read_len;
-
-	//Check if we can actually use this read
-	if (//re_buffer[i].max_n_kmers <= 0
-	    //|| 
-	    re_buffer[i].read_len > longest_read_len
-	    || (Qflag && !ignore_qvs && re_buffer[i].avg_qv < min_avg_qv) // ignore reads with low avg qv
-	    ) {
-	  if (re_buffer[i].max_n_kmers <= 0) {
-	    fprintf(stderr, "warning: skipping read [%s]; smaller then any seed!\n",
-		    re_buffer[i].name);
-	    re_buffer[i].max_n_kmers=1;
-	  } else if (re_buffer[i].read_len > longest_read_len) {
-	    fprintf(stderr, "warning: skipping read [%s]; it has length %d, maximum allowed is %d. Use --longest-read ?\n",
-		    re_buffer[i].name, re_buffer[i].read_len, longest_read_len);
-	  } else {
-	    //fprintf(stderr, "skipping read [%s] with avg_qv:%g\n", re_buffer[i].name, (double)re_buffer[i].avg_qv);
-	  }
-	  if (pair_mode == PAIR_NONE) {
-	    #pragma omp atomic
-	    total_reads_dropped++;
 
-	    read_free_full(&re_buffer[i], &mem_mapping);
-	  } else {
-	    #pragma omp atomic
-	    total_pairs_dropped++;
+	for (i = b; i < end; i++) {
+	  if (!ready[i - b])
+	    continue;
 
-	    if (i%2 == 1) {
-	      read_free_full(&re_buffer[i-1], &mem_mapping);
-	      read_free_full(&re_buffer[i], &mem_mapping);
-	    } else {
-	      read_free_full(&re_buffer[i], &mem_mapping);
-	      re_buffer[i].ignore = true;
+	  // time to do some mapping!
+	  if (pair_mode == PAIR_NONE)
+	    {
+	      if (i + 1 < end && ready[i + 1 - b])
+		read_prefetch(&re_buffer[i + 1]);
+	      handle_read(&re_buffer[i], unpaired_mapping_options[0], n_unpaired_mapping_options[0]);
+	      read_free_full(&re_buffer[i], &read_arena);
 	    }
-	  }
-	  continue;	
-	}
-
-	re_buffer[i].window_len = (uint16_t)abs_or_pct(window_len,re_buffer[i].read_len);
-	// compute position-based crossover scores based on qvs
-	if (shrimp_mode == MODE_COLOUR_SPACE && Qflag && !ignore_qvs) {
-	  int j;
-
-	  re_buffer[i].crossover_score = (int *)xmalloc(re_buffer[i].read_len * sizeof(re_buffer[i].crossover_score[0]));
-	  for (j = 0; j < re_buffer[i].read_len; j++) {
-	    re_buffer[i].crossover_score[j] = (int)(score_alpha * log(pr_err_from_qv(re_buffer[i].qual[j] - qual_delta) / 3.0) / log(2.0));
-	    if (re_buffer[i].crossover_score[j] > -1) {
-	      re_buffer[i].crossover_score[j] = -1;
-	    } else if (re_buffer[i].crossover_score[j] < 2*crossover_score) {
-	      re_buffer[i].crossover_score[j] = 2*crossover_score;
+	  else if (i % 2 == 1)
+	    {
+	      pair_entry pe;
+	      memset(&pe, 0, sizeof(pe));
+	      if (i + 2 < end && ready[i + 2 - b]) {
+		read_prefetch(&re_buffer[i + 1]);
+		read_prefetch(&re_buffer[i + 2]);
+	      }
+	      pe.re[0] = &re_buffer[i-1];
+	      pe.re[1] = &re_buffer[i];
+	      handle_readpair(&pe, paired_mapping_options, n_paired_mapping_options);
+	      readpair_free_full(&pe, &read_arena);
 	    }
-	  }
 	}
-
-	if (re_buffer[i].range_string != NULL) {
-	  assert(0); // not maintained
-	  //read_compute_ranges(&re_buffer[i]);
-	  free(re_buffer[i].range_string);
-	  re_buffer[i].range_string = NULL;
-	}
-	//free(re_buffer[i].seq);
-
-	// time to do some mapping!
-	if (pair_mode == PAIR_NONE)
-	  {
-	    handle_read(&re_buffer[i], unpaired_mapping_options[0], n_unpaired_mapping_options[0]);
-	    read_free_full(&re_buffer[i], &mem_mapping);
-	  }
-	else if (i % 2 == 1)
-	  {
-	    pair_entry pe;
-	    memset(&pe, 0, sizeof(pe));
-	    if (pair_reverse[pair_mode][0])
-	      read_reverse(&re_buffer[i-1]);
-	    if (pair_reverse[pair_mode][1])
-	      read_reverse(&re_buffer[i]);
-	    re_buffer[i-1].paired=true;
-	    re_buffer[i-1].first_in_pair=true;
-	    re_buffer[i-1].mate_pair=&re_buffer[i];
-	    re_buffer[i].paired=true;
-	    re_buffer[i].first_in_pair=false;
-	    re_buffer[i].mate_pair=&re_buffer[i-1];
-	    pe.re[0] = &re_buffer[i-1];
-	    pe.re[1] = &re_buffer[i];
-	    handle_readpair(&pe, paired_mapping_options, n_paired_mapping_options);
-	    readpair_free_full(&pe, &mem_mapping);
-	  }
+      }
+      if (thread_output_buffer_chunk[thread_id] <= insert_learn_chunks)
+	insert_learn_chunk_done();
+      read_queue_put_back(c);
+
+      if (bam_output) {
+	// compress the chunk here, so the writer thread only copies bytes
+	size_t len = thread_output_buffer_filled[thread_id] - thread_output_buffer[thread_id];
+	size_t bgzf_size = bgzf_bound(len) + 1;
+	char * bgzf = (char *)
+	  my_malloc(bgzf_size, &mem_thread_buffer, "thread_output_buffer[]");
+	ssize_t res = bgzf_compress(bgzf, thread_output_buffer[thread_id], len, bam_compression_level);
+	if (res < 0) {
+	  crash(1, 0, "BGZF compression failed");
+	}
+	bgzf[res] = '\0';
+	my_free(thread_output_buffer[thread_id], thread_output_buffer_sizes[thread_id],
+		&mem_thread_buffer, "thread_output_buffer[]");
+	thread_output_buffer[thread_id] = bgzf;
+	thread_output_buffer_sizes[thread_id] = bgzf_size;
+	thread_output_buffer_filled[thread_id] = bgzf + res;
       }
 
       // free unused memory while the buffer waits in the output heap
@@ -584,49 +1065,19 @@ launch_scan_threads(fasta_t fasta, fasta_t left_fasta, fasta_t right_fasta)
 	my_realloc(thread_output_buffer[thread_id], new_size, thread_output_buffer_sizes[thread_id],
 		   &mem_thread_buffer, "thread_output_buffer[]");
 
-      //fprintf(stdout,"%s",thread_output_buffer[thread_id]);
-#pragma omp critical
-      {
-	struct heap_out_elem tmp;
-	tmp.key = thread_output_buffer_chunk[thread_id];
-	//tmp.rest = thread_output_buffer[thread_id];
-	tmp.rest.ptr = thread_output_buffer[thread_id];
-	tmp.rest.sz = new_size; //thread_output_buffer_sizes[thread_id];
-	thread_output_buffer[thread_id] = NULL;	
-	heap_out_insert(&h, &tmp);
-	heap_out_get_min(&h, &tmp);
-	while (h.load > 0 && tmp.key == next_chunk_to_print) {
-	  heap_out_extract_min(&h, &tmp);
-	  //fprintf(stdout, "%s", tmp.rest);
-	  fprintf(stdout, "%s", (char *)tmp.rest.ptr);
-	  //free(tmp.rest);
-	  my_free(tmp.rest.ptr, tmp.rest.sz,
-		  &mem_thread_buffer, "thread_output_buffer[]");
-	  next_chunk_to_print++;
-	}
-      }
+      output_queue_push(thread_output_buffer_chunk[thread_id], thread_output_buffer[thread_id], new_size);
+      thread_output_buffer[thread_id] = NULL;
     }
 
-    //free(re_buffer);
-    my_free(re_buffer, chunk_size * sizeof(re_buffer[0]),
-	    &mem_thread_buffer, "re_buffer");
+    my_arena_destroy(&read_arena);
   } // end parallel section
 
+  read_queue_stop(reader);
+
   if (progress > 0)
     fprintf(stderr, "\n");
 
-  //assert(h.load == 0);
-  
-  struct heap_out_elem tmp;
-  while (h.load>0) {
-    heap_out_extract_min(&h,&tmp);
-    fprintf(stdout,"%s",(char *)tmp.rest.ptr);
-    //free(tmp.rest);
-    my_free(tmp.rest.ptr, tmp.rest.sz,
-	    &mem_thread_buffer, "thread_output_buffer[]");
-  }
-  
-  heap_out_destroy(&h);
+  output_queue_stop(writer);
 
   //free(thread_output_buffer_sizes);
   my_free(thread_output_buffer_sizes, sizeof(size_t) * num_threads,
@@ -668,6 +1119,11 @@ static void
 print_insert_histogram()
 {
   int i;
+  if (insert_learned_pairs > 0) {
+    fprintf(stderr, "Learned insert sizes (%d pairs): mean %.1f, stddev %.1f, window [%d-%d]\n",
+	    insert_learned_pairs, insert_learned_mean, insert_learned_stddev,
+	    paired_mapping_options[0].pairing.min_insert_size, paired_mapping_options[0].pairing.max_insert_size);
+  }
   for (i = 0; i < 100; i++) {
     fprintf(stderr, "[%d-%d]: %.2f%%\n",
 	    min_insert_size + i * insert_histogram_bucket_size,
@@ -679,6 +1135,7 @@ print_insert_histogram()
 typedef struct tp_stats_t {
   uint64_t f1_invocs, f1_cells, f1_ticks;
   double f1_secs, f1_cellspersec;
+  uint64_t f1_cache_lookups, f1_cache_hits;
   uint64_t f2_invocs, f2_cells, f2_ticks;
   double f2_secs, f2_cellspersec;
   uint64_t fwbw_invocs, fwbw_cells, fwbw_ticks;
@@ -699,6 +1156,7 @@ print_statistics()
   uint64_t f1_total_invocs = 0, f1_total_cells = 0;
   double f1_total_secs = 0, f1_total_cellspersec = 0;
   uint64_t f1_calls_bypassed = 0;
+  uint64_t f1_total_cache_lookups = 0, f1_total_cache_hits = 0;
   //uint64_t f2_invocs[num_threads], f2_cells[num_threads], f2_ticks[num_threads];
   //double f2_secs[num_threads], f2_cellspersec[num_threads];
   uint64_t f2_total_invocs = 0, f2_total_cells = 0;
@@ -732,6 +1190,7 @@ print_statistics()
     memcpy(&tpgA[tid], &tpg, sizeof(tpg_t));
 
     f1_stats(&tps[tid].f1_invocs, &tps[tid].f1_cells, &tps[tid].f1_secs, NULL);
+    f1_read_cache_stats(&tps[tid].f1_cache_lookups, &tps[tid].f1_cache_hits);
 
     //tps[tid].f1_secs = (double)tps[tid].f1_ticks / hz;
     tps[tid].f1_cellspersec = (double)tps[tid].f1_cells / tps[tid].f1_secs;
@@ -814,6 +1273,8 @@ print_statistics()
     f1_total_secs += tps[i].f1_secs;
     f1_total_invocs += tps[i].f1_invocs;
     f1_total_cells += tps[i].f1_cells;
+    f1_total_cache_lookups += tps[i].f1_cache_lookups;
+    f1_total_cache_hits += tps[i].f1_cache_hits;
 
     f2_total_secs += tps[i].f2_secs;
     f2_total_invocs += tps[i].f2_invocs;
@@ -874,6 +1335,13 @@ print_statistics()
           "Invocations:", comma_integer(f1_total_invocs));
   fprintf(stderr, "%s%s%-24s" "%s\n", my_tab, my_tab,
           "Bypassed Calls:", comma_integer(f1_calls_bypassed));
+  if (sw_cache_size > 0) {
+    fprintf(stderr, "%s%s%-24s" "%s\n", my_tab, my_tab,
+	    "Cross-read Lookups:", comma_integer(f1_total_cache_lookups));
+    fprintf(stderr, "%s%s%-24s" "%s    (%.4f%%)\n", my_tab, my_tab,
+	    "Cross-read Hits:", comma_integer(f1_total_cache_hits),
+	    f1_total_cache_lookups == 0? 0 : ((double)f1_total_cache_hits / (double)f1_total_cache_lookups) * 100);
+  }
   fprintf(stderr, "%s%s%-24s" "%.2f million\n", my_tab, my_tab,
           "Cells Computed:", (double)f1_total_cells / 1.0e6);
   fprintf(stderr, "%s%s%-24s" "%.2f million\n", my_tab, my_tab,
@@ -1110,6 +1578,14 @@ usage(char * progname, bool full_usage){
   fprintf(stderr,
 	  "   -K/--thread-chunk    Thread Chunk Size             (default: %d)\n",
 	  DEF_CHUNK_SIZE);
+  fprintf(stderr,
+	  "      --read-batch      Reads Prepared Together       (default: %d)\n",
+	  DEF_READ_BATCH);
+  fprintf(stderr,
+	  "      --inflate-threads Threads Inflating BGZF Input,\n");
+  fprintf(stderr,
+	  "                                    0 to use zlib     (default: %d)\n",
+	  DEF_INFLATE_THREADS);
   }
 
   fprintf(stderr, "\n");
@@ -1142,6 +1618,10 @@ usage(char * progname, bool full_usage){
           "      --no-mapping-qualities Do not compute mapping qualities\n");
   fprintf(stderr,
 	  "      --insert-size-dist Specifies the mean and stddev of the insert sizes\n");
+  fprintf(stderr,
+	  "      --insert-size-learn Learn Insert Sizes From the First\n");
+  fprintf(stderr,
+	  "                                    Pairs, 0 for none (default: %d)\n", DEF_INSERT_LEARN_PAIRS);
   fprintf(stderr,
 	  "      --no-improper-mappings (see README)\n");
   if (full_usage) {
@@ -1158,13 +1638,20 @@ usage(char * progname, bool full_usage){
   fprintf(stderr,
           "      --progress        Display a progress line each <value> reads. (default %d)\n",progress);
   fprintf(stderr,
- 	  "      --save-mmap       Save genome projection to shared memory\n");
+ 	  "      --save-mmap       Save genome projection to an mmap file or shared memory\n");
+  fprintf(stderr,
+          "      --load-mmap       Map genome projection from an mmap file or shared memory\n");
+  fprintf(stderr,
+          "      --compress-index  Keep genome projection delta-encoded in memory\n");
   fprintf(stderr,
-          "      --load-mmap       Load genome projection from shared memory\n");
+          "      --region-map      Region counts in a dense map or a per-read hash (default: %s)\n",
+	  use_region_hash ? "hash" : "dense");
   fprintf(stderr,
           "      --indel-taboo-len Prevent indels from starting or ending in the tail\n");
   fprintf(stderr,
           "      --shrimp-format   Output mappings in SHRiMP format (default: %s)\n",Eflag ? "disabled" : "enabled");
+  fprintf(stderr,
+          "      --bam             Output mappings in BAM format (default: %s)\n", bam_output ? "enabled" : "disabled");
   fprintf(stderr,
           "      --qv-offset       (see README)\n");
   fprintf(stderr,
@@ -1221,6 +1708,10 @@ usage(char * progname, bool full_usage){
 	  "   -Z/--bypass-off      Disable Cache Bypass for SW\n");
   fprintf(stderr,
 	  "                                    Vector Calls      (default: %s)\n", hash_filter_calls ? "enabled" : "disabled");
+  fprintf(stderr,
+	  "      --sw-cache        Vector Scores Cached Across\n");
+  fprintf(stderr,
+	  "                                    Reads, 0 for none (default: %d)\n", DEF_SW_CACHE_SIZE);
   fprintf(stderr,
 	  "   -H/--spaced-kmers    Hash Spaced Kmers in Genome\n");
   fprintf(stderr,
@@ -1367,9 +1858,15 @@ print_settings() {
   fprintf(stderr, "\n");
   fprintf(stderr, "%s%-40s%d\n", my_tab, "Number of threads:", num_threads);
   fprintf(stderr, "%s%-40s%d\n", my_tab, "Thread chunk size:", chunk_size);
+  fprintf(stderr, "%s%-40s%d\n", my_tab, "Read batch:", read_batch);
+  fprintf(stderr, "%s%-40s%d\n", my_tab, "BGZF inflate threads:", inflate_threads);
   fprintf(stderr, "%s%-40s%s\n", my_tab, "Window length:", thres_to_buff(buff, &window_len));
 
   fprintf(stderr, "%s%-40s%s\n", my_tab, "Hash filter calls:", hash_filter_calls? "yes" : "no");
+  if (sw_cache_size > 0)
+    fprintf(stderr, "%s%-40s%d entries\n", my_tab, "Cross-read SW cache:", sw_cache_size);
+  else
+    fprintf(stderr, "%s%-40s%s\n", my_tab, "Cross-read SW cache:", "no");
   fprintf(stderr, "%s%-40s%d%s\n", my_tab, "Anchor width:", anchor_width,
 	  anchor_width == -1? " (disabled)" : "");
   fprintf(stderr, "%s%-40s%d%s\n", my_tab, "Indel taboo Len:", indel_taboo_len,
@@ -1377,12 +1874,16 @@ print_settings() {
   if (list_cutoff < DEF_LIST_CUTOFF) {
   fprintf(stderr, "%s%-40s%u\n", my_tab, "Index list cutoff length:", list_cutoff);
   }
+  fprintf(stderr, "%s%-40s%s\n", my_tab, "Compressed index:", compress_index? "yes" : "no");
   fprintf(stderr, "%s%-40s%s\n", my_tab, "Gapless mode:", gapless_sw? "yes" : "no");
+  fprintf(stderr, "%s%-40s%s\n", my_tab, "Vector SW kernel:", sw_vector_isa());
+  fprintf(stderr, "%s%-40s%s\n", my_tab, "Seed kmer gather:", seed_gather_isa());
   fprintf(stderr, "%s%-40s%s\n", my_tab, "Global alignment:", Gflag? "yes" : "no");
   fprintf(stderr, "%s%-40s%s\n", my_tab, "Region filter:", use_regions? "yes" : "no");
   if (use_regions) {
   fprintf(stderr, "%s%-40s%d\n", my_tab, "Region size:", (1 << region_bits));
   fprintf(stderr, "%s%-40s%d\n", my_tab, "Region overlap:", region_overlap);
+  fprintf(stderr, "%s%-40s%s\n", my_tab, "Region map:", use_region_hash? "hash" : "dense");
   }
   if (Qflag) {
   fprintf(stderr, "%s%-40s%s\n", my_tab, "Ignore QVs:", ignore_qvs? "yes" : "no");
@@ -1485,6 +1986,10 @@ print_settings() {
   fprintf(stderr, "%s%-40s%s\n", my_tab, "Paired mode:", pair_mode_string[pair_mode]);
   if (pair_mode != PAIR_NONE) {
     fprintf(stderr, "%s%-40smin:%d max:%d\n", my_tab, "Insert sizes:", min_insert_size, max_insert_size);
+    if (insert_learn_pairs > 0)
+      fprintf(stderr, "%s%-40sfrom the first %d pairs\n", my_tab, "Learn insert sizes:", insert_learn_pairs);
+    else
+      fprintf(stderr, "%s%-40s%s\n", my_tab, "Learn insert sizes:", "no");
     if (Xflag) {
       fprintf(stderr, "%s%-40s%d\n", my_tab, "Bucket size:", insert_histogram_bucket_size);
     }
@@ -2168,6 +2673,7 @@ int main(int argc, char **argv){
 			if (c == NULL)
 			  crash(1, 0, "argmuent for insert-size-dist should be \"mean,stddev\" [%s]", optarg);
 			insert_size_stddev = atof(c);
+			insert_size_dist_given = true;
 			break;
 		case 26:
 		  use_regions = !use_regions;
@@ -2230,7 +2736,6 @@ int main(int argc, char **argv){
 		  if (region_bits < 8 || region_bits > 20) {
 		    crash(1, 0, "invalid number of region bits: %s; must be between 8 and 20", optarg);
 		  }
-		  n_regions = (1 << (32 - region_bits));
 		  break;
 		case 33:
 		  progress = atoi(optarg);
@@ -2307,6 +2812,44 @@ int main(int argc, char **argv){
 		case 126:
 		  pr_xover = atof(optarg);
 		  break;
+		case 127: // compress-index
+		  compress_index = true;
+		  break;
+		case 128: // --bam
+		  bam_output = true;
+		  break;
+		case 130: // --read-batch
+		  read_batch = atoi(optarg);
+		  if (read_batch < 1) {
+		    crash(1, 0, "invalid read batch: %s; must be positive", optarg);
+		  }
+		  break;
+		case 133: // --insert-size-learn
+		  insert_learn_pairs = atoi(optarg);
+		  if (insert_learn_pairs < 0) {
+		    crash(1, 0, "invalid number of pairs to learn insert sizes from: %s; must be non-negative", optarg);
+		  }
+		  break;
+		case 132: // --inflate-threads
+		  inflate_threads = atoi(optarg);
+		  if (inflate_threads < 0) {
+		    crash(1, 0, "invalid number of inflate threads: %s; must be non-negative", optarg);
+		  }
+		  break;
+		case 131: // --sw-cache
+		  sw_cache_size = atoi(optarg);
+		  if (sw_cache_size < 0) {
+		    crash(1, 0, "invalid sw cache size: %s; must be non-negative", optarg);
+		  }
+		  break;
+		case 129: // --region-map
+		  if (!strcmp(optarg, "dense"))
+		    use_region_hash = false;
+		  else if (!strcmp(optarg, "hash"))
+		    use_region_hash = true;
+		  else
+		    crash(1, 0, "invalid region map: %s; must be dense or hash", optarg);
+		  break;
 		default:
 			usage(progname, false);
 		}
@@ -2315,6 +2858,9 @@ int main(int argc, char **argv){
 	argc -= optind;
 	argv += optind;
 
+	if (pair_mode != PAIR_NONE && (read_batch % 2) != 0) {
+	  read_batch++;
+	}
 	if ((pair_mode != PAIR_NONE || !single_reads_file) && (chunk_size % 2) != 0) {
 	  logit(0, "in paired mode or if using options -1 and -2, the thread chunk size must be even; adjusting it to [%d]", chunk_size + 1);
 	  chunk_size++;
@@ -2333,6 +2879,10 @@ int main(int argc, char **argv){
 		fprintf(stderr,"error: when using flag --sam-unaligned must also use -E/--sam\n");
 		usage(progname,false);
 	}
+	if (bam_output && !Eflag) {
+		fprintf(stderr,"error: --bam cannot be used with --shrimp-format\n");
+		usage(progname,false);
+	}
 	if (right_reads_filename != NULL || left_reads_filename !=NULL) {
 		if (right_reads_filename == NULL || left_reads_filename == NULL ){
 			fprintf(stderr,"error: when using \"%s\" must also specify \"%s\"\n",
@@ -2359,6 +2909,18 @@ int main(int argc, char **argv){
 	  fprintf(stderr, "warning: insert histogram not available in unpaired mode; ignoring\n");
 	  Xflag = false;
 	}
+	if (insert_learn_pairs > 0 && pair_mode == PAIR_NONE) {
+	  fprintf(stderr, "warning: insert size learning not available in unpaired mode; ignoring\n");
+	  insert_learn_pairs = 0;
+	}
+	if (insert_learn_pairs > 0) {
+	  // at most one sample per pair and output call: one per option set, and the final one
+	  insert_learn_chunks = ceil_div(insert_learn_pairs, chunk_size / 2);
+	  insert_learn_sample = (int *)
+	    xmalloc(insert_learn_chunks * (chunk_size / 2) * (n_paired_mapping_options + 1) * sizeof(insert_learn_sample[0]));
+	  pthread_mutex_init(&il.mutex, NULL);
+	  pthread_cond_init(&il.done, NULL);
+	}
 	if (pair_mode != PAIR_NONE) {
 	  insert_histogram_bucket_size = ceil_div(max_insert_size - min_insert_size + 1, 100);
 	  for (i = 0; i < 100; i++) {
@@ -2725,6 +3287,8 @@ int main(int argc, char **argv){
 	  exit(genome_load_map_save_mmap(load_file, save_mmap) == true ? 0 : 1);
 	}
 
+	fasta_inflate_threads = inflate_threads;
+
 	before = gettimeinusecs();
 	if (load_mmap != NULL) {
 	  genome_load_mmap(load_mmap);
@@ -2800,6 +3364,8 @@ int main(int argc, char **argv){
 
 	load_genome_usecs += (gettimeinusecs() - before);
 
+	init_seed_gather_plans();
+
 	// initialize general search tree for contig offsets
 	gen_st_init(&contig_offsets_gen_st, 17, contig_offsets, num_contigs);
 
@@ -2854,10 +3420,21 @@ int main(int argc, char **argv){
 	  exit(0);
 	}
 
+	if (compress_index) {
+	  if (load_mmap != NULL) {
+	    logit(0, "the index in shared memory cannot be compressed; ignoring --compress-index");
+	  } else {
+	    compress_genome();
+	  }
+	}
+
 	// compute total genome size
 	for (cn = 0; cn < num_contigs; cn++)
 	  total_genome_size += genome_len[cn];
 
+	// the region maps only need to cover the genome
+	n_regions = (int)(total_genome_size >> region_bits) + 1;
+
 	//TODO setup need max window and max read len
 	//int longest_read_len = 2000;
 	int max_window_len = (int)abs_or_pct(window_len,longest_read_len);
@@ -2918,15 +3495,8 @@ int main(int argc, char **argv){
 	  tpg.duplicate_removal_tc.type = DEF_FAST_TIME_COUNTER;
 
 	  /* region handling */
-	  if (use_regions) {
-	    region_map_id = 0;
-	    for (int number_in_pair = 0; number_in_pair < 2; number_in_pair++)
-	      for (int st = 0; st < 2; st++)
-		//region_map[number_in_pair][st] = (int32_t *)xcalloc(n_regions * sizeof(region_map[0][0][0]));
-		region_map[number_in_pair][st] = (region_map_t *)
-		  my_calloc(n_regions * sizeof(region_map[0][0][0]),
-			    &mem_mapping, "region_map");
-	  }
+	  if (use_regions)
+	    region_map_init();
 
 	  if (f1_setup(max_window_len, longest_read_len,
 		       a_gap_open_score, a_gap_extend_score, b_gap_open_score, b_gap_extend_score,
@@ -2966,45 +3536,61 @@ int main(int argc, char **argv){
 	char * output;
 	if (Eflag){
 	  int i;
+	  // in BAM mode, the header text goes in the BAM header
+	  char * header_text = NULL;
+	  size_t header_len = 0;
+	  FILE * header_out = stdout;
+	  if (bam_output) {
+	    header_out = open_memstream(&header_text, &header_len);
+	    if (header_out == NULL) {
+	      crash(1, 1, "could not create BAM header");
+	    }
+	  }
+
 	  if (sam_header_filename != NULL) {
 	    FILE * sam_header_file = fopen(sam_header_filename, "r");
 	    if (sam_header_file == NULL) {
 	      perror("Failed to open sam header file ");
 	      exit(1);
 	    }
-	    cat(sam_header_file, stdout);
+	    cat(sam_header_file, header_out);
 	    fclose(sam_header_file);
 	  } else {
 	    // HD line
 	    if (sam_header_hd != NULL) {
-	      cat(sam_header_hd, stdout);
+	      cat(sam_header_hd, header_out);
 	    } else {
-	      fprintf(stdout,"@HD\tVN:%s\tSO:%s\n","1.0","unsorted");
+	      fprintf(header_out,"@HD\tVN:%s\tSO:%s\n","1.0","unsorted");
 	    }
 
 	    // SQ lines
 	    if (sam_header_sq != NULL) {
-	      cat(sam_header_sq, stdout);
+	      cat(sam_header_sq, header_out);
 	    } else {
 	      for(i = 0; i < num_contigs; i++){
-		fprintf(stdout,"@SQ\tSN:%s\tLN:%u\n",contig_names[i],genome_len[i]);
+		fprintf(header_out,"@SQ\tSN:%s\tLN:%u\n",contig_names[i],genome_len[i]);
 	      }
 	    }
 
 	    // RG lines
 	    if (sam_header_rg != NULL) {
-	      cat(sam_header_rg, stdout);
+	      cat(sam_header_rg, header_out);
 	    } else if (sam_read_group_name != NULL) {
-	      fprintf(stdout, "@RG\tID:%s\tSM:%s\n", sam_read_group_name, sam_sample_name);
+	      fprintf(header_out, "@RG\tID:%s\tSM:%s\n", sam_read_group_name, sam_sample_name);
 	    }
 
 	    // PG lines
 	    if (sam_header_pg != NULL) {
-	      cat(sam_header_pg, stdout);
+	      cat(sam_header_pg, header_out);
 	    } else {
-	      fprintf(stdout, "@PG\tID:%s\tVN:%s\tCL:%s\n", "gmapper", SHRIMP_VERSION_STRING, command_line);
+	      fprintf(header_out, "@PG\tID:%s\tVN:%s\tCL:%s\n", "gmapper", SHRIMP_VERSION_STRING, command_line);
 	    }
 	  }
+	  if (bam_output) {
+	    fclose(header_out);
+	    bam_output_header(header_text, header_len);
+	    free(header_text);
+	  }
 	} else {
 	  output = output_format_line(Rflag);
 	  puts(output);
@@ -3017,6 +3603,9 @@ int main(int argc, char **argv){
 	  exit(1);
 	}
 	mapping_wallclock_usecs += (gettimeinusecs() - before);
+	if (bam_output) {
+	  fwrite(bgzf_eof, 1, BGZF_EOF_SIZE, stdout);
+	}
 
 	if (single_reads_file) {
 	  fasta_close(fasta);
@@ -3037,19 +3626,25 @@ int main(int argc, char **argv){
 	  sw_full_ls_cleanup();
 	  f1_free();
 
-	  if (use_regions) {
-	    for (int number_in_pair = 0; number_in_pair < 2; number_in_pair++)
-	      for (int st = 0; st < 2; st++)
-		//free(region_map[number_in_pair][st]);
-		my_free(region_map[number_in_pair][st], n_regions * sizeof(region_map[0][0][0]),
-			&mem_mapping, "region_map");
-	  }
+	  if (list_buf != NULL)
+	    my_free(list_buf, list_buf_len * sizeof(list_buf[0]),
+		    &mem_mapping, "list_buf");
+
+	  if (use_regions)
+	    region_map_free();
 	}
 
 	gen_st_delete(&contig_offsets_gen_st);
+	free_seed_gather_plans();
+
+	if (insert_learn_sample != NULL) {
+	  free(insert_learn_sample);
+	  pthread_cond_destroy(&il.done);
+	  pthread_mutex_destroy(&il.mutex);
+	}
 
 	if (load_mmap != NULL) {
-	  // munmap?
+	  genome_unload_mmap();
 	} else {
 	  free_genome();
 
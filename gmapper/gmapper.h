@@ -10,6 +10,7 @@
 //extern "C" {
 #endif
 
+#include <emmintrin.h>
 #include "../gmapper/gmapper-definitions.h"
 #include "../common/debug.h"
 #include "../common/util.h"
@@ -37,6 +38,8 @@ EXTERN(shrimp_args_t,	shrimp_args,		{});
 /* thread control */
 EXTERN(int,			num_threads,		DEF_NUM_THREADS);
 EXTERN(int,			chunk_size,		DEF_CHUNK_SIZE);
+EXTERN(int,			read_batch,		DEF_READ_BATCH);
+EXTERN(int,			inflate_threads,	DEF_INFLATE_THREADS);
 EXTERN(int,			not_used,		0);
 
 
@@ -58,6 +61,7 @@ EXTERN(int,		indel_taboo_len,	DEF_INDEL_TABOO_LEN);
 EXTERN(uint32_t,	list_cutoff,		DEF_LIST_CUTOFF);
 EXTERN(bool,		gapless_sw,		DEF_GAPLESS_SW);
 EXTERN(bool,		hash_filter_calls,	DEF_HASH_FILTER_CALLS);
+EXTERN(int,		sw_cache_size,		DEF_SW_CACHE_SIZE);
 EXTERN(int,		longest_read_len,	DEF_LONGEST_READ_LENGTH);
 EXTERN(bool,		trim,			false);
 EXTERN(int,		trim_front,		0);
@@ -145,6 +149,15 @@ EXTERN(double,		insert_size_stddev,		DEF_INSERT_SIZE_STDDEV);
 EXTERN(llint,		insert_histogram[100],		{});
 EXTERN(int,		insert_histogram_bucket_size,	1);
 EXTERN(int,		insert_histogram_load,		100);
+EXTERN(bool,		insert_size_dist_given,		false);
+EXTERN(int,		insert_learn_pairs,		DEF_INSERT_LEARN_PAIRS);
+EXTERN(unsigned int,	insert_learn_chunks,		0);	/* chunks the learning pairs come from */
+EXTERN(int *,		insert_learn_sample,		NULL);
+EXTERN(int,		insert_learn_load,		0);
+EXTERN(bool,		insert_learn_done,		false);
+EXTERN(int,		insert_learned_pairs,		0);	/* 0 unless the estimate was applied */
+EXTERN(double,		insert_learned_mean,		0);
+EXTERN(double,		insert_learned_stddev,		0);
 EXTERN(char *,		reads_filename,			NULL);
 EXTERN(char *,	 	left_reads_filename,		NULL);
 EXTERN(char *,		right_reads_filename,		NULL);
@@ -178,6 +191,8 @@ EXTERN(unsigned int,		thread_output_heap_capacity,	DEF_THREAD_OUTPUT_HEAP_CAPACI
 EXTERN(FILE *,		unaligned_reads_file,		NULL);
 EXTERN(FILE *,		aligned_reads_file,		NULL);
 EXTERN(bool,		sam_unaligned,			false);
+EXTERN(bool,		bam_output,			false);
+EXTERN(int,		bam_compression_level,		DEF_BAM_COMPRESSION_LEVEL);
 EXTERN(bool,		half_paired,			true); //output reads in paired mode that only have one mapping
 EXTERN(bool,		sam_r2,				false);
 EXTERN(char *,		sam_header_filename,		NULL);
@@ -258,10 +273,17 @@ EXTERN(count_t,			mem_mapping,			{});
 EXTERN(count_t,			mem_sw,				{});
 
 
-/* genome map */
-EXTERN(uint32_t ***,		genomemap,			NULL);
-EXTERN(uint32_t **,		genomemap_len,			NULL);
-EXTERN(uint32_t *,		contig_offsets,			NULL);	/* offset info for genome contigs */
+/* genome map: the kmer lists of seed sn, concatenated in mapidx order; list mapidx
+   is genomemap[sn][genomemap_offsets[sn][mapidx] .. genomemap_offsets[sn][mapidx + 1]) */
+EXTERN(genome_pos_t **,		genomemap,			NULL);
+EXTERN(genome_pos_t **,		genomemap_offsets,		NULL);	/* capacity + 1 entries per seed */
+EXTERN(bool,			compress_index,			false);
+/* compressed genome map (replaces genomemap): each list is its first position, the
+   delta width b, and the deltas bit-packed on b bits; lists that would not get
+   shorter are stored as is; see genomemap_decode_list() */
+EXTERN(uint32_t **,		genomemap_packed,		NULL);
+EXTERN(genome_pos_t **,		genomemap_packed_offsets,	NULL);	/* in words; capacity + 1 entries per seed */
+EXTERN(genome_pos_t *,		contig_offsets,			NULL);	/* offset info for genome contigs */
 EXTERN(char **,			contig_names,			NULL);
 EXTERN(int,			num_contigs,			0);
 EXTERN(uint32_t **,		genome_contigs,			NULL);	/* genome -- always in letter */
@@ -274,7 +296,6 @@ EXTERN(bool,			genome_is_rna,			false);	/* is genome RNA (has uracil)?*/
 EXTERN(long long int,		total_genome_size,		0);
 EXTERN(gen_st,			contig_offsets_gen_st,		{});
 
-EXTERN(ptr_and_sz *,		genomemap_block,		NULL);
 EXTERN(ptr_and_sz,		genome_contigs_block,		{});
 EXTERN(ptr_and_sz,		genome_contigs_rc_block,	{});
 EXTERN(ptr_and_sz,		genome_cs_contigs_block,	{});
@@ -284,7 +305,7 @@ EXTERN(ptr_and_sz,		genome_cs_contigs_block,	{});
 EXTERN(bool,			use_regions,			DEF_USE_REGIONS);
 EXTERN(int,			region_bits,			DEF_REGION_BITS);
 EXTERN(int,			region_overlap,			DEF_REGION_OVERLAP);
-EXTERN(int,			n_regions,			(1 << (32 - DEF_REGION_BITS)));
+EXTERN(int,			n_regions,			0);	/* set once the genome is loaded */
 
 typedef uint16_t	region_map_t;
 EXTERN(region_map_t *,		region_map[2][2],		{});
@@ -293,6 +314,35 @@ EXTERN(int,			region_map_id_bits,		13);
 //EXTERN(int,			region_map_max_count,		((1 << 8) - 1));
 #pragma omp threadprivate(region_map, region_map_id)
 
+/*
+ * Sparse alternative to the dense region maps: an open-addressing table of
+ * the regions the current read actually hits, small enough to stay in cache.
+ * The probing costs more than a dense lookup, so this only saves memory.
+ */
+typedef struct region_hash_entry {
+  int32_t		region;		/* -1 if empty */
+  region_map_t		c;
+} region_hash_entry;
+
+typedef struct region_hash_t {
+  region_hash_entry *	tab;
+  uint32_t		size;		/* power of 2 */
+  uint32_t		n;
+} region_hash_t;
+
+EXTERN(bool,			use_region_hash,		DEF_USE_REGION_HASH);
+EXTERN(region_hash_t,		region_hash[2][2],		{});
+#pragma omp threadprivate(region_hash)
+
+/* scratch space for decoding compressed genome map lists */
+EXTERN(genome_pos_t *,		list_buf,			NULL);
+EXTERN(size_t,			list_buf_len,			0);
+#pragma omp threadprivate(list_buf, list_buf_len)
+
+/* per-thread arena for the mapping state of the reads in a chunk */
+EXTERN(my_arena,		read_arena,			{});
+#pragma omp threadprivate(read_arena)
+
 
 /* contains inlined calls; uses gapless_sw and hash_filter_calls vars */
 #include "../common/f1-wrapper.h"
@@ -369,9 +419,92 @@ kmer_to_mapidx_orig(uint32_t *kmerWindow, int sn)
 
 #define KMER_TO_MAPIDX(kmer, sn) (Hflag? kmer_to_mapidx_hash((kmer), (sn)) : kmer_to_mapidx_orig((kmer), (sn)))
 
+/* kmer list of mapidx for seed sn, and its length */
+static inline genome_pos_t *
+genomemap_list(int sn, uint32_t mapidx)
+{
+  return genomemap[sn] + genomemap_offsets[sn][mapidx];
+}
+
+static inline uint32_t
+genomemap_list_len(int sn, uint32_t mapidx)
+{
+  return (uint32_t)(genomemap_offsets[sn][mapidx + 1] - genomemap_offsets[sn][mapidx]);
+}
+
+/* prefetch the offsets giving the position and length of the list of mapidx */
+static inline void
+genomemap_prefetch_len(int sn, uint32_t mapidx)
+{
+  _mm_prefetch((char const *)&genomemap_offsets[sn][mapidx], _MM_HINT_T0);
+  if (genomemap_packed != NULL)
+    _mm_prefetch((char const *)&genomemap_packed_offsets[sn][mapidx], _MM_HINT_T0);
+}
+
+/* prefetch the head of the list of mapidx; best once its offsets are in cache */
+static inline void
+genomemap_prefetch_list(int sn, uint32_t mapidx)
+{
+  if (genomemap_packed != NULL)
+    _mm_prefetch((char const *)(genomemap_packed[sn] + genomemap_packed_offsets[sn][mapidx]), _MM_HINT_T0);
+  else
+    _mm_prefetch((char const *)genomemap_list(sn, mapidx), _MM_HINT_T0);
+}
+
+/* words taken by one position in the compressed genome map */
+#define GENOMEMAP_POS_WORDS ((uint32_t)(sizeof(genome_pos_t) / sizeof(uint32_t)))
+
+/*
+ * Decode the list of mapidx for seed sn from the compressed genome map into dst.
+ * The deltas are unpacked with 64-bit loads (the packed array is padded by one
+ * word), then the prefix sum is computed 4 positions at a time with SSE2
+ * (one at a time for 64-bit positions).
+ */
+static inline void
+genomemap_decode_list(int sn, uint32_t mapidx, genome_pos_t * dst)
+{
+  uint32_t len = genomemap_list_len(sn, mapidx);
+  uint32_t const * w = genomemap_packed[sn] + genomemap_packed_offsets[sn][mapidx];
+  uint32_t b, mask, i;
+  uint64_t bit, x;
+
+  if (genomemap_packed_offsets[sn][mapidx + 1] - genomemap_packed_offsets[sn][mapidx] == len * GENOMEMAP_POS_WORDS) {
+    memcpy(dst, w, len * sizeof(dst[0]));
+    return;
+  }
+
+  memcpy(&dst[0], w, sizeof(dst[0]));
+  w += GENOMEMAP_POS_WORDS;
+
+  b = *w++;
+  mask = (uint32_t)((1llu << b) - 1);
+  for (i = 1, bit = 0; i < len; i++, bit += b) {
+    x = (uint64_t)w[bit >> 5] | ((uint64_t)w[(bit >> 5) + 1] << 32);
+    dst[i] = (uint32_t)(x >> (bit & 31)) & mask;
+  }
+
+#ifdef LONG_GENOME
+  i = 1;
+#else
+  __m128i v, carry;
+
+  carry = _mm_set1_epi32(dst[0]);
+  for (i = 1; i + 4 <= len; i += 4) {
+    v = _mm_loadu_si128((__m128i *)&dst[i]);
+    v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+    v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+    v = _mm_add_epi32(v, carry);
+    _mm_storeu_si128((__m128i *)&dst[i], v);
+    carry = _mm_shuffle_epi32(v, 0xFF);
+  }
+#endif
+  for ( ; i < len; i++)
+    dst[i] += dst[i - 1];
+}
+
 /* get contig number from absolute index */
 static inline void
-get_contig_num(uint32_t idx, int * cn) {
+get_contig_num(genome_pos_t idx, int * cn) {
 
   if (num_contigs < 100)
     {
@@ -10,6 +10,7 @@
 #include <limits.h>
 #include "mapping.h"
 #include "output.h"
+#include "seeds.h"
 #include "../common/sw-full-common.h"
 #include "../common/sw-full-cs.h"
 #include "../common/sw-full-ls.h"
@@ -17,7 +18,6 @@
 #include "../common/read_hit_heap.h"
 #include "../common/sw-post.h"
 
-DEF_HEAP(uint32_t, uint, uu)
 DEF_HEAP(double, struct read_hit_holder, unpaired)
 DEF_HEAP(double, struct read_hit_pair_holder, paired)
 
@@ -31,6 +31,173 @@ DEF_HEAP(double, struct read_hit_pair_holder, paired)
 #define RG_SET_MP_CNT(c, cnt) (c) &= ~(0x6); (c) |= ( (cnt) << 1 )
 
 
+/*
+ * Region map access. The dense maps index one entry per genome region; the
+ * sparse ones hash the regions hit by the current read (or pair). An absent
+ * region reads as 0, whose map id never matches region_map_id.
+ */
+#define REGION_HASH_MIN_SIZE 1024
+
+static inline uint32_t
+region_hash_slot(region_hash_t * h, int region)
+{
+  return (uint32_t)(((uint64_t)((uint32_t)region * 0x9E3779B1u) * h->size) >> 32);
+}
+
+static void
+region_hash_alloc(region_hash_t * h, uint32_t size)
+{
+  h->tab = (region_hash_entry *)
+    my_malloc(size * sizeof(h->tab[0]), &mem_mapping, "region_hash");
+  memset(h->tab, 0xff, size * sizeof(h->tab[0]));
+  h->size = size;
+  h->n = 0;
+}
+
+static void
+region_hash_grow(region_hash_t * h)
+{
+  region_hash_entry * old = h->tab;
+  uint32_t old_size = h->size, i, k;
+
+  region_hash_alloc(h, 2 * old_size);
+  for (i = 0; i < old_size; i++) {
+    if (old[i].region < 0)
+      continue;
+    for (k = region_hash_slot(h, old[i].region); h->tab[k].region >= 0; k = (k + 1) & (h->size - 1));
+    h->tab[k] = old[i];
+    h->n++;
+  }
+  my_free(old, old_size * sizeof(old[0]), &mem_mapping, "region_hash");
+}
+
+/* forget all regions; tables left oversized by a repetitive read shrink back */
+static void
+region_hash_clear(region_hash_t * h)
+{
+  if (h->size > REGION_HASH_MIN_SIZE && h->n < h->size / 16) {
+    my_free(h->tab, h->size * sizeof(h->tab[0]), &mem_mapping, "region_hash");
+    region_hash_alloc(h, h->size / 2);
+  } else if (h->n > 0) {
+    memset(h->tab, 0xff, h->size * sizeof(h->tab[0]));
+    h->n = 0;
+  }
+}
+
+/* entry of the given region, added (as 0) if absent */
+static inline region_map_t *
+region_map_get(int nip, int st, int region)
+{
+  if (!use_region_hash)
+    return &region_map[nip][st][region];
+
+  region_hash_t * h = &region_hash[nip][st];
+  uint32_t k;
+
+  for (k = region_hash_slot(h, region); h->tab[k].region >= 0; k = (k + 1) & (h->size - 1))
+    if (h->tab[k].region == region)
+      return &h->tab[k].c;
+
+  if (2 * (h->n + 1) > h->size) {
+    region_hash_grow(h);
+    for (k = region_hash_slot(h, region); h->tab[k].region >= 0; k = (k + 1) & (h->size - 1));
+  }
+  h->tab[k].region = region;
+  h->tab[k].c = 0;
+  h->n++;
+  return &h->tab[k].c;
+}
+
+static inline region_map_t
+region_map_peek(int nip, int st, int region)
+{
+  if (!use_region_hash)
+    return region_map[nip][st][region];
+
+  region_hash_t * h = &region_hash[nip][st];
+  uint32_t k;
+
+  for (k = region_hash_slot(h, region); h->tab[k].region >= 0; k = (k + 1) & (h->size - 1))
+    if (h->tab[k].region == region)
+      return h->tab[k].c;
+  return 0;
+}
+
+static inline void
+region_map_prefetch(int nip, int st, int region)
+{
+#ifdef USE_PREFETCH
+  if (!use_region_hash)
+    _mm_prefetch((char *)&region_map[nip][st][region], _MM_HINT_T0);
+  else
+    _mm_prefetch((char *)&region_hash[nip][st].tab[region_hash_slot(&region_hash[nip][st], region)], _MM_HINT_T0);
+#endif
+}
+
+
+void
+region_map_init()
+{
+  region_map_id = 0;
+  for (int nip = 0; nip < 2; nip++)
+    for (int st = 0; st < 2; st++) {
+      if (use_region_hash)
+	region_hash_alloc(&region_hash[nip][st], REGION_HASH_MIN_SIZE);
+      else
+	//region_map[nip][st] = (int32_t *)xcalloc(n_regions * sizeof(region_map[0][0][0]));
+	region_map[nip][st] = (region_map_t *)
+	  my_calloc(n_regions * sizeof(region_map[0][0][0]),
+		    &mem_mapping, "region_map");
+    }
+}
+
+
+void
+region_map_free()
+{
+  for (int nip = 0; nip < 2; nip++)
+    for (int st = 0; st < 2; st++) {
+      if (use_region_hash)
+	my_free(region_hash[nip][st].tab, region_hash[nip][st].size * sizeof(region_hash[0][0].tab[0]),
+		&mem_mapping, "region_hash");
+      else
+	//free(region_map[nip][st]);
+	my_free(region_map[nip][st], n_regions * sizeof(region_map[0][0][0]),
+		&mem_mapping, "region_map");
+    }
+}
+
+
+/*
+ * Make room for len positions in the thread-private list_buf.
+ */
+static inline void
+list_buf_reserve(size_t len)
+{
+  if (len > list_buf_len) {
+    list_buf = (genome_pos_t *)
+      my_realloc(list_buf, len * sizeof(list_buf[0]), list_buf_len * sizeof(list_buf[0]),
+		 &mem_mapping, "list_buf");
+    list_buf_len = len;
+  }
+}
+
+/*
+ * Get the kmer list of mapidx for seed sn. With a compressed index, the list is
+ * decoded in list_buf at position buf_start; the caller must have reserved room.
+ */
+static inline genome_pos_t *
+get_genomemap_list(int sn, uint32_t mapidx, size_t buf_start)
+{
+  if (genomemap_packed == NULL)
+    return genomemap_list(sn, mapidx);
+
+  assert(buf_start + genomemap_list_len(sn, mapidx) <= list_buf_len);
+  genomemap_decode_list(sn, mapidx, &list_buf[buf_start]);
+  return &list_buf[buf_start];
+}
+
+
 /*
  * Mapping routines
  */
@@ -46,8 +213,11 @@ read_get_mapidxs_per_strand(struct read_entry * re, int st)
   
   //re->mapidx[st] = (uint32_t *)xmalloc(n_seeds * re->max_n_kmers * sizeof(re->mapidx[0][0]));
   re->mapidx[st] = (uint32_t *)
-    my_malloc(n_seeds * re->max_n_kmers * sizeof(re->mapidx[0][0]),
-	      &mem_mapping, "mapidx [%s]", re->name);
+    my_arena_malloc(&read_arena, n_seeds * re->max_n_kmers * sizeof(re->mapidx[0][0]));
+
+  if (seed_gather_mapidxs(re->read[st], re->read_len, re->min_kmer_pos, re->max_n_kmers,
+			  re->mapidx[st]))
+    return;
 
   load = 0;
   for (i = 0; i < re->read_len; i++) {
@@ -166,8 +336,8 @@ read_get_restricted_anchor_list_per_strand(struct read_entry * re, int st, bool
 	offset = sn*re->max_n_kmers + i;
 	mapidx = re->mapidx[st][offset];
 
-	idx_start = bin_search(genomemap[sn][mapidx], 0, (int)genomemap_len[sn][mapidx], g_start);
-	idx_end = bin_search(genomemap[sn][mapidx], idx_start, (int)genomemap_len[sn][mapidx], g_end + 1);
+	idx_start = bin_search(genomemap_list(sn, mapidx), 0, (int)genomemap_list_len(sn, mapidx), g_start);
+	idx_end = bin_search(genomemap_list(sn, mapidx), idx_start, (int)genomemap_list_len(sn, mapidx), g_end + 1);
 
 	if (idx_start >= idx_end)
 	  continue;
@@ -178,7 +348,7 @@ read_get_restricted_anchor_list_per_strand(struct read_entry * re, int st, bool
 	for (k = 0; idx_start + k < idx_end; k++) {
 	  re->anchors[st][re->n_anchors[st] + k].cn = re->ranges[j].cn;
 	  re->anchors[st][re->n_anchors[st] + k].x =
-	    genomemap[sn][mapidx][idx_start + k] - contig_offsets[re->ranges[j].cn];
+	    genomemap_list(sn, mapidx)[idx_start + k] - contig_offsets[re->ranges[j].cn];
 	  re->anchors[st][re->n_anchors[st] + k].y = re->min_kmer_pos + i;
 	  re->anchors[st][re->n_anchors[st] + k].length = seed[sn].span;
 	  re->anchors[st][re->n_anchors[st] + k].weight = 1;
@@ -263,15 +433,29 @@ reverse_hit(struct read_entry * re, struct read_hit * rh)
 }
 
 
+/*
+ * Both hit lists are sorted by contig and offset, so the window of mates of
+ * each hit only moves forward: its start j and end k are swept once. The mate
+ * hits record the first and last hit whose window holds them, which again only
+ * takes one sweep in each direction. Windows left from an earlier option set
+ * are cleared first.
+ */
 static void
 readpair_pair_up_hits(struct read_entry * re1, struct read_entry * re2)
 {
-  int st1, st2, i, j, k, l;
+  int st1, st2, i, j, k, l, last;
 
   for (st1 = 0; st1 < 2; st1++) {
     st2 = 1 - st1; // opposite strand
 
+    for (i = 0; i < re1->n_hits[st1]; i++)
+      re1->hits[st1][i].pair_min = re1->hits[st1][i].pair_max = -1;
+    for (l = 0; l < re2->n_hits[st2]; l++)
+      re2->hits[st2][l].pair_min = re2->hits[st2][l].pair_max = -1;
+
     j = 0; // invariant: matching hit at index j or larger
+    k = 0;
+    last = 0; // mates before this one already have their pair_min
     for (i = 0; i < re1->n_hits[st1]; i++) {
 
       // find matching hit, if any
@@ -286,7 +470,9 @@ readpair_pair_up_hits(struct read_entry * re1, struct read_entry * re2)
 	  j++;
 	}
 
-      k = j;
+      // the window end only moves forward within a contig, and j is past the last one
+      if (k < j)
+	k = j;
       while (k < re2->n_hits[st2]
 	     && re2->hits[st2][k].cn == re1->hits[st1][i].cn
 	     && (int64_t)(re2->hits[st2][k].g_off) <= (int64_t)(re1->hits[st1][i].g_off) + (int64_t)re1->delta_g_off_max[st1]
@@ -302,12 +488,21 @@ readpair_pair_up_hits(struct read_entry * re1, struct read_entry * re2)
 
       re1->hits[st1][i].pair_min = j;
       re1->hits[st1][i].pair_max = k-1;
-      for (l = j; l < k; l++) {
-	if (re2->hits[st2][l].pair_min < 0) {
-	  re2->hits[st2][l].pair_min = i;
-	}
+      for (l = MAX(j, last); l < k; l++) {
+	re2->hits[st2][l].pair_min = i;
+      }
+      last = MAX(last, k);
+    }
+
+    // pair_max: the last window holding each mate, sweeping backwards
+    last = re2->n_hits[st2];
+    for (i = re1->n_hits[st1] - 1; i >= 0; i--) {
+      if (re1->hits[st1][i].pair_min < 0)
+	continue;
+      for (l = re1->hits[st1][i].pair_min; l <= re1->hits[st1][i].pair_max && l < last; l++) {
 	re2->hits[st2][l].pair_max = i;
       }
+      last = re1->hits[st1][i].pair_min;
     }
   }
 
@@ -325,6 +520,14 @@ readpair_pair_up_hits(struct read_entry * re1, struct read_entry * re2)
 }
 
 
+/* the full SW results live in the read arena, with their sfrp */
+static void *
+read_arena_alloc(size_t size)
+{
+  return my_arena_malloc(&read_arena, size);
+}
+
+
 /*
  * Run full SW filter on this hit.
  */
@@ -362,7 +565,7 @@ hit_run_full_sw(struct read_entry * re, struct read_hit * rh, int thresh)
 
   // allocate sfrp struct
   assert(rh->sfrp == NULL);
-  rh->sfrp = (struct sw_full_results *)my_calloc(sizeof(rh->sfrp[0]), &mem_mapping, "sfrp [%s]", re->name);
+  rh->sfrp = (struct sw_full_results *)my_arena_calloc(&read_arena, sizeof(rh->sfrp[0]));
   rh->sfrp->in_use = false;
   rh->sfrp->mqv = 255; // unavailable
 
@@ -376,7 +579,7 @@ hit_run_full_sw(struct read_entry * re, struct read_hit * rh, int thresh)
     sw_full_cs(gen, rh->g_off, rh->w_len,
 	       re->read[rh->st], re->read_len, re->initbp[rh->st],
 	       thresh, rh->sfrp, rh->gen_st && Tflag, genome_is_rna,
-	       &rh->anchor, 1,Gflag ? 0 : 1, re->crossover_score);
+	       &rh->anchor, 1,Gflag ? 0 : 1, re->crossover_score, read_arena_alloc);
   } else {
     /*
      * The full SW in letter space assumes it's given the correct max score.
@@ -391,7 +594,7 @@ hit_run_full_sw(struct read_entry * re, struct read_hit * rh, int thresh)
       sw_full_ls(gen, rh->g_off, rh->w_len,
 		 re->read[rh->st], re->read_len,
 		 thresh, rh->score_vector, rh->sfrp, rh->gen_st && Tflag,
-		 &rh->anchor, 1, Gflag ? 0 : 1);
+		 &rh->anchor, 1, Gflag ? 0 : 1, read_arena_alloc);
       //assert(rh->sfrp->score == rh->score_vector);
     } else { // this wouldn't have passed the filter
       rh->sfrp->score = 0;
@@ -456,11 +659,63 @@ get_insert_size(struct read_hit *rh, struct read_hit * rh_mp)
 }
 
 
+/*
+ * Prefetch the genome map lists of all the k-mers of the read on strand st:
+ * first every list offset, then every list head. The misses of the whole
+ * read overlap instead of being taken one k-mer at a time by the walks below.
+ */
+static void
+read_prefetch_lists(struct read_entry * re, int st)
+{
+  int sn, i, offset;
+
+  if (re->mapidx[st] == NULL)
+    return;
+
+  for (sn = 0; sn < n_seeds; sn++) {
+    for (i = 0; re->min_kmer_pos + i + seed[sn].span - 1 < re->read_len; i++) {
+      offset = sn*re->max_n_kmers + i;
+      genomemap_prefetch_len(sn, re->mapidx[st][offset]);
+    }
+  }
+
+  for (sn = 0; sn < n_seeds; sn++) {
+    for (i = 0; re->min_kmer_pos + i + seed[sn].span - 1 < re->read_len; i++) {
+      offset = sn*re->max_n_kmers + i;
+      if (genomemap_list_len(sn, re->mapidx[st][offset]) <= list_cutoff)
+	genomemap_prefetch_list(sn, re->mapidx[st][offset]);
+    }
+  }
+}
+
+
+/*
+ * Extract the kmers of a read ahead of handle_read()/handle_readpair(), so the
+ * lists they point to can be prefetched while the reads before it map.
+ */
+void
+read_get_kmers(struct read_entry * re)
+{
+  if (re->mapidx[0] == NULL)
+    read_get_mapidxs(re);
+}
+
+
+void
+read_prefetch(struct read_entry * re)
+{
+  read_prefetch_lists(re, 0);
+  read_prefetch_lists(re, 1);
+}
+
+
 static void
 read_get_region_counts(struct read_entry * re, int st, struct regions_options * options)
 {
   int sn, i, offset, region;
-  uint j;
+  uint j, list_len;
+  genome_pos_t * list;
+  region_map_t * c;
   //llint before = gettimeinusecs();
   //llint before = rdtsc(), after;
   TIME_COUNTER_START(tpg.region_counts_tc);
@@ -472,7 +727,11 @@ read_get_region_counts(struct read_entry * re, int st, struct regions_options *
     region_map_id = 1;
     for (int _nip = 0; _nip < 2; _nip++) {
       for (int _st = 0; _st < 2; _st++) {
-	
+	if (use_region_hash) {
+	  region_hash_clear(&region_hash[_nip][_st]);
+	  continue;
+	}
+
 	//free(region_map[_nip][_st]);
 	my_free(region_map[_nip][_st], n_regions * sizeof(region_map[0][0][0]),
 		&mem_mapping, "region_map");
@@ -486,48 +745,59 @@ read_get_region_counts(struct read_entry * re, int st, struct regions_options *
     }
   }
 
-  assert(region_map[0][0] != NULL);
+  read_prefetch_lists(re, st);
+
+  if (use_region_hash)
+    region_hash_clear(&region_hash[number_in_pair][st]);
+
+  assert(use_region_hash || region_map[0][0] != NULL);
 
   for (sn = 0; //(options->min_seed >= 0? options->min_seed : 0);
        sn <= n_seeds - 1; //(options->max_seed >= 0? options->max_seed: n_seeds - 1);
        sn++) {
     for (i = 0; re->min_kmer_pos + i + seed[sn].span - 1 < re->read_len; i++) {
       offset = sn*re->max_n_kmers + i;
-
-      if (genomemap_len[sn][re->mapidx[st][offset]] > list_cutoff)
+      list_len = genomemap_list_len(sn, re->mapidx[st][offset]);
+      if (list_len > list_cutoff)
         continue;
 
-      for (j = 0; j < genomemap_len[sn][re->mapidx[st][offset]]; j++) {
+      if (genomemap_packed != NULL)
+	list_buf_reserve(list_len);
+      list = get_genomemap_list(sn, re->mapidx[st][offset], 0);
+
+      for (j = 0; j < list_len; j++) {
 #ifdef USE_PREFETCH
-	if (j + 4 < genomemap_len[sn][re->mapidx[st][offset]]) {
-	  int region_ahead = (int)(genomemap[sn][re->mapidx[st][offset]][j + 4] >> region_bits);
-	  _mm_prefetch((char *)&region_map[number_in_pair][st][region_ahead], _MM_HINT_T0);
+	if (j + 4 < list_len) {
+	  int region_ahead = (int)(list[j + 4] >> region_bits);
+	  region_map_prefetch(number_in_pair, st, region_ahead);
 	}
 #endif
 
-        region = (int)(genomemap[sn][re->mapidx[st][offset]][j] >> region_bits);
+        region = (int)(list[j] >> region_bits);
 
 	// BEGIN COPY
-	if (RG_GET_MAP_ID(region_map[number_in_pair][st][region]) == region_map_id) {
+	c = region_map_get(number_in_pair, st, region);
+	if (RG_GET_MAP_ID(*c) == region_map_id) {
 	  // a previous kmer set it, so there are >=2 kmers in this region
-	  RG_SET_HAS_2(region_map[number_in_pair][st][region]);
+	  RG_SET_HAS_2(*c);
 	} else {
-	  region_map[number_in_pair][st][region] = 0; // clear old entry
-	  RG_SET_MAP_ID(region_map[number_in_pair][st][region], region_map_id); // set new id
+	  *c = 0; // clear old entry
+	  RG_SET_MAP_ID(*c, region_map_id); // set new id
 	}
 	// END COPY
 
 	// extend regions by region_overlap
-	if ((genomemap[sn][re->mapidx[st][offset]][j] & ((1 << region_bits) - 1)) < (uint)region_overlap && region > 0) {
+	if ((list[j] & ((1 << region_bits) - 1)) < (uint)region_overlap && region > 0) {
 	  region--;
 
 	  // BEGIN PASTE
-	  if (RG_GET_MAP_ID(region_map[number_in_pair][st][region]) == region_map_id) {
+	  c = region_map_get(number_in_pair, st, region);
+	  if (RG_GET_MAP_ID(*c) == region_map_id) {
 	    // a previous kmer set it, so there are >=2 kmers in this region
-	    RG_SET_HAS_2(region_map[number_in_pair][st][region]);
+	    RG_SET_HAS_2(*c);
 	  } else {
-	    region_map[number_in_pair][st][region] = 0; // clear old entry
-	    RG_SET_MAP_ID(region_map[number_in_pair][st][region], region_map_id); // set new id
+	    *c = 0; // clear old entry
+	    RG_SET_MAP_ID(*c, region_map_id); // set new id
 	  }
 	  // END PASTE
 	}
@@ -550,52 +820,62 @@ read_get_mp_region_counts(struct read_entry * re, int st)
 
   int nip, sn, i, offset, region;
   int first, last, max, k;
-  unsigned int j;
+  unsigned int j, list_len;
+  genome_pos_t * list;
+  region_map_t * c, c_mp;
 
   nip = re->first_in_pair? 0 : 1;
   for (sn = 0; sn < n_seeds; sn++) {
     for (i = 0; re->min_kmer_pos + i + seed[sn].span - 1 < re->read_len; i++) {
       offset = sn*re->max_n_kmers + i;
-
-      if (genomemap_len[sn][re->mapidx[st][offset]] > list_cutoff)
+      list_len = genomemap_list_len(sn, re->mapidx[st][offset]);
+      if (list_len > list_cutoff)
 	continue;
+
+      if (genomemap_packed != NULL)
+	list_buf_reserve(list_len);
+      list = get_genomemap_list(sn, re->mapidx[st][offset], 0);
   
-      for (j = 0; j < genomemap_len[sn][re->mapidx[st][offset]]; j++) {
+      for (j = 0; j < list_len; j++) {
 #ifdef USE_PREFETCH
-	if (j + 4 < genomemap_len[sn][re->mapidx[st][offset]]) {
-	  int region_ahead = (int)(genomemap[sn][re->mapidx[st][offset]][j + 4] >> region_bits);
-	  _mm_prefetch((char *)&region_map[nip][st][region_ahead], _MM_HINT_T0);
-	  _mm_prefetch((char *)&region_map[1-nip][1-st][region_ahead], _MM_HINT_T0);
+	if (j + 4 < list_len) {
+	  int region_ahead = (int)(list[j + 4] >> region_bits);
+	  region_map_prefetch(nip, st, region_ahead);
+	  region_map_prefetch(1-nip, 1-st, region_ahead);
 	}
 #endif
 
-	region = (int)(genomemap[sn][re->mapidx[st][offset]][j] >> region_bits);
+	region = (int)(list[j] >> region_bits);
 
-	if (!RG_VALID_MP_CNT(region_map[nip][st][region])) {
+	c = region_map_get(nip, st, region);
+	if (!RG_VALID_MP_CNT(*c)) {
 	  first = MAX(0, region + re->delta_region_min[st]);
 	  last = MIN(n_regions - 1, region + re->delta_region_max[st]);
 	  max = 0;
 	  for (k = first; k <= last && max < 2; k++) {
-	    if (RG_GET_MAP_ID(region_map[1-nip][1-st][k]) == region_map_id) {
-	      max = (RG_GET_HAS_2(region_map[1-nip][1-st][k]) ? 2 : 1);
+	    c_mp = region_map_peek(1-nip, 1-st, k);
+	    if (RG_GET_MAP_ID(c_mp) == region_map_id) {
+	      max = (RG_GET_HAS_2(c_mp) ? 2 : 1);
 	    }
 	  }
-	  RG_SET_MP_CNT(region_map[nip][st][region], max);
+	  RG_SET_MP_CNT(*c, max);
 	}
 
 	if (region > 0
-	    && (genomemap[sn][re->mapidx[st][offset]][j] & ((1 << region_bits) - 1)) < (uint)region_overlap) {
+	    && (list[j] & ((1 << region_bits) - 1)) < (uint)region_overlap) {
 	  region--;
-	  if (!RG_VALID_MP_CNT(region_map[nip][st][region])) {
+	  c = region_map_get(nip, st, region);
+	  if (!RG_VALID_MP_CNT(*c)) {
 	    first = MAX(0, region + re->delta_region_min[st]);
 	    last = MIN(n_regions - 1, region + re->delta_region_max[st]);
 	    max = 0;
 	    for (k = first; k <= last && max < 2; k++) {
-	      if (RG_GET_MAP_ID(region_map[1-nip][1-st][k]) == region_map_id) {
-		max = (RG_GET_HAS_2(region_map[1-nip][1-st][k]) ? 2 : 1);
+	      c_mp = region_map_peek(1-nip, 1-st, k);
+	      if (RG_GET_MAP_ID(c_mp) == region_map_id) {
+		max = (RG_GET_HAS_2(c_mp) ? 2 : 1);
 	      }
 	    }
-	    RG_SET_MP_CNT(region_map[nip][st][region], max);
+	    RG_SET_MP_CNT(*c, max);
 	  }
 	}
       }
@@ -646,7 +926,7 @@ read_get_mp_region_counts(struct read_entry * re, struct read_entry * re_mp,
 static inline void
 advance_index_in_genomemap(struct read_entry * re, int st,
 			   struct anchor_list_options * options,
-			   uint * idx, uint max_idx, uint32_t * map, int * anchors_discarded)
+			   uint * idx, uint max_idx, genome_pos_t * map, int * anchors_discarded)
 {
   //int first, last, max, k;
   int nip = re->first_in_pair? 0 : 1;
@@ -656,12 +936,12 @@ advance_index_in_genomemap(struct read_entry * re, int st,
 #ifdef USE_PREFETCH
     if (*idx + 2 < max_idx) {
       int region_ahead = (int)(map[*idx + 2] >> region_bits);
-      _mm_prefetch((char *)&region_map[nip][st][region_ahead], _MM_HINT_T0);
+      region_map_prefetch(nip, st, region_ahead);
     }
 #endif
     int region = (int)(map[*idx] >> region_bits);
 
-    assert(RG_GET_MAP_ID(region_map[nip][st][region]) == region_map_id);
+    assert(RG_GET_MAP_ID(region_map_peek(nip, st, region)) == region_map_id);
 
     // if necessary, compute the mp counts
     if (options->use_mp_region_counts != 0)
@@ -703,8 +983,8 @@ advance_index_in_genomemap(struct read_entry * re, int st,
 	*/
 
 	// BEGIN COPY
-	count_main = (RG_GET_HAS_2(region_map[nip][st][region]) ? 2 : 1);
-	count_mp = RG_GET_MP_CNT(region_map[nip][st][region]);
+	count_main = (RG_GET_HAS_2(region_map_peek(nip, st, region)) ? 2 : 1);
+	count_mp = RG_GET_MP_CNT(region_map_peek(nip, st, region));
 	if ((options->use_mp_region_counts == 1 && (count_main >= 2 && count_mp >= 2))
 	    || (options->use_mp_region_counts == 2 && (count_main >= 2 || count_mp >= 2))
 	    || (options->use_mp_region_counts == 3 && (count_mp >= 1 && (count_main + count_mp) >= 3))
@@ -717,8 +997,8 @@ advance_index_in_genomemap(struct read_entry * re, int st,
           region--;
 
 	  //BEGIN PASTE
-	  count_main = (RG_GET_HAS_2(region_map[nip][st][region]) ? 2 : 1);
-	  count_mp = RG_GET_MP_CNT(region_map[nip][st][region]);
+	  count_main = (RG_GET_HAS_2(region_map_peek(nip, st, region)) ? 2 : 1);
+	  count_mp = RG_GET_MP_CNT(region_map_peek(nip, st, region));
 	  if ((options->use_mp_region_counts == 1 && (count_main >= 2 && count_mp >= 2))
 	      || (options->use_mp_region_counts == 2 && (count_main >= 2 || count_mp >= 2))
 	      || (options->use_mp_region_counts == 3 && (count_mp >= 1 && (count_main + count_mp) >= 3))
@@ -730,14 +1010,14 @@ advance_index_in_genomemap(struct read_entry * re, int st,
       }
     else  // don't use mp counts at all
       {
-	if (RG_GET_HAS_2(region_map[nip][st][region]))
+	if (RG_GET_HAS_2(region_map_peek(nip, st, region)))
 	  break;
 
 	if (region > 0
             && (map[*idx] & ((1 << region_bits) - 1)) < (uint)region_overlap) {
           region--;
 
-	  if (RG_GET_HAS_2(region_map[nip][st][region]))
+	  if (RG_GET_HAS_2(region_map_peek(nip, st, region)))
 	    break;
 	}
       }
@@ -858,16 +1138,77 @@ expand_anchor(read_entry * re, int st, anchor * a)
 */
 
 
+/*
+ * Tournament (loser) tree merging the k-mer lists of a read. Leaf j holds the
+ * head of list j, internal node p the loser of the match played there and
+ * node 0 the overall winner, so advancing the winner only replays its path to
+ * the root: one comparison per level against two for a heap. Ties go to the
+ * lower leaf; exhausted lists hold KMER_LIST_END.
+ */
+#define KMER_LIST_END ((genome_pos_t)-1)
+
+struct kmer_tourney {
+  genome_pos_t *	key;		/* n leaves */
+  uint *		node;		/* n nodes */
+  uint			n;
+};
+
+static inline bool
+kmer_tourney_less(struct kmer_tourney * t, uint a, uint b)
+{
+  return t->key[a] < t->key[b] || (t->key[a] == t->key[b] && a < b);
+}
+
+static void
+kmer_tourney_init(struct kmer_tourney * t)
+{
+  uint win[2 * t->n];
+  uint p, a, b;
+
+  for (p = 0; p < t->n; p++)
+    win[t->n + p] = p;
+  for (p = t->n - 1; p >= 1; p--) {
+    a = win[2*p];
+    b = win[2*p + 1];
+    if (kmer_tourney_less(t, a, b)) {
+      win[p] = a;
+      t->node[p] = b;
+    } else {
+      win[p] = b;
+      t->node[p] = a;
+    }
+  }
+  t->node[0] = win[1];
+}
+
+/* leaf j changed key: replay its matches up to the root */
+static inline void
+kmer_tourney_replay(struct kmer_tourney * t, uint j)
+{
+  uint p, w = j, tmp;
+
+  for (p = (t->n + j) / 2; p >= 1; p /= 2) {
+    if (kmer_tourney_less(t, t->node[p], w)) {
+      tmp = t->node[p];
+      t->node[p] = w;
+      w = tmp;
+    }
+  }
+  t->node[0] = w;
+}
+
+
 static void
 read_get_anchor_list_per_strand(struct read_entry * re, int st,
 				struct anchor_list_options * options)
 {
-  uint list_sz;
+  uint list_sz, list_start;
   uint offset;
   int i, sn;
   //uint * idx;
-  struct heap_uu h;
-  struct heap_uu_elem tmp;
+  struct kmer_tourney tt;
+  genome_pos_t pos;
+  uint leaf;
   int anchor_cache[re->read_len];
   int anchors_discarded = 0;
   int big_gaps = 0;
@@ -881,26 +1222,41 @@ read_get_anchor_list_per_strand(struct read_entry * re, int st,
   if ((st == 0 && !Fflag) || (st == 1 && !Cflag))
     return;
 
-  // compute estimate size of anchor list
+  // compute estimate size of anchor list; lists longer than the cutoff are skipped
+  genome_pos_t * list[n_seeds * re->max_n_kmers];
+  uint list_len[n_seeds * re->max_n_kmers];
   list_sz = 0;
   for (sn = 0; sn < n_seeds; sn++) {
     for (i = 0; re->min_kmer_pos + i + seed[sn].span - 1 < re->read_len; i++) {
       offset = sn*re->max_n_kmers + i;
-      if (genomemap_len[sn][re->mapidx[st][offset]] > list_cutoff)
-        continue;
-      list_sz += genomemap_len[sn][re->mapidx[st][offset]];
+      list_len[offset] = genomemap_list_len(sn, re->mapidx[st][offset]);
+      if (list_len[offset] > list_cutoff)
+        list_len[offset] = 0;
+      list_sz += list_len[offset];
     }
   }
   stat_add(&tpg.anchor_list_init_size, list_sz);
 
+  // get the lists, decoded one after the other in list_buf for a compressed index
+  if (genomemap_packed != NULL)
+    list_buf_reserve(list_sz);
+  list_start = 0;
+  for (sn = 0; sn < n_seeds; sn++) {
+    for (i = 0; re->min_kmer_pos + i + seed[sn].span - 1 < re->read_len; i++) {
+      offset = sn*re->max_n_kmers + i;
+      if (list_len[offset] > 0) {
+	list[offset] = get_genomemap_list(sn, re->mapidx[st][offset], list_start);
+	list_start += list_len[offset];
+      }
+    }
+  }
+
   // init anchor list
   //re->anchors[st] = (struct anchor *)xmalloc(list_sz * sizeof(re->anchors[0][0]));
   re->anchors[st] = (struct anchor *)
-    my_malloc(list_sz * sizeof(re->anchors[0][0]),
-	      &mem_mapping, "anchors [%s]", re->name);
+    my_arena_malloc(&read_arena, list_sz * sizeof(re->anchors[0][0]));
 
-  // init min heap, indices in genomemap lists, and anchor_cache
-  heap_uu_init(&h, n_seeds * re->max_n_kmers);
+  // init indices in genomemap lists and anchor_cache
   //idx = (uint *)xcalloc(n_seeds * re->max_n_kmers * sizeof(idx[0]));
   //uint32_t * idx = (uint32_t *)
   //  my_calloc(n_seeds * re->max_n_kmers * sizeof(idx[0]), &mem_mapping, "idx for read [%s]", re->name);
@@ -909,47 +1265,51 @@ read_get_anchor_list_per_strand(struct read_entry * re, int st,
   for (i = 0; i < re->read_len; i++)
     anchor_cache[i] = -1;
 
-  // load inital anchors in min heap
+  // one leaf per non-empty list, holding its first anchor
+  genome_pos_t tt_key[n_seeds * re->max_n_kmers];
+  uint tt_node[n_seeds * re->max_n_kmers];
+  uint leaf_offset[n_seeds * re->max_n_kmers];
+  tt.key = tt_key;
+  tt.node = tt_node;
+  tt.n = 0;
   for (sn = 0; sn < n_seeds; sn++) {
     for (i = 0; re->min_kmer_pos + i + seed[sn].span - 1 < re->read_len; i++) {
       offset = sn*re->max_n_kmers + i;
 
-      if (genomemap_len[sn][re->mapidx[st][offset]] > list_cutoff) {
-	idx[offset] = genomemap_len[sn][re->mapidx[st][offset]];
-      }
-
       if (options->use_region_counts) {
 	advance_index_in_genomemap(re, st, options,
-				   &idx[offset], genomemap_len[sn][re->mapidx[st][offset]],
-				   genomemap[sn][re->mapidx[st][offset]],
+				   &idx[offset], list_len[offset], list[offset],
 				   &anchors_discarded);
       }
 
-      if (idx[offset] < genomemap_len[sn][re->mapidx[st][offset]]) {
-	tmp.key = genomemap[sn][re->mapidx[st][offset]][idx[offset]];
-	tmp.rest = offset;
-	heap_uu_insert(&h, &tmp);
+      if (idx[offset] < list_len[offset]) {
+	tt.key[tt.n] = list[offset][idx[offset]];
+	leaf_offset[tt.n] = offset;
+	tt.n++;
 	idx[offset]++;
       }
     }
   }
+  if (tt.n > 0)
+    kmer_tourney_init(&tt);
 
-  while (h.load > 0) {
-    // extract min
-    heap_uu_get_min(&h, &tmp);
+  while (tt.n > 0 && tt.key[tt.node[0]] != KMER_LIST_END) {
+    // take the winner
+    leaf = tt.node[0];
+    pos = tt.key[leaf];
 
     // add to anchor list
-    offset = tmp.rest;
+    offset = leaf_offset[leaf];
     sn = offset / re->max_n_kmers;
     i = offset % re->max_n_kmers;
-    re->anchors[st][re->n_anchors[st]].x = tmp.key;
+    re->anchors[st][re->n_anchors[st]].x = pos;
     re->anchors[st][re->n_anchors[st]].y = re->min_kmer_pos + i;
     re->anchors[st][re->n_anchors[st]].length = seed[sn].span;
     re->anchors[st][re->n_anchors[st]].width = 1;
     re->anchors[st][re->n_anchors[st]].weight = 1;
     get_contig_num(re->anchors[st][re->n_anchors[st]].x, &re->anchors[st][re->n_anchors[st]].cn);
 
-    if (re->n_anchors[st] > 0 && tmp.key - re->anchors[st][re->n_anchors[st] - 1].x >= anchor_list_big_gap)
+    if (re->n_anchors[st] > 0 && (llint)pos - re->anchors[st][re->n_anchors[st] - 1].x >= anchor_list_big_gap)
       big_gaps++;
 
     re->n_anchors[st]++;
@@ -972,29 +1332,25 @@ read_get_anchor_list_per_strand(struct read_entry * re, int st,
 
     if (options->use_region_counts) {
       advance_index_in_genomemap(re, st, options,
-				 &idx[offset], genomemap_len[sn][re->mapidx[st][offset]],
-				 genomemap[sn][re->mapidx[st][offset]],
+				 &idx[offset], list_len[offset], list[offset],
 				 &anchors_discarded);
     }
 
     // load next anchor for that seed/mapidx
-    if (idx[offset] < genomemap_len[sn][re->mapidx[st][offset]]) {
-      tmp.key = genomemap[sn][re->mapidx[st][offset]][idx[offset]];
-      tmp.rest = offset;
-      heap_uu_replace_min(&h, &tmp);
+    if (idx[offset] < list_len[offset]) {
+      tt.key[leaf] = list[offset][idx[offset]];
       idx[offset]++;
     } else {
-      heap_uu_extract_min(&h, &tmp);
+      tt.key[leaf] = KMER_LIST_END;
     }
+    kmer_tourney_replay(&tt, leaf);
   }
 
-  heap_uu_destroy(&h);
   //free(idx);
   //my_free(idx, n_seeds * re->max_n_kmers * sizeof(idx[0]), &mem_mapping, "idx");
 
   re->anchors[st] = (struct anchor *)
-    my_realloc(re->anchors[st], re->n_anchors[st] * sizeof(re->anchors[0][0]), list_sz * sizeof(re->anchors[0][0]),
-	       &mem_mapping, "anchors [%s]", re->name);
+    my_arena_realloc(&read_arena, re->anchors[st], re->n_anchors[st] * sizeof(re->anchors[0][0]), list_sz * sizeof(re->anchors[0][0]));
 
   //if (hack)
   //  for (i = 0; i < re->n_anchors[st]; i++) {
@@ -1012,6 +1368,11 @@ read_get_anchor_list(struct read_entry * re, struct anchor_list_options * option
   //llint before = rdtsc(), after;
   TIME_COUNTER_START(tpg.anchor_list_tc);
 
+  if (!options->use_region_counts) {
+    // otherwise the region counts just walked the same lists
+    read_prefetch_lists(re, 0);
+    read_prefetch_lists(re, 1);
+  }
   read_get_anchor_list_per_strand(re, 0, options);
   read_get_anchor_list_per_strand(re, 1, options);
 
@@ -1042,8 +1403,7 @@ read_get_hit_list_per_strand(struct read_entry * re, int st, struct hit_list_opt
 
   //re->hits[st] = (struct read_hit *)xcalloc(re->n_anchors[st] * sizeof(re->hits[0][0]));
   re->hits[st] = (struct read_hit *)
-    my_calloc(re->n_anchors[st] * sizeof(re->hits[0][0]),
-	      &mem_mapping, "hits [%s]", re->name);
+    my_arena_calloc(&read_arena, re->n_anchors[st] * sizeof(re->hits[0][0]));
 
   for (i = 0; i < re->n_anchors[st]; i++) {
     // contig num of crt anchor
@@ -1055,7 +1415,7 @@ read_get_hit_list_per_strand(struct read_entry * re, int st, struct hit_list_opt
       w_len = (int)genome_len[cn];
 
     // set gstart and gend
-    gend = (re->anchors[st][i].x - contig_offsets[cn]) + re->read_len - 1 - re->anchors[st][i].y;
+    gend = (re->anchors[st][i].x - (llint)contig_offsets[cn]) + re->read_len - 1 - re->anchors[st][i].y;
     if (gend > genome_len[cn] - 1) {
       gend = genome_len[cn] - 1;
     }
@@ -1160,8 +1520,8 @@ read_get_hit_list_per_strand(struct read_entry * re, int st, struct hit_list_opt
 	// set goff
 	int x_len = (int)(re->anchors[st][i].x - re->anchors[st][max_idx].x) + re->anchors[st][i].length;
 
-	if ((re->window_len - x_len)/2 < re->anchors[st][max_idx].x - contig_offsets[cn]) {
-	  goff = (re->anchors[st][max_idx].x - contig_offsets[cn]) - (re->window_len - x_len)/2;
+	if ((re->window_len - x_len)/2 < re->anchors[st][max_idx].x - (llint)contig_offsets[cn]) {
+	  goff = (re->anchors[st][max_idx].x - (llint)contig_offsets[cn]) - (re->window_len - x_len)/2;
 	} else {
 	  goff = 0;
 	}
@@ -1172,13 +1532,13 @@ read_get_hit_list_per_strand(struct read_entry * re, int st, struct hit_list_opt
 	// compute anchor
 	if (max_idx < i) {
 	  a[0] = re->anchors[st][i];
-	  anchor_to_relative(&a[0], contig_offsets[cn] + goff);
+	  anchor_to_relative(&a[0], (llint)contig_offsets[cn] + goff);
 	  a[1] = re->anchors[st][max_idx];
-	  anchor_to_relative(&a[1], contig_offsets[cn] + goff);
+	  anchor_to_relative(&a[1], (llint)contig_offsets[cn] + goff);
 	  anchor_join(a, 2, &a[2]);
 	} else {
 	  a[2] = re->anchors[st][i];
-	  anchor_to_relative(&a[2], contig_offsets[cn] + goff);
+	  anchor_to_relative(&a[2], (llint)contig_offsets[cn] + goff);
 	}
 
 	// add hit
@@ -1223,8 +1583,7 @@ read_get_hit_list_per_strand(struct read_entry * re, int st, struct hit_list_opt
   }
 
   re->hits[st] = (struct read_hit *)
-    my_realloc(re->hits[st], re->n_hits[st] * sizeof(re->hits[0][0]), re->n_anchors[st] * sizeof(re->hits[0][0]),
-	       &mem_mapping, "hits [%s]", re->name);
+    my_arena_realloc(&read_arena, re->hits[st], re->n_hits[st] * sizeof(re->hits[0][0]), re->n_anchors[st] * sizeof(re->hits[0][0]));
 
 }
 
@@ -1258,84 +1617,174 @@ read_get_hit_list(struct read_entry * re, struct hit_list_options * options)
 }
 
 
+/*
+ * Gapped windows of one read strand waiting for the vector filter.
+ */
+struct pass1_batch {
+  int n;
+  int idx[F1_BATCH_MAX];
+  struct sw_vector_window w[F1_BATCH_MAX];
+  uint32_t * read;
+  int init_bp;
+};
+
+
+/*
+ * Would hit rh be dropped for overlapping the good window at (cn, g_off)?
+ */
+static inline bool
+pass1_overlaps(struct read_entry * re, struct pass1_options * options,
+	       struct read_hit * rh, int cn, unsigned int g_off)
+{
+  return cn >= 0
+    && rh->cn == cn
+    && rh->g_off_pos_strand + (unsigned int)abs_or_pct(options->window_overlap, re->window_len) <= g_off + re->window_len;
+}
+
+
+static inline void
+pass1_set_score(struct read_entry * re, struct read_hit * rh, struct pass1_options * options,
+		int score, int * last_good_cn, unsigned int * last_good_g_off)
+{
+  rh->score_vector = score;
+  rh->pct_score_vector = (1000 * 100 * rh->score_vector)/rh->score_max;
+  if (rh->score_vector >= (int)abs_or_pct(options->threshold, rh->score_max)) {
+    *last_good_cn = rh->cn;
+    *last_good_g_off = rh->g_off_pos_strand;
+  }
+}
+
+
+/*
+ * Score the pending windows, then apply the results in hit order.
+ */
+static void
+pass1_flush(struct read_entry * re, int st, struct pass1_options * options, struct pass1_batch * b,
+	    int * last_good_cn, unsigned int * last_good_g_off)
+{
+  int k;
+
+  if (b->n == 0)
+    return;
+
+  f1_run_batch(b->w, b->n, b->read, re->read_len, b->init_bp, genome_is_rna, f1_hash_tag);
+
+  for (k = 0; k < b->n; k++)
+    pass1_set_score(re, &re->hits[st][b->idx[k]], options, b->w[k].score,
+		    last_good_cn, last_good_g_off);
+
+  b->n = 0;
+}
+
+
+/*
+ * Run the vector filter on every hit not covered by an earlier good one.
+ *
+ * Gapped windows are queued and scored in batches. A hit is only queued when
+ * no pending window could, by turning out good, make it overlap; otherwise
+ * the batch is settled first, so the outcome is the same as scoring the hits
+ * one at a time.
+ */
 static void
 read_pass1_per_strand(struct read_entry * re, int st, struct pass1_options * options)
 {
-  int i;
+  int i, k;
   int last_good_cn = -1;
   unsigned int last_good_g_off = 0; // init not needed
+  struct pass1_batch b;
 
   f1_hash_tag++;
+  b.n = 0;
 
   for (i = 0; i < re->n_hits[st]; i++) {
-    if (options->only_paired && re->hits[st][i].pair_min < 0) {
+    struct read_hit * rh = &re->hits[st][i];
+
+    if (options->only_paired && rh->pair_min < 0) {
       continue;
     }
 
-    if (re->hits[st][i].matches < options->min_matches) {
+    if (rh->matches < options->min_matches) {
       continue;
     }
 
     // if this hit is saved, leave it be, but update last_good
-    if (re->hits[st][i].saved == 1) {
-      last_good_cn = re->hits[st][i].cn;
-      last_good_g_off = re->hits[st][i].g_off_pos_strand;
+    if (rh->saved == 1) {
+      pass1_flush(re, st, options, &b, &last_good_cn, &last_good_g_off);
+      last_good_cn = rh->cn;
+      last_good_g_off = rh->g_off_pos_strand;
       continue;
     }
 
+    // settle pending windows this one could depend on
+    if (b.n > 0) {
+      bool dep = pass1_overlaps(re, options, rh, last_good_cn, last_good_g_off);
+
+      for (k = 0; k < b.n && !dep; k++)
+	dep = pass1_overlaps(re, options, rh, re->hits[st][b.idx[k]].cn,
+			     re->hits[st][b.idx[k]].g_off_pos_strand);
+      if (dep)
+	pass1_flush(re, st, options, &b, &last_good_cn, &last_good_g_off);
+    }
+
     // check window overlap
-    if (last_good_cn >= 0
-	&& re->hits[st][i].cn == last_good_cn
-	&& re->hits[st][i].g_off_pos_strand + (unsigned int)abs_or_pct(options->window_overlap, re->window_len) <= last_good_g_off + re->window_len) {
-      re->hits[st][i].score_vector = 0;
-      re->hits[st][i].pct_score_vector = 0;
+    if (pass1_overlaps(re, options, rh, last_good_cn, last_good_g_off)) {
+      rh->score_vector = 0;
+      rh->pct_score_vector = 0;
       continue;
     }
 
-    if (re->hits[st][i].score_vector <= 0) {
+    if (rh->score_vector <= 0) {
+      uint32_t * genome;
+      uint32_t * genome_ls = NULL;
+      uint32_t * read;
+      int init_bp = -1;
 
       if (shrimp_mode == MODE_COLOUR_SPACE)
 	{
-	  uint32_t ** gen_cs;
-	  uint32_t ** gen_ls;
-	  struct read_hit * rh = &re->hits[st][i];
-
 	  if (rh->st != re->input_strand)
-	    reverse_hit(re, &re->hits[st][i]);
+	    reverse_hit(re, rh);
 
-	  if (re->hits[st][i].gen_st == 0) {
-	    gen_cs = genome_cs_contigs;
-	    gen_ls = genome_contigs;
+	  if (rh->gen_st == 0) {
+	    genome = genome_cs_contigs[rh->cn];
+	    genome_ls = genome_contigs[rh->cn];
 	  } else {
-	    gen_cs = genome_cs_contigs_rc;
-	    gen_ls = genome_contigs_rc;
+	    genome = genome_cs_contigs_rc[rh->cn];
+	    genome_ls = genome_contigs_rc[rh->cn];
 	  }
-
-	  re->hits[st][i].score_vector = f1_run(gen_cs[re->hits[st][i].cn], genome_len[re->hits[st][i].cn],
-						re->hits[st][i].g_off, re->hits[st][i].w_len,
-						re->read[rh->st], re->read_len,
-						re->hits[st][i].g_off + re->hits[st][i].anchor.x, re->hits[st][i].anchor.y,
-						gen_ls[re->hits[st][i].cn], re->initbp[st], genome_is_rna, f1_hash_tag,
-						options->gapless);
+	  read = re->read[rh->st];
+	  init_bp = re->initbp[st];
 	}
       else
 	{
-	  re->hits[st][i].score_vector = f1_run(genome_contigs[re->hits[st][i].cn], genome_len[re->hits[st][i].cn],
-						re->hits[st][i].g_off, re->hits[st][i].w_len,
-						re->read[st], re->read_len,
-						re->hits[st][i].g_off + re->hits[st][i].anchor.x, re->hits[st][i].anchor.y,
-						NULL, -1, genome_is_rna, f1_hash_tag,
-						options->gapless);
+	  genome = genome_contigs[rh->cn];
+	  read = re->read[st];
 	}
 
-      re->hits[st][i].pct_score_vector = (1000 * 100 * re->hits[st][i].score_vector)/re->hits[st][i].score_max;
-      if (re->hits[st][i].score_vector >= (int)abs_or_pct(options->threshold, re->hits[st][i].score_max)) {
-	last_good_cn = re->hits[st][i].cn;
-	last_good_g_off = re->hits[st][i].g_off_pos_strand;
+      if (options->gapless) {
+	pass1_set_score(re, rh, options,
+			f1_run(genome, genome_len[rh->cn], rh->g_off, rh->w_len,
+			       read, re->read_len,
+			       rh->g_off + rh->anchor.x, rh->anchor.y,
+			       genome_ls, init_bp, genome_is_rna, f1_hash_tag,
+			       true),
+			&last_good_cn, &last_good_g_off);
+	continue;
       }
+
+      b.idx[b.n] = i;
+      b.w[b.n].genome = genome;
+      b.w[b.n].genome_ls = genome_ls;
+      b.w[b.n].goff = rh->g_off;
+      b.w[b.n].glen = rh->w_len;
+      b.read = read;
+      b.init_bp = init_bp;
+      if (++b.n == F1_BATCH_MAX)
+	pass1_flush(re, st, options, &b, &last_good_cn, &last_good_g_off);
     }
 
   }
+
+  pass1_flush(re, st, options, &b, &last_good_cn, &last_good_g_off);
 }
 
 
@@ -1611,7 +2060,7 @@ hit_run_post_sw(struct read_entry * re, struct read_hit * rh)
 {
   //fprintf(stderr, "running post sw for read: [%s]\n", re->name);
   if (shrimp_mode == MODE_COLOUR_SPACE) {
-    post_sw(re->read[rh->st], re->initbp[rh->st], re->qual, rh->sfrp);
+    post_sw(re->read[rh->st], re->initbp[rh->st], re->qual, rh->sfrp, false);
   } else { // LS: cheat; reuse SW score to get posterior
     rh->sfrp->posterior = pow(2.0, ((double)rh->sfrp->score - (double)rh->sfrp->rmapped * (2.0 * score_alpha + score_beta))/score_alpha);
   }
@@ -1625,6 +2074,21 @@ hit_run_post_sw(struct read_entry * re, struct read_hit * rh)
 }
 
 
+/*
+ * Base calls and qualities from the posteriors, for a hit selected for
+ * output; hit_run_post_sw() only computed what the mapping qualities need.
+ */
+static void
+hit_decode_post_sw(struct read_entry * re, struct read_hit * rh)
+{
+  if (shrimp_mode != MODE_COLOUR_SPACE || !compute_mapping_qualities
+      || rh->sfrp->score <= 0 || rh->sfrp->qual != NULL)
+    return;
+
+  post_sw(re->read[rh->st], re->initbp[rh->st], re->qual, rh->sfrp, true);
+}
+
+
 /*
  * Do a final pass for given read.
  */
@@ -1725,6 +2189,7 @@ read_pass2(struct read_entry * re,
   for (i = 0; i < *n_hits_pass2; i++) {
     hits_pass2[i]->saved = 1;
     hits_pass2[i]->sfrp->in_use = true;
+    hit_decode_post_sw(re, hits_pass2[i]);
   }
 
   // update counts
@@ -1757,10 +2222,9 @@ read_save_final_hits(read_entry * re, read_hit * * hits_pass2, int n_hits_pass2)
 
   // make room for new hits
   re->final_unpaired_hits = (read_hit *)
-      my_realloc(re->final_unpaired_hits,
+      my_arena_realloc(&read_arena, re->final_unpaired_hits,
 	  (re->n_final_unpaired_hits + n_hits_pass2) * sizeof(re->final_unpaired_hits[0]),
-	  re->n_final_unpaired_hits * sizeof(re->final_unpaired_hits[0]),
-	  &mem_mapping, "final_unpaired_hits [%s]", re->name);
+	  re->n_final_unpaired_hits * sizeof(re->final_unpaired_hits[0]));
   for (i = 0; i < n_hits_pass2; i++) {
     memcpy(&re->final_unpaired_hits[re->n_final_unpaired_hits + i], hits_pass2[i], sizeof(*hits_pass2[0]));
     // erase sfrp structs to prevent them from being freed too early
@@ -1797,12 +2261,12 @@ handle_read(struct read_entry * re, struct read_mapping_options_t * options, int
     }
 
     if (options[option_index].anchor_list.recompute) {
-      read_free_anchor_list(re, &mem_mapping);
+      read_free_anchor_list(re, &read_arena);
       read_get_anchor_list(re, &options[option_index].anchor_list);
     }
 
     if (options[option_index].hit_list.recompute) {
-      read_free_hit_list(re, &mem_mapping);
+      read_free_hit_list(re, &read_arena);
       read_get_hit_list(re, &options[option_index].hit_list);
     }
 
@@ -1811,12 +2275,12 @@ handle_read(struct read_entry * re, struct read_mapping_options_t * options, int
     }
 
     hits_pass1 = (struct read_hit * *)
-      my_malloc(options[option_index].pass1.num_outputs * sizeof(hits_pass1[0]), &mem_mapping, "hits_pass1 [%s]", re->name);
+      my_arena_malloc(&read_arena, options[option_index].pass1.num_outputs * sizeof(hits_pass1[0]));
     n_hits_pass1 = 0;
     read_get_vector_hits(re, hits_pass1, &n_hits_pass1, &options[option_index].pass1);
 
     hits_pass2 = (struct read_hit * *)
-      my_malloc(options[option_index].pass1.num_outputs * sizeof(hits_pass2[0]), &mem_mapping, "hits_pass2 [%s]", re->name);
+      my_arena_malloc(&read_arena, options[option_index].pass1.num_outputs * sizeof(hits_pass2[0]));
     n_hits_pass2 = 0;
     done = read_pass2(re, hits_pass1, n_hits_pass1, hits_pass2, &n_hits_pass2, &options[option_index].pass2);
 
@@ -1834,9 +2298,9 @@ handle_read(struct read_entry * re, struct read_mapping_options_t * options, int
     // free pass1 structs
     for (i = 0; i < n_hits_pass1; i++)
       if (hits_pass1[i]->sfrp != NULL && !hits_pass1[i]->sfrp->in_use)
-	free_sfrp(&hits_pass1[i]->sfrp, re, &mem_mapping);
-    my_free(hits_pass1, options[option_index].pass1.num_outputs * sizeof(hits_pass1[0]), &mem_mapping, "hits_pass1 [%s]", re->name);
-    my_free(hits_pass2, options[option_index].pass1.num_outputs * sizeof(hits_pass2[0]), &mem_mapping, "hits_pass2 [%s]", re->name);
+	free_sfrp(&hits_pass1[i]->sfrp, re, &read_arena);
+    my_arena_free(&read_arena, hits_pass2);
+    my_arena_free(&read_arena, hits_pass1);
 
   } while (!done && ++option_index < n_options);
 
@@ -1873,6 +2337,13 @@ DEF_EXTHEAP(struct read_hit_pair, paired_pass1)
 
 /*
  * Go through the hit lists, constructing paired hits.
+ *
+ * The mate windows only move forward (see readpair_pair_up_hits), so the best
+ * vector score and the smallest score_max in the current window are kept in
+ * two monotone queues. Together with the score of the hit, they bound every
+ * pair the window can make; a window whose bound misses the threshold, or
+ * cannot beat the worst pair in a full heap, is skipped as a whole. Pairs of
+ * repeats, where windows are long and scores alike, mostly end up there.
  */
 static void
 readpair_get_vector_hits(struct read_entry * re1, struct read_entry * re2,
@@ -1883,6 +2354,8 @@ readpair_get_vector_hits(struct read_entry * re1, struct read_entry * re2,
   TIME_COUNTER_START(tpg.get_vector_hits_tc);
 
   int st1, st2, i, j;
+  int * q_score, * q_max;	// indices of mates, by decreasing score_vector and increasing score_max
+  int qs_head, qs_tail, qm_head, qm_tail, next, bound, bound_max;
   read_hit_pair tmp;
 
   assert(re1 != NULL && re2 != NULL && a != NULL);
@@ -1890,11 +2363,44 @@ readpair_get_vector_hits(struct read_entry * re1, struct read_entry * re2,
   for (st1 = 0; st1 < 2; st1++) {
     st2 = 1 - st1; // opposite strand
 
+    if (re1->n_hits[st1] == 0 || re2->n_hits[st2] == 0)
+      continue;
+    q_score = (int *)my_arena_malloc(&read_arena, 2 * re2->n_hits[st2] * sizeof(q_score[0]));
+    q_max = q_score + re2->n_hits[st2];
+    qs_head = qs_tail = qm_head = qm_tail = 0;
+    next = 0;
+
     for (i = 0; i < re1->n_hits[st1]; i++) {
       if (re1->hits[st1][i].saved == 1) continue;
       if (re1->hits[st1][i].pair_min < 0)
 	continue;
 
+      // slide the window to [pair_min, pair_max]; saved mates never pair
+      for (; next <= re1->hits[st1][i].pair_max; next++) {
+	if (re2->hits[st2][next].saved == 1)
+	  continue;
+	while (qs_tail > qs_head && re2->hits[st2][q_score[qs_tail - 1]].score_vector <= re2->hits[st2][next].score_vector)
+	  qs_tail--;
+	q_score[qs_tail++] = next;
+	while (qm_tail > qm_head && re2->hits[st2][q_max[qm_tail - 1]].score_max >= re2->hits[st2][next].score_max)
+	  qm_tail--;
+	q_max[qm_tail++] = next;
+      }
+      while (qs_head < qs_tail && q_score[qs_head] < re1->hits[st1][i].pair_min)
+	qs_head++;
+      while (qm_head < qm_tail && q_max[qm_head] < re1->hits[st1][i].pair_min)
+	qm_head++;
+      if (qs_head == qs_tail)
+	continue;
+
+      bound = re1->hits[st1][i].score_vector + re2->hits[st2][q_score[qs_head]].score_vector;
+      bound_max = re1->hits[st1][i].score_max + re2->hits[st2][q_max[qm_head]].score_max;
+      if (bound < (int)abs_or_pct(options->pass1_threshold, bound_max))
+	continue;
+      if (*load == options->pass1_num_outputs
+	  && (IS_ABSOLUTE(options->pass1_threshold)? bound : (bound < 0? 0 : (1000 * 100 * bound)/bound_max)) <= a[0].key)
+	continue;
+
       for (j = re1->hits[st1][i].pair_min; j <= re1->hits[st1][i].pair_max; j++) {
 	if (re2->hits[st2][j].saved == 1) continue;
 	//if (re1->hits[st1][i].matches + re2->hits[st2][j].matches < options->min_num_matches)
@@ -1924,6 +2430,7 @@ readpair_get_vector_hits(struct read_entry * re1, struct read_entry * re2,
 	}
       }
     }
+    my_arena_free(&read_arena, q_score);
   }
 
   //after = rdtsc();
@@ -2287,8 +2794,10 @@ readpair_pass2(struct read_entry * re1, struct read_entry * re2,
   for (i = 0; i < *n_hits_pass2; i++) {
     hits_pass2[i].rh[0]->saved = 1;
     hits_pass2[i].rh[0]->sfrp->in_use = true;
+    hit_decode_post_sw(re1, hits_pass2[i].rh[0]);
     hits_pass2[i].rh[1]->saved = 1;
     hits_pass2[i].rh[1]->sfrp->in_use = true;
+    hit_decode_post_sw(re2, hits_pass2[i].rh[1]);
   }
 
   // update counts
@@ -2452,10 +2961,9 @@ readpair_save_final_hits(pair_entry * pe, read_hit_pair * hits_pass2, int n_hits
 
   // first, copy array of paired hit entries
   pe->final_paired_hits = (struct read_hit_pair *)
-    my_realloc(pe->final_paired_hits,
+    my_arena_realloc(&read_arena, pe->final_paired_hits,
 	(pe->n_final_paired_hits + n_hits_pass2) * sizeof(pe->final_paired_hits[0]),
-	pe->n_final_paired_hits * sizeof(pe->final_paired_hits[0]),
-	&mem_mapping, "final_paired_hits [%s,%s]", pe->re[0]->name, pe->re[1]->name);
+	pe->n_final_paired_hits * sizeof(pe->final_paired_hits[0]));
   memcpy(&pe->final_paired_hits[pe->n_final_paired_hits], hits_pass2, n_hits_pass2 * sizeof(pe->final_paired_hits[0]));
 
   // next, copy read_hit entries to persistent pool
@@ -2465,10 +2973,9 @@ readpair_save_final_hits(pair_entry * pe, read_hit_pair * hits_pass2, int n_hits
       if (pe->final_paired_hits[pe->n_final_paired_hits + i].rh[nip] != NULL) {
 	// no, need to move it now
 	pe->final_paired_hit_pool[nip] = (read_hit *)
-	  my_realloc(pe->final_paired_hit_pool[nip],
+	  my_arena_realloc(&read_arena, pe->final_paired_hit_pool[nip],
 	      (pe->final_paired_hit_pool_size[nip] + 1) * sizeof(pe->final_paired_hit_pool[nip][0]),
-	      pe->final_paired_hit_pool_size[nip] * sizeof(pe->final_paired_hit_pool[nip][0]),
-	      &mem_mapping, "final_paired_hit_pool[%d] [%s,%s]", nip, pe->re[0]->name, pe->re[1]->name);
+	      pe->final_paired_hit_pool_size[nip] * sizeof(pe->final_paired_hit_pool[nip][0]));
 	pe->final_paired_hit_pool_size[nip]++;
 	rhp = &pe->final_paired_hit_pool[nip][pe->final_paired_hit_pool_size[nip] - 1];
 	memcpy(rhp, pe->final_paired_hits[pe->n_final_paired_hits + i].rh[nip], sizeof(read_hit));
@@ -2484,10 +2991,9 @@ readpair_save_final_hits(pair_entry * pe, read_hit_pair * hits_pass2, int n_hits
 	    rhpp->rh[nip] = NULL;
 	    rhpp->rh_idx[nip] = pe->final_paired_hit_pool_size[nip] - 1;
 	    rhp->paired_hit_idx = (int *)
-		my_realloc(rhp->paired_hit_idx,
+		my_arena_realloc(&read_arena, rhp->paired_hit_idx,
 		    (rhp->n_paired_hit_idx + 1) * sizeof(rhp->paired_hit_idx[0]),
-		    rhp->n_paired_hit_idx * sizeof(rhp->paired_hit_idx[0]),
-		    &mem_mapping, "paired_hits [%s]", pe->re[nip]->name);
+		    rhp->n_paired_hit_idx * sizeof(rhp->paired_hit_idx[0]));
 	    rhp->n_paired_hit_idx++;
 	    rhp->paired_hit_idx[rhp->n_paired_hit_idx - 1] = pe->n_final_paired_hits + j;
 	  }
@@ -2515,8 +3021,10 @@ handle_readpair(pair_entry * pe,
 
   llint before = gettimeinusecs();
 
-  read_get_mapidxs(re1);
-  read_get_mapidxs(re2);
+  if (re1->mapidx[0] == NULL)
+    read_get_mapidxs(re1);
+  if (re2->mapidx[0] == NULL)
+    read_get_mapidxs(re2);
 
   do {
     readpair_compute_mp_ranges(re1, re2, &options[option_index].pairing);
@@ -2540,20 +3048,20 @@ handle_readpair(pair_entry * pe,
     }
 
     if (options[option_index].read[0].anchor_list.recompute) {
-      read_free_anchor_list(re1, &mem_mapping);
+      read_free_anchor_list(re1, &read_arena);
       read_get_anchor_list(re1, &options[option_index].read[0].anchor_list);
     }
     if (options[option_index].read[1].anchor_list.recompute) {
-      read_free_anchor_list(re2, &mem_mapping);
+      read_free_anchor_list(re2, &read_arena);
       read_get_anchor_list(re2, &options[option_index].read[1].anchor_list);
     }
 
     if (options[option_index].read[0].hit_list.recompute) {
-      read_free_hit_list(re1, &mem_mapping);
+      read_free_hit_list(re1, &read_arena);
       read_get_hit_list(re1, &options[option_index].read[0].hit_list);
     }
     if (options[option_index].read[1].hit_list.recompute) {
-      read_free_hit_list(re2, &mem_mapping);
+      read_free_hit_list(re2, &read_arena);
       read_get_hit_list(re2, &options[option_index].read[1].hit_list);
     }
 
@@ -2567,12 +3075,12 @@ handle_readpair(pair_entry * pe,
     }
 
     hits_pass1 = (struct read_hit_pair *)
-      my_malloc(options[option_index].pairing.pass1_num_outputs * sizeof(hits_pass1[0]), &mem_mapping, "hits_pass1 [%s,%s]", re1->name, re2->name);
+      my_arena_malloc(&read_arena, options[option_index].pairing.pass1_num_outputs * sizeof(hits_pass1[0]));
     n_hits_pass1 = 0;
     readpair_get_vector_hits(re1, re2, hits_pass1, &n_hits_pass1, &options[option_index].pairing);
 
     hits_pass2 = (struct read_hit_pair *)
-      my_malloc(options[option_index].pairing.pass1_num_outputs * sizeof(hits_pass2[0]), &mem_mapping, "hits_pass2 [%s,%s]", re1->name, re2->name);
+      my_arena_malloc(&read_arena, options[option_index].pairing.pass1_num_outputs * sizeof(hits_pass2[0]));
     n_hits_pass2 = 0;
     done = readpair_pass2(re1, re2, hits_pass1, n_hits_pass1, hits_pass2, &n_hits_pass2, &options[option_index].pairing,
 			  &options[option_index].read[0].pass2, &options[option_index].read[1].pass2);
@@ -2592,13 +3100,13 @@ handle_readpair(pair_entry * pe,
 
     for (i = 0; i < n_hits_pass1; i++) {
       if (hits_pass1[i].rh[0]->sfrp != NULL && !hits_pass1[i].rh[0]->sfrp->in_use)
-	free_sfrp(&hits_pass1[i].rh[0]->sfrp, re1, &mem_mapping);
+	free_sfrp(&hits_pass1[i].rh[0]->sfrp, re1, &read_arena);
       if (hits_pass1[i].rh[1]->sfrp != NULL && !hits_pass1[i].rh[1]->sfrp->in_use)
-	free_sfrp(&hits_pass1[i].rh[1]->sfrp, re2, &mem_mapping);
+	free_sfrp(&hits_pass1[i].rh[1]->sfrp, re2, &read_arena);
     }
 
-    my_free(hits_pass1, options[option_index].pairing.pass1_num_outputs * sizeof(hits_pass1[0]), &mem_mapping, "hits_pass1 [%s,%s]", re1->name, re2->name);
-    my_free(hits_pass2, options[option_index].pairing.pass1_num_outputs * sizeof(hits_pass2[0]), &mem_mapping, "hits_pass2 [%s,%s]", re1->name, re2->name);
+    my_arena_free(&read_arena, hits_pass2);
+    my_arena_free(&read_arena, hits_pass1);
 
   } while (!done && ++option_index < n_options);
 
@@ -20,6 +20,10 @@
 #endif
 
 
+void		read_get_kmers(read_entry *);
+void		read_prefetch(read_entry *);
+void		region_map_init();
+void		region_map_free();
 void		handle_read(read_entry *, struct read_mapping_options_t *, int);
 void		handle_readpair(pair_entry *, struct readpair_mapping_options_t *, int);
 int		get_insert_size(read_hit *, read_hit *);
@@ -7,216 +7,301 @@
 #include "../common/output.h"
 #include "mapping.h"
 #include "../common/sw-full-common.h"
+#include "../common/bgzf.h"
 
 
-/*
-	read_start and read_end are 1 based
-*/
-static cigar_t *
-make_cigar(int read_start, int read_end , int read_length, char* qralign,char* dbalign)
+static void
+reverse_cigar(uint32_t * cigar, int n_cigar)
 {
-	cigar_t * cigar = (cigar_t*)xmalloc(sizeof(cigar_t));
-	cigar->size=2; 
-	assert(cigar->size>=2); //for start and end without loop
-	cigar->ops=(char*)xmalloc(sizeof(char)*cigar->size);
-	cigar->lengths=(uint32_t*)xmalloc(sizeof(uint32_t)*cigar->size);
-	int used=0;
-	if (read_start>1) {
-		assert(cigar->size-used>0);
-		cigar->ops[used]='S';
-		cigar->lengths[used]=read_start-1;
-		used++;
-	}
-	int i=0; int qralign_length=strlen(qralign);
-	while (i<qralign_length) {
-		int length; char op;
-		if (qralign[i]=='-') {
-			for (length=0; qralign[i+length]=='-' && i+length<qralign_length; length++);
-			op='D';
-		} else if (dbalign[i]=='-') {
-			for (length=0; dbalign[i+length]=='-' && i+length<qralign_length; length++);
-			op='I';
-		} else {
-			for (length=0; dbalign[i+length]!='-' && qralign[i+length]!='-' && i+length<qralign_length; length++);
-			op='M';
-		}
-		while ((used+1)>=cigar->size) { //make it bigger, want to make sure have enough for one more after loop!
-			assert(cigar->size!=0);
-			cigar->size*=2;
-			cigar->ops=(char*)xrealloc(cigar->ops,sizeof(char)*cigar->size);
-			cigar->lengths=(uint32_t*)xrealloc(cigar->lengths,sizeof(uint32_t)*cigar->size);			
-		}
-		cigar->ops[used]=op;
-		cigar->lengths[used]=length;
-		i+=length;
-		used++;		
-	}
-	if (read_end!=read_length) {
-		assert(used<cigar->size); //by loop invariant and initial size >=2
-		cigar->ops[used]='S';
-		cigar->lengths[used]=read_length-read_end; 
-		used++;
+	int i;
+	for (i=0; i<n_cigar/2; i++) {
+		uint32_t tmp=cigar[i];
+		cigar[i]=cigar[n_cigar-i-1];
+		cigar[n_cigar-i-1]=tmp;
 	}
-	cigar->ops=(char*)xrealloc(cigar->ops,sizeof(char)*used);
-	cigar->lengths=(uint32_t*)xrealloc(cigar->lengths,sizeof(uint32_t)*used);
-	cigar->size=used;
-	return cigar;
-} 
+}
+
+
+/*
+ * Record emission. In SAM mode fields and tags are printed as text; with --bam
+ * the same calls encode a binary BAM record in the thread output buffer, which
+ * the mapping thread compresses into BGZF blocks once its chunk is done.
+ */
+static inline char *
+bam_put(char * p, void const * x, size_t n)
+{
+  memcpy(p, x, n);
+  return p + n;
+}
+
+static inline char *
+bam_put_i32(char * p, int32_t x)
+{
+  return bam_put(p, &x, sizeof(x));
+}
+
+/* make sure n more bytes fit before the end of the thread output buffer */
+static inline void
+bam_check_space(char const * p, char const * end, size_t n)
+{
+  if ((size_t)(end - p) < n)
+    crash(1, 0, "BAM record does not fit in the thread output buffer (%zu bytes needed, %zu left)",
+	  n, (size_t)(end - p));
+}
+
+/* the BAI bin of the 0-based half-open interval [beg,end) */
+static int
+bam_reg2bin(int beg, int end)
+{
+  --end;
+  if (beg >> 14 == end >> 14) return ((1 << 15) - 1) / 7 + (beg >> 14);
+  if (beg >> 17 == end >> 17) return ((1 << 12) - 1) / 7 + (beg >> 17);
+  if (beg >> 20 == end >> 20) return ((1 << 9) - 1) / 7 + (beg >> 20);
+  if (beg >> 23 == end >> 23) return ((1 << 6) - 1) / 7 + (beg >> 23);
+  if (beg >> 26 == end >> 26) return ((1 << 3) - 1) / 7 + (beg >> 26);
+  return 0;
+}
+
+static inline uint8_t
+bam_seq_code(char c)
+{
+  static char const codes[] = "=ACMGRSVTWYHKDBN";
+  char const * s = strchr(codes, c);
 
+  return (s != NULL && *s != '\0' ? s - codes : 15);
+}
 
+/*
+ * Output the mandatory fields. pos and mpos are 1-based, 0 if not set; ref_id
+ * and mate_ref_id are contig indices, -1 for "*". cigar holds n_cigar edit
+ * operations (see sw-full-common.h), none for "*".
+ */
 static void
-reverse_cigar(cigar_t * cigar)
+output_fields(char ** output_buffer, char * output_buffer_end,
+	      char const * qname, int flag, int ref_id, char const * rname, int pos, int mapq,
+	      uint32_t const * cigar, int n_cigar, int mate_ref_id, char const * mrnm, int mpos,
+	      int isize, char const * seq, char const * qual)
 {
-	char ops[cigar->size];
-	uint32_t lengths[cigar->size];
-	memcpy(ops,cigar->ops,sizeof(char)*cigar->size);
-	memcpy(lengths,cigar->lengths,sizeof(uint32_t)*cigar->size);
-	int i;	
-	for (i=0; i<cigar->size; i++) {
-		cigar->ops[i]=ops[cigar->size-i-1];
-		cigar->lengths[i]=lengths[cigar->size-i-1];
-	}
-	return;
+  int i;
+
+  if (!bam_output) {
+    *output_buffer += snprintf(*output_buffer, output_buffer_end - *output_buffer,
+			       "%s\t%i\t%s\t%u\t%i\t",
+			       qname, flag, rname, pos, mapq);
+    if (n_cigar == 0)
+      *output_buffer += snprintf(*output_buffer, output_buffer_end - *output_buffer, "*");
+    for (i = 0; i < n_cigar; i++) {
+      *output_buffer += snprintf(*output_buffer, output_buffer_end - *output_buffer, "%u%c",
+				 SW_OP_LEN(cigar[i]), SW_OP_CHARS[SW_OP_TYPE(cigar[i])]);
+    }
+    *output_buffer += snprintf(*output_buffer, output_buffer_end - *output_buffer,
+			       "\t%s\t%u\t%i\t%s\t%s",
+			       mrnm, mpos, isize, seq, qual);
+    return;
+  }
+
+  char * p = *output_buffer + sizeof(int32_t); // block_size is set by output_end_record()
+  int l_qname = MIN((int)strlen(qname), 254) + 1; // l_read_name is 8 bits, NUL included
+  int l_seq = (strcmp(seq, "*") == 0 ? 0 : strlen(seq));
+  int ref_len = 0;
+
+  bam_check_space(*output_buffer, output_buffer_end,
+		  9 * sizeof(int32_t) + l_qname + n_cigar * sizeof(cigar[0]) + (l_seq + 1) / 2 + l_seq);
+
+  for (i = 0; i < n_cigar; i++) {
+    if (strchr("MDN=X", SW_OP_CHARS[SW_OP_TYPE(cigar[i])]) != NULL)
+      ref_len += SW_OP_LEN(cigar[i]);
+  }
+
+  p = bam_put_i32(p, ref_id);
+  p = bam_put_i32(p, pos - 1);
+  p = bam_put_i32(p, (bam_reg2bin(pos - 1, pos - 1 + MAX(ref_len, 1)) << 16) | (mapq << 8) | l_qname);
+  p = bam_put_i32(p, (flag << 16) | n_cigar);
+  p = bam_put_i32(p, l_seq);
+  p = bam_put_i32(p, mate_ref_id);
+  p = bam_put_i32(p, mpos - 1);
+  p = bam_put_i32(p, isize);
+  p = bam_put(p, qname, l_qname - 1);
+  *p++ = '\0';
+  p = bam_put(p, cigar, n_cigar * sizeof(cigar[0]));
+  for (i = 0; i < l_seq; i += 2) {
+    *p++ = (bam_seq_code(seq[i]) << 4) | (i + 1 < l_seq ? bam_seq_code(seq[i + 1]) : 0);
+  }
+  if ((int)strlen(qual) == l_seq) {
+    for (i = 0; i < l_seq; i++)
+      *p++ = qual[i] - 33;
+  } else {
+    memset(p, 0xff, l_seq);
+    p += l_seq;
+  }
+  *output_buffer = p;
 }
 
+static void
+output_int_tag(char ** output_buffer, char * output_buffer_end, char const * tag, int x)
+{
+  if (!bam_output) {
+    *output_buffer += snprintf(*output_buffer, output_buffer_end - *output_buffer, "\t%s:i:%d", tag, x);
+    return;
+  }
 
-static char *
-reverse_alignment_edit_string(char * editstr)
+  // smallest integer type, as samtools does
+  bam_check_space(*output_buffer, output_buffer_end, 3 + sizeof(int32_t));
+  char * p = bam_put(*output_buffer, tag, 2);
+  if (x >= 0) {
+    if (x <= UINT8_MAX) {
+      *p++ = 'C';
+      *p++ = (uint8_t)x;
+    } else if (x <= UINT16_MAX) {
+      uint16_t y = x;
+      *p++ = 'S';
+      p = bam_put(p, &y, sizeof(y));
+    } else {
+      *p++ = 'i';
+      p = bam_put_i32(p, x);
+    }
+  } else {
+    if (x >= INT8_MIN) {
+      *p++ = 'c';
+      *p++ = (int8_t)x;
+    } else if (x >= INT16_MIN) {
+      int16_t y = x;
+      *p++ = 's';
+      p = bam_put(p, &y, sizeof(y));
+    } else {
+      *p++ = 'i';
+      p = bam_put_i32(p, x);
+    }
+  }
+  *output_buffer = p;
+}
+
+static void
+output_string_tag(char ** output_buffer, char * output_buffer_end, char const * tag, char const * s)
 {
-  int n = strlen(editstr);
-  char * res = (char *)malloc((n + 1) * sizeof(char));
-  int i = 0;
-  while (i < n) {
-    if (isdigit(editstr[n - 1 - i])) {
-      int j = i + 1;
-      while (j < n && isdigit(editstr[n - 1 - j])) j++;
-      j--;
-      memcpy(&res[i], &editstr[n - 1 - j], (j - i + 1) * sizeof(char));
-      i = j + 1;
-    } else if (editstr[n - 1 - i] == '-' || editstr[n - 1 - i] == 'x') {
-      res[i] = editstr[n - 1 - i];
-      i++;
-    } else if (editstr[n - 1 - i] == ')') {
-      res[i] = '(';
-      i++;
-    } else if (editstr[n - 1 - i] == '(') {
-      res[i] = ')';
-      i++;
-    } else if (editstr[n - 1 - i] == 'A') {
-      res[i] = 'T';
-      i++;
-    } else if (editstr[n - 1 - i] == 'C') {
-      res[i] = 'G';
-      i++;
-    } else if (editstr[n - 1 - i] == 'G') {
-      res[i] = 'C';
-      i++;
-    } else if (editstr[n - 1 - i] == 'T') {
-      res[i] = 'A';
-      i++;
-    } else
-      assert(0);
+  if (!bam_output) {
+    *output_buffer += snprintf(*output_buffer, output_buffer_end - *output_buffer, "\t%s:Z:%s", tag, s);
+    return;
   }
-  res[n] = 0;
-  return res;
+
+  bam_check_space(*output_buffer, output_buffer_end, 3 + strlen(s) + 1);
+  char * p = bam_put(*output_buffer, tag, 2);
+  *p++ = 'Z';
+  *output_buffer = bam_put(p, s, strlen(s) + 1);
+}
+
+static void
+output_end_record(char ** output_buffer, char * output_buffer_end, char * record)
+{
+  if (!bam_output) {
+    *output_buffer += snprintf(*output_buffer, output_buffer_end - *output_buffer, "\n");
+    return;
+  }
+
+  bam_put_i32(record, *output_buffer - record - sizeof(int32_t));
 }
 
 
-static char *
-make_cigar_string(cigar_t * cigar)
+static inline char
+complement_base(char c)
 {
-	int string_length=cigar->size; //1 char for each op
-	int i;
-	for (i=0; i<cigar->size; i++) {
-		int j=0,length;
-		for (length=cigar->lengths[i]; length>0; j++)
-			length/=10;
-		string_length+=j;
-	}
-	string_length++; // for null term
-	char * ret = (char*)xmalloc(sizeof(char)*(string_length));
-	int used=0;
-	for (i=0; i<cigar->size; i++) {
-		//printf("%d%c\n",cigar->lengths[i],cigar->ops[i]);
-		used+=sprintf(ret+used,"%d%c",cigar->lengths[i],cigar->ops[i]);
+	switch (c) {
+		case 'A': return 'T';
+		case 'a': return 't';
+		case 'T': return 'A';
+		case 't': return 'a';
+
+		case 'C': return 'G';
+		case 'c': return 'g';
+		case 'G': return 'C';
+		case 'g': return 'c';
+
+		case '-': return '-';
+
+		case 'N': return 'N';
+		case 'n': return 'n';
+		case '.': return '.';
+
+		case 'R': return 'Y';
+		case 'r': return 'y';
+		case 'Y': return 'R';
+		case 'y': return 'r';
+
+		case 'S': return 'S';
+		case 's': return 's';
+		case 'W': return 'W';
+		case 'w': return 'w';
+
+		case 'K': return 'M';
+		case 'k': return 'm';
+		case 'M': return 'K';
+		case 'm': return 'k';
+
+		case 'B': return 'V';
+		case 'b': return 'v';
+		case 'V': return 'B';
+		case 'v': return 'b';
+
+		case 'D': return 'H';
+		case 'd': return 'h';
+		case 'H': return 'D';
+		case 'h': return 'd';
+
+		default: return '\0';
 	}
-	//printf("%d vs %d, %d\n",used,string_length,cigar->size);
-	assert(used+1==string_length);
-	ret[used]='\0';
-	return ret;
 }
 
 
+/* reverse complement s in place */
 static void
-free_cigar(cigar_t * cigar)
+reverse_complement(char * s)
 {
-	if (cigar->size>0) {
-		assert(cigar->ops!=NULL);
-		assert(cigar->lengths!=NULL);
-		free(cigar->ops);
-		free(cigar->lengths);
+	int l=strlen(s);
+	int i;
+	for (i=0; i<(l+1)/2; i++) {
+		char c=complement_base(s[i]);
+		char d=complement_base(s[l-i-1]);
+		if (c=='\0' || d=='\0') {
+			fprintf(stderr,"There has been a error in getting reverse complement of %s\n",s);
+			exit(1);
+		}
+		s[i]=d;
+		s[l-i-1]=c;
 	}
-	free(cigar);
 }
 
 
-//TODO move this to utils
+/*
+ * Reverse an edit string in place, for a hit on the negative strand: runs of
+ * matches keep their digits, gaps in the reference swap parentheses and the
+ * letters are complemented.
+ */
 static void
-reverse(char* s, char* t)  // USING TWO ARRAYS FOR THIS IS BAD CODE!!!
+reverse_alignment_edit_string(char * editstr)
 {
-       int l=strlen(s);
-       int i;
-       for (i=0; i<l; i++) {
-               switch (s[i]) {
-                       case 'A': t[l-i-1]='T'; break;
-                       case 'a': t[l-i-1]='t'; break;
-                       case 'T': t[l-i-1]='A'; break;
-                       case 't': t[l-i-1]='a'; break;
-
-                       case 'C': t[l-i-1]='G'; break;
-                       case 'c': t[l-i-1]='g'; break;
-                       case 'G': t[l-i-1]='C'; break;
-                       case 'g': t[l-i-1]='c'; break;
-
-                       case '-': t[l-i-1]='-'; break;
-
-                       case 'N': t[l-i-1]='N'; break;
-                       case 'n': t[l-i-1]='n'; break;
-		       case '.': t[l-i-1]='.'; break;
-
-                       case 'R': t[l-i-1]='Y'; break;
-                       case 'r': t[l-i-1]='y'; break;
-                       case 'Y': t[l-i-1]='R'; break;
-                       case 'y': t[l-i-1]='r'; break;
-
-                       case 'S': t[l-i-1]='S'; break;
-                       case 's': t[l-i-1]='s'; break;
-                       case 'W': t[l-i-1]='W'; break;
-                       case 'w': t[l-i-1]='w'; break;
-
-                       case 'K': t[l-i-1]='M'; break;
-                       case 'k': t[l-i-1]='m'; break;
-                       case 'M': t[l-i-1]='K'; break;
-                       case 'm': t[l-i-1]='k'; break;
-
-                       case 'B': t[l-i-1]='V'; break;
-                       case 'b': t[l-i-1]='v'; break;
-                       case 'V': t[l-i-1]='B'; break;
-                       case 'v': t[l-i-1]='b'; break;
-
-                       case 'D': t[l-i-1]='H'; break;
-                       case 'd': t[l-i-1]='h'; break;
-                       case 'H': t[l-i-1]='D'; break;
-                       case 'h': t[l-i-1]='d'; break;
-	
-                       default:
-                               fprintf(stderr,"There has been a error in getting reverse complement of %s\n",s);
-                               exit(1);
-               }
-       }
-       t[l]='\0';
-       //printf("%s vs %s\n", s , t);
-       strcpy(s,t);
+  int n = strlen(editstr);
+  int i, j, k;
+  for (i = 0, j = n - 1; i < j; i++, j--) {
+    char c = editstr[i];
+    editstr[i] = editstr[j];
+    editstr[j] = c;
+  }
+  for (i = 0; i < n; i++) {
+    if (isdigit(editstr[i])) {
+      for (j = i; j + 1 < n && isdigit(editstr[j + 1]); j++);
+      for (k = i, i = j; k < j; k++, j--) {
+	char c = editstr[k];
+	editstr[k] = editstr[j];
+	editstr[j] = c;
+      }
+    } else if (editstr[i] == '(') {
+      editstr[i] = ')';
+    } else if (editstr[i] == ')') {
+      editstr[i] = '(';
+    } else if (editstr[i] != 'x' && complement_base(editstr[i]) != '\0') {
+      editstr[i] = complement_base(editstr[i]);
+    }
+  }
 }
 
 
@@ -306,15 +391,17 @@ hit_output(struct read_entry * re, struct read_hit * rh, struct read_hit * rh_mp
 	int flag;
 	//rname
 	char const * rname = "*";
+	int ref_id = -1;
 	//pos
 	int pos=0;
 	//mapq
 	int mapq = (rh != NULL ? rh->sfrp->mqv : 0);
 	//cigar
-	char * cigar=(char *)"*";
-	cigar_t * cigar_binary=NULL;
+	uint32_t * cigar=NULL;
+	int n_cigar=0;
 	//mrnm
 	const char * mrnm = "*"; //mate reference name
+	int mate_ref_id = -1;
 	//mpos
 	int mpos=0;
 	//isize
@@ -404,6 +491,7 @@ hit_output(struct read_entry * re, struct read_hit * rh, struct read_hit * rh_mp
 			genome_end_mp=genome_start_mp+rh_mp->sfrp->gmapped-1;
 			mpos=genome_start_mp;
 			mrnm = contig_names[rh_mp->cn];
+			mate_ref_id = rh_mp->cn;
 		}
 	}
 	bool second_in_pair = (paired_read && !first_in_pair);
@@ -434,35 +522,35 @@ hit_output(struct read_entry * re, struct read_hit * rh, struct read_hit * rh_mp
 		//char *extra = *output1 + sprintf(*output1,"%s\t%i\t%s\t%u\t%i\t%s\t%s\t%u\t%i\t%s\t%s",
 		//	qname,flag,rname,pos,mapq,cigar,mrnm,mpos,
 		//	isize,seq,qual);
-		*output_buffer += snprintf(*output_buffer,output_buffer_end-*output_buffer,
-			"%s\t%i\t%s\t%u\t%i\t%s\t%s\t%u\t%i\t%s\t%s",
-			qname,flag,rname,pos,mapq,cigar,mrnm,mpos,
+		char * record = *output_buffer;
+		output_fields(output_buffer, output_buffer_end,
+			qname,flag,ref_id,rname,pos,mapq,cigar,n_cigar,mate_ref_id,mrnm,mpos,
 			isize,seq,qual);
 		if (shrimp_mode == MODE_COLOUR_SPACE) {
 			if (Qflag) {
 				//extra = extra + sprintf(extra,"\tCQ:Z:%s",re->qual);
-				*output_buffer += snprintf(*output_buffer,output_buffer_end-*output_buffer,"\tCQ:Z:%s",re->qual);
+				output_string_tag(output_buffer, output_buffer_end, "CQ", re->qual);
 			} else {
 				//extra = extra + sprintf(extra,"\tCQ:Z:%s",qual);
-				*output_buffer += snprintf(*output_buffer,output_buffer_end-*output_buffer,"\tCQ:Z:%s",qual);
+				output_string_tag(output_buffer, output_buffer_end, "CQ", qual);
 			}
 			//extra = extra + sprintf(extra, "\tCS:Z:%s",re->seq);
-			*output_buffer += snprintf(*output_buffer,output_buffer_end-*output_buffer, "\tCS:Z:%s",re->seq);
+			output_string_tag(output_buffer, output_buffer_end, "CS", re->seq);
 		}
 		if (sam_r2) {
 			if (shrimp_mode == MODE_COLOUR_SPACE) {
 				//extra = extra + sprintf(extra, "\tX2:Z:%s",re_mp->seq);
-				*output_buffer += snprintf(*output_buffer,output_buffer_end-*output_buffer, "\tX2:Z:%s",re_mp->seq);
+				output_string_tag(output_buffer, output_buffer_end, "X2", re_mp->seq);
 			} else {
 				//extra = extra + sprintf(extra, "\tR2:Z:%s",re_mp->seq);
-				*output_buffer += snprintf(*output_buffer,output_buffer_end-*output_buffer, "\tR2:Z:%s",re_mp->seq);
+				output_string_tag(output_buffer, output_buffer_end, "R2", re_mp->seq);
 			}
 		}
 		if (sam_read_group_name!=NULL ){
 			//extra+=sprintf(extra,"\tRG:Z:%s",sam_read_group_name);
-			*output_buffer += snprintf(*output_buffer,output_buffer_end-*output_buffer,"\tRG:Z:%s",sam_read_group_name);
+			output_string_tag(output_buffer, output_buffer_end, "RG", sam_read_group_name);
 		}
-		*output_buffer += snprintf(*output_buffer,output_buffer_end-*output_buffer,"\n");	
+		output_end_record(output_buffer, output_buffer_end, record);
 		assert(satisfying_alignments==0);
 		assert(stored_alignments==0);
 		//assert(hits[0]==0);
@@ -476,11 +564,23 @@ hit_output(struct read_entry * re, struct read_hit * rh, struct read_hit * rh_mp
 	assert( !paired_read || (!query_unmapped && !mate_unmapped) || half_paired);
 	//start filling in the fields
 	rname = contig_names[rh->cn];
+	ref_id = rh->cn;
 	reverse_strand = (rh->gen_st == 1);
 	int read_start = rh->sfrp->read_start+1; //1based
 	int read_end = read_start + rh->sfrp->rmapped -1; //1base
 	int genome_length = genome_len[rh->cn];
-	cigar_binary = make_cigar(read_start,read_end,read_length,rh->sfrp->qralign,rh->sfrp->dbalign);
+	//clipped ends around the alignment, hard clipped in colour space
+	int clip_op = (shrimp_mode == MODE_COLOUR_SPACE ? SW_OP_HARD_CLIP : SW_OP_SOFT_CLIP);
+	uint32_t cigar_ops[rh->sfrp->n_edit_ops+2];
+	cigar=cigar_ops;
+	if (read_start>1) {
+		cigar[n_cigar++]=SW_OP(read_start-1,clip_op);
+	}
+	memcpy(cigar+n_cigar,rh->sfrp->edit_ops,rh->sfrp->n_edit_ops*sizeof(cigar[0]));
+	n_cigar+=rh->sfrp->n_edit_ops;
+	if (read_end!=read_length) {
+		cigar[n_cigar++]=SW_OP(read_length-read_end,clip_op);
+	}
 
 	int qralign_length=strlen(rh->sfrp->qralign);
 	int i,j=0;
@@ -568,15 +668,9 @@ hit_output(struct read_entry * re, struct read_hit * rh, struct read_hit * rh_mp
 			}
 		}
 	//else in colour space dont print a qual string
-	//but get the seq differently and change 'S' to 'H' in cigar
+	//but get the seq differently
 	} else if (shrimp_mode == MODE_COLOUR_SPACE) {
-		//also change 'S' in cigar to 'H'
 		//clip the qual values
-		for (i=0; i<cigar_binary->size; i++) {
-			if (cigar_binary->ops[i]=='S') {
-				cigar_binary->ops[i]='H';
-			}
-		}
 		if (Qflag) {
 			if (Bflag) {
 				int read_length=(read_end-read_start+1);
@@ -631,15 +725,11 @@ hit_output(struct read_entry * re, struct read_hit * rh, struct read_hit * rh_mp
 		//rh->sfrp->deletions is deletions in the reference
 		// This is when the read has extra characters that dont match into ref
 		genome_start = genome_right_most_coordinate - (read_end - read_start - rh->sfrp->deletions + rh->sfrp->insertions);
-		char * tmp = (char*)xmalloc(sizeof(char)*(strlen(seq)+1));
-		reverse(seq,tmp);
-		free(tmp);
-		reverse_cigar(cigar_binary);
+		reverse_complement(seq);
+		reverse_cigar(cigar,n_cigar);
 	}
 	int genome_end=genome_start+rh->sfrp->gmapped-1;
 	pos=genome_start;
-	//make the cigar string
-	cigar = make_cigar_string(cigar_binary); 
 
 	//do some stats using matepair
 	if (paired_read && !mate_unmapped) {
@@ -680,38 +770,40 @@ hit_output(struct read_entry * re, struct read_hit * rh, struct read_hit * rh_mp
 	//char *extra = *output1 + sprintf(*output1,"%s\t%i\t%s\t%u\t%i\t%s\t%s\t%u\t%i\t%s\t%s",
 	//	qname,flag,rname,pos,mapq,cigar,mrnm,mpos,
 	//	isize,seq,qual);
-	*output_buffer += snprintf(*output_buffer,output_buffer_end-*output_buffer,"%s\t%i\t%s\t%u\t%i\t%s\t%s\t%u\t%i\t%s\t%s",
-		qname,flag,rname,pos,mapq,cigar,mrnm,mpos,
+	char * record = *output_buffer;
+	output_fields(output_buffer, output_buffer_end,
+		qname,flag,ref_id,rname,pos,mapq,cigar,n_cigar,mate_ref_id,mrnm,mpos,
 		isize,seq,qual);
 	//extra = extra + sprintf(extra,"\tAS:i:%d\tH0:i:%d\tH1:i:%d\tH2:i:%d\tNM:i:%d\tNH:i:%d\tIH:i:%d",rh->sfrp->score,hits[0],hits[1],hits[2],rh->sfrp->mismatches+rh->sfrp->deletions+rh->sfrp->insertions,found_alignments,stored_alignments);
 		//MERGESAM DEPENDS ON SCORE BEING FIRST!
-	*output_buffer += snprintf(*output_buffer, output_buffer_end - *output_buffer, "\tAS:i:%d",
-				   rh->score_full);
+	output_int_tag(output_buffer, output_buffer_end, "AS", rh->score_full);
 
 	if (compute_mapping_qualities && !all_contigs) {
 	  if (pair_mode == PAIR_NONE)
 	  {
-	    *output_buffer += snprintf(*output_buffer, output_buffer_end - *output_buffer, "\tZ0:i:%d\tZ1:i:%d",
-		double_to_neglog(rh->sfrp->z0), double_to_neglog(rh->sfrp->z1));
+	    output_int_tag(output_buffer, output_buffer_end, "Z0", double_to_neglog(rh->sfrp->z0));
+	    output_int_tag(output_buffer, output_buffer_end, "Z1", double_to_neglog(rh->sfrp->z1));
 	  }
 	  else // paired mode
 	  {
 	    if (rh != NULL && rh_mp != NULL && !improper_mapping) {
-	      *output_buffer += snprintf(*output_buffer, output_buffer_end - *output_buffer, "\tZ2:i:%d\tZ3:i:%d\tZ4:i:%d\tZ6:i:%d",
-		  double_to_neglog(rh->sfrp->z2), double_to_neglog(rh->sfrp->z3),
-		  double_to_neglog(rh->sfrp->pr_top_random_at_location), double_to_neglog(rh->sfrp->insert_size_denom));
+	      output_int_tag(output_buffer, output_buffer_end, "Z2", double_to_neglog(rh->sfrp->z2));
+	      output_int_tag(output_buffer, output_buffer_end, "Z3", double_to_neglog(rh->sfrp->z3));
+	      output_int_tag(output_buffer, output_buffer_end, "Z4", double_to_neglog(rh->sfrp->pr_top_random_at_location));
+	      output_int_tag(output_buffer, output_buffer_end, "Z6", double_to_neglog(rh->sfrp->insert_size_denom));
 	    } else {
-	      *output_buffer += snprintf(*output_buffer, output_buffer_end - *output_buffer, "\tZ0:i:%d\tZ1:i:%d\tZ4:i:%d\tZ5:i:%d",
-		  double_to_neglog(rh->sfrp->z0), double_to_neglog(rh->sfrp->z1),
-		  double_to_neglog(rh->sfrp->pr_top_random_at_location), double_to_neglog(rh->sfrp->pr_missed_mp));
+	      output_int_tag(output_buffer, output_buffer_end, "Z0", double_to_neglog(rh->sfrp->z0));
+	      output_int_tag(output_buffer, output_buffer_end, "Z1", double_to_neglog(rh->sfrp->z1));
+	      output_int_tag(output_buffer, output_buffer_end, "Z4", double_to_neglog(rh->sfrp->pr_top_random_at_location));
+	      output_int_tag(output_buffer, output_buffer_end, "Z5", double_to_neglog(rh->sfrp->pr_missed_mp));
 	    }
 	  }
 	}
 
 	//*output_buffer += snprintf(*output_buffer, output_buffer_end - *output_buffer, "\tH0:i:%d\tH1:i:%d\tH2:i:%d",
 	//			   hits[0],hits[1],hits[2]);
-	*output_buffer += snprintf(*output_buffer, output_buffer_end - *output_buffer, "\tNM:i:%d",
-				   rh->sfrp->mismatches+rh->sfrp->deletions+rh->sfrp->insertions);
+	output_int_tag(output_buffer, output_buffer_end, "NM",
+		       rh->sfrp->mismatches+rh->sfrp->deletions+rh->sfrp->insertions);
 	//*output_buffer += snprintf(*output_buffer, output_buffer_end - *output_buffer, "\tNH:i:%d\tIH:i:%d",
 	//			   satisfying_alignments, stored_alignments);
 	if (shrimp_mode == COLOUR_SPACE){
@@ -721,44 +813,40 @@ hit_output(struct read_entry * re, struct read_hit * rh, struct read_hit * rh_mp
 		//assert(strcmp(readtostr(re->read[0],re->read_len,true,first_bp),re->seq)==0);
 		if (Qflag) {
 			//extra = extra + sprintf(extra,"\tCQ:Z:%s",re->qual);
-			*output_buffer += snprintf(*output_buffer,output_buffer_end-*output_buffer,"\tCQ:Z:%s",re->qual);
+			output_string_tag(output_buffer, output_buffer_end, "CQ", re->qual);
 		}
 		//extra = extra + sprintf(extra, "\tCS:Z:%s\tCM:i:%d\tXX:Z:%s",re->seq,rh->sfrp->crossovers,rh->sfrp->qralign);
-		*output_buffer += snprintf(*output_buffer,output_buffer_end-*output_buffer, "\tCS:Z:%s\tCM:i:%d\tXX:Z:%s",re->seq,rh->sfrp->crossovers,rh->sfrp->qralign);
+		output_string_tag(output_buffer, output_buffer_end, "CS", re->seq);
+		output_int_tag(output_buffer, output_buffer_end, "CM", rh->sfrp->crossovers);
+		output_string_tag(output_buffer, output_buffer_end, "XX", rh->sfrp->qralign);
 	} 
 	if (sam_r2) {
 		if (shrimp_mode == MODE_COLOUR_SPACE) {
 			//extra = extra + sprintf(extra, "\tX2:Z:%s",re_mp->seq);
-			*output_buffer += snprintf(*output_buffer,output_buffer_end-*output_buffer, "\tX2:Z:%s",re_mp->seq);
+			output_string_tag(output_buffer, output_buffer_end, "X2", re_mp->seq);
 		} else {
 			//extra = extra + sprintf(extra, "\tR2:Z:%s",re_mp->seq);
-			*output_buffer += snprintf(*output_buffer,output_buffer_end-*output_buffer, "\tR2:Z:%s",re_mp->seq);
+			output_string_tag(output_buffer, output_buffer_end, "R2", re_mp->seq);
 		}
 	}
 	
 	if (sam_read_group_name!=NULL) {
 			//extra+=sprintf(extra,"\tRG:Z:%s",sam_read_group_name);
-			*output_buffer+=snprintf(*output_buffer,output_buffer_end-*output_buffer,"\tRG:Z:%s",sam_read_group_name);
+			output_string_tag(output_buffer, output_buffer_end, "RG", sam_read_group_name);
 	}
 	if (extra_sam_fields) {
-	  char * editstr = alignment_edit_string(rh->sfrp->dbalign, rh->sfrp->qralign);
+	  char editstr[ALIGNMENT_EDIT_STRING_SIZE(strlen(rh->sfrp->dbalign))];
+	  alignment_edit_string_fill(editstr, rh->sfrp->dbalign, rh->sfrp->qralign);
 	  if (reverse_strand) {
-	    char * tmp = reverse_alignment_edit_string(editstr);
-	    free(editstr);
-	    editstr = tmp;
+	    reverse_alignment_edit_string(editstr);
 	  }
-	  *output_buffer += snprintf(*output_buffer, output_buffer_end - *output_buffer,
-				     "\tZM:i:%d\tZR:i:%d\tZV:i:%d\tZH:i:%d\tZE:Z:%s",
-				     rh->matches, rh->score_window_gen,
-				     rh->score_vector, rh->sfrp->score,
-				     editstr);
-	  free(editstr);
-	}
-	if (cigar_binary!=NULL) {
-		free_cigar(cigar_binary);
-		free(cigar);
+	  output_int_tag(output_buffer, output_buffer_end, "ZM", rh->matches);
+	  output_int_tag(output_buffer, output_buffer_end, "ZR", rh->score_window_gen);
+	  output_int_tag(output_buffer, output_buffer_end, "ZV", rh->score_vector);
+	  output_int_tag(output_buffer, output_buffer_end, "ZH", rh->sfrp->score);
+	  output_string_tag(output_buffer, output_buffer_end, "ZE", editstr);
 	}
-	*output_buffer += snprintf(*output_buffer,output_buffer_end-*output_buffer,"\n");	
+	output_end_record(output_buffer, output_buffer_end, record);
 
     //to calculate the insert size we need to find the five' end of the reads
 /*
@@ -808,6 +896,21 @@ get_pr_insert_size(double insert_size)
 }
 
 
+/*
+ * Keep the insert size of a confidently paired read pair, if it comes from one
+ * of the chunks the insert sizes are learned from.
+ */
+static inline void
+insert_learn_add(int insert_size)
+{
+  if (insert_learn_chunks > 0
+      && thread_output_buffer_chunk[omp_get_thread_num()] <= insert_learn_chunks) {
+    int k = __sync_fetch_and_add(&insert_learn_load, 1);
+    insert_learn_sample[k] = abs(insert_size);
+  }
+}
+
+
 static void
 compute_paired_mqv(pair_entry * pe)
 {
@@ -1021,6 +1124,10 @@ readpair_output_no_mqv(pair_entry * pe, struct read_hit_pair * hits_pass2, int n
     }
   }
 
+  // without mapping qualities, only a unique pairing is confident
+  if (n_hits_pass2 == 1)
+    insert_learn_add(hits_pass2[0].insert_size);
+
   for (i = 0; i < n_hits_pass2; i++) {
     struct read_hit * rh1 = hits_pass2[i].rh[0];
     struct read_hit * rh2 = hits_pass2[i].rh[1];
@@ -1246,6 +1353,9 @@ readpair_output(pair_entry * pe)
     hit_output(pe->re[0], rh1,  rh2, true, sam_hit_counts[0], pe->n_final_paired_hits, pe->final_paired_hits[i].improper_mapping);
     hit_output(pe->re[1], rh2,  rh1, false, sam_hit_counts[1], pe->n_final_paired_hits, pe->final_paired_hits[i].improper_mapping);
 
+    if (i == first[2] && !pe->final_paired_hits[i].improper_mapping && rh1->sfrp->mqv >= 10 && rh2->sfrp->mqv >= 10)
+      insert_learn_add(pe->final_paired_hits[i].insert_size);
+
     if (!pe->final_paired_hits[i].improper_mapping && (rh1->sfrp->mqv >= 10 || rh2->sfrp->mqv >= 10)) {
       good_pair = true;
     } else if (pe->final_paired_hits[i].improper_mapping && (rh1->sfrp->mqv >= 10 || rh2->sfrp->mqv >= 10)) {
@@ -1289,3 +1399,42 @@ readpair_output(pair_entry * pe)
     total_reads_matched_conf++;
   }
 }
+
+
+/*
+ * Write the BAM header: the SAM header text, followed by the reference list that
+ * record contig indices refer to.
+ */
+void
+bam_output_header(char const * text, size_t text_len)
+{
+  size_t len = 3 * sizeof(int32_t) + text_len;
+  int i;
+
+  for (i = 0; i < num_contigs; i++) {
+    len += 2 * sizeof(int32_t) + strlen(contig_names[i]) + 1;
+  }
+
+  char * header = (char *)xmalloc(len);
+  char * bgzf = (char *)xmalloc(bgzf_bound(len));
+  char * p = bam_put(header, "BAM\1", 4);
+
+  p = bam_put_i32(p, text_len);
+  p = bam_put(p, text, text_len);
+  p = bam_put_i32(p, num_contigs);
+  for (i = 0; i < num_contigs; i++) {
+    p = bam_put_i32(p, strlen(contig_names[i]) + 1);
+    p = bam_put(p, contig_names[i], strlen(contig_names[i]) + 1);
+    p = bam_put_i32(p, genome_len[i]);
+  }
+  assert((size_t)(p - header) == len);
+
+  ssize_t res = bgzf_compress(bgzf, header, len, bam_compression_level);
+  if (res < 0) {
+    crash(1, 0, "BGZF compression failed");
+  }
+  fwrite(bgzf, 1, res, stdout);
+
+  free(bgzf);
+  free(header);
+}
@@ -25,6 +25,7 @@ void	hit_output(struct read_entry *, struct read_hit *, struct read_hit *,
 void	read_output(read_entry *, struct read_hit * *, int);
 void	readpair_output_no_mqv(pair_entry *, struct read_hit_pair *, int);
 void	readpair_output(pair_entry *);
+void	bam_output_header(char const *, size_t);
 
 
 #ifdef __cplusplus
@@ -0,0 +1,21 @@
+/*
+ * Spaced seed gather loop, BMI2: every mapidx is one pext.
+ */
+
+#include <stdint.h>
+
+#include <immintrin.h>	/* BMI2 */
+
+#include "../gmapper/seed-gather.h"
+
+#define GATHER_FN		gather_pext
+#define GATHER(win, plan)	((uint32_t)_pext_u64((win), (plan)->mask))
+#include "../gmapper/seed-gather-kernel.h"
+
+void
+seed_gather_bmi2(struct seed_gather_plan const * plan, int n_seeds,
+		 uint32_t const * read, int read_len,
+		 int min_kmer_pos, int max_n_kmers, uint32_t * mapidx)
+{
+  gather_pext(plan, n_seeds, read, read_len, min_kmer_pos, max_n_kmers, mapidx);
+}
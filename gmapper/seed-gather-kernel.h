@@ -0,0 +1,36 @@
+/*
+ * Spaced seed gather loop; included by seeds.c and seed-gather-bmi2.c,
+ * which define:
+ *	GATHER_FN		the function name
+ *	GATHER(win, plan)	the seed bits of the window, packed
+ *
+ * Every position of the read is shifted into the window once, and the
+ * mapidx of every seed ending there is gathered out of it. Seed sn's kmer
+ * at read position min_kmer_pos + k goes to mapidx[sn * max_n_kmers + k].
+ */
+
+static void
+GATHER_FN(struct seed_gather_plan const * plan, int n_seeds,
+	  uint32_t const * read, int read_len,
+	  int min_kmer_pos, int max_n_kmers, uint32_t * mapidx)
+{
+  uint64_t win = 0;
+  uint32_t word = 0;
+  int i, k, sn;
+
+  for (i = 0; i < read_len; i++) {
+    if (i % 8 == 0)
+      word = read[i / 8];
+    win = (win >> 2) | ((uint64_t)(word & 0x3) << 62);
+    word >>= 4;
+
+    for (sn = 0; sn < n_seeds; sn++) {
+      k = i - plan[sn].span + 1 - min_kmer_pos;
+      if (k >= 0)
+	mapidx[sn * max_n_kmers + k] = GATHER(win, &plan[sn]);
+    }
+  }
+}
+
+#undef GATHER_FN
+#undef GATHER
@@ -0,0 +1,34 @@
+/*
+ * Spaced seed gather plans.
+ *
+ * A read is scanned with a window of 2-bit bases that keeps the newest base
+ * in its top two bits, so the positions of a spaced seed are a fixed bit
+ * mask over the window and the mapidx of a kmer is that mask's bits packed
+ * together: a single pext on BMI2, or a few byte table lookups otherwise.
+ * Both give the same mapidx as kmer_to_mapidx_orig(), for seeds up to 32
+ * bases long.
+ *
+ * The pext loop lives in its own translation unit, compiled with -mbmi2;
+ * seeds.c builds the plans and picks the loop at run time.
+ */
+#ifndef _SEED_GATHER_H
+#define _SEED_GATHER_H
+
+#include <stdint.h>
+
+#define SEED_GATHER_MAX_SPAN	32
+
+struct seed_gather_plan {
+  uint64_t	mask;		/* seed positions in the window */
+  int		span;
+  int		n_bytes;	/* window bytes holding seed positions, */
+  int		byte[8];	/* which ones, */
+  int		shift[8];	/* where their bits go in the mapidx, */
+  uint8_t	tab[8][256];	/* and their bits packed, per byte value */
+};
+
+void	seed_gather_bmi2(struct seed_gather_plan const * plan, int n_seeds,
+			 uint32_t const * read, int read_len,
+			 int min_kmer_pos, int max_n_kmers, uint32_t * mapidx);
+
+#endif
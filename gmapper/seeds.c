@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "seeds.h"
+#include "seed-gather.h"
 #include "../common/util.h"
 
 
@@ -139,3 +140,124 @@ valid_spaced_seeds()
 
   return true;
 }
+
+
+/*
+ * Gather plans for the read kmers; see seed-gather.h.
+ */
+#define GATHER_FN		gather_table
+#define GATHER(win, plan)	gather_table_one((win), (plan))
+
+static inline uint32_t
+gather_table_one(uint64_t win, struct seed_gather_plan const * plan)
+{
+  uint32_t mapidx = 0;
+  int k;
+
+  for (k = 0; k < plan->n_bytes; k++)
+    mapidx |= (uint32_t)plan->tab[k][(win >> 8*plan->byte[k]) & 0xff] << plan->shift[k];
+
+  return mapidx;
+}
+
+#include "seed-gather-kernel.h"
+
+static struct seed_gather_plan * gather_plan = NULL;
+static void (*gather_fn)(struct seed_gather_plan const *, int, uint32_t const *, int,
+			 int, int, uint32_t *) = NULL;
+
+/*
+ * pext is microcoded, and slower than the tables, on AMD before Zen 3.
+ */
+static bool
+gather_use_pext()
+{
+#if defined(__GNUC__) && !defined(__INTEL_COMPILER)
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("bmi2")
+    && !__builtin_cpu_is("amdfam15h") && !__builtin_cpu_is("amdfam17h");
+#else
+  return false;
+#endif
+}
+
+
+char const *
+seed_gather_isa()
+{
+  if (Hflag || max_seed_span > SEED_GATHER_MAX_SPAN)
+    return "bitwise";
+  return gather_use_pext()? "pext (bmi2)" : "table";
+}
+
+
+void
+init_seed_gather_plans()
+{
+  struct seed_gather_plan * p;
+  int sn, i, b, v, n;
+
+  if (Hflag || max_seed_span > SEED_GATHER_MAX_SPAN)
+    return;
+
+  gather_plan = (struct seed_gather_plan *)
+    my_calloc(n_seeds * sizeof(gather_plan[0]), &mem_small, "gather_plan");
+
+  for (sn = 0; sn < n_seeds; sn++) {
+    p = &gather_plan[sn];
+    p->span = seed[sn].span;
+
+    // mask bit i is the base i positions before the newest one
+    for (i = 0; i < seed[sn].span; i++)
+      if ((seed[sn].mask[0] >> i) & 0x1)
+	p->mask |= (uint64_t)0x3 << (62 - 2*i);
+
+    // mapidx bits come from the low window bytes first
+    for (b = 0, n = 0; b < 8; b++) {
+      uint8_t m = (uint8_t)(p->mask >> 8*b);
+      if (m == 0)
+	continue;
+
+      p->byte[p->n_bytes] = b;
+      p->shift[p->n_bytes] = n;
+      for (v = 0; v < 256; v++) {
+	int j, l = 0;
+	for (j = 0; j < 8; j++)
+	  if ((m >> j) & 0x1)
+	    p->tab[p->n_bytes][v] |= (uint8_t)(((v >> j) & 0x1) << l++);
+      }
+      n += __builtin_popcount(m);
+      p->n_bytes++;
+    }
+  }
+
+  gather_fn = (gather_use_pext()? seed_gather_bmi2 : gather_table);
+}
+
+
+void
+free_seed_gather_plans()
+{
+  if (gather_plan == NULL)
+    return;
+
+  my_free(gather_plan, n_seeds * sizeof(gather_plan[0]), &mem_small, "gather_plan");
+  gather_plan = NULL;
+  gather_fn = NULL;
+}
+
+
+/*
+ * Fill in the mapidx of every seed at every kmer position of the read;
+ * false if there are no plans, and the caller has to do it kmer by kmer.
+ */
+bool
+seed_gather_mapidxs(uint32_t const * read, int read_len, int min_kmer_pos, int max_n_kmers,
+		    uint32_t * mapidx)
+{
+  if (gather_fn == NULL)
+    return false;
+
+  gather_fn(gather_plan, n_seeds, read, read_len, min_kmer_pos, max_n_kmers, mapidx);
+  return true;
+}
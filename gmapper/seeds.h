@@ -39,6 +39,10 @@ bool		load_default_seeds(int);
 void		init_seed_hash_mask();
 char *		seed_to_string(int);
 bool		valid_spaced_seeds();
+char const *	seed_gather_isa();
+void		init_seed_gather_plans();
+void		free_seed_gather_plans();
+bool		seed_gather_mapidxs(uint32_t const *, int, int, int, uint32_t *);
 
 
 #ifdef __cplusplus
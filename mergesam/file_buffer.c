@@ -6,6 +6,9 @@
 #include <assert.h>
 #include "file_buffer.h"
 
+//threads inflating BGZF input, per open file
+#define FB_INFLATE_THREADS 2
+
 //#define MIN(a,b) (((a) < (b)) ? (a) : (b))
 #ifdef __APPLE__
 void * memrchr(const void *s, int c, size_t n) {
@@ -64,7 +67,12 @@ bool auto_detect_fastq(gzFile fp, char * reads_filename) {
 void fb_close(file_buffer * fb) {
 	free(fb->base);
 	free(fb->frb.base);
-	gzclose(fb->frb.file);
+	if (fb->frb.bgzf!=NULL) {
+		bgzf_reader_close(fb->frb.bgzf);
+	} else {
+		gzclose(fb->frb.file);
+	}
+	free(fb->frb.path);
 	free(fb);
 }
 
@@ -102,6 +110,10 @@ file_buffer * fb_open(char * path,size_t buffer_size,size_t read_size) {
 		fprintf(stderr,"file_buffer : failed to open file %s\n",path);
 		exit(1);
 	}	
+	//BGZF input is switched to the parallel reader on the first fill
+	if (strcmp(path,"-")!=0 && bgzf_is_bgzf(path)) {
+		fb->frb.path=strdup(path);
+	}
 	return fb;
 }
 
@@ -113,15 +125,32 @@ void fill_read_buffer(file_read_buffer * frb) {
 	//fprintf(stderr,"unseen is %lu, seen is %lu\n",frb->unseen,frb->seen);
 	//assert(frb->unseen==0 || !frb->pad);
 	memmove(frb->base,frb->base+frb->filled-frb->unseen,frb->unseen);
+	//pick up after anything already read through zlib, e.g. by auto_detect_fastq
+	if (frb->path!=NULL && frb->bgzf==NULL) {
+		frb->bgzf=bgzf_reader_open(frb->path,FB_INFLATE_THREADS,gztell(frb->file));
+		if (frb->bgzf!=NULL) {
+			gzclose(frb->file);
+			frb->file=NULL;
+		} else {
+			free(frb->path);
+			frb->path=NULL;
+		}
+	}
 	//read into the rest of the buffer
-	int ret = gzread(frb->file,frb->base+frb->unseen,frb->size-frb->unseen);
+	//bgzf_read is only short at the end of the file, which is when gzeof turns true
+	int ret;
+	if (frb->bgzf!=NULL) {
+		ret = bgzf_read(frb->bgzf,frb->base+frb->unseen,frb->size-frb->unseen);
+	} else {
+		ret = gzread(frb->file,frb->base+frb->unseen,frb->size-frb->unseen);
+	}
 	assert(frb->size-frb->unseen!=0);
 	//fprintf(stderr,"trying to read %lu\n",frb->size-frb->unseen);
 	if (ret<0) {
 		fprintf(stderr,"A gzread error has occured\n");
 		exit(1);
 	}	
-	frb->eof=gzeof(frb->file);
+	frb->eof=(frb->bgzf!=NULL) ? ((size_t)ret<frb->size-frb->unseen) : gzeof(frb->file);
 	//fprintf(stderr,"EOF %d ret %d\n",frb->eof,ret);
 	if (ret==0 && frb->eof==0) {
 		fprintf(stderr,"A error has occured in reading\n");
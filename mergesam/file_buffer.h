@@ -2,9 +2,12 @@
 #define __FILE_BUFFER__
 #include <stdbool.h>
 #include <zlib.h>
+#include "../common/bgzf.h"
 
 typedef struct file_read_buffer {
         gzFile file;
+	bgzf_reader_t bgzf;
+	char * path;
         char * base;
         size_t size;
         size_t filled;
@@ -153,6 +153,7 @@ compute_alignment(struct fpo *fpo, struct sequence *contig)
 
 	free(sfr.dbalign);
 	free(sfr.qralign);
+	free(sfr.edit_ops);
 }
 
 static void
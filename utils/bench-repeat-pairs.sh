@@ -0,0 +1,37 @@
+#!/bin/bash
+#
+# Time the mate pairing of gmapper on the repeat-heavy pairs of
+# repeat-pairs.py, for the insert ranges in INSERTS. For each gmapper given
+# (default: ../bin/gmapper-ls), print the "Vect Hits" time of the per-thread
+# statistics and an md5 of the SAM records, so that two builds can be
+# compared for speed and identical output.
+#
+# usage: bench-repeat-pairs.sh [gmapper ...]
+#
+# PAIRS (2000), SEED (7), INSERTS ("0,1000 0,5000") and WORK_DIR (a temporary
+# directory) can be set in the environment.
+
+UTILS_DIR=$(cd "$(dirname "$0")" && pwd)
+PAIRS=${PAIRS:-2000}
+SEED=${SEED:-7}
+INSERTS=${INSERTS:-"0,1000 0,5000"}
+WORK_DIR=${WORK_DIR:-$(mktemp -d)}
+
+if [ $# -eq 0 ]; then
+	set -- "$UTILS_DIR/../bin/gmapper-ls"
+fi
+
+mkdir -p "$WORK_DIR" || exit 1
+cd "$WORK_DIR" || exit 1
+python3 "$UTILS_DIR/repeat-pairs.py" $PAIRS $SEED || exit 1
+
+printf "%-40s %-10s %10s  %s\n" "gmapper" "-I" "Vect Hits" "SAM md5"
+for gmapper in "$@"; do
+	for ins in $INSERTS; do
+		"$gmapper" -D -N 1 --qv-offset 33 -I $ins -p opp-in -1 r1.fq -2 r2.fq ref.fa \
+			>out.sam 2>out.err || { echo "error: $gmapper failed, see $WORK_DIR/out.err" >&2; exit 1; }
+		vect=$(awk '$1 == "Thread" && $2 == "0" { print $10 }' out.err)
+		md5=$(grep -v '^@PG' out.sam | md5sum | cut -d ' ' -f 1)
+		printf "%-40s %-10s %9ss  %s\n" "$gmapper" "$ins" "$vect" "$md5"
+	done
+done
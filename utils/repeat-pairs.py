@@ -0,0 +1,55 @@
+#	Generate a repeat-heavy paired read set for timing the mate pairing code.
+#
+#	The genome is 50 kbp of random sequence on each side of a 30 kbp tandem
+#	repeat of a 37 bp unit, with a mutation every 997 bp. Half the pairs come
+#	from inside the repeat, where every read has hundreds of equally good hits;
+#	the others are drawn from anywhere. Inserts are 270-330 bp, opposing strands
+#	inwards (-p opp-in). Writes ref.fa, r1.fq and r2.fq in the current directory.
+
+import random
+import sys
+
+if len(sys.argv) > 3:
+	sys.stderr.write("usage: %s [pairs [seed]]\n" % (sys.argv[0]))
+	sys.exit(1)
+
+pairs = int(sys.argv[1]) if len(sys.argv) > 1 else 2000
+random.seed(int(sys.argv[2]) if len(sys.argv) > 2 else 7)
+
+READ_LEN = 70
+REPEAT_LEN = 30000
+FLANK_LEN = 50000
+
+def rnd(n):
+	return ''.join(random.choice('ACGT') for _ in range(n))
+
+comp = {'A': 'T', 'C': 'G', 'G': 'C', 'T': 'A'}
+def revcmpl(s):
+	return ''.join(comp[c] for c in reversed(s))
+
+unit = rnd(37)
+rep = list((unit * (REPEAT_LEN // len(unit) + 1))[:REPEAT_LEN])
+for k in range(0, len(rep), 997):
+	rep[k] = random.choice('ACGT')
+genome = rnd(FLANK_LEN) + ''.join(rep) + rnd(FLANK_LEN)
+
+f = open('ref.fa', 'w')
+f.write('>chrR\n')
+for i in range(0, len(genome), 80):
+	f.write(genome[i:i + 80] + '\n')
+f.close()
+
+f1 = open('r1.fq', 'w')
+f2 = open('r2.fq', 'w')
+for n in range(pairs):
+	if n % 2 == 0:
+		p = FLANK_LEN + random.randint(0, REPEAT_LEN - 400)
+	else:
+		p = random.randint(0, len(genome) - 400)
+	ins = random.randint(270, 330)
+	a = genome[p:p + READ_LEN]
+	b = revcmpl(genome[p + ins - READ_LEN:p + ins])
+	f1.write('@p%d/1\n%s\n+\n%s\n' % (n, a, 'I' * READ_LEN))
+	f2.write('@p%d/2\n%s\n+\n%s\n' % (n, b, 'I' * READ_LEN))
+f1.close()
+f2.close()